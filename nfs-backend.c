@@ -0,0 +1,2221 @@
+#define _FILE_OFFSET_BITS 64
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+
+#include "nfs-backend.h"
+
+/*
+ * File handle. It has a fixed size and alignment so that decoding it is
+ * just a few loads. The generation tells apart objects that reuse an
+ * inode number, so handles of deleted objects become stale. The export
+ * id of handles is that of the backend xor the number of the export they
+ * were handed out under, inodes keep their own.
+ */
+struct nfs_handle
+{
+    uint32_t export_id;
+    uint32_t gen;
+    uint64_t ino;
+};
+
+struct inode
+{
+    struct nfs_handle fh;
+    // Bit n is set once a handle under export n has been handed out
+    uint64_t exports;
+    int refs;
+    int hashed;
+    mode_t type;
+    // Where we last found the inode, used to reopen it
+    struct inode *parent;
+    char *name;
+    // Cached attributes, attr_time is 0 when they are invalid
+    fattr3 attr;
+    uint64_t attr_time;
+    // Unstable writes not handed to writeback yet, and sequence numbers
+    // of unstable writes done and covered by a COMMIT
+    uint64_t dirty_start;
+    uint64_t dirty_end;
+    uint64_t write_seq;
+    uint64_t commit_seq;
+    // Sequential read streams, allocated on the first read
+    struct read_stream *streams;
+    // Directory listing snapshot and count of our changes to the directory
+    struct dir_snapshot *snapshot;
+    unsigned dir_changes;
+};
+
+/*
+ * All inodes known to the clients, in an open addressing hash table keyed
+ * by inode number. Slots keep the number next to the pointer, so a probe
+ * doesn't touch the inodes themselves.
+ * The table holds one reference to every hashed inode, and every inode
+ * holds a reference to its parent. inode_lock protects the table and the
+ * parent/name of all inodes.
+ */
+struct inode_slot
+{
+    uint64_t ino;
+    struct inode *inode;
+};
+
+static pthread_rwlock_t inode_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct inode_slot *inode_table;
+static size_t inode_table_mask;
+static size_t inode_count;
+static uint32_t next_gen;
+static uint32_t export_id;
+
+static struct inode *root_inode;
+static int export_fd = -1;
+static uint64_t export_fsid;
+
+/*
+ * Attribute cache. Attributes of every inode are cached for attr_timeout_ms
+ * to notice changes made outside of NFS, our own changes invalidate them
+ * immediately. Cached attributes are protected by striped locks.
+ */
+#define ATTR_LOCKS 64
+
+int attr_timeout_ms = 1000;
+uint64_t attr_cache_hits;
+uint64_t attr_cache_misses;
+static pthread_mutex_t attr_locks[ATTR_LOCKS];
+
+/*
+ * Write-behind. Unstable writes only go to the page cache. Adjacent and
+ * overlapping writes to a file are gathered into one range that is handed
+ * to writeback once it reaches WRITEBACK_BATCH, so the disk sees large
+ * sequential writes. COMMIT waits for everything with a single
+ * fdatasync() and is free when nothing has been written since the last
+ * one. The write-behind state is protected by the same striped locks.
+ *
+ * The write verifier changes on every start and whenever writeback fails,
+ * so clients resend the unstable writes that may have been lost.
+ */
+#define WRITEBACK_BATCH (8*1024*1024)
+
+static uint64_t write_verf;
+
+/*
+ * Read-ahead. Reads of different clients interleave on our shared fds and
+ * hide sequential streams from the kernel, so we detect them ourselves:
+ * every file tracks a few streams keyed by client. A read close to where
+ * the previous one of the same client ended doubles the window and
+ * prefetches up to a window past it; any other read resets the stream.
+ * Streams are protected by the striped locks too.
+ */
+#define READ_STREAMS 4
+#define READAHEAD_MIN (256*1024)
+#define READAHEAD_MAX (64*1024*1024)
+// How many reads of reordering still count as sequential
+#define READ_SLACK 8
+
+struct read_stream
+{
+    const void *client;
+    uint64_t next;
+    uint64_t window;
+    uint64_t prefetched;
+    uint64_t used;
+};
+
+/*
+ * Directory snapshots. The first listing of a directory reads all of its
+ * entries into an array sorted by directory offset. Offsets are the
+ * cookies: the filesystem keeps them valid while the directory changes,
+ * so a listing can continue from an older snapshot. A listing that goes
+ * on from where the previous one stopped resumes without a search, other
+ * cookies are found by binary search.
+ * A snapshot is used while the directory's mtime, which is also the cookie
+ * verifier, doesn't change, our own changes drop it immediately. Snapshots
+ * are kept in an LRU list of at most SNAPSHOT_MAX_ENTRIES entries in total.
+ * snapshot_lock protects the list and the snapshot pointers of inodes.
+ */
+#define SNAPSHOT_MAX_ENTRIES (4*1024*1024)
+
+struct dir_entry
+{
+    uint64_t cookie;
+    uint64_t ino;
+    // Offset of the name in names
+    size_t name;
+};
+
+struct dir_snapshot
+{
+    struct dir_snapshot *lru_prev;
+    struct dir_snapshot *lru_next;
+    struct inode *dir;
+    int refs;
+    nfstime3 mtime;
+    size_t count;
+    struct dir_entry *entries;
+    char *names;
+    // Index of the entry the last listing stopped at
+    size_t resume;
+};
+
+static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dir_snapshot snapshot_lru = { &snapshot_lru, &snapshot_lru };
+static size_t snapshot_entries;
+
+static void snapshot_drop(struct inode *dir);
+
+/*
+ * Directory name lookup cache. Maps (directory, name) to the inode number
+ * and generation of the child, or to nothing for names that don't exist.
+ * It is set associative: a name hashes to a set of DNLC_WAYS entries and
+ * replaces the oldest one. Entries expire like cached attributes, our own
+ * changes update them immediately. Longer names aren't cached.
+ * Sets are protected by striped locks.
+ */
+#define DNLC_SETS (64*1024)
+#define DNLC_WAYS 4
+#define DNLC_LOCKS 64
+#define DNLC_NAME_MAX 39
+
+struct dnlc_entry
+{
+    uint64_t hash;
+    uint64_t dir;
+    uint64_t ino;
+    uint64_t time;
+    uint32_t dir_gen;
+    uint32_t gen;
+    uint8_t len;
+    char name[DNLC_NAME_MAX];
+};
+
+uint64_t dnlc_hits;
+uint64_t dnlc_negative_hits;
+uint64_t dnlc_misses;
+static struct dnlc_entry *dnlc;
+static pthread_mutex_t dnlc_locks[DNLC_LOCKS];
+
+/*
+ * Per-thread LRU cache of open file descriptors.
+ * Entries are keyed by inode number and generation, so an fd of an inode
+ * that has been forgotten is never returned for a new inode that happens
+ * to reuse its number. Cached fds are registered with the thread's ring.
+ */
+struct fd_entry
+{
+    struct fd_entry *hash_next;
+    struct fd_entry *lru_prev;
+    struct fd_entry *lru_next;
+    uint64_t ino;
+    uint32_t gen;
+    int fd;
+};
+
+struct fd_cache
+{
+    struct fd_entry **hash;
+    int hash_size;
+    struct fd_entry lru;
+    int count;
+};
+
+int fd_cache_max = 1024;
+static __thread struct fd_cache *fd_cache;
+
+static nfsstat3 errno_to_nfs(int err)
+{
+    switch (err)
+    {
+    case 0:
+        return NFS3_OK;
+    case EPERM:
+        return NFS3ERR_PERM;
+    case ENOENT:
+        return NFS3ERR_NOENT;
+    case ENXIO:
+        return NFS3ERR_NXIO;
+    case EACCES:
+    case EBADF:
+        return NFS3ERR_ACCES;
+    case EEXIST:
+        return NFS3ERR_EXIST;
+    case EXDEV:
+        return NFS3ERR_XDEV;
+    case ENODEV:
+        return NFS3ERR_NODEV;
+    case ENOTDIR:
+        return NFS3ERR_NOTDIR;
+    case EISDIR:
+        return NFS3ERR_ISDIR;
+    case EINVAL:
+    case ELOOP:
+        return NFS3ERR_INVAL;
+    case EFBIG:
+        return NFS3ERR_FBIG;
+    case ENOSPC:
+        return NFS3ERR_NOSPC;
+    case EROFS:
+        return NFS3ERR_ROFS;
+    case EMLINK:
+        return NFS3ERR_MLINK;
+    case ENAMETOOLONG:
+        return NFS3ERR_NAMETOOLONG;
+    case ENOTEMPTY:
+        return NFS3ERR_NOTEMPTY;
+    case EDQUOT:
+        return NFS3ERR_DQUOT;
+    case ESTALE:
+        return NFS3ERR_STALE;
+    case EOPNOTSUPP:
+        return NFS3ERR_NOTSUPP;
+    case EAGAIN:
+    case ENOMEM:
+        return NFS3ERR_JUKEBOX;
+    default:
+        return NFS3ERR_IO;
+    }
+}
+
+nfsstat3 check_name(const char *name)
+{
+    if (name == NULL || name[0] == 0 || strchr(name, '/'))
+        return NFS3ERR_ACCES;
+    if (strlen(name) > NAME_MAX)
+        return NFS3ERR_NAMETOOLONG;
+    return NFS3_OK;
+}
+
+static void statx_to_fattr(struct statx *stx, fattr3 *attr)
+{
+    switch (stx->stx_mode & S_IFMT)
+    {
+    case S_IFREG:  attr->type = NF3REG;  break;
+    case S_IFDIR:  attr->type = NF3DIR;  break;
+    case S_IFBLK:  attr->type = NF3BLK;  break;
+    case S_IFCHR:  attr->type = NF3CHR;  break;
+    case S_IFLNK:  attr->type = NF3LNK;  break;
+    case S_IFSOCK: attr->type = NF3SOCK; break;
+    default:       attr->type = NF3FIFO; break;
+    }
+    attr->mode = stx->stx_mode & 07777;
+    attr->nlink = stx->stx_nlink;
+    attr->uid = stx->stx_uid;
+    attr->gid = stx->stx_gid;
+    attr->size = stx->stx_size;
+    attr->used = stx->stx_blocks * 512;
+    attr->rdev.specdata1 = stx->stx_rdev_major;
+    attr->rdev.specdata2 = stx->stx_rdev_minor;
+    attr->fsid = export_fsid;
+    attr->fileid = stx->stx_ino;
+    attr->atime.seconds = stx->stx_atime.tv_sec;
+    attr->atime.nseconds = stx->stx_atime.tv_nsec;
+    attr->mtime.seconds = stx->stx_mtime.tv_sec;
+    attr->mtime.nseconds = stx->stx_mtime.tv_nsec;
+    attr->ctime.seconds = stx->stx_ctime.tv_sec;
+    attr->ctime.nseconds = stx->stx_ctime.tv_nsec;
+}
+
+static void fattr_to_wcc(fattr3 *from, pre_op_attr *attr)
+{
+    attr->attributes_follow = TRUE;
+    attr->pre_op_attr_u.attributes.size = from->size;
+    attr->pre_op_attr_u.attributes.mtime = from->mtime;
+    attr->pre_op_attr_u.attributes.ctime = from->ctime;
+}
+
+static nfsstat3 stat_fd(int fd, struct statx *stx)
+{
+    if (statx(fd, "", AT_EMPTY_PATH|AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, stx) < 0)
+        return errno_to_nfs(errno);
+    return NFS3_OK;
+}
+
+int in_group(struct nfs_cred *cred, uint32_t gid)
+{
+    uint32_t i;
+    if (cred->gid == gid)
+        return 1;
+    for (i = 0; i < cred->ngids; i++)
+    {
+        if (cred->gids[i] == gid)
+            return 1;
+    }
+    return 0;
+}
+
+int may_access(fattr3 *attr, struct nfs_cred *cred, int want)
+{
+    int bits;
+    if (cred->uid == 0)
+    {
+        // root can do anything but execute files nobody can execute
+        if ((want & MAY_EXEC) && attr->type != NF3DIR && !(attr->mode & 0111))
+            return 0;
+        return 1;
+    }
+    if (cred->uid == attr->uid)
+        bits = attr->mode >> 6;
+    else if (in_group(cred, attr->gid))
+        bits = attr->mode >> 3;
+    else
+        bits = attr->mode;
+    return (bits & want) == want;
+}
+
+int may_delete(fattr3 *dir_attr, uint32_t owner, struct nfs_cred *cred)
+{
+    return !(dir_attr->mode & S_ISVTX) || cred->uid == 0 || cred->uid == dir_attr->uid || cred->uid == owner;
+}
+
+/*
+ * Inode table
+ */
+
+static inline size_t inode_slot_of(uint64_t ino)
+{
+    return (size_t)((ino * 0x9e3779b97f4a7c15ull) >> 32) & inode_table_mask;
+}
+
+static void inode_hash_insert(struct inode *inode)
+{
+    size_t i;
+    // Keep the table at most half full so probe sequences stay short
+    if ((inode_count + 1) * 2 > (inode_table ? inode_table_mask + 1 : 0))
+    {
+        struct inode_slot *old_table = inode_table;
+        size_t old_size = old_table ? inode_table_mask + 1 : 0;
+        size_t new_size = old_size ? old_size * 2 : 1024;
+        inode_table = calloc(new_size, sizeof(struct inode_slot));
+        inode_table_mask = new_size - 1;
+        for (i = 0; i < old_size; i++)
+        {
+            if (old_table[i].inode)
+            {
+                size_t j = inode_slot_of(old_table[i].ino);
+                while (inode_table[j].inode)
+                    j = (j + 1) & inode_table_mask;
+                inode_table[j] = old_table[i];
+            }
+        }
+        free(old_table);
+    }
+    for (i = inode_slot_of(inode->fh.ino); inode_table[i].inode; i = (i + 1) & inode_table_mask)
+        ;
+    inode_table[i].ino = inode->fh.ino;
+    inode_table[i].inode = inode;
+    inode->hashed = 1;
+    inode_count++;
+}
+
+static struct inode *inode_hash_lookup(uint64_t ino)
+{
+    size_t i;
+    if (!inode_table)
+        return NULL;
+    for (i = inode_slot_of(ino); inode_table[i].inode; i = (i + 1) & inode_table_mask)
+    {
+        if (inode_table[i].ino == ino)
+            return inode_table[i].inode;
+    }
+    return NULL;
+}
+
+static void inode_hash_remove(struct inode *inode)
+{
+    size_t i, j, home;
+    for (i = inode_slot_of(inode->fh.ino); inode_table[i].inode != inode; i = (i + 1) & inode_table_mask)
+        ;
+    inode_table[i].inode = NULL;
+    inode->hashed = 0;
+    inode_count--;
+    // Shift back following entries that can't be found across the hole anymore
+    for (j = (i + 1) & inode_table_mask; inode_table[j].inode; j = (j + 1) & inode_table_mask)
+    {
+        home = inode_slot_of(inode_table[j].ino);
+        if (((j - home) & inode_table_mask) >= ((j - i) & inode_table_mask))
+        {
+            inode_table[i] = inode_table[j];
+            inode_table[j].inode = NULL;
+            i = j;
+        }
+    }
+}
+
+static void inode_get(struct inode *inode)
+{
+    __atomic_add_fetch(&inode->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drop a reference. Only unhashed inodes can reach zero references,
+ * so nobody can find them anymore and no lock is needed to free them.
+ */
+static void inode_put(struct inode *inode)
+{
+    while (inode && __atomic_sub_fetch(&inode->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        struct inode *parent = inode->parent;
+        if (inode->type == S_IFDIR)
+            snapshot_drop(inode);
+        free(inode->streams);
+        free(inode->name);
+        free(inode);
+        inode = parent;
+    }
+}
+
+// Must be called with inode_lock held, returns the references to drop
+static struct inode *inode_set_path(struct inode *inode, struct inode *parent, const char *name)
+{
+    struct inode *old_parent = inode->parent;
+    if (inode == root_inode)
+        return NULL;
+    if (old_parent == parent && !strcmp(inode->name, name))
+        return NULL;
+    inode_get(parent);
+    inode->parent = parent;
+    free(inode->name);
+    inode->name = strdup(name);
+    return old_parent;
+}
+
+/*
+ * Find the inode with the given number or create it.
+ * The inode number may have been reused by an object of another type, or,
+ * when fresh is set, by an object we have just created. In that case the
+ * old inode is forgotten.
+ */
+static struct inode *inode_find_or_create(uint64_t ino, mode_t type, struct inode *parent, const char *name, int fresh)
+{
+    struct inode *inode, *put = NULL;
+
+    // Most lookups find a known inode at the same place
+    pthread_rwlock_rdlock(&inode_lock);
+    inode = inode_hash_lookup(ino);
+    if (inode && !fresh && inode->type == type &&
+        (inode == root_inode || (inode->parent == parent && !strcmp(inode->name, name))))
+    {
+        inode_get(inode);
+        pthread_rwlock_unlock(&inode_lock);
+        return inode;
+    }
+    pthread_rwlock_unlock(&inode_lock);
+
+    pthread_rwlock_wrlock(&inode_lock);
+    inode = inode_hash_lookup(ino);
+    if (inode && inode != root_inode && (fresh || inode->type != type))
+    {
+        inode_hash_remove(inode);
+        put = inode;
+        inode = NULL;
+    }
+    if (inode)
+    {
+        struct inode *old_parent = inode_set_path(inode, parent, name);
+        inode_get(inode);
+        pthread_rwlock_unlock(&inode_lock);
+        inode_put(old_parent);
+        inode_put(put);
+        return inode;
+    }
+    inode = calloc(1, sizeof(struct inode));
+    inode->fh.export_id = export_id;
+    inode->fh.gen = ++next_gen;
+    inode->fh.ino = ino;
+    inode->type = type;
+    // One reference for the table and one for the caller
+    inode->refs = 2;
+    inode_get(parent);
+    inode->parent = parent;
+    inode->name = strdup(name);
+    inode_hash_insert(inode);
+    pthread_rwlock_unlock(&inode_lock);
+    inode_put(put);
+    return inode;
+}
+
+// Forget an inode that was removed from the tree
+static void inode_forget(uint64_t ino, mode_t type)
+{
+    struct inode *inode;
+    pthread_rwlock_wrlock(&inode_lock);
+    inode = inode_hash_lookup(ino);
+    if (inode && inode->type == type && inode != root_inode)
+        inode_hash_remove(inode);
+    else
+        inode = NULL;
+    pthread_rwlock_unlock(&inode_lock);
+    inode_put(inode);
+}
+
+// Update the path of an inode that has been renamed
+static void inode_moved(uint64_t ino, struct inode *parent, const char *name)
+{
+    struct inode *inode, *put = NULL;
+    pthread_rwlock_wrlock(&inode_lock);
+    inode = inode_hash_lookup(ino);
+    if (inode)
+        put = inode_set_path(inode, parent, name);
+    pthread_rwlock_unlock(&inode_lock);
+    inode_put(put);
+}
+
+static struct inode *inode_get_parent(struct inode *inode)
+{
+    struct inode *parent;
+    pthread_rwlock_rdlock(&inode_lock);
+    parent = inode->parent ? inode->parent : inode;
+    inode_get(parent);
+    pthread_rwlock_unlock(&inode_lock);
+    return parent;
+}
+
+// Invalidate cached attributes of an inode we may not have at hand
+static void inode_invalidate(uint64_t ino)
+{
+    struct inode *inode;
+    pthread_rwlock_rdlock(&inode_lock);
+    inode = inode_hash_lookup(ino);
+    if (inode)
+        __atomic_store_n(&inode->attr_time, 0, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&inode_lock);
+}
+
+// Find a known inode by number and generation
+static struct inode *inode_find(uint64_t ino, uint32_t gen)
+{
+    struct inode *inode;
+    pthread_rwlock_rdlock(&inode_lock);
+    inode = inode_hash_lookup(ino);
+    if (inode && inode->fh.gen == gen)
+        inode_get(inode);
+    else
+        inode = NULL;
+    pthread_rwlock_unlock(&inode_lock);
+    return inode;
+}
+
+/*
+ * Attribute cache
+ */
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000 + 1;
+}
+
+static pthread_mutex_t *attr_lock(struct inode *inode)
+{
+    return &attr_locks[inode->fh.ino % ATTR_LOCKS];
+}
+
+static void attr_store(struct inode *inode, fattr3 *attr)
+{
+    pthread_mutex_t *lock = attr_lock(inode);
+    pthread_mutex_lock(lock);
+    inode->attr = *attr;
+    inode->attr_time = now_ms();
+    pthread_mutex_unlock(lock);
+}
+
+static void attr_invalidate(struct inode *inode)
+{
+    __atomic_store_n(&inode->attr_time, 0, __ATOMIC_RELAXED);
+}
+
+static int attr_lookup(struct inode *inode, fattr3 *attr)
+{
+    pthread_mutex_t *lock = attr_lock(inode);
+    int found = 0;
+    pthread_mutex_lock(lock);
+    if (inode->attr_time && now_ms() - inode->attr_time < (uint64_t)attr_timeout_ms)
+    {
+        *attr = inode->attr;
+        found = 1;
+    }
+    pthread_mutex_unlock(lock);
+    __atomic_add_fetch(found ? &attr_cache_hits : &attr_cache_misses, 1, __ATOMIC_RELAXED);
+    return found;
+}
+
+/*
+ * Directory snapshots
+ */
+
+static void snapshot_put(struct dir_snapshot *snap)
+{
+    if (snap && __atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(snap->entries);
+        free(snap->names);
+        free(snap);
+    }
+}
+
+// Must be called with snapshot_lock held, the caller drops the list's reference
+static void snapshot_unlink(struct dir_snapshot *snap)
+{
+    snap->lru_prev->lru_next = snap->lru_next;
+    snap->lru_next->lru_prev = snap->lru_prev;
+    snap->dir->snapshot = NULL;
+    snap->dir = NULL;
+    snapshot_entries -= snap->count;
+}
+
+static void snapshot_drop(struct inode *dir)
+{
+    struct dir_snapshot *snap;
+    pthread_mutex_lock(&snapshot_lock);
+    snap = dir->snapshot;
+    if (snap)
+        snapshot_unlink(snap);
+    pthread_mutex_unlock(&snapshot_lock);
+    snapshot_put(snap);
+}
+
+// Our own change to a directory, drops its attributes and snapshot
+static unsigned dir_changed(struct inode *dir)
+{
+    unsigned changes;
+    attr_invalidate(dir);
+    changes = __atomic_add_fetch(&dir->dir_changes, 1, __ATOMIC_RELEASE);
+    snapshot_drop(dir);
+    return changes;
+}
+
+static int dir_entry_cmp(const void *a, const void *b)
+{
+    const struct dir_entry *x = a, *y = b;
+    return x->cookie < y->cookie ? -1 : x->cookie > y->cookie;
+}
+
+// Read all entries of a directory
+static nfsstat3 snapshot_read(int fd, struct dir_snapshot **snap_out)
+{
+    struct dir_snapshot *snap = calloc(1, sizeof(*snap));
+    size_t alloc = 0, names_size = 0, names_alloc = 0;
+    char buf[65536];
+    ssize_t len, pos;
+
+    snap->refs = 1;
+    if (lseek(fd, 0, SEEK_SET) < 0)
+        len = -1;
+    else while ((len = getdents64(fd, buf, sizeof(buf))) > 0)
+    {
+        for (pos = 0; pos < len; )
+        {
+            struct dirent64 *de = (struct dirent64 *)(buf + pos);
+            size_t name_len = strlen(de->d_name) + 1;
+            struct dir_entry *entry;
+            if (snap->count >= alloc)
+            {
+                alloc = alloc ? alloc*2 : 64;
+                snap->entries = realloc(snap->entries, alloc*sizeof(struct dir_entry));
+            }
+            if (names_size + name_len > names_alloc)
+            {
+                names_alloc = names_alloc ? names_alloc*2 : 4096;
+                snap->names = realloc(snap->names, names_alloc);
+            }
+            entry = &snap->entries[snap->count++];
+            entry->cookie = de->d_off;
+            entry->ino = de->d_ino;
+            entry->name = names_size;
+            memcpy(snap->names + names_size, de->d_name, name_len);
+            names_size += name_len;
+            pos += de->d_reclen;
+        }
+    }
+    if (len < 0)
+    {
+        nfsstat3 status = errno_to_nfs(errno);
+        snapshot_put(snap);
+        return status;
+    }
+    qsort(snap->entries, snap->count, sizeof(struct dir_entry), dir_entry_cmp);
+    *snap_out = snap;
+    return NFS3_OK;
+}
+
+/*
+ * Get a snapshot of a directory with the given attributes, reading it if the
+ * cached one is missing or out of date. The new snapshot is only cached when
+ * we didn't change the directory while reading it.
+ */
+static nfsstat3 snapshot_get(struct inode *dir, int fd, fattr3 *attr, struct dir_snapshot **snap_out)
+{
+    struct dir_snapshot *snap, *old = NULL;
+    unsigned changes;
+    nfsstat3 status;
+
+    pthread_mutex_lock(&snapshot_lock);
+    snap = dir->snapshot;
+    if (snap && snap->mtime.seconds == attr->mtime.seconds && snap->mtime.nseconds == attr->mtime.nseconds)
+    {
+        __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+        // Move to the front of the LRU
+        snap->lru_prev->lru_next = snap->lru_next;
+        snap->lru_next->lru_prev = snap->lru_prev;
+        snap->lru_next = snapshot_lru.lru_next;
+        snap->lru_prev = &snapshot_lru;
+        snapshot_lru.lru_next->lru_prev = snap;
+        snapshot_lru.lru_next = snap;
+        pthread_mutex_unlock(&snapshot_lock);
+        *snap_out = snap;
+        return NFS3_OK;
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+
+    changes = __atomic_load_n(&dir->dir_changes, __ATOMIC_ACQUIRE);
+    if ((status = snapshot_read(fd, &snap)) != NFS3_OK)
+        return status;
+    snap->mtime = attr->mtime;
+    *snap_out = snap;
+
+    pthread_mutex_lock(&snapshot_lock);
+    if (changes != __atomic_load_n(&dir->dir_changes, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_unlock(&snapshot_lock);
+        return NFS3_OK;
+    }
+    if (dir->snapshot)
+    {
+        old = dir->snapshot;
+        snapshot_unlink(old);
+        snapshot_put(old);
+    }
+    snap->refs++;
+    snap->dir = dir;
+    dir->snapshot = snap;
+    snap->lru_next = snapshot_lru.lru_next;
+    snap->lru_prev = &snapshot_lru;
+    snapshot_lru.lru_next->lru_prev = snap;
+    snapshot_lru.lru_next = snap;
+    snapshot_entries += snap->count;
+    while (snapshot_entries > SNAPSHOT_MAX_ENTRIES && snapshot_lru.lru_prev != snap)
+    {
+        old = snapshot_lru.lru_prev;
+        snapshot_unlink(old);
+        snapshot_put(old);
+    }
+    pthread_mutex_unlock(&snapshot_lock);
+    return NFS3_OK;
+}
+
+// Index of the first entry after cookie
+static size_t snapshot_find(struct dir_snapshot *snap, uint64_t cookie)
+{
+    size_t lo = 0, hi = snap->count;
+    size_t resume = __atomic_load_n(&snap->resume, __ATOMIC_RELAXED);
+    if (cookie == 0)
+        return 0;
+    if (resume > 0 && resume <= snap->count && snap->entries[resume-1].cookie == cookie)
+        return resume;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (snap->entries[mid].cookie <= cookie)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * Directory name lookup cache
+ */
+
+// FNV-1a of the name, seeded with the directory
+static uint64_t dnlc_hash(struct inode *dir, const char *name, size_t *len)
+{
+    uint64_t hash = 0xcbf29ce484222325ull ^ (dir->fh.ino * 0x9e3779b97f4a7c15ull);
+    const char *p;
+    for (p = name; *p; p++)
+        hash = (hash ^ (uint8_t)*p) * 0x100000001b3ull;
+    *len = p - name;
+    return hash;
+}
+
+static struct dnlc_entry *dnlc_set(uint64_t hash, pthread_mutex_t **lock)
+{
+    size_t set = (hash >> 32) % DNLC_SETS;
+    *lock = &dnlc_locks[set % DNLC_LOCKS];
+    return &dnlc[set * DNLC_WAYS];
+}
+
+static int dnlc_match(struct dnlc_entry *entry, struct inode *dir, const char *name, size_t len, uint64_t hash)
+{
+    return entry->time && entry->hash == hash && entry->dir == dir->fh.ino && entry->dir_gen == dir->fh.gen &&
+        entry->len == len && !memcmp(entry->name, name, len);
+}
+
+/*
+ * Returns 1 with a reference to the child, 0 without a child when the name
+ * is known not to exist and -1 when it isn't cached.
+ */
+static int dnlc_lookup(struct inode *dir, const char *name, size_t len, uint64_t hash, struct inode **child)
+{
+    uint64_t ino = 0, now = now_ms();
+    pthread_mutex_t *lock;
+    struct dnlc_entry *set;
+    uint32_t gen = 0;
+    int i, found = 0;
+
+    *child = NULL;
+    if (len > DNLC_NAME_MAX)
+        return -1;
+    set = dnlc_set(hash, &lock);
+    pthread_mutex_lock(lock);
+    for (i = 0; i < DNLC_WAYS; i++)
+    {
+        if (dnlc_match(&set[i], dir, name, len, hash) && now - set[i].time < (uint64_t)attr_timeout_ms)
+        {
+            found = 1;
+            ino = set[i].ino;
+            gen = set[i].gen;
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+    if (found && !ino)
+    {
+        __atomic_add_fetch(&dnlc_negative_hits, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    // A positive entry is only useful while we still know the inode
+    if (found && (*child = inode_find(ino, gen)) != NULL)
+    {
+        __atomic_add_fetch(&dnlc_hits, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+    __atomic_add_fetch(&dnlc_misses, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+/*
+ * Remember a name, child is NULL if it doesn't exist. Nothing is entered
+ * when we have changed the directory since changes was read, the result
+ * may already be out of date.
+ */
+static void dnlc_enter(struct inode *dir, const char *name, size_t len, uint64_t hash, struct inode *child, unsigned changes)
+{
+    pthread_mutex_t *lock;
+    struct dnlc_entry *set, *entry;
+    int i;
+
+    if (len > DNLC_NAME_MAX)
+        return;
+    set = dnlc_set(hash, &lock);
+    pthread_mutex_lock(lock);
+    if (changes != __atomic_load_n(&dir->dir_changes, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_unlock(lock);
+        return;
+    }
+    entry = &set[0];
+    for (i = 0; i < DNLC_WAYS; i++)
+    {
+        if (dnlc_match(&set[i], dir, name, len, hash))
+        {
+            entry = &set[i];
+            break;
+        }
+        if (set[i].time < entry->time)
+            entry = &set[i];
+    }
+    entry->hash = hash;
+    entry->dir = dir->fh.ino;
+    entry->dir_gen = dir->fh.gen;
+    entry->ino = child ? child->fh.ino : 0;
+    entry->gen = child ? child->fh.gen : 0;
+    entry->time = now_ms();
+    entry->len = len;
+    memcpy(entry->name, name, len);
+    pthread_mutex_unlock(lock);
+}
+
+// Our own change to a name, changes is what dir_changed() returned
+static void dnlc_update(struct inode *dir, const char *name, struct inode *child, unsigned changes)
+{
+    size_t len;
+    uint64_t hash = dnlc_hash(dir, name, &len);
+    dnlc_enter(dir, name, len, hash, child, changes);
+}
+
+// Forget a name whose new state we don't know
+static void dnlc_remove(struct inode *dir, const char *name)
+{
+    size_t len;
+    uint64_t hash = dnlc_hash(dir, name, &len);
+    pthread_mutex_t *lock;
+    struct dnlc_entry *set;
+    int i;
+
+    if (len > DNLC_NAME_MAX)
+        return;
+    set = dnlc_set(hash, &lock);
+    pthread_mutex_lock(lock);
+    for (i = 0; i < DNLC_WAYS; i++)
+    {
+        if (dnlc_match(&set[i], dir, name, len, hash))
+            set[i].time = 0;
+    }
+    pthread_mutex_unlock(lock);
+}
+
+/*
+ * File descriptor cache
+ */
+
+static struct fd_cache *get_fd_cache(void)
+{
+    if (fd_cache == NULL)
+    {
+        fd_cache = calloc(1, sizeof(struct fd_cache));
+        fd_cache->hash_size = fd_cache_max * 2;
+        fd_cache->hash = calloc(fd_cache->hash_size, sizeof(struct fd_entry *));
+        fd_cache->lru.lru_next = fd_cache->lru.lru_prev = &fd_cache->lru;
+    }
+    return fd_cache;
+}
+
+static void fd_lru_unlink(struct fd_entry *entry)
+{
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void fd_lru_push(struct fd_cache *cache, struct fd_entry *entry)
+{
+    entry->lru_next = cache->lru.lru_next;
+    entry->lru_prev = &cache->lru;
+    cache->lru.lru_next->lru_prev = entry;
+    cache->lru.lru_next = entry;
+}
+
+static struct fd_entry **fd_bucket(struct fd_cache *cache, uint64_t ino)
+{
+    return &cache->hash[ino % cache->hash_size];
+}
+
+static void fd_cache_add(struct inode *inode, int fd)
+{
+    struct fd_cache *cache = get_fd_cache();
+    struct fd_entry *entry = malloc(sizeof(struct fd_entry));
+    struct fd_entry **bucket = fd_bucket(cache, inode->fh.ino);
+    entry->ino = inode->fh.ino;
+    entry->gen = inode->fh.gen;
+    entry->fd = fd;
+    entry->hash_next = *bucket;
+    *bucket = entry;
+    fd_lru_push(cache, entry);
+    cache->count++;
+    io_register_file(fd);
+}
+
+/*
+ * Close least recently used fds above the limit. This is only done when
+ * a new request starts, so fds handed out during a request stay valid.
+ */
+static void fd_cache_trim(void)
+{
+    struct fd_cache *cache = fd_cache;
+    if (cache == NULL)
+        return;
+    while (cache->count > fd_cache_max)
+    {
+        struct fd_entry *entry = cache->lru.lru_prev;
+        struct fd_entry **tmp;
+        for (tmp = fd_bucket(cache, entry->ino); *tmp != entry; tmp = &(*tmp)->hash_next)
+            ;
+        *tmp = entry->hash_next;
+        fd_lru_unlink(entry);
+        io_close_file(entry->fd);
+        free(entry);
+        cache->count--;
+    }
+}
+
+/*
+ * Returns an fd for the inode from the fd cache. The fd belongs to the
+ * cache and stays valid until the next inode_from_fh() call on this thread.
+ */
+static nfsstat3 inode_fd(struct inode *inode, int *fd);
+
+static nfsstat3 inode_open(struct inode *inode, int *fd_out)
+{
+    char name[NAME_MAX + 1];
+    struct inode *parent;
+    struct stat st;
+    int parent_fd, fd, flags;
+    nfsstat3 status;
+
+    pthread_rwlock_rdlock(&inode_lock);
+    parent = inode->parent;
+    if (parent == NULL || !inode->hashed)
+    {
+        pthread_rwlock_unlock(&inode_lock);
+        return NFS3ERR_STALE;
+    }
+    inode_get(parent);
+    strcpy(name, inode->name);
+    pthread_rwlock_unlock(&inode_lock);
+
+    status = inode_fd(parent, &parent_fd);
+    if (status == NFS3_OK)
+    {
+        switch (inode->type)
+        {
+        case S_IFDIR:
+            flags = O_RDONLY|O_DIRECTORY;
+            break;
+        case S_IFREG:
+            flags = O_RDWR;
+            break;
+        default:
+            // Symlinks and special files are only ever used through the fd
+            flags = O_PATH;
+            break;
+        }
+        fd = openat(parent_fd, name, flags|O_NOFOLLOW|O_CLOEXEC);
+        if (fd < 0 && inode->type == S_IFREG && (errno == EACCES || errno == EROFS || errno == ETXTBSY))
+            fd = openat(parent_fd, name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+        if (fd < 0)
+            status = errno == ENOENT ? NFS3ERR_STALE : errno_to_nfs(errno);
+        else if (fstat(fd, &st) < 0 || st.st_ino != inode->fh.ino)
+        {
+            // The name now refers to another object
+            close(fd);
+            status = NFS3ERR_STALE;
+        }
+        else
+            *fd_out = fd;
+    }
+    inode_put(parent);
+    return status;
+}
+
+static nfsstat3 inode_fd(struct inode *inode, int *fd)
+{
+    struct fd_cache *cache;
+    struct fd_entry *entry;
+    nfsstat3 status;
+
+    if (inode == root_inode)
+    {
+        *fd = export_fd;
+        return NFS3_OK;
+    }
+    cache = get_fd_cache();
+    for (entry = *fd_bucket(cache, inode->fh.ino); entry; entry = entry->hash_next)
+    {
+        if (entry->ino == inode->fh.ino && entry->gen == inode->fh.gen)
+        {
+            fd_lru_unlink(entry);
+            fd_lru_push(cache, entry);
+            *fd = entry->fd;
+            return NFS3_OK;
+        }
+    }
+    status = inode_open(inode, fd);
+    if (status == NFS3_OK)
+        fd_cache_add(inode, *fd);
+    return status;
+}
+
+/*
+ * Handles
+ */
+
+static struct inode *backend_root(void)
+{
+    inode_get(root_inode);
+    return root_inode;
+}
+
+static struct inode *inode_from_fh(nfs_fh3 *fh, int *export, nfsstat3 *status)
+{
+    struct nfs_handle handle;
+    struct inode *inode;
+
+    fd_cache_trim();
+    if (fh->data.data_len != sizeof(struct nfs_handle))
+    {
+        *status = NFS3ERR_BADHANDLE;
+        return NULL;
+    }
+    // The handle may be unaligned in the request buffer
+    memcpy(&handle, fh->data.data_val, sizeof(struct nfs_handle));
+    if ((handle.export_id ^ export_id) >= MAX_EXPORTS)
+    {
+        *status = NFS3ERR_STALE;
+        return NULL;
+    }
+    *export = handle.export_id ^ export_id;
+    pthread_rwlock_rdlock(&inode_lock);
+    inode = inode_hash_lookup(handle.ino);
+    if (inode && inode->fh.gen == handle.gen && (__atomic_load_n(&inode->exports, __ATOMIC_RELAXED) & 1ull << *export))
+        inode_get(inode);
+    else
+        inode = NULL;
+    pthread_rwlock_unlock(&inode_lock);
+    *status = inode ? NFS3_OK : NFS3ERR_STALE;
+    return inode;
+}
+
+static uint32_t inode_to_fh(struct inode *inode, int export, char *fh)
+{
+    struct nfs_handle handle = inode->fh;
+
+    if (!(__atomic_load_n(&inode->exports, __ATOMIC_RELAXED) & 1ull << export))
+        __atomic_fetch_or(&inode->exports, 1ull << export, __ATOMIC_RELAXED);
+    handle.export_id ^= export;
+    memcpy(fh, &handle, sizeof(handle));
+    return sizeof(handle);
+}
+
+static int backend_init(const char *path)
+{
+    struct statx stx;
+    struct timespec now;
+    int i;
+
+    for (i = 0; i < ATTR_LOCKS; i++)
+        pthread_mutex_init(&attr_locks[i], NULL);
+    for (i = 0; i < DNLC_LOCKS; i++)
+        pthread_mutex_init(&dnlc_locks[i], NULL);
+    dnlc = calloc(DNLC_SETS * DNLC_WAYS, sizeof(struct dnlc_entry));
+
+    export_fd = open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (export_fd < 0 || stat_fd(export_fd, &stx) != NFS3_OK)
+        return -1;
+    export_fsid = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    // Modes are always set explicitly
+    umask(0);
+
+    // Handles of other export directories are stale, the root handle survives restarts
+    export_id = (uint32_t)(export_fsid ^ (export_fsid >> 32) ^ (stx.stx_ino * 0x9e3779b97f4a7c15ull >> 32));
+    clock_gettime(CLOCK_REALTIME, &now);
+    next_gen = now.tv_sec;
+
+    root_inode = calloc(1, sizeof(struct inode));
+    root_inode->fh.export_id = export_id;
+    root_inode->fh.gen = 0;
+    root_inode->fh.ino = stx.stx_ino;
+    root_inode->type = S_IFDIR;
+    root_inode->refs = 1;
+    inode_hash_insert(root_inode);
+
+    write_verf = now.tv_sec * 1000000000ull + now.tv_nsec;
+    return 0;
+}
+
+/*
+ * Operations
+ */
+
+// Get current attributes of an open inode and refresh the cache
+static nfsstat3 stat_inode(struct inode *inode, int fd, fattr3 *attr)
+{
+    struct statx stx;
+    nfsstat3 status;
+    if ((status = stat_fd(fd, &stx)) != NFS3_OK)
+        return status;
+    statx_to_fattr(&stx, attr);
+    attr_store(inode, attr);
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_getattr(struct inode *inode, fattr3 *attr)
+{
+    nfsstat3 status;
+    int fd;
+
+    if (attr_lookup(inode, attr))
+        return NFS3_OK;
+    if ((status = inode_fd(inode, &fd)) != NFS3_OK)
+        return status;
+    return stat_inode(inode, fd, attr);
+}
+
+static nfsstat3 apply_sattr(int fd, mode_t type, sattr3 *sattr)
+{
+    char path[32];
+    struct timespec times[2];
+
+    // O_PATH fds of special files can only be changed through /proc
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    if (sattr->size.set_it)
+    {
+        if (type != S_IFREG)
+            return type == S_IFDIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+        if (ftruncate(fd, sattr->size.set_size3_u.size) < 0)
+            return errno_to_nfs(errno);
+    }
+    if (sattr->mode.set_it && type != S_IFLNK)
+    {
+        int r;
+        if (type == S_IFREG || type == S_IFDIR)
+            r = fchmod(fd, sattr->mode.set_mode3_u.mode & 07777);
+        else
+            r = chmod(path, sattr->mode.set_mode3_u.mode & 07777);
+        if (r < 0)
+            return errno_to_nfs(errno);
+    }
+    if (sattr->uid.set_it || sattr->gid.set_it)
+    {
+        uid_t uid = sattr->uid.set_it ? sattr->uid.set_uid3_u.uid : (uid_t)-1;
+        gid_t gid = sattr->gid.set_it ? sattr->gid.set_gid3_u.gid : (gid_t)-1;
+        if (fchownat(fd, "", uid, gid, AT_EMPTY_PATH|AT_SYMLINK_NOFOLLOW) < 0)
+            return errno_to_nfs(errno);
+    }
+    if ((sattr->atime.set_it != DONT_CHANGE || sattr->mtime.set_it != DONT_CHANGE) && type != S_IFLNK)
+    {
+        int r;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_nsec = UTIME_OMIT;
+        if (sattr->atime.set_it == SET_TO_SERVER_TIME)
+            times[0].tv_nsec = UTIME_NOW;
+        else if (sattr->atime.set_it == SET_TO_CLIENT_TIME)
+        {
+            times[0].tv_sec = sattr->atime.set_atime_u.atime.seconds;
+            times[0].tv_nsec = sattr->atime.set_atime_u.atime.nseconds;
+        }
+        if (sattr->mtime.set_it == SET_TO_SERVER_TIME)
+            times[1].tv_nsec = UTIME_NOW;
+        else if (sattr->mtime.set_it == SET_TO_CLIENT_TIME)
+        {
+            times[1].tv_sec = sattr->mtime.set_mtime_u.mtime.seconds;
+            times[1].tv_nsec = sattr->mtime.set_mtime_u.mtime.nseconds;
+        }
+        if (type == S_IFREG || type == S_IFDIR)
+            r = futimens(fd, times);
+        else
+            r = utimensat(AT_FDCWD, path, times, 0);
+        if (r < 0)
+            return errno_to_nfs(errno);
+    }
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_setattr(struct inode *inode, struct nfs_cred *cred, sattr3 *sattr, nfstime3 *guard_ctime)
+{
+    nfsstat3 status;
+    fattr3 attr;
+    int fd, is_owner;
+
+    if ((status = inode_fd(inode, &fd)) != NFS3_OK)
+        return status;
+    // The guard must be checked against the current ctime, not the cached one
+    if ((status = stat_inode(inode, fd, &attr)) != NFS3_OK)
+        return status;
+    if (guard_ctime && (guard_ctime->seconds != attr.ctime.seconds || guard_ctime->nseconds != attr.ctime.nseconds))
+        return NFS3ERR_NOT_SYNC;
+
+    is_owner = cred->uid == 0 || cred->uid == attr.uid;
+    if ((sattr->mode.set_it || sattr->atime.set_it == SET_TO_CLIENT_TIME ||
+        sattr->mtime.set_it == SET_TO_CLIENT_TIME) && !is_owner)
+        return NFS3ERR_PERM;
+    if (sattr->uid.set_it && sattr->uid.set_uid3_u.uid != attr.uid && cred->uid != 0)
+        return NFS3ERR_PERM;
+    if (sattr->gid.set_it && sattr->gid.set_gid3_u.gid != attr.gid &&
+        cred->uid != 0 && (!is_owner || !in_group(cred, sattr->gid.set_gid3_u.gid)))
+        return NFS3ERR_PERM;
+    if ((sattr->size.set_it || sattr->atime.set_it == SET_TO_SERVER_TIME ||
+        sattr->mtime.set_it == SET_TO_SERVER_TIME) && !is_owner && !may_access(&attr, cred, MAY_WRITE))
+        return NFS3ERR_ACCES;
+
+    status = apply_sattr(fd, inode->type, sattr);
+    attr_invalidate(inode);
+    return status;
+}
+
+// Open a directory and check that the caller may search (and modify) it
+static nfsstat3 dir_fd_attr(struct inode *dir, struct nfs_cred *cred, int want, int *fd, fattr3 *attr)
+{
+    nfsstat3 status;
+
+    if (dir->type != S_IFDIR)
+        return NFS3ERR_NOTDIR;
+    if ((status = inode_fd(dir, fd)) != NFS3_OK)
+        return status;
+    if (!attr_lookup(dir, attr) && (status = stat_inode(dir, *fd, attr)) != NFS3_OK)
+        return status;
+    if (!may_access(attr, cred, want))
+        return NFS3ERR_ACCES;
+    return NFS3_OK;
+}
+
+static nfsstat3 dir_fd(struct inode *dir, struct nfs_cred *cred, int want, int *fd)
+{
+    fattr3 attr;
+    return dir_fd_attr(dir, cred, want, fd, &attr);
+}
+
+static nfsstat3 backend_lookup(struct inode *dir, struct nfs_cred *cred, const char *name, struct inode **child, fattr3 *attr)
+{
+    struct statx stx;
+    nfsstat3 status;
+    unsigned changes;
+    uint64_t hash;
+    size_t len;
+    int fd;
+
+    if ((status = dir_fd(dir, cred, MAY_EXEC, &fd)) != NFS3_OK)
+        return status;
+    if (!strcmp(name, ".") || !strcmp(name, ".."))
+    {
+        if (name[1])
+        {
+            // The root is its own parent, clients can't escape the export
+            *child = inode_get_parent(dir);
+        }
+        else
+        {
+            inode_get(dir);
+            *child = dir;
+        }
+        status = backend_getattr(*child, attr);
+        if (status != NFS3_OK)
+        {
+            inode_put(*child);
+            *child = NULL;
+        }
+        return status;
+    }
+    if ((status = check_name(name)) != NFS3_OK)
+        return status;
+    hash = dnlc_hash(dir, name, &len);
+    switch (dnlc_lookup(dir, name, len, hash, child))
+    {
+    case 0:
+        return NFS3ERR_NOENT;
+    case 1:
+        if (attr_lookup(*child, attr))
+            return NFS3_OK;
+        inode_put(*child);
+        *child = NULL;
+        break;
+    }
+    changes = __atomic_load_n(&dir->dir_changes, __ATOMIC_ACQUIRE);
+    if (statx(fd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) < 0)
+    {
+        if (errno == ENOENT)
+            dnlc_enter(dir, name, len, hash, NULL, changes);
+        return errno_to_nfs(errno);
+    }
+    *child = inode_find_or_create(stx.stx_ino, stx.stx_mode & S_IFMT, dir, name, 0);
+    statx_to_fattr(&stx, attr);
+    attr_store(*child, attr);
+    dnlc_enter(dir, name, len, hash, *child, changes);
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_access(struct inode *inode, struct nfs_cred *cred, uint32_t want, uint32_t *granted)
+{
+    nfsstat3 status;
+    fattr3 attr;
+
+    if ((status = backend_getattr(inode, &attr)) != NFS3_OK)
+        return status;
+    *granted = 0;
+    if ((want & ACCESS3_READ) && may_access(&attr, cred, MAY_READ))
+        *granted |= ACCESS3_READ;
+    if (attr.type == NF3DIR)
+    {
+        if ((want & ACCESS3_LOOKUP) && may_access(&attr, cred, MAY_EXEC))
+            *granted |= ACCESS3_LOOKUP;
+        if (may_access(&attr, cred, MAY_WRITE|MAY_EXEC))
+            *granted |= want & (ACCESS3_MODIFY|ACCESS3_EXTEND|ACCESS3_DELETE);
+    }
+    else
+    {
+        if (may_access(&attr, cred, MAY_WRITE))
+            *granted |= want & (ACCESS3_MODIFY|ACCESS3_EXTEND);
+        if ((want & ACCESS3_EXECUTE) && may_access(&attr, cred, MAY_EXEC))
+            *granted |= ACCESS3_EXECUTE;
+    }
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_readlink(struct inode *inode, char *buf, size_t size)
+{
+    nfsstat3 status;
+    ssize_t len;
+    int fd;
+
+    if (inode->type != S_IFLNK)
+        return NFS3ERR_INVAL;
+    if ((status = inode_fd(inode, &fd)) != NFS3_OK)
+        return status;
+    len = readlinkat(fd, "", buf, size - 1);
+    if (len < 0)
+        return errno_to_nfs(errno);
+    buf[len] = 0;
+    return NFS3_OK;
+}
+
+static nfsstat3 read_fd(struct inode *inode, struct nfs_cred *cred, int *fd, fattr3 *attr)
+{
+    nfsstat3 status;
+
+    if (inode->type != S_IFREG)
+        return inode->type == S_IFDIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+    if ((status = inode_fd(inode, fd)) != NFS3_OK)
+        return status;
+    if (!attr_lookup(inode, attr) && (status = stat_inode(inode, *fd, attr)) != NFS3_OK)
+        return status;
+    // The owner may always read, the client has already checked the open
+    if (cred->uid != attr->uid && !may_access(attr, cred, MAY_READ))
+        return NFS3ERR_ACCES;
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_read_fd(struct inode *inode, struct nfs_cred *cred, uint64_t offset, uint32_t count, int *fd, uint32_t *len, int *eof, fattr3 *attr)
+{
+    nfsstat3 status;
+
+    if ((status = read_fd(inode, cred, fd, attr)) != NFS3_OK)
+        return status;
+    *len = offset >= attr->size ? 0 : (attr->size - offset < count ? attr->size - offset : count);
+    *eof = offset + *len >= attr->size;
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_read(struct inode *inode, struct nfs_cred *cred, uint64_t offset, uint32_t count, char *buf, uint32_t *done, int *eof, fattr3 *attr)
+{
+    nfsstat3 status;
+    ssize_t r;
+    int fd;
+
+    if ((status = read_fd(inode, cred, &fd, attr)) != NFS3_OK)
+        return status;
+    r = pread(fd, buf, count, offset);
+    if (r < 0)
+        return errno_to_nfs(errno);
+    *done = r;
+    *eof = r < count || offset + r >= attr->size;
+    return NFS3_OK;
+}
+
+static void read_complete(struct io_op *op, int res)
+{
+    struct backend_io *io = (struct backend_io *)op;
+    if (res < 0)
+        io->status = errno_to_nfs(-res);
+    else
+    {
+        io->done = res;
+        io->eof = (uint32_t)res < io->count || io->offset + res >= io->attr.size;
+    }
+    io->complete(io);
+}
+
+static void backend_read_async(struct backend_io *io, struct nfs_cred *cred)
+{
+    ssize_t r;
+    int fd;
+
+    io->status = read_fd(io->inode, cred, &fd, &io->attr);
+    if (io->status != NFS3_OK)
+    {
+        io->complete(io);
+        return;
+    }
+    io->op.complete = read_complete;
+    if (io_readv(&io->op, fd, io->iov, io->iovcnt, io->offset) == 0)
+        return;
+    // No room in the ring, read right away
+    r = preadv(fd, io->iov, io->iovcnt, io->offset);
+    read_complete(&io->op, r < 0 ? -errno : r);
+}
+
+static void backend_readahead(struct inode *inode, const void *client, uint64_t offset, uint32_t count)
+{
+    pthread_mutex_t *lock = attr_lock(inode);
+    struct read_stream *stream = NULL;
+    uint64_t start = 0, end = 0, size, slack;
+    int i, fd;
+
+    pthread_mutex_lock(lock);
+    if (inode->streams == NULL)
+        inode->streams = calloc(READ_STREAMS, sizeof(struct read_stream));
+    for (i = 0; i < READ_STREAMS; i++)
+    {
+        if (inode->streams[i].client == client)
+        {
+            stream = &inode->streams[i];
+            break;
+        }
+        if (stream == NULL || inode->streams[i].used < stream->used)
+            stream = &inode->streams[i];
+    }
+    size = inode->attr.size;
+    // Clients send several reads at once, so they may arrive slightly out of order
+    slack = READ_SLACK * (uint64_t)count;
+    if (stream->client == client && stream->window &&
+        offset + slack >= stream->next && offset <= stream->next + slack)
+    {
+        stream->window = stream->window * 2 < READAHEAD_MAX ? stream->window * 2 : READAHEAD_MAX;
+        start = stream->prefetched > offset + count ? stream->prefetched : offset + count;
+        end = offset + count + stream->window;
+        if (end > size)
+            end = size;
+        if (end > start)
+            stream->prefetched = end;
+        if (offset + count > stream->next)
+            stream->next = offset + count;
+    }
+    else
+    {
+        // A new stream or random access
+        stream->client = client;
+        stream->next = offset + count;
+        stream->window = READAHEAD_MIN;
+        stream->prefetched = 0;
+    }
+    stream->used = now_ms();
+    pthread_mutex_unlock(lock);
+
+    if (end > start && inode_fd(inode, &fd) == NFS3_OK)
+        posix_fadvise(fd, start, end - start, POSIX_FADV_WILLNEED);
+}
+
+static void backend_write_verf(char *verf)
+{
+    uint64_t value = __atomic_load_n(&write_verf, __ATOMIC_RELAXED);
+    memcpy(verf, &value, NFS3_WRITEVERFSIZE);
+}
+
+// Unstable data may have been lost, make clients write it again
+static void write_failed(void)
+{
+    __atomic_add_fetch(&write_verf, 1, __ATOMIC_RELAXED);
+}
+
+static void gather_write(struct inode *inode, int fd, uint64_t offset, uint64_t len)
+{
+    pthread_mutex_t *lock = attr_lock(inode);
+    uint64_t flush[2][2];
+    int i, n = 0;
+
+    pthread_mutex_lock(lock);
+    inode->write_seq++;
+    if (inode->dirty_end > inode->dirty_start &&
+        (offset > inode->dirty_end || offset + len < inode->dirty_start))
+    {
+        // Not adjacent to the gathered range, write that out first
+        flush[n][0] = inode->dirty_start;
+        flush[n][1] = inode->dirty_end;
+        n++;
+        inode->dirty_end = inode->dirty_start = 0;
+    }
+    if (inode->dirty_end == inode->dirty_start)
+    {
+        inode->dirty_start = offset;
+        inode->dirty_end = offset + len;
+    }
+    else
+    {
+        if (offset < inode->dirty_start)
+            inode->dirty_start = offset;
+        if (offset + len > inode->dirty_end)
+            inode->dirty_end = offset + len;
+    }
+    if (inode->dirty_end - inode->dirty_start >= WRITEBACK_BATCH)
+    {
+        flush[n][0] = inode->dirty_start;
+        flush[n][1] = inode->dirty_end;
+        n++;
+        inode->dirty_end = inode->dirty_start = 0;
+    }
+    pthread_mutex_unlock(lock);
+
+    // Start writeback without waiting for it, unless the fd is gone
+    for (i = 0; i < n && fd >= 0; i++)
+    {
+        if (sync_file_range(fd, flush[i][0], flush[i][1] - flush[i][0], SYNC_FILE_RANGE_WRITE) < 0 && errno == EIO)
+            write_failed();
+    }
+}
+
+static int write_flags(stable_how stable)
+{
+    return stable == FILE_SYNC ? RWF_SYNC : (stable == DATA_SYNC ? RWF_DSYNC : 0);
+}
+
+// Checks before a write, returns the fd to write to
+static nfsstat3 write_begin(struct inode *inode, struct nfs_cred *cred, int *fd, wcc_data *wcc)
+{
+    fattr3 *attr = &wcc->after.post_op_attr_u.attributes;
+    nfsstat3 status;
+
+    wcc->before.attributes_follow = FALSE;
+    wcc->after.attributes_follow = FALSE;
+    if (inode->type != S_IFREG)
+        return inode->type == S_IFDIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+    if ((status = inode_fd(inode, fd)) != NFS3_OK)
+        return status;
+    if (!attr_lookup(inode, attr) && (status = stat_inode(inode, *fd, attr)) != NFS3_OK)
+        return status;
+    fattr_to_wcc(attr, &wcc->before);
+    if (cred->uid != attr->uid && !may_access(attr, cred, MAY_WRITE))
+        return NFS3ERR_ACCES;
+    return NFS3_OK;
+}
+
+// Bookkeeping after a write that returned res, a byte count or -errno
+static nfsstat3 write_end(struct inode *inode, int fd, uint64_t offset, stable_how stable, ssize_t res, wcc_data *wcc)
+{
+    if (res < 0)
+    {
+        attr_invalidate(inode);
+        return errno_to_nfs(-res);
+    }
+    // Stable writes bypass write-behind
+    if (stable == UNSTABLE && res > 0)
+        gather_write(inode, fd, offset, res);
+    if (fd >= 0 && stat_inode(inode, fd, &wcc->after.post_op_attr_u.attributes) == NFS3_OK)
+        wcc->after.attributes_follow = TRUE;
+    else
+        attr_invalidate(inode);
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_write(struct inode *inode, struct nfs_cred *cred, uint64_t offset, uint32_t count, char *buf, stable_how stable, uint32_t *done, wcc_data *wcc)
+{
+    struct iovec iov;
+    nfsstat3 status;
+    ssize_t r;
+    int fd;
+
+    if ((status = write_begin(inode, cred, &fd, wcc)) != NFS3_OK)
+        return status;
+    iov.iov_base = buf;
+    iov.iov_len = count;
+    r = pwritev2(fd, &iov, 1, offset, write_flags(stable));
+    if (r >= 0)
+        *done = r;
+    return write_end(inode, fd, offset, stable, r < 0 ? -errno : r, wcc);
+}
+
+/*
+ * Owner of a new object: the caller, unless root asked for another one.
+ */
+static void new_owner(struct nfs_cred *cred, sattr3 *sattr, uid_t *uid, gid_t *gid)
+{
+    *uid = cred->uid;
+    *gid = cred->gid;
+    if (sattr && sattr->uid.set_it && cred->uid == 0)
+        *uid = sattr->uid.set_uid3_u.uid;
+    if (sattr && sattr->gid.set_it && (cred->uid == 0 || in_group(cred, sattr->gid.set_gid3_u.gid)))
+        *gid = sattr->gid.set_gid3_u.gid;
+}
+
+// Get the inode of an object in dir, fresh if we have just created it
+static nfsstat3 new_child(struct inode *dir, int dir_fd, const char *name, int fresh, struct inode **child)
+{
+    struct statx stx;
+    unsigned changes;
+    fattr3 attr;
+    changes = dir_changed(dir);
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) < 0)
+    {
+        dnlc_remove(dir, name);
+        return errno_to_nfs(errno);
+    }
+    *child = inode_find_or_create(stx.stx_ino, stx.stx_mode & S_IFMT, dir, name, fresh);
+    statx_to_fattr(&stx, &attr);
+    attr_store(*child, &attr);
+    dnlc_update(dir, name, *child, changes);
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_create(struct inode *dir, struct nfs_cred *cred, const char *name, createhow3 *how, struct inode **child)
+{
+    sattr3 *sattr = how->mode == EXCLUSIVE ? NULL : &how->createhow3_u.obj_attributes;
+    mode_t mode = 0644;
+    nfsstat3 status;
+    struct statx stx;
+    unsigned changes;
+    fattr3 attr;
+    uid_t uid;
+    gid_t gid;
+    int dfd, fd;
+
+    *child = NULL;
+    if ((status = check_name(name)) != NFS3_OK)
+        return status;
+    if ((status = dir_fd(dir, cred, MAY_WRITE|MAY_EXEC, &dfd)) != NFS3_OK)
+        return status;
+    if (sattr && sattr->mode.set_it)
+        mode = sattr->mode.set_mode3_u.mode & 07777;
+
+    fd = openat(dfd, name, O_CREAT|O_EXCL|O_RDWR|O_NOFOLLOW|O_CLOEXEC, mode);
+    if (fd >= 0)
+    {
+        new_owner(cred, sattr, &uid, &gid);
+        if (fchown(fd, uid, gid) < 0)
+            status = errno_to_nfs(errno);
+        else if (how->mode == EXCLUSIVE)
+        {
+            // Keep the verifier in the timestamps, like knfsd does
+            struct timespec times[2];
+            uint32_t verf[2];
+            memcpy(verf, how->createhow3_u.verf, sizeof(verf));
+            times[0].tv_sec = verf[0];
+            times[0].tv_nsec = 0;
+            times[1].tv_sec = verf[1];
+            times[1].tv_nsec = 0;
+            if (futimens(fd, times) < 0)
+                status = errno_to_nfs(errno);
+        }
+        else
+        {
+            sattr3 rest = *sattr;
+            rest.mode.set_it = FALSE;
+            rest.uid.set_it = FALSE;
+            rest.gid.set_it = FALSE;
+            status = apply_sattr(fd, S_IFREG, &rest);
+        }
+        if (status != NFS3_OK)
+        {
+            unlinkat(dfd, name, 0);
+            close(fd);
+            return status;
+        }
+    }
+    else if (errno == EEXIST && how->mode == UNCHECKED)
+    {
+        // Only regular files are opened; devices, FIFOs and the rest get NFS3ERR_EXIST
+        if (statx(dfd, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) < 0)
+            return errno_to_nfs(errno);
+        if (!S_ISREG(stx.stx_mode))
+            return NFS3ERR_EXIST;
+        // Existing files are only truncated if asked to, with the rights SETATTR would need
+        if (sattr->size.set_it)
+        {
+            // Non-blocking in case the name has been replaced by a FIFO meanwhile
+            fd = openat(dfd, name, O_WRONLY|O_NONBLOCK|O_NOFOLLOW|O_CLOEXEC);
+            if (fd < 0)
+                return errno == ENXIO || errno == EISDIR || errno == ELOOP ? NFS3ERR_EXIST : errno_to_nfs(errno);
+            if ((status = stat_fd(fd, &stx)) == NFS3_OK)
+            {
+                statx_to_fattr(&stx, &attr);
+                if (!S_ISREG(stx.stx_mode))
+                    status = NFS3ERR_EXIST;
+                else if (cred->uid != 0 && cred->uid != attr.uid && !may_access(&attr, cred, MAY_WRITE))
+                    status = NFS3ERR_ACCES;
+                else if (ftruncate(fd, sattr->size.set_size3_u.size) < 0)
+                    status = errno_to_nfs(errno);
+            }
+            close(fd);
+            if (status != NFS3_OK)
+                return status;
+        }
+        return new_child(dir, dfd, name, 0, child);
+    }
+    else if (errno == EEXIST && how->mode == EXCLUSIVE)
+    {
+        // A retransmission of our own EXCLUSIVE create succeeds
+        uint32_t verf[2];
+        memcpy(verf, how->createhow3_u.verf, sizeof(verf));
+        if (statx(dfd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) < 0)
+            return errno_to_nfs(errno);
+        if (!S_ISREG(stx.stx_mode) || stx.stx_atime.tv_sec != verf[0] || stx.stx_mtime.tv_sec != verf[1])
+            return NFS3ERR_EXIST;
+        return new_child(dir, dfd, name, 0, child);
+    }
+    else
+        return errno_to_nfs(errno);
+
+    if (stat_fd(fd, &stx) != NFS3_OK)
+    {
+        close(fd);
+        return NFS3ERR_IO;
+    }
+    changes = dir_changed(dir);
+    *child = inode_find_or_create(stx.stx_ino, S_IFREG, dir, name, 1);
+    statx_to_fattr(&stx, &attr);
+    attr_store(*child, &attr);
+    dnlc_update(dir, name, *child, changes);
+    // Keep the fd we already have instead of reopening the file later
+    fd_cache_add(*child, fd);
+    return NFS3_OK;
+}
+
+static nfsstat3 chown_new(int dfd, const char *name, struct nfs_cred *cred, sattr3 *sattr)
+{
+    uid_t uid;
+    gid_t gid;
+    new_owner(cred, sattr, &uid, &gid);
+    if (fchownat(dfd, name, uid, gid, AT_SYMLINK_NOFOLLOW) < 0)
+        return errno_to_nfs(errno);
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_mkdir(struct inode *dir, struct nfs_cred *cred, const char *name, sattr3 *sattr, struct inode **child)
+{
+    mode_t mode = sattr->mode.set_it ? sattr->mode.set_mode3_u.mode & 07777 : 0755;
+    nfsstat3 status;
+    int dfd;
+
+    *child = NULL;
+    if ((status = check_name(name)) != NFS3_OK)
+        return status;
+    if ((status = dir_fd(dir, cred, MAY_WRITE|MAY_EXEC, &dfd)) != NFS3_OK)
+        return status;
+    if (mkdirat(dfd, name, mode) < 0)
+        return errno_to_nfs(errno);
+    if ((status = chown_new(dfd, name, cred, sattr)) != NFS3_OK)
+    {
+        unlinkat(dfd, name, AT_REMOVEDIR);
+        return status;
+    }
+    return new_child(dir, dfd, name, 1, child);
+}
+
+static nfsstat3 backend_symlink(struct inode *dir, struct nfs_cred *cred, const char *name, const char *target, sattr3 *sattr, struct inode **child)
+{
+    nfsstat3 status;
+    int dfd;
+
+    *child = NULL;
+    if ((status = check_name(name)) != NFS3_OK)
+        return status;
+    if ((status = dir_fd(dir, cred, MAY_WRITE|MAY_EXEC, &dfd)) != NFS3_OK)
+        return status;
+    if (symlinkat(target, dfd, name) < 0)
+        return errno_to_nfs(errno);
+    if ((status = chown_new(dfd, name, cred, sattr)) != NFS3_OK)
+    {
+        unlinkat(dfd, name, 0);
+        return status;
+    }
+    return new_child(dir, dfd, name, 1, child);
+}
+
+static nfsstat3 backend_mknod(struct inode *dir, struct nfs_cred *cred, const char *name, mknoddata3 *what, struct inode **child)
+{
+    sattr3 *sattr;
+    nfsstat3 status;
+    mode_t mode;
+    dev_t dev = 0;
+    int dfd;
+
+    *child = NULL;
+    switch (what->type)
+    {
+    case NF3CHR:
+    case NF3BLK:
+        sattr = &what->mknoddata3_u.device.dev_attributes;
+        mode = what->type == NF3CHR ? S_IFCHR : S_IFBLK;
+        dev = makedev(what->mknoddata3_u.device.spec.specdata1, what->mknoddata3_u.device.spec.specdata2);
+        break;
+    case NF3SOCK:
+    case NF3FIFO:
+        sattr = &what->mknoddata3_u.pipe_attributes;
+        mode = what->type == NF3SOCK ? S_IFSOCK : S_IFIFO;
+        break;
+    default:
+        return NFS3ERR_BADTYPE;
+    }
+    if ((status = check_name(name)) != NFS3_OK)
+        return status;
+    if ((status = dir_fd(dir, cred, MAY_WRITE|MAY_EXEC, &dfd)) != NFS3_OK)
+        return status;
+    mode |= sattr->mode.set_it ? sattr->mode.set_mode3_u.mode & 07777 : 0644;
+    if (mknodat(dfd, name, mode, dev) < 0)
+        return errno_to_nfs(errno);
+    if ((status = chown_new(dfd, name, cred, sattr)) != NFS3_OK)
+    {
+        unlinkat(dfd, name, 0);
+        return status;
+    }
+    return new_child(dir, dfd, name, 1, child);
+}
+
+static nfsstat3 backend_remove(struct inode *dir, struct nfs_cred *cred, const char *name)
+{
+    struct statx stx;
+    nfsstat3 status;
+    fattr3 attr;
+    int dfd;
+
+    if ((status = check_name(name)) != NFS3_OK)
+        return status;
+    if ((status = dir_fd_attr(dir, cred, MAY_WRITE|MAY_EXEC, &dfd, &attr)) != NFS3_OK)
+        return status;
+    if (statx(dfd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) < 0)
+        return errno_to_nfs(errno);
+    if (S_ISDIR(stx.stx_mode))
+        return NFS3ERR_ISDIR;
+    // unlinkat() runs as root, which the sticky bit doesn't stop
+    if (!may_delete(&attr, stx.stx_uid, cred))
+        return NFS3ERR_ACCES;
+    if (unlinkat(dfd, name, 0) < 0)
+        return errno_to_nfs(errno);
+    dnlc_update(dir, name, NULL, dir_changed(dir));
+    if (stx.stx_nlink <= 1)
+        inode_forget(stx.stx_ino, stx.stx_mode & S_IFMT);
+    else
+        inode_invalidate(stx.stx_ino);
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_rmdir(struct inode *dir, struct nfs_cred *cred, const char *name)
+{
+    struct statx stx;
+    nfsstat3 status;
+    fattr3 attr;
+    int dfd;
+
+    if (!strcmp(name, "."))
+        return NFS3ERR_INVAL;
+    if (!strcmp(name, ".."))
+        return NFS3ERR_NOTEMPTY;
+    if ((status = check_name(name)) != NFS3_OK)
+        return status;
+    if ((status = dir_fd_attr(dir, cred, MAY_WRITE|MAY_EXEC, &dfd, &attr)) != NFS3_OK)
+        return status;
+    if (statx(dfd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) < 0)
+        return errno_to_nfs(errno);
+    if (!may_delete(&attr, stx.stx_uid, cred))
+        return NFS3ERR_ACCES;
+    if (unlinkat(dfd, name, AT_REMOVEDIR) < 0)
+        return errno_to_nfs(errno);
+    dnlc_update(dir, name, NULL, dir_changed(dir));
+    inode_forget(stx.stx_ino, S_IFDIR);
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_rename(struct inode *from_dir, const char *from_name, struct inode *to_dir, const char *to_name, struct nfs_cred *cred)
+{
+    struct statx from_stx, to_stx;
+    int from_fd, to_fd, replaced;
+    fattr3 from_attr, to_attr;
+    nfsstat3 status;
+
+    if (!strcmp(from_name, ".") || !strcmp(from_name, "..") ||
+        !strcmp(to_name, ".") || !strcmp(to_name, ".."))
+        return NFS3ERR_INVAL;
+    if ((status = check_name(from_name)) != NFS3_OK ||
+        (status = check_name(to_name)) != NFS3_OK)
+        return status;
+    if ((status = dir_fd_attr(from_dir, cred, MAY_WRITE|MAY_EXEC, &from_fd, &from_attr)) != NFS3_OK ||
+        (status = dir_fd_attr(to_dir, cred, MAY_WRITE|MAY_EXEC, &to_fd, &to_attr)) != NFS3_OK)
+        return status;
+    if (statx(from_fd, from_name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &from_stx) < 0)
+        return errno_to_nfs(errno);
+    replaced = statx(to_fd, to_name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &to_stx) == 0;
+    // Both the entry that moves and the one it replaces count as removed
+    if (!may_delete(&from_attr, from_stx.stx_uid, cred) ||
+        (replaced && to_stx.stx_ino != from_stx.stx_ino && !may_delete(&to_attr, to_stx.stx_uid, cred)))
+        return NFS3ERR_ACCES;
+    if (renameat(from_fd, from_name, to_fd, to_name) < 0)
+        return errno_to_nfs(errno);
+    dnlc_update(from_dir, from_name, NULL, dir_changed(from_dir));
+    dir_changed(to_dir);
+    dnlc_remove(to_dir, to_name);
+    if (replaced && to_stx.stx_ino != from_stx.stx_ino)
+    {
+        if (S_ISDIR(to_stx.stx_mode) || to_stx.stx_nlink <= 1)
+            inode_forget(to_stx.stx_ino, to_stx.stx_mode & S_IFMT);
+        else
+            inode_invalidate(to_stx.stx_ino);
+    }
+    inode_moved(from_stx.stx_ino, to_dir, to_name);
+    inode_invalidate(from_stx.stx_ino);
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_link(struct inode *inode, struct inode *dir, const char *name, struct nfs_cred *cred)
+{
+    char path[32];
+    nfsstat3 status;
+    int fd, dfd;
+
+    if (inode->type == S_IFDIR)
+        return NFS3ERR_ISDIR;
+    if ((status = check_name(name)) != NFS3_OK)
+        return status;
+    if ((status = inode_fd(inode, &fd)) != NFS3_OK)
+        return status;
+    if ((status = dir_fd(dir, cred, MAY_WRITE|MAY_EXEC, &dfd)) != NFS3_OK)
+        return status;
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, path, dfd, name, AT_SYMLINK_FOLLOW) < 0)
+        return errno_to_nfs(errno);
+    attr_invalidate(inode);
+    dnlc_update(dir, name, inode, dir_changed(dir));
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_readdir(struct inode *dir, struct nfs_cred *cred, uint64_t cookie, char *verf, readdir_fn fn, void *private_data, int *eof)
+{
+    struct dir_snapshot *snap;
+    nfsstat3 status;
+    fattr3 attr;
+    size_t i;
+    int fd;
+
+    *eof = 0;
+    if ((status = dir_fd_attr(dir, cred, MAY_READ, &fd, &attr)) != NFS3_OK)
+        return status;
+    if ((status = snapshot_get(dir, fd, &attr, &snap)) != NFS3_OK)
+        return status;
+    memcpy(verf, &snap->mtime.seconds, 4);
+    memcpy(verf + 4, &snap->mtime.nseconds, 4);
+    for (i = snapshot_find(snap, cookie); i < snap->count; i++)
+    {
+        struct dir_entry *entry = &snap->entries[i];
+        if (fn(private_data, snap->names + entry->name, entry->ino, entry->cookie))
+            break;
+    }
+    *eof = i == snap->count;
+    __atomic_store_n(&snap->resume, i, __ATOMIC_RELAXED);
+    snapshot_put(snap);
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_fsstat(struct inode *inode, FSSTAT3resok *res)
+{
+    struct statvfs st;
+    if (fstatvfs(export_fd, &st) < 0)
+        return errno_to_nfs(errno);
+    res->tbytes = (uint64_t)st.f_blocks * st.f_frsize;
+    res->fbytes = (uint64_t)st.f_bfree * st.f_frsize;
+    res->abytes = (uint64_t)st.f_bavail * st.f_frsize;
+    res->tfiles = st.f_files;
+    res->ffiles = st.f_ffree;
+    res->afiles = st.f_favail;
+    res->invarsec = 0;
+    return NFS3_OK;
+}
+
+/*
+ * Returns 1 if nothing has been written unstably since the last commit,
+ * otherwise the sequence number the flush will cover.
+ */
+static int commit_begin(struct inode *inode, uint64_t *seq)
+{
+    pthread_mutex_t *lock = attr_lock(inode);
+    int done;
+
+    pthread_mutex_lock(lock);
+    *seq = inode->write_seq;
+    done = inode->commit_seq >= *seq;
+    inode->dirty_end = inode->dirty_start = 0;
+    pthread_mutex_unlock(lock);
+    return done;
+}
+
+// Bookkeeping after the flush returned res, 0 or -errno
+static nfsstat3 commit_end(struct inode *inode, uint64_t seq, int res)
+{
+    pthread_mutex_t *lock = attr_lock(inode);
+
+    if (res < 0)
+    {
+        write_failed();
+        return errno_to_nfs(-res);
+    }
+    pthread_mutex_lock(lock);
+    if (inode->commit_seq < seq)
+        inode->commit_seq = seq;
+    pthread_mutex_unlock(lock);
+    return NFS3_OK;
+}
+
+static nfsstat3 backend_commit(struct inode *inode, uint64_t offset, uint32_t count)
+{
+    nfsstat3 status;
+    uint64_t seq;
+    int fd;
+
+    if (inode->type != S_IFREG)
+        return inode->type == S_IFDIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+    if (commit_begin(inode, &seq))
+        return NFS3_OK;
+    if ((status = inode_fd(inode, &fd)) != NFS3_OK)
+        return status;
+    // One flush for all gathered writes, whatever range was asked for
+    return commit_end(inode, seq, fdatasync(fd) < 0 ? -errno : 0);
+}
+
+static void commit_complete(struct io_op *op, int res)
+{
+    struct backend_io *io = (struct backend_io *)op;
+    io->status = commit_end(io->inode, io->seq, res);
+    io->complete(io);
+}
+
+static void backend_commit_async(struct backend_io *io)
+{
+    struct inode *inode = io->inode;
+    int fd;
+
+    if (inode->type != S_IFREG)
+        io->status = inode->type == S_IFDIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+    else if (commit_begin(inode, &io->seq))
+        io->status = NFS3_OK;
+    else if ((io->status = inode_fd(inode, &fd)) == NFS3_OK)
+    {
+        io->op.complete = commit_complete;
+        if (io_fdatasync(&io->op, fd) == 0)
+            return;
+        commit_complete(&io->op, fdatasync(fd) < 0 ? -errno : 0);
+        return;
+    }
+    io->complete(io);
+}
+
+const struct backend passthrough_backend = {
+    .init = backend_init,
+    .write_verf = backend_write_verf,
+    .root = backend_root,
+    .inode_from_fh = inode_from_fh,
+    .inode_to_fh = inode_to_fh,
+    .inode_put = inode_put,
+    .getattr = backend_getattr,
+    .setattr = backend_setattr,
+    .lookup = backend_lookup,
+    .access = backend_access,
+    .readlink = backend_readlink,
+    .read = backend_read,
+    .read_fd = backend_read_fd,
+    .readahead = backend_readahead,
+    .write = backend_write,
+    .create = backend_create,
+    .mkdir = backend_mkdir,
+    .symlink = backend_symlink,
+    .mknod = backend_mknod,
+    .remove = backend_remove,
+    .rmdir = backend_rmdir,
+    .rename = backend_rename,
+    .link = backend_link,
+    .readdir = backend_readdir,
+    .fsstat = backend_fsstat,
+    .commit = backend_commit,
+    .read_async = backend_read_async,
+    .commit_async = backend_commit_async,
+};
+
+const struct backend *backend = &passthrough_backend;
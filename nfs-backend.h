@@ -0,0 +1,189 @@
+#pragma once
+
+#include "nfs-service.h"
+#include "nfs-uring.h"
+#include "nfs-pool.h"
+
+/*
+ * Backends.
+ *
+ * The nfs3 procs reach the exported filesystem through the backend table
+ * that is selected at startup. Every backend defines its own struct inode:
+ * an in-memory object for everything the clients know about.
+ *
+ * All operations return an nfsstat3. Inodes returned by the backend hold a
+ * reference that must be dropped with inode_put().
+ */
+struct inode;
+
+struct nfs_cred
+{
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t ngids;
+    uint32_t gids[16];
+};
+
+struct export_rule;
+
+// The caller's identity, from the credentials of the call and the client's rule for the export
+void get_cred(struct rpc_msg *call, const struct export_rule *rule, struct nfs_cred *cred);
+
+/*
+ * Buffers for a transfer of count bytes, in chunks of POOL_CHUNK_SIZE from
+ * io_buffer_get(). Returns how many or -1, with nothing taken, if the pool
+ * is used up.
+ */
+#define MAX_CHUNKS (MAX_TRANSFER / POOL_CHUNK_SIZE)
+int get_chunks(struct iovec *chunks, uint32_t count);
+void put_chunks(struct iovec *chunks, int count);
+
+/*
+ * Directory listing. The callback is called for every entry starting after
+ * cookie and returns non-zero to stop the listing; that entry is not
+ * consumed and will be returned again when listing from the previous cookie.
+ * Cookies stay valid when the directory changes, the cookie verifier
+ * (NFS3_COOKIEVERFSIZE bytes) only tells the client that it did.
+ */
+typedef int (*readdir_fn)(void *private_data, const char *name, uint64_t ino, uint64_t cookie);
+
+/*
+ * Asynchronous read or commit. The caller fills in the arguments,
+ * starts it and keeps it until the backend calls complete, exactly once
+ * and on the calling thread, possibly before the start function returns.
+ * By then status and the results of the synchronous version are set.
+ */
+struct backend_io
+{
+    // Used by the backend
+    struct io_op op;
+    uint64_t seq;
+
+    void (*complete)(struct backend_io *io);
+    struct inode *inode;
+    uint64_t offset;
+    uint32_t count;
+    // Room for the data to read, count bytes in total
+    struct iovec *iov;
+    int iovcnt;
+    stable_how stable;
+
+    nfsstat3 status;
+    uint32_t done;
+    int eof;
+    // Attributes of a read and wcc data of a write
+    fattr3 attr;
+    wcc_data wcc;
+};
+
+// Exports are numbered below this, see inode_from_fh()
+#define MAX_EXPORTS 64
+
+struct backend
+{
+    int (*init)(const char *path);
+    // Current write verifier, changes on restart and when writeback fails
+    void (*write_verf)(char *verf);
+
+    struct inode *(*root)(void);
+    /*
+     * Handles carry the number of the export they were handed out under,
+     * below MAX_EXPORTS, see nfs-export.h. inode_to_fh() writes the handle
+     * of inode under export to fh, which has room for NFS3_FHSIZE bytes,
+     * and returns its length. inode_from_fh() returns the export of a
+     * handle in *export, and handles under exports the object has never
+     * been handed out under are stale.
+     */
+    struct inode *(*inode_from_fh)(nfs_fh3 *fh, int *export, nfsstat3 *status);
+    uint32_t (*inode_to_fh)(struct inode *inode, int export, char *fh);
+    void (*inode_put)(struct inode *inode);
+
+    nfsstat3 (*getattr)(struct inode *inode, fattr3 *attr);
+    nfsstat3 (*setattr)(struct inode *inode, struct nfs_cred *cred, sattr3 *sattr, nfstime3 *guard_ctime);
+    nfsstat3 (*lookup)(struct inode *dir, struct nfs_cred *cred, const char *name, struct inode **child, fattr3 *attr);
+    nfsstat3 (*access)(struct inode *inode, struct nfs_cred *cred, uint32_t want, uint32_t *granted);
+    nfsstat3 (*readlink)(struct inode *inode, char *buf, size_t size);
+    nfsstat3 (*read)(struct inode *inode, struct nfs_cred *cred, uint64_t offset, uint32_t count, char *buf, uint32_t *done, int *eof, fattr3 *attr);
+    /*
+     * Zero-copy read: checks access like read() but only returns the fd
+     * and how many bytes the file has at offset, according to the cached
+     * attributes. The fd is only valid until the next inode_from_fh().
+     * NULL if the backend has no files to send from.
+     */
+    nfsstat3 (*read_fd)(struct inode *inode, struct nfs_cred *cred, uint64_t offset, uint32_t count, int *fd, uint32_t *len, int *eof, fattr3 *attr);
+    /*
+     * Called after every successful read, prefetches data when the client
+     * (any pointer identifying it) reads the file sequentially. May be NULL.
+     */
+    void (*readahead)(struct inode *inode, const void *client, uint64_t offset, uint32_t count);
+    nfsstat3 (*write)(struct inode *inode, struct nfs_cred *cred, uint64_t offset, uint32_t count, char *buf, stable_how stable, uint32_t *done, wcc_data *wcc);
+    nfsstat3 (*create)(struct inode *dir, struct nfs_cred *cred, const char *name, createhow3 *how, struct inode **child);
+    nfsstat3 (*mkdir)(struct inode *dir, struct nfs_cred *cred, const char *name, sattr3 *sattr, struct inode **child);
+    nfsstat3 (*symlink)(struct inode *dir, struct nfs_cred *cred, const char *name, const char *target, sattr3 *sattr, struct inode **child);
+    nfsstat3 (*mknod)(struct inode *dir, struct nfs_cred *cred, const char *name, mknoddata3 *what, struct inode **child);
+    nfsstat3 (*remove)(struct inode *dir, struct nfs_cred *cred, const char *name);
+    nfsstat3 (*rmdir)(struct inode *dir, struct nfs_cred *cred, const char *name);
+    nfsstat3 (*rename)(struct inode *from_dir, const char *from_name, struct inode *to_dir, const char *to_name, struct nfs_cred *cred);
+    nfsstat3 (*link)(struct inode *inode, struct inode *dir, const char *name, struct nfs_cred *cred);
+    nfsstat3 (*readdir)(struct inode *dir, struct nfs_cred *cred, uint64_t cookie, char *verf, readdir_fn fn, void *private_data, int *eof);
+    nfsstat3 (*fsstat)(struct inode *inode, FSSTAT3resok *res);
+    nfsstat3 (*commit)(struct inode *inode, uint64_t offset, uint32_t count);
+    /*
+     * Asynchronous read and commit, see struct backend_io. NULL if the
+     * backend never waits for I/O, the synchronous ones are used then.
+     * Access is checked before a read is started, with cred. Writes are
+     * always synchronous, see nfs3_write_proc().
+     */
+    void (*read_async)(struct backend_io *io, struct nfs_cred *cred);
+    void (*commit_async)(struct backend_io *io);
+};
+
+// The backend in use, the passthrough backend unless main() picks another
+extern const struct backend *backend;
+
+/*
+ * Helpers shared by the backends
+ */
+#define MAY_READ  4
+#define MAY_WRITE 2
+#define MAY_EXEC  1
+
+nfsstat3 check_name(const char *name);
+int in_group(struct nfs_cred *cred, uint32_t gid);
+int may_access(fattr3 *attr, struct nfs_cred *cred, int want);
+// In a sticky directory only the owners of the entry and the directory may remove or replace it
+int may_delete(fattr3 *dir_attr, uint32_t owner, struct nfs_cred *cred);
+
+/*
+ * Passthrough backend.
+ *
+ * Exports a local directory tree. Every object the clients know about has
+ * an in-memory inode that records its parent and name, so it can be
+ * reopened with openat() relative to its parent directory. Open file
+ * descriptors are kept in a per-thread LRU cache keyed by inode.
+ */
+extern const struct backend passthrough_backend;
+
+/* Size of the per-thread open fd cache */
+extern int fd_cache_max;
+
+/* Attribute cache timeout and statistics */
+extern int attr_timeout_ms;
+extern uint64_t attr_cache_hits;
+extern uint64_t attr_cache_misses;
+
+/* Name lookup cache statistics */
+extern uint64_t dnlc_hits;
+extern uint64_t dnlc_negative_hits;
+extern uint64_t dnlc_misses;
+
+/*
+ * RAM backend, see nfs-ramfs.c.
+ *
+ * Keeps the whole filesystem in memory, starting out empty, for scratch
+ * exports and for benchmarking without a disk. Everything is lost on exit.
+ */
+extern const struct backend ram_backend;
+
+/* Most file data it stores, in bytes */
+extern uint64_t ram_max_bytes;
@@ -0,0 +1,533 @@
+#define _FILE_OFFSET_BITS 64
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnfs.h"
+#include "libnfs-raw.h"
+#include "libnfs-raw-mount.h"
+#include "libnfs-raw-nfs.h"
+
+/*
+ * NFS load generator.
+ *
+ * Every connection runs on its own thread with its own libnfs context,
+ * mounts the export and keeps queue_depth calls in flight, picking each
+ * call from the configured mix. READ and WRITE go to random aligned
+ * offsets of a test file that is created in the export root. The results
+ * are printed as a single JSON object.
+ */
+enum { OP_NULL, OP_GETATTR, OP_LOOKUP, OP_READ, OP_WRITE, OP_READDIRPLUS, NUM_OPS };
+
+static const char *op_names[NUM_OPS] = { "null", "getattr", "lookup", "read", "write", "readdirplus" };
+
+// Log-linear latency histogram, 12.5% wide buckets up to 2^40 ns
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((40 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct op_stats
+{
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t hist[HIST_BUCKETS];
+};
+
+struct connection;
+
+// A call in flight
+struct slot
+{
+    struct connection *conn;
+    int op;
+    uint64_t start;
+};
+
+struct connection
+{
+    pthread_t thread;
+    struct rpc_context *rpc;
+    struct slot *slots;
+    int in_flight;
+    uint64_t random;
+    char *write_buf;
+    struct op_stats stats[NUM_OPS];
+};
+
+static const char *host = "127.0.0.1";
+static int port = 2049;
+static const char *export_path = "/";
+static const char *file_name = "nfs-bench.dat";
+static int num_conns = 1;
+static int queue_depth = 16;
+static int duration = 10;
+static uint32_t io_size = 64*1024;
+static uint64_t file_size = 256*1024*1024;
+static int mix[NUM_OPS] = { 0, 40, 20, 20, 15, 5 };
+static int mix_total;
+
+static nfs_fh3 root_fh;
+static nfs_fh3 file_fh;
+static uint64_t deadline;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void hist_add(uint64_t *hist, uint64_t ns)
+{
+    int bucket = ns;
+    if (ns >= 2 << HIST_SUB_BITS)
+    {
+        int exp = 63 - __builtin_clzll(ns);
+        bucket = ((exp - HIST_SUB_BITS) << HIST_SUB_BITS) + (ns >> (exp - HIST_SUB_BITS));
+        if (bucket >= HIST_BUCKETS)
+            bucket = HIST_BUCKETS - 1;
+    }
+    hist[bucket]++;
+}
+
+// Latency at quantile q in microseconds, the middle of its bucket
+static double hist_quantile(uint64_t *hist, uint64_t count, double q)
+{
+    uint64_t rank = q * count, seen = 0, mantissa, width;
+    int bucket, exp;
+
+    for (bucket = 0; bucket < HIST_BUCKETS - 1; bucket++)
+    {
+        seen += hist[bucket];
+        if (seen > rank)
+            break;
+    }
+    if (bucket < 2 << HIST_SUB_BITS)
+        return bucket / 1000.0;
+    exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    mantissa = (bucket & ((1 << HIST_SUB_BITS) - 1)) | (1 << HIST_SUB_BITS);
+    width = 1ull << (exp - HIST_SUB_BITS);
+    return (mantissa * width + width / 2.0) / 1000;
+}
+
+// xorshift64, every connection has its own state
+static uint64_t next_random(struct connection *conn)
+{
+    conn->random ^= conn->random << 13;
+    conn->random ^= conn->random >> 7;
+    conn->random ^= conn->random << 17;
+    return conn->random;
+}
+
+// Run the event loop of a context until *done is set
+static int wait_for(struct rpc_context *rpc, int *done)
+{
+    struct pollfd pfd;
+
+    while (!*done)
+    {
+        pfd.fd = rpc_get_fd(rpc);
+        pfd.events = rpc_which_events(rpc);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR)
+            return -1;
+        if (rpc_service(rpc, pfd.revents) < 0)
+        {
+            printf("Connection failed: %s\n", rpc_get_error(rpc));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void copy_fh(nfs_fh3 *to, const char *data, u_int len)
+{
+    to->data.data_len = len;
+    to->data.data_val = malloc(len);
+    memcpy(to->data.data_val, data, len);
+}
+
+struct setup
+{
+    int done;
+    int status;
+    nfs_fh3 *fh;
+};
+
+static void connect_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+    struct setup *setup = private_data;
+    setup->status = status;
+    setup->done = 1;
+}
+
+static void mount_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+    struct setup *setup = private_data;
+    mountres3 *res = data;
+
+    setup->done = 1;
+    setup->status = status == RPC_STATUS_SUCCESS && res->fhs_status == MNT3_OK ? 0 : -1;
+    if (setup->status == 0 && setup->fh)
+        copy_fh(setup->fh, res->mountres3_u.mountinfo.fhandle.fhandle3_val, res->mountres3_u.mountinfo.fhandle.fhandle3_len);
+}
+
+static void create_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+    struct setup *setup = private_data;
+    CREATE3res *res = data;
+
+    setup->done = 1;
+    setup->status = status == RPC_STATUS_SUCCESS && res->status == NFS3_OK &&
+        res->CREATE3res_u.resok.obj.handle_follows ? 0 : -1;
+    if (setup->status == 0)
+        copy_fh(setup->fh, res->CREATE3res_u.resok.obj.post_op_fh3_u.handle.data.data_val,
+            res->CREATE3res_u.resok.obj.post_op_fh3_u.handle.data.data_len);
+}
+
+// Connect a context and mount the export, optionally returning the root handle
+static struct rpc_context *connect_and_mount(nfs_fh3 *fh)
+{
+    struct rpc_context *rpc = rpc_init_context();
+    struct setup setup = {0, 0, fh};
+
+    if (rpc == NULL)
+    {
+        printf("Failed to create RPC context\n");
+        exit(10);
+    }
+    if (rpc_connect_async(rpc, host, port, connect_cb, &setup) != 0 ||
+        wait_for(rpc, &setup.done) < 0 || setup.status != RPC_STATUS_SUCCESS)
+    {
+        printf("Failed to connect to %s:%d\n", host, port);
+        exit(10);
+    }
+    setup.done = 0;
+    if (rpc_mount3_mnt_async(rpc, mount_cb, (char *)export_path, &setup) != 0 ||
+        wait_for(rpc, &setup.done) < 0 || setup.status != 0)
+    {
+        printf("Failed to mount %s:%s\n", host, export_path);
+        exit(10);
+    }
+    return rpc;
+}
+
+// Create the test file, sparse and file_size bytes big
+static void create_file(struct rpc_context *rpc)
+{
+    struct setup setup = {0, 0, &file_fh};
+    CREATE3args args;
+
+    memset(&args, 0, sizeof(args));
+    args.where.dir = root_fh;
+    args.where.name = (char *)file_name;
+    args.how.mode = UNCHECKED;
+    args.how.createhow3_u.obj_attributes.mode.set_it = TRUE;
+    args.how.createhow3_u.obj_attributes.mode.set_mode3_u.mode = 0644;
+    args.how.createhow3_u.obj_attributes.size.set_it = TRUE;
+    args.how.createhow3_u.obj_attributes.size.set_size3_u.size = file_size;
+    if (rpc_nfs3_create_async(rpc, create_cb, &args, &setup) != 0 ||
+        wait_for(rpc, &setup.done) < 0 || setup.status != 0)
+    {
+        printf("Failed to create %s\n", file_name);
+        exit(10);
+    }
+}
+
+static void start_op(struct slot *slot);
+
+// Completion of any call, counts it and starts the next one
+static void op_cb(struct rpc_context *rpc, int status, void *data, void *private_data)
+{
+    struct slot *slot = private_data;
+    struct connection *conn = slot->conn;
+    struct op_stats *stats = &conn->stats[slot->op];
+    uint64_t now = now_ns();
+    // Every NFS result starts with its nfsstat3
+    int ok = status == RPC_STATUS_SUCCESS && (slot->op == OP_NULL || *(nfsstat3 *)data == NFS3_OK);
+
+    stats->ops++;
+    if (!ok)
+        stats->errors++;
+    else if (slot->op == OP_READ)
+        stats->bytes += ((READ3res *)data)->READ3res_u.resok.count;
+    else if (slot->op == OP_WRITE)
+        stats->bytes += ((WRITE3res *)data)->WRITE3res_u.resok.count;
+    hist_add(stats->hist, now - slot->start);
+
+    conn->in_flight--;
+    if (now < deadline)
+        start_op(slot);
+}
+
+static void start_op(struct slot *slot)
+{
+    struct connection *conn = slot->conn;
+    uint64_t offset;
+    int r, pick;
+
+    pick = next_random(conn) % mix_total;
+    for (slot->op = 0; pick >= mix[slot->op]; slot->op++)
+        pick -= mix[slot->op];
+    offset = (next_random(conn) % (file_size / io_size)) * io_size;
+    slot->start = now_ns();
+
+    switch (slot->op)
+    {
+    case OP_NULL:
+        r = rpc_nfs3_null_async(conn->rpc, op_cb, slot);
+        break;
+    case OP_GETATTR:
+    {
+        GETATTR3args args;
+        args.object = file_fh;
+        r = rpc_nfs3_getattr_async(conn->rpc, op_cb, &args, slot);
+        break;
+    }
+    case OP_LOOKUP:
+    {
+        LOOKUP3args args;
+        args.what.dir = root_fh;
+        args.what.name = (char *)file_name;
+        r = rpc_nfs3_lookup_async(conn->rpc, op_cb, &args, slot);
+        break;
+    }
+    case OP_READ:
+    {
+        READ3args args;
+        args.file = file_fh;
+        args.offset = offset;
+        args.count = io_size;
+        r = rpc_nfs3_read_async(conn->rpc, op_cb, &args, slot);
+        break;
+    }
+    case OP_WRITE:
+    {
+        WRITE3args args;
+        args.file = file_fh;
+        args.offset = offset;
+        args.count = io_size;
+        args.stable = UNSTABLE;
+        args.data.data_len = io_size;
+        args.data.data_val = conn->write_buf;
+        r = rpc_nfs3_write_async(conn->rpc, op_cb, &args, slot);
+        break;
+    }
+    default:
+    {
+        READDIRPLUS3args args;
+        memset(&args, 0, sizeof(args));
+        args.dir = root_fh;
+        args.dircount = 8192;
+        args.maxcount = 32768;
+        r = rpc_nfs3_readdirplus_async(conn->rpc, op_cb, &args, slot);
+        break;
+    }
+    }
+    if (r != 0)
+    {
+        printf("Failed to queue %s call\n", op_names[slot->op]);
+        exit(10);
+    }
+    conn->in_flight++;
+}
+
+static void *connection_main(void *private_data)
+{
+    struct connection *conn = private_data;
+    int i;
+
+    for (i = 0; i < queue_depth; i++)
+        start_op(&conn->slots[i]);
+    // Calls stop being started at the deadline, wait for the rest
+    while (conn->in_flight > 0)
+    {
+        struct pollfd pfd;
+        pfd.fd = rpc_get_fd(conn->rpc);
+        pfd.events = rpc_which_events(conn->rpc);
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 100) < 0 && errno != EINTR)
+            break;
+        if (rpc_service(conn->rpc, pfd.revents) < 0)
+        {
+            printf("Connection failed: %s\n", rpc_get_error(conn->rpc));
+            exit(10);
+        }
+    }
+    return NULL;
+}
+
+// Parse a mix like "getattr:40,read:30,write:30"
+static void parse_mix(char *spec)
+{
+    char *item, *save = NULL;
+    int i;
+
+    memset(mix, 0, sizeof(mix));
+    for (item = strtok_r(spec, ",", &save); item; item = strtok_r(NULL, ",", &save))
+    {
+        char *colon = strchr(item, ':');
+        if (colon)
+            *colon = 0;
+        for (i = 0; i < NUM_OPS && strcmp(op_names[i], item); i++)
+            ;
+        if (i == NUM_OPS)
+        {
+            fprintf(stderr, "Unknown operation %s in mix\n", item);
+            exit(1);
+        }
+        mix[i] = colon ? atoi(colon + 1) : 1;
+    }
+}
+
+static void print_results(struct connection *conns, double seconds)
+{
+    struct op_stats total, op;
+    int i, c, b, first = 1;
+
+    memset(&total, 0, sizeof(total));
+    printf("{\"connections\": %d, \"queue_depth\": %d, \"io_size\": %u, \"seconds\": %.3f, \"ops\": {",
+        num_conns, queue_depth, io_size, seconds);
+    for (i = 0; i < NUM_OPS; i++)
+    {
+        memset(&op, 0, sizeof(op));
+        for (c = 0; c < num_conns; c++)
+        {
+            op.ops += conns[c].stats[i].ops;
+            op.errors += conns[c].stats[i].errors;
+            op.bytes += conns[c].stats[i].bytes;
+            for (b = 0; b < HIST_BUCKETS; b++)
+                op.hist[b] += conns[c].stats[i].hist[b];
+        }
+        total.ops += op.ops;
+        total.errors += op.errors;
+        total.bytes += op.bytes;
+        for (b = 0; b < HIST_BUCKETS; b++)
+            total.hist[b] += op.hist[b];
+        if (op.ops == 0)
+            continue;
+        printf("%s\"%s\": {\"ops\": %lu, \"errors\": %lu, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+            "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}",
+            first ? "" : ", ", op_names[i], op.ops, op.errors, op.ops / seconds, op.bytes / seconds / 1e6,
+            hist_quantile(op.hist, op.ops, 0.5), hist_quantile(op.hist, op.ops, 0.99), hist_quantile(op.hist, op.ops, 0.999));
+        first = 0;
+    }
+    printf("}, \"total\": {\"ops\": %lu, \"errors\": %lu, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+        "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f}}\n",
+        total.ops, total.errors, total.ops / seconds, total.bytes / seconds / 1e6,
+        hist_quantile(total.hist, total.ops, 0.5), hist_quantile(total.hist, total.ops, 0.99), hist_quantile(total.hist, total.ops, 0.999));
+}
+
+int main(int argc, char *argv[])
+{
+    struct connection *conns;
+    struct rpc_context *rpc;
+    uint64_t start;
+    int i, j, opt;
+
+    while ((opt = getopt(argc, argv, "H:p:e:f:c:q:d:s:z:m:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'e':
+            export_path = optarg;
+            break;
+        case 'f':
+            file_name = optarg;
+            break;
+        case 'c':
+            num_conns = atoi(optarg);
+            break;
+        case 'q':
+            queue_depth = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 's':
+            io_size = atoi(optarg) * 1024;
+            break;
+        case 'z':
+            file_size = strtoull(optarg, NULL, 0) * 1024*1024;
+            break;
+        case 'm':
+            parse_mix(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-H host] [-p port] [-e export] [-f file] [-c connections] [-q queue_depth] "
+                "[-d seconds] [-s io_size_kb] [-z file_size_mb] [-m op:weight,...]\n"
+                "operations: null getattr lookup read write readdirplus\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (num_conns < 1)
+        num_conns = 1;
+    if (queue_depth < 1)
+        queue_depth = 1;
+    if (io_size < 1024)
+        io_size = 1024;
+    if (file_size < io_size)
+        file_size = io_size;
+    for (i = 0; i < NUM_OPS; i++)
+        mix_total += mix[i];
+    if (mix_total <= 0)
+    {
+        fprintf(stderr, "The mix is empty\n");
+        exit(1);
+    }
+
+    // Set up the test file on a connection of its own
+    rpc = connect_and_mount(&root_fh);
+    create_file(rpc);
+    rpc_destroy_context(rpc);
+
+    conns = calloc(num_conns, sizeof(struct connection));
+    for (i = 0; i < num_conns; i++)
+    {
+        struct connection *conn = &conns[i];
+        conn->rpc = connect_and_mount(NULL);
+        conn->random = 0x9e3779b97f4a7c15ull * (i + 1);
+        conn->write_buf = malloc(io_size);
+        conn->slots = calloc(queue_depth, sizeof(struct slot));
+        if (conn->write_buf == NULL || conn->slots == NULL)
+        {
+            printf("Failed to allocate buffers\n");
+            exit(10);
+        }
+        memset(conn->write_buf, 'x', io_size);
+        for (j = 0; j < queue_depth; j++)
+            conn->slots[j].conn = conn;
+    }
+
+    start = now_ns();
+    deadline = start + duration * 1000000000ull;
+    for (i = 0; i < num_conns; i++)
+    {
+        if (pthread_create(&conns[i].thread, NULL, connection_main, &conns[i]) != 0)
+        {
+            printf("Failed to start connection thread\n");
+            exit(10);
+        }
+    }
+    for (i = 0; i < num_conns; i++)
+        pthread_join(conns[i].thread, NULL);
+
+    print_results(conns, (now_ns() - start) / 1e9);
+    return 0;
+}
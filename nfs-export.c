@@ -0,0 +1,557 @@
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "nfs-export.h"
+
+/*
+ * The rules are compiled into two tries, for IPv4 and IPv6 addresses, with
+ * a node per byte of the address. A prefix that ends within a byte is
+ * expanded to all the entries of its node that it covers, so a lookup is a
+ * walk down the bytes of the address that remembers the last rule it
+ * passed. An entry keeps the longest prefix that covers it, prefixes that
+ * end in a later byte are in deeper nodes. Every export has its own pair
+ * of tries, the global pair has the rules of all of them.
+ */
+struct trie_node
+{
+    const struct export_rule *rules[256];
+    struct trie_node *children[256];
+};
+
+// Recorded mounts, beyond that MNT still works but DUMP doesn't show them
+#define MAX_MOUNTS 4096
+
+struct mount_entry
+{
+    struct mount_entry *next;
+    uint8_t addr[16];
+    char *path;
+};
+
+struct export *export_table;
+struct export *exports_by_index[MAX_EXPORTS];
+int num_exports;
+
+static struct trie_node trie_v4;
+static struct trie_node trie_v6;
+
+static pthread_mutex_t mounts_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mount_entry *mounts;
+static int num_mounts;
+
+/*
+ * Make an absolute path canonical in place: no repeated or trailing
+ * slashes and no "." components. Returns -1 for relative paths and paths
+ * with ".." components.
+ */
+static int normalize_path(char *path)
+{
+    char *in = path, *out = path, *name;
+
+    if (*in != '/')
+        return -1;
+    while (*in)
+    {
+        while (*in == '/')
+            in++;
+        if (*in == 0)
+            break;
+        *out++ = '/';
+        name = out;
+        while (*in && *in != '/')
+            *out++ = *in++;
+        if (out - name == 2 && name[0] == '.' && name[1] == '.')
+            return -1;
+        if (out - name == 1 && name[0] == '.')
+            out = name - 1;
+    }
+    if (out == path)
+        *out++ = '/';
+    *out = 0;
+    return 0;
+}
+
+static int trie_insert(struct trie_node *node, const uint8_t *addr, int len, const struct export_rule *rule)
+{
+    int i, first, count;
+
+    // Whole bytes lead to the node of the last one, it has 1 to 8 bits
+    for (; len > 8; len -= 8, addr++)
+    {
+        if (node->children[*addr] == NULL && (node->children[*addr] = calloc(1, sizeof(struct trie_node))) == NULL)
+            return -1;
+        node = node->children[*addr];
+    }
+    count = 1 << (8 - len);
+    first = *addr & ~(count - 1) & 0xff;
+    for (i = first; i < first + count; i++)
+    {
+        if (node->rules[i] == NULL || node->rules[i]->prefix_len < rule->prefix_len)
+            node->rules[i] = rule;
+    }
+    return 0;
+}
+
+static int trie_add_rule(struct trie_node *v4, struct trie_node *v6, const struct export_rule *rule)
+{
+    if (rule->prefix_len == 0)
+        return trie_insert(v4, rule->addr, 0, rule) | trie_insert(v6, rule->addr, 0, rule);
+    if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *)rule->addr) && rule->prefix_len >= 96)
+        return trie_insert(v4, rule->addr + 12, rule->prefix_len - 96, rule);
+    return trie_insert(v6, rule->addr, rule->prefix_len, rule);
+}
+
+static int build_trie(void)
+{
+    struct export_rule *rule;
+    struct export *export;
+    int r = 0;
+
+    for (export = export_table; export; export = export->next)
+    {
+        export->trie_v4 = calloc(1, sizeof(struct trie_node));
+        export->trie_v6 = calloc(1, sizeof(struct trie_node));
+        if (export->trie_v4 == NULL || export->trie_v6 == NULL)
+            return -1;
+        for (rule = export->rules; rule; rule = rule->next)
+            r |= trie_add_rule(&trie_v4, &trie_v6, rule) | trie_add_rule(export->trie_v4, export->trie_v6, rule);
+    }
+    return r;
+}
+
+static const struct export_rule *trie_lookup(const struct trie_node *v4, const struct trie_node *v6, const uint8_t *addr)
+{
+    const struct export_rule *rule = NULL;
+    const struct trie_node *node = v6;
+    int i = 0;
+
+    if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)addr))
+    {
+        node = v4;
+        i = 12;
+    }
+    for (; node && i < 16; i++)
+    {
+        if (node->rules[addr[i]])
+            rule = node->rules[addr[i]];
+        node = node->children[addr[i]];
+    }
+    return rule;
+}
+
+const struct export_rule *export_match(const uint8_t *addr)
+{
+    return trie_lookup(&trie_v4, &trie_v6, addr);
+}
+
+const struct export_rule *export_client_rule(const struct export *export, const uint8_t *addr)
+{
+    return trie_lookup(export->trie_v4, export->trie_v6, addr);
+}
+
+void export_client_rules(const uint8_t *addr, const struct export_rule **rules)
+{
+    int i;
+    for (i = 0; i < num_exports; i++)
+        rules[i] = export_client_rule(exports_by_index[i], addr);
+}
+
+struct export *export_find(char *path, const uint8_t *addr, const struct export_rule **rule)
+{
+    struct export *export, *found = NULL;
+    size_t len, found_len = 0;
+
+    *rule = NULL;
+    if (normalize_path(path) < 0)
+        return NULL;
+    for (export = export_table; export; export = export->next)
+    {
+        len = strcmp(export->path, "/") == 0 ? 0 : strlen(export->path);
+        if ((found == NULL || len > found_len) && strncmp(path, export->path, len) == 0 && (path[len] == 0 || path[len] == '/'))
+        {
+            found = export;
+            found_len = len;
+        }
+    }
+    if (found)
+        *rule = export_client_rule(found, addr);
+    return found;
+}
+
+// Look up path below dir, as root, the reference to dir goes to *inode
+static nfsstat3 lookup_path(struct inode *dir, const char *path, struct inode **inode)
+{
+    struct nfs_cred cred = { 0, 0, 0 };
+    char name[NAME_MAX + 1];
+    struct inode *child;
+    nfsstat3 status;
+    fattr3 attr;
+    size_t len;
+
+    status = backend->getattr(dir, &attr);
+    while (status == NFS3_OK && *path)
+    {
+        len = strcspn(path, "/");
+        if (len >= sizeof(name))
+        {
+            status = NFS3ERR_NAMETOOLONG;
+            break;
+        }
+        memcpy(name, path, len);
+        name[len] = 0;
+        path += len + (path[len] == '/');
+        if ((status = backend->lookup(dir, &cred, name, &child, &attr)) == NFS3_OK)
+        {
+            backend->inode_put(dir);
+            dir = child;
+        }
+    }
+    if (status == NFS3_OK && attr.type != NF3DIR)
+        status = NFS3ERR_NOTDIR;
+    if (status != NFS3_OK)
+    {
+        backend->inode_put(dir);
+        dir = NULL;
+    }
+    *inode = dir;
+    return status;
+}
+
+nfsstat3 export_lookup(struct export *export, const char *path, struct inode **inode)
+{
+    size_t len = strcmp(export->path, "/") == 0 ? 0 : strlen(export->path);
+    struct inode *root;
+    nfsstat3 status;
+    fattr3 attr;
+
+    *inode = NULL;
+    if ((status = lookup_path(backend->root(), export->path + 1, &root)) != NFS3_OK)
+        return status;
+    // The directory may have been replaced since it was last looked up
+    if ((status = backend->getattr(root, &attr)) != NFS3_OK)
+    {
+        backend->inode_put(root);
+        return status;
+    }
+    __atomic_store_n(&export->root_fsid, attr.fsid, __ATOMIC_RELAXED);
+    __atomic_store_n(&export->root_fileid, attr.fileid, __ATOMIC_RELAXED);
+    return lookup_path(root, path + len + (path[len] == '/'), inode);
+}
+
+int export_is_root(int export, struct inode *dir)
+{
+    struct export *e = exports_by_index[export];
+    fattr3 attr;
+
+    return backend->getattr(dir, &attr) == NFS3_OK &&
+        attr.fileid == __atomic_load_n(&e->root_fileid, __ATOMIC_RELAXED) &&
+        attr.fsid == __atomic_load_n(&e->root_fsid, __ATOMIC_RELAXED);
+}
+
+/*
+ * Number the exports and build their tries. Handles of the root survive
+ * restarts, clients may still have them under the exports of "/".
+ */
+static int exports_init(void)
+{
+    struct export *export;
+    struct inode *root;
+    char fh[NFS3_FHSIZE];
+
+    for (export = export_table; export; export = export->next)
+    {
+        export->index = num_exports;
+        exports_by_index[num_exports++] = export;
+    }
+    if (build_trie() < 0)
+        return -1;
+    for (export = export_table; export; export = export->next)
+    {
+        if (strcmp(export->path, "/") == 0 && export_lookup(export, "/", &root) == NFS3_OK)
+        {
+            backend->inode_to_fh(root, export->index, fh);
+            backend->inode_put(root);
+        }
+    }
+    return 0;
+}
+
+// Parse "*", an address or a network into rule
+static int parse_client(struct export_rule *rule, char *client)
+{
+    char *slash = strchr(client, '/'), *end;
+    struct in_addr in;
+    long len = -1;
+    int max = 128;
+
+    if (strcmp(client, "*") == 0)
+        return 0;
+    if (slash)
+    {
+        *slash = 0;
+        len = strtol(slash + 1, &end, 10);
+        if (slash[1] == 0 || *end != 0)
+            len = -2;
+    }
+    if (inet_pton(AF_INET, client, &in) == 1)
+    {
+        rule->addr[10] = rule->addr[11] = 0xff;
+        memcpy(rule->addr + 12, &in, 4);
+        max = 32;
+    }
+    else if (inet_pton(AF_INET6, client, rule->addr) != 1)
+        return -1;
+    if (slash)
+        *slash = '/';
+    if (len == -1)
+        len = max;
+    if (len < 0 || len > max)
+        return -1;
+    rule->prefix_len = len + 128 - max;
+    // Clear the host part
+    for (max = rule->prefix_len; max < 128; max++)
+        rule->addr[max / 8] &= ~(0x80 >> (max % 8));
+    return 0;
+}
+
+static int parse_option(struct export_rule *rule, char *option)
+{
+    char *value = strchr(option, '='), *end;
+    unsigned long id = 0;
+
+    if (value)
+    {
+        *value++ = 0;
+        id = strtoul(value, &end, 10);
+        if (*value == 0 || *end != 0 || id > UINT32_MAX)
+            return -1;
+    }
+    if (strcmp(option, "ro") == 0 && !value)
+        rule->read_only = 1;
+    else if (strcmp(option, "rw") == 0 && !value)
+        rule->read_only = 0;
+    else if (strcmp(option, "root_squash") == 0 && !value)
+        rule->squash = SQUASH_ROOT;
+    else if (strcmp(option, "no_root_squash") == 0 && !value)
+        rule->squash = SQUASH_NONE;
+    else if (strcmp(option, "all_squash") == 0 && !value)
+        rule->squash = SQUASH_ALL;
+    else if (strcmp(option, "anonuid") == 0 && value)
+        rule->anon_uid = id;
+    else if (strcmp(option, "anongid") == 0 && value)
+        rule->anon_gid = id;
+    else
+        return -1;
+    return 0;
+}
+
+// Parse a client with its options, e.g. "10.0.0.0/8(rw,no_root_squash)"
+static struct export_rule *parse_rule(char *token, const char *file, int line)
+{
+    struct export_rule *rule = calloc(1, sizeof(struct export_rule));
+    char *options = strchr(token, '('), *option, *save;
+
+    rule->read_only = 1;
+    rule->squash = SQUASH_ROOT;
+    rule->anon_uid = 65534;
+    rule->anon_gid = 65534;
+    if (options)
+    {
+        if (options[strlen(options) - 1] != ')')
+        {
+            printf("%s:%d: missing ) after the options of %s\n", file, line, token);
+            return NULL;
+        }
+        *options++ = 0;
+        options[strlen(options) - 1] = 0;
+    }
+    rule->client = strdup(token);
+    if (parse_client(rule, token) < 0)
+    {
+        printf("%s:%d: invalid client %s\n", file, line, rule->client);
+        return NULL;
+    }
+    for (option = options ? strtok_r(options, ",", &save) : NULL; option; option = strtok_r(NULL, ",", &save))
+    {
+        if (parse_option(rule, option) < 0)
+        {
+            printf("%s:%d: invalid option %s\n", file, line, option);
+            return NULL;
+        }
+    }
+    return rule;
+}
+
+int exports_load(const char *file)
+{
+    struct export **tail = &export_table, *export;
+    struct export_rule **rule_tail;
+    char buf[4096], *token, *save;
+    FILE *f = fopen(file, "r");
+    int line = 0, count = 0;
+
+    if (f == NULL)
+    {
+        printf("Failed to open %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+    while (fgets(buf, sizeof(buf), f))
+    {
+        line++;
+        if (strchr(buf, '\n') == NULL && !feof(f))
+        {
+            printf("%s:%d: line too long\n", file, line);
+            fclose(f);
+            return -1;
+        }
+        if ((token = strchr(buf, '#')) != NULL)
+            *token = 0;
+        if ((token = strtok_r(buf, " \t\r\n", &save)) == NULL)
+            continue;
+        if (normalize_path(token) < 0)
+        {
+            printf("%s:%d: invalid path %s\n", file, line, token);
+            fclose(f);
+            return -1;
+        }
+        for (export = export_table; export; export = export->next)
+        {
+            if (strcmp(export->path, token) == 0)
+            {
+                printf("%s:%d: %s is exported twice\n", file, line, token);
+                fclose(f);
+                return -1;
+            }
+        }
+        if (++count > MAX_EXPORTS)
+        {
+            printf("%s:%d: more than %d exports\n", file, line, MAX_EXPORTS);
+            fclose(f);
+            return -1;
+        }
+        export = calloc(1, sizeof(struct export));
+        export->path = strdup(token);
+        rule_tail = &export->rules;
+        while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+        {
+            if ((*rule_tail = parse_rule(token, file, line)) == NULL)
+            {
+                fclose(f);
+                return -1;
+            }
+            (*rule_tail)->export = export;
+            rule_tail = &(*rule_tail)->next;
+        }
+        if (export->rules == NULL)
+        {
+            printf("%s:%d: %s has no clients\n", file, line, export->path);
+            fclose(f);
+            return -1;
+        }
+        *tail = export;
+        tail = &export->next;
+    }
+    fclose(f);
+    if (export_table == NULL)
+    {
+        printf("%s: no exports\n", file);
+        return -1;
+    }
+    if (exports_init() < 0)
+    {
+        printf("Failed to build the client table\n");
+        return -1;
+    }
+    return 0;
+}
+
+void exports_default(void)
+{
+    static struct export_rule everyone = { NULL, NULL, "*", {0}, 0, 0, SQUASH_NONE, 65534, 65534 };
+    static struct export root = { NULL, "/", &everyone };
+
+    everyone.export = &root;
+    export_table = &root;
+    exports_init();
+}
+
+void addr_to_string(const uint8_t *addr, char *name, size_t size)
+{
+    if (IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)addr))
+        inet_ntop(AF_INET, addr + 12, name, size);
+    else
+        inet_ntop(AF_INET6, addr, name, size);
+}
+
+void mount_add(const uint8_t *addr, const char *path)
+{
+    struct mount_entry *entry;
+
+    pthread_mutex_lock(&mounts_lock);
+    for (entry = mounts; entry; entry = entry->next)
+    {
+        if (memcmp(entry->addr, addr, 16) == 0 && strcmp(entry->path, path) == 0)
+            break;
+    }
+    if (entry == NULL && num_mounts < MAX_MOUNTS && (entry = malloc(sizeof(struct mount_entry))) != NULL)
+    {
+        memcpy(entry->addr, addr, 16);
+        entry->path = strdup(path);
+        entry->next = mounts;
+        mounts = entry;
+        num_mounts++;
+    }
+    pthread_mutex_unlock(&mounts_lock);
+}
+
+void mount_remove(const uint8_t *addr, char *path)
+{
+    struct mount_entry **link, *entry;
+
+    if (path && normalize_path(path) < 0)
+        return;
+    pthread_mutex_lock(&mounts_lock);
+    for (link = &mounts; (entry = *link) != NULL; )
+    {
+        if (memcmp(entry->addr, addr, 16) == 0 && (path == NULL || strcmp(entry->path, path) == 0))
+        {
+            *link = entry->next;
+            free(entry->path);
+            free(entry);
+            num_mounts--;
+        }
+        else
+            link = &entry->next;
+    }
+    pthread_mutex_unlock(&mounts_lock);
+}
+
+mountlist mount_list(void)
+{
+    mountlist list = NULL, *tail = &list;
+    struct mount_entry *entry;
+    struct mountbody *body;
+
+    pthread_mutex_lock(&mounts_lock);
+    for (entry = mounts; entry; entry = entry->next)
+    {
+        body = rpc_alloc(sizeof(struct mountbody) + INET6_ADDRSTRLEN + strlen(entry->path) + 1);
+        if (body == NULL)
+            break;
+        body->ml_hostname = (char *)(body + 1);
+        body->ml_directory = body->ml_hostname + INET6_ADDRSTRLEN;
+        addr_to_string(entry->addr, body->ml_hostname, INET6_ADDRSTRLEN);
+        strcpy(body->ml_directory, entry->path);
+        body->ml_next = NULL;
+        *tail = body;
+        tail = &body->ml_next;
+    }
+    pthread_mutex_unlock(&mounts_lock);
+    return list;
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include "nfs-service.h"
+#include "nfs-backend.h"
+
+/*
+ * Exports.
+ *
+ * The export table comes from a file in the format of exports(5), a
+ * subset of it: every line names a directory, relative to the exported
+ * tree, and the clients that may mount it with their options.
+ *
+ *     /          10.0.0.0/8(rw,no_root_squash) 192.168.1.7
+ *     /pub       *(ro,all_squash,anonuid=1000,anongid=1000)
+ *
+ * Clients are "*", an IPv4 or IPv6 address or a network in CIDR
+ * notation. IPv4 clients that connect over IPv6 are matched as IPv4
+ * clients, by their mapped address. The options are ro (the default), rw,
+ * root_squash (the default), no_root_squash, all_squash, anonuid and
+ * anongid. Without a file everything is exported read-write to everyone
+ * with no squashing.
+ *
+ * Every export has a number, which is part of the file handles handed
+ * out under it: by MNT, by PUTROOTFH and PUTPUBFH, which give v4 clients
+ * the first export they are admitted to, and by calls on a handle of the
+ * export. Calls are checked against the client's rule for the export of
+ * their handle, the most specific one, longest prefix first and the first
+ * one listed for equal prefixes. ".." and LOOKUPP stop at the root of the
+ * export, and the backends only take handles under the exports they have
+ * been handed out under, so a client can't leave its exports by making up
+ * a handle either. As with no_subtree_check, objects that are moved out
+ * of an export stay reachable by the handles clients already have. Calls
+ * of clients that aren't admitted to any export are rejected before they
+ * reach the procs.
+ *
+ * The rules are compiled into tries that find the rule for an address
+ * with one memory access per byte, one for each export and one for all of
+ * them. Connections look up their rules once when accepted.
+ */
+
+enum squash
+{
+    SQUASH_NONE,
+    SQUASH_ROOT,
+    SQUASH_ALL,
+};
+
+struct export;
+struct trie_node;
+
+struct export_rule
+{
+    struct export_rule *next;
+    struct export *export;
+    // The client as written in the file
+    char *client;
+    // Its network, IPv4 networks are mapped to IPv6, "*" is a prefix of 0
+    uint8_t addr[16];
+    int prefix_len;
+    int read_only;
+    enum squash squash;
+    uint32_t anon_uid;
+    uint32_t anon_gid;
+};
+
+struct export
+{
+    struct export *next;
+    // Normalized, "/" is the root of the exported tree
+    char *path;
+    struct export_rule *rules;
+    // Its number in handles, the position in the table
+    int index;
+    struct trie_node *trie_v4;
+    struct trie_node *trie_v6;
+    // The root directory once it has been looked up, see export_is_root()
+    uint64_t root_fsid;
+    uint64_t root_fileid;
+};
+
+extern struct export *export_table;
+extern struct export *exports_by_index[MAX_EXPORTS];
+extern int num_exports;
+
+// Load the export table, prints what is wrong with it and returns -1 if invalid
+int exports_load(const char *file);
+
+// Export the whole tree read-write to everyone
+void exports_default(void);
+
+// The rule that admits a client to some export, or NULL
+const struct export_rule *export_match(const uint8_t *addr);
+
+// The rule that admits a client to export, or NULL
+const struct export_rule *export_client_rule(const struct export *export, const uint8_t *addr);
+
+// The same for every export, rules[i] for the export with index i
+void export_client_rules(const uint8_t *addr, const struct export_rule **rules);
+
+/*
+ * The export that contains path and the rule that admits the client to
+ * it. path is made canonical in place. Returns NULL if no export contains
+ * path; *rule is NULL if the client is not admitted.
+ */
+struct export *export_find(char *path, const uint8_t *addr, const struct export_rule **rule);
+
+/*
+ * Look up a directory in export as root, path as returned by
+ * export_find(). Remembers the root of the export on the way.
+ */
+nfsstat3 export_lookup(struct export *export, const char *path, struct inode **inode);
+
+// Whether dir is the root of the export with index export, its ".." is itself
+int export_is_root(int export, struct inode *dir);
+
+/*
+ * Mount list, for DUMP. Entries are added by MNT and removed by UMNT and
+ * UMNTALL, where path is NULL.
+ */
+void mount_add(const uint8_t *addr, const char *path);
+void mount_remove(const uint8_t *addr, char *path);
+
+// The mount list in call memory, see rpc_alloc()
+mountlist mount_list(void);
+
+// Text form of an address, IPv4 addresses are unmapped
+void addr_to_string(const uint8_t *addr, char *name, size_t size);
@@ -0,0 +1,171 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "nfs-pool.h"
+
+/*
+ * The reservation is split into regions of one huge page each. A region
+ * holds buffers of a single size class while any of them is in use and
+ * goes back to the empty list when the last one is put, so memory moves
+ * between the classes as the mix of transfer sizes changes. Regions with
+ * free buffers are kept on a list per class; a buffer is found by its
+ * address, which tells its region. Buffers are handed out in address order
+ * the first time, so untouched memory stays unfaulted.
+ *
+ * A single lock is enough: every operation moves at least POOL_MIN_SIZE
+ * bytes of file data.
+ */
+#define POOL_REGION_SHIFT 21
+#define POOL_REGION_SIZE ((size_t)1 << POOL_REGION_SHIFT)
+#define POOL_CLASSES 5
+
+struct pool_region
+{
+    struct pool_region *prev;
+    struct pool_region *next;
+    // Buffers given back, linked through their first bytes
+    char *free;
+    // Buffers from unused on have never been handed out
+    unsigned unused;
+    unsigned used;
+    int class;
+};
+
+uint64_t pool_max_bytes = 1024*1024*1024;
+
+uint64_t pool_used_bytes;
+uint64_t pool_peak_bytes;
+uint64_t pool_denied;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *pool_base;
+static struct pool_region *regions;
+// Circular lists of regions with free buffers, by class
+static struct pool_region partial[POOL_CLASSES];
+static struct pool_region *empty;
+
+static size_t class_size(int class)
+{
+    return (size_t)POOL_MIN_SIZE << class;
+}
+
+static void region_link(struct pool_region *head, struct pool_region *region)
+{
+    region->prev = head;
+    region->next = head->next;
+    head->next->prev = region;
+    head->next = region;
+}
+
+static void region_unlink(struct pool_region *region)
+{
+    region->prev->next = region->next;
+    region->next->prev = region->prev;
+}
+
+int pool_init(void)
+{
+    size_t count = pool_max_bytes >> POOL_REGION_SHIFT, i;
+    char *map, *end;
+
+    if (count == 0)
+        count = 1;
+    // Over-reserve by a region to align the pool to huge pages
+    map = mmap(NULL, (count + 1) * POOL_REGION_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    pool_base = (char *)(((uintptr_t)map + POOL_REGION_SIZE - 1) & ~(POOL_REGION_SIZE - 1));
+    end = pool_base + count * POOL_REGION_SIZE;
+    if (pool_base > map)
+        munmap(map, pool_base - map);
+    munmap(end, map + (count + 1) * POOL_REGION_SIZE - end);
+    // Only a hint, the pool works with small pages too
+    madvise(pool_base, count * POOL_REGION_SIZE, MADV_HUGEPAGE);
+
+    regions = calloc(count, sizeof(struct pool_region));
+    if (regions == NULL)
+        return -1;
+    for (i = count; i-- > 0; )
+    {
+        regions[i].next = empty;
+        empty = &regions[i];
+    }
+    for (i = 0; i < POOL_CLASSES; i++)
+        partial[i].prev = partial[i].next = &partial[i];
+    pool_max_bytes = count * POOL_REGION_SIZE;
+    return 0;
+}
+
+char *pool_get(size_t size)
+{
+    struct pool_region *region;
+    uint64_t used;
+    int class = 0;
+    char *buf;
+
+    if (size > POOL_CHUNK_SIZE)
+        return NULL;
+    while (class_size(class) < size)
+        class++;
+    pthread_mutex_lock(&pool_lock);
+    region = partial[class].next;
+    if (region == &partial[class])
+    {
+        if ((region = empty) == NULL)
+        {
+            pthread_mutex_unlock(&pool_lock);
+            __atomic_add_fetch(&pool_denied, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        empty = region->next;
+        region->free = NULL;
+        region->unused = 0;
+        region->used = 0;
+        region->class = class;
+        region_link(&partial[class], region);
+    }
+    if (region->free)
+    {
+        buf = region->free;
+        region->free = *(char **)buf;
+    }
+    else
+        buf = pool_base + ((size_t)(region - regions) << POOL_REGION_SHIFT) + region->unused++ * class_size(class);
+    if (++region->used == POOL_REGION_SIZE / class_size(class))
+        region_unlink(region);
+    used = __atomic_add_fetch(&pool_used_bytes, class_size(class), __ATOMIC_RELAXED);
+    if (used > pool_peak_bytes)
+        __atomic_store_n(&pool_peak_bytes, used, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&pool_lock);
+    return buf;
+}
+
+void pool_put(char *buf)
+{
+    struct pool_region *region;
+    int full;
+
+    if (buf == NULL)
+        return;
+    region = &regions[(buf - pool_base) >> POOL_REGION_SHIFT];
+    pthread_mutex_lock(&pool_lock);
+    full = region->used == POOL_REGION_SIZE / class_size(region->class);
+    *(char **)buf = region->free;
+    region->free = buf;
+    __atomic_sub_fetch(&pool_used_bytes, class_size(region->class), __ATOMIC_RELAXED);
+    if (--region->used == 0)
+    {
+        if (!full)
+            region_unlink(region);
+        region->next = empty;
+        empty = region;
+    }
+    else if (full)
+        region_link(&partial[region->class], region);
+    pthread_mutex_unlock(&pool_lock);
+}
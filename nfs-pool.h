@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Buffer pool.
+ *
+ * READ data is staged in buffers from a pool shared by all workers,
+ * with a hard budget of pool_max_bytes. Buffers come in power of two size
+ * classes from POOL_MIN_SIZE to POOL_CHUNK_SIZE; bigger transfers
+ * are split into chunks of POOL_CHUNK_SIZE. The budget is reserved up
+ * front as one mapping backed by transparent huge pages, so only what has
+ * been used is resident and big transfers don't miss the TLB every 4K.
+ *
+ * Once the budget is used up pool_get() returns NULL rather than making
+ * the server grow: callers fall back to a path that needs no buffer, or
+ * ask the client to retry.
+ */
+#define POOL_MIN_SIZE (64*1024)
+#define POOL_CHUNK_SIZE (1024*1024)
+
+extern uint64_t pool_max_bytes;
+
+// Reserve the pool, returns -1 if there's no room for it
+int pool_init(void);
+
+// A buffer of at least size bytes, at most POOL_CHUNK_SIZE, or NULL
+char *pool_get(size_t size);
+void pool_put(char *buf);
+
+/* Statistics */
+extern uint64_t pool_used_bytes;
+extern uint64_t pool_peak_bytes;
+extern uint64_t pool_denied;
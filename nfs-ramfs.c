@@ -0,0 +1,1296 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nfs-backend.h"
+
+/*
+ * RAM backend.
+ *
+ * Inodes live in a table of fixed-size chunks indexed by inode number, so
+ * a handle is decoded with two loads and inodes never move. Free numbers
+ * are reused with a new generation, which makes old handles stale.
+ * Directories are arrays of entries with a hash index on the names; an
+ * entry's position in the array is its cookie and stays put while other
+ * entries come and go. File data is kept in 4 KiB pages in a radix tree
+ * that only grows as high as the file is large. Missing pages read as
+ * zeros, so sparse files cost nothing for their holes.
+ *
+ * Locking: ram_lock protects the namespace, i.e. directory contents,
+ * symlink targets and the inode table, and is only taken for writing by
+ * operations that change it. Attributes and file data are protected by
+ * striped locks, so reads and writes of files don't touch ram_lock at all.
+ * ram_lock is always taken before a striped lock and no operation holds
+ * two striped locks at once.
+ */
+#define RAM_PAGE_SHIFT 12
+#define RAM_PAGE_SIZE (1 << RAM_PAGE_SHIFT)
+#define RADIX_BITS 6
+#define RADIX_SLOTS (1 << RADIX_BITS)
+#define INODE_CHUNK_SHIFT 12
+#define INODE_CHUNK (1 << INODE_CHUNK_SHIFT)
+#define INODE_CHUNKS 16384
+#define DATA_LOCKS 64
+#define ROOT_INO 1
+#define NO_SLOT 0xffffffffu
+// Entries copied per batch while listing a directory
+#define READDIR_BATCH 32
+
+// Same layout and export numbers as the passthrough backend's handles
+struct ram_handle
+{
+    uint32_t export_id;
+    uint32_t gen;
+    uint64_t ino;
+};
+
+struct radix_node
+{
+    void *slots[RADIX_SLOTS];
+};
+
+struct ram_dirent
+{
+    // NULL for a free slot
+    char *name;
+    uint32_t hash;
+    // Next entry in the hash chain, or the next free slot
+    uint32_t next;
+    uint32_t ino;
+};
+
+struct ram_dir
+{
+    struct ram_dirent *entries;
+    // Slots in use or freed, allocated, and live entries
+    uint32_t size;
+    uint32_t alloc;
+    uint32_t count;
+    uint32_t free;
+    uint32_t *buckets;
+    uint32_t bucket_mask;
+    uint32_t parent;
+};
+
+struct inode
+{
+    struct ram_handle fh;
+    uint32_t refs;
+    uint32_t next_free;
+    // Bit n is set once a handle under export n has been handed out
+    uint64_t exports;
+    // type is 0 for a free inode
+    fattr3 attr;
+    union
+    {
+        // Pages of a regular file, a tree of this height covers 64^height pages
+        struct
+        {
+            void *root;
+            int height;
+        } file;
+        struct ram_dir *dir;
+        char *target;
+    } u;
+};
+
+uint64_t ram_max_bytes = 1024ull*1024*1024;
+
+static pthread_rwlock_t ram_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct inode *inode_chunks[INODE_CHUNKS];
+static uint32_t next_ino = ROOT_INO;
+static uint32_t free_ino = NO_SLOT;
+static uint32_t inode_count;
+static uint32_t next_gen;
+static uint32_t export_id;
+static uint64_t write_verf;
+static uint64_t ram_pages;
+static pthread_rwlock_t data_locks[DATA_LOCKS];
+
+/*
+ * Inode table
+ */
+
+static struct inode *inode_at(uint64_t ino)
+{
+    struct inode *chunk;
+    if (ino >= (uint64_t)INODE_CHUNKS << INODE_CHUNK_SHIFT)
+        return NULL;
+    chunk = inode_chunks[ino >> INODE_CHUNK_SHIFT];
+    return chunk ? &chunk[ino & (INODE_CHUNK - 1)] : NULL;
+}
+
+static pthread_rwlock_t *data_lock(struct inode *inode)
+{
+    return &data_locks[inode->fh.ino % DATA_LOCKS];
+}
+
+static void get_attr(struct inode *inode, fattr3 *attr)
+{
+    pthread_rwlock_t *lock = data_lock(inode);
+    pthread_rwlock_rdlock(lock);
+    *attr = inode->attr;
+    pthread_rwlock_unlock(lock);
+}
+
+static void ram_now(nfstime3 *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    t->seconds = now.tv_sec;
+    t->nseconds = now.tv_nsec;
+}
+
+// A new inode without references or links, ram_lock must be held for writing
+static struct inode *inode_alloc(ftype3 type, uint32_t mode, uint32_t uid, uint32_t gid)
+{
+    struct inode *inode;
+    uint32_t ino = free_ino;
+
+    if (ino != NO_SLOT)
+    {
+        inode = inode_at(ino);
+        free_ino = inode->next_free;
+    }
+    else
+    {
+        ino = next_ino;
+        if (ino >= INODE_CHUNKS << INODE_CHUNK_SHIFT)
+            return NULL;
+        if (inode_chunks[ino >> INODE_CHUNK_SHIFT] == NULL &&
+            (inode_chunks[ino >> INODE_CHUNK_SHIFT] = calloc(INODE_CHUNK, sizeof(struct inode))) == NULL)
+            return NULL;
+        next_ino++;
+        inode = inode_at(ino);
+    }
+    memset(inode, 0, sizeof(*inode));
+    inode->fh.export_id = export_id;
+    inode->fh.gen = ++next_gen;
+    inode->fh.ino = ino;
+    inode->attr.type = type;
+    inode->attr.mode = mode;
+    inode->attr.uid = uid;
+    inode->attr.gid = gid;
+    inode->attr.fsid = export_id;
+    inode->attr.fileid = ino;
+    ram_now(&inode->attr.ctime);
+    inode->attr.atime = inode->attr.mtime = inode->attr.ctime;
+    inode_count++;
+    return inode;
+}
+
+/*
+ * File data
+ */
+
+static char *page_find(struct inode *inode, uint64_t index)
+{
+    void *node = inode->u.file.root;
+    int height = inode->u.file.height;
+
+    if (index >> (height * RADIX_BITS))
+        return NULL;
+    while (node && height > 0)
+    {
+        height--;
+        node = ((struct radix_node *)node)->slots[(index >> (height * RADIX_BITS)) & (RADIX_SLOTS - 1)];
+    }
+    return node;
+}
+
+// The page at index, allocated if it's missing
+static char *page_get(struct inode *inode, uint64_t index, nfsstat3 *status)
+{
+    void **slot;
+    int height;
+
+    // Grow the tree until it covers index
+    while (index >> (inode->u.file.height * RADIX_BITS))
+    {
+        if (inode->u.file.root)
+        {
+            struct radix_node *node = calloc(1, sizeof(struct radix_node));
+            if (node == NULL)
+                goto nomem;
+            node->slots[0] = inode->u.file.root;
+            inode->u.file.root = node;
+        }
+        inode->u.file.height++;
+    }
+    slot = &inode->u.file.root;
+    for (height = inode->u.file.height; height > 0; height--)
+    {
+        if (*slot == NULL && (*slot = calloc(1, sizeof(struct radix_node))) == NULL)
+            goto nomem;
+        slot = &((struct radix_node *)*slot)->slots[(index >> ((height - 1) * RADIX_BITS)) & (RADIX_SLOTS - 1)];
+    }
+    if (*slot)
+        return *slot;
+    if (__atomic_add_fetch(&ram_pages, 1, __ATOMIC_RELAXED) > ram_max_bytes >> RAM_PAGE_SHIFT)
+    {
+        __atomic_sub_fetch(&ram_pages, 1, __ATOMIC_RELAXED);
+        *status = NFS3ERR_NOSPC;
+        return NULL;
+    }
+    if ((*slot = calloc(1, RAM_PAGE_SIZE)) == NULL)
+    {
+        __atomic_sub_fetch(&ram_pages, 1, __ATOMIC_RELAXED);
+        goto nomem;
+    }
+    inode->attr.used += RAM_PAGE_SIZE;
+    return *slot;
+nomem:
+    *status = NFS3ERR_JUKEBOX;
+    return NULL;
+}
+
+// Free the pages from first on in the subtree covering the pages from base
+static void radix_truncate(struct inode *inode, void **slot, int height, uint64_t base, uint64_t first)
+{
+    uint64_t span = 1ull << (height * RADIX_BITS);
+    struct radix_node *node = *slot;
+    int i;
+
+    if (node == NULL || base + span <= first)
+        return;
+    if (height == 0)
+    {
+        free(node);
+        *slot = NULL;
+        inode->attr.used -= RAM_PAGE_SIZE;
+        __atomic_sub_fetch(&ram_pages, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    for (i = 0; i < RADIX_SLOTS; i++)
+        radix_truncate(inode, &node->slots[i], height - 1, base + i * (span >> RADIX_BITS), first);
+    if (base >= first)
+    {
+        free(node);
+        *slot = NULL;
+    }
+}
+
+/*
+ * Bytes past the end of a file are always zero in its pages, so it can
+ * grow without touching them. The data lock must be held for writing.
+ */
+static void file_truncate(struct inode *inode, uint64_t size)
+{
+    uint32_t tail = size & (RAM_PAGE_SIZE - 1);
+    char *page;
+
+    if (size < inode->attr.size)
+    {
+        radix_truncate(inode, &inode->u.file.root, inode->u.file.height, 0, (size + RAM_PAGE_SIZE - 1) >> RAM_PAGE_SHIFT);
+        if (tail && (page = page_find(inode, size >> RAM_PAGE_SHIFT)) != NULL)
+            memset(page + tail, 0, RAM_PAGE_SIZE - tail);
+        if (inode->u.file.root == NULL)
+            inode->u.file.height = 0;
+    }
+    inode->attr.size = size;
+}
+
+/*
+ * Directories
+ */
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name)
+        hash = (hash ^ (uint8_t)*name++) * 16777619u;
+    return hash;
+}
+
+static uint32_t dir_find(struct ram_dir *dir, const char *name, uint32_t hash)
+{
+    uint32_t slot;
+    if (dir->buckets == NULL)
+        return NO_SLOT;
+    for (slot = dir->buckets[hash & dir->bucket_mask]; slot != NO_SLOT; slot = dir->entries[slot].next)
+    {
+        if (dir->entries[slot].hash == hash && !strcmp(dir->entries[slot].name, name))
+            return slot;
+    }
+    return NO_SLOT;
+}
+
+// Keep at most one entry per bucket on average
+static int dir_rehash(struct ram_dir *dir)
+{
+    uint32_t size = dir->buckets ? (dir->bucket_mask + 1) * 2 : 16;
+    uint32_t *buckets = malloc(size * sizeof(uint32_t));
+    uint32_t slot;
+
+    if (buckets == NULL)
+        return -1;
+    memset(buckets, 0xff, size * sizeof(uint32_t));
+    for (slot = 0; slot < dir->size; slot++)
+    {
+        struct ram_dirent *entry = &dir->entries[slot];
+        if (entry->name == NULL)
+            continue;
+        entry->next = buckets[entry->hash & (size - 1)];
+        buckets[entry->hash & (size - 1)] = slot;
+    }
+    free(dir->buckets);
+    dir->buckets = buckets;
+    dir->bucket_mask = size - 1;
+    return 0;
+}
+
+static nfsstat3 dir_add(struct ram_dir *dir, const char *name, uint32_t hash, uint32_t ino)
+{
+    struct ram_dirent *entry;
+    uint32_t slot;
+    char *copy;
+
+    if (dir->buckets == NULL || dir->count + 1 > dir->bucket_mask + 1)
+    {
+        if (dir_rehash(dir) < 0)
+            return NFS3ERR_JUKEBOX;
+    }
+    if (dir->free == NO_SLOT && dir->size == dir->alloc)
+    {
+        uint32_t alloc = dir->alloc ? dir->alloc * 2 : 16;
+        struct ram_dirent *entries = realloc(dir->entries, alloc * sizeof(struct ram_dirent));
+        if (entries == NULL)
+            return NFS3ERR_JUKEBOX;
+        dir->entries = entries;
+        dir->alloc = alloc;
+    }
+    if ((copy = strdup(name)) == NULL)
+        return NFS3ERR_JUKEBOX;
+    if (dir->free != NO_SLOT)
+    {
+        slot = dir->free;
+        dir->free = dir->entries[slot].next;
+    }
+    else
+        slot = dir->size++;
+    entry = &dir->entries[slot];
+    entry->name = copy;
+    entry->hash = hash;
+    entry->ino = ino;
+    entry->next = dir->buckets[hash & dir->bucket_mask];
+    dir->buckets[hash & dir->bucket_mask] = slot;
+    dir->count++;
+    return NFS3_OK;
+}
+
+static void dir_remove(struct ram_dir *dir, uint32_t slot)
+{
+    struct ram_dirent *entry = &dir->entries[slot];
+    uint32_t *prev = &dir->buckets[entry->hash & dir->bucket_mask];
+
+    while (*prev != slot)
+        prev = &dir->entries[*prev].next;
+    *prev = entry->next;
+    free(entry->name);
+    entry->name = NULL;
+    entry->next = dir->free;
+    dir->free = slot;
+    dir->count--;
+}
+
+// Update a directory's times after a change to its entries, and its link count
+static void dir_changed(struct inode *dir, int links)
+{
+    pthread_rwlock_t *lock = data_lock(dir);
+    pthread_rwlock_wrlock(lock);
+    ram_now(&dir->attr.mtime);
+    dir->attr.ctime = dir->attr.mtime;
+    dir->attr.size = (uint64_t)(dir->u.dir->count + 2) * 32;
+    __atomic_store_n(&dir->attr.nlink, dir->attr.nlink + links, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(lock);
+}
+
+static void inode_free(struct inode *inode)
+{
+    uint32_t i;
+
+    switch (inode->attr.type)
+    {
+    case NF3REG:
+        radix_truncate(inode, &inode->u.file.root, inode->u.file.height, 0, 0);
+        break;
+    case NF3DIR:
+        if (inode->u.dir == NULL)
+            break;
+        for (i = 0; i < inode->u.dir->size; i++)
+            free(inode->u.dir->entries[i].name);
+        free(inode->u.dir->entries);
+        free(inode->u.dir->buckets);
+        free(inode->u.dir);
+        break;
+    case NF3LNK:
+        free(inode->u.target);
+        break;
+    default:
+        break;
+    }
+    inode->attr.type = 0;
+    inode->next_free = free_ino;
+    free_ino = inode->fh.ino;
+    inode_count--;
+}
+
+// Drop a link, the inode goes away with its last link and reference
+static void inode_unlink(struct inode *inode, int all)
+{
+    pthread_rwlock_t *lock = data_lock(inode);
+    pthread_rwlock_wrlock(lock);
+    __atomic_store_n(&inode->attr.nlink, all ? 0 : inode->attr.nlink - 1, __ATOMIC_SEQ_CST);
+    ram_now(&inode->attr.ctime);
+    pthread_rwlock_unlock(lock);
+    if (inode->attr.nlink == 0 && __atomic_load_n(&inode->refs, __ATOMIC_SEQ_CST) == 0)
+        inode_free(inode);
+}
+
+/*
+ * Handles
+ */
+
+static void ram_write_verf(char *verf)
+{
+    memcpy(verf, &write_verf, NFS3_WRITEVERFSIZE);
+}
+
+static int ram_init(const char *path)
+{
+    struct timespec now;
+    struct inode *root;
+    int i;
+
+    for (i = 0; i < DATA_LOCKS; i++)
+        pthread_rwlock_init(&data_locks[i], NULL);
+    // Handles of an earlier run are stale, the files are gone
+    clock_gettime(CLOCK_REALTIME, &now);
+    export_id = (uint32_t)(now.tv_sec * 0x9e3779b97f4a7c15ull >> 32) ^ now.tv_nsec;
+    write_verf = now.tv_sec * 1000000000ull + now.tv_nsec;
+
+    // Like /tmp, anyone may create files but only remove their own
+    root = inode_alloc(NF3DIR, 01777, 0, 0);
+    if (root == NULL || (root->u.dir = calloc(1, sizeof(struct ram_dir))) == NULL)
+        return -1;
+    root->u.dir->free = NO_SLOT;
+    root->u.dir->parent = ROOT_INO;
+    root->attr.nlink = 2;
+    root->attr.size = 64;
+    root->refs = 1;
+    return 0;
+}
+
+static struct inode *ram_root(void)
+{
+    struct inode *root = inode_at(ROOT_INO);
+    __atomic_add_fetch(&root->refs, 1, __ATOMIC_RELAXED);
+    return root;
+}
+
+static struct inode *ram_inode_from_fh(nfs_fh3 *fh, int *export, nfsstat3 *status)
+{
+    struct ram_handle handle;
+    struct inode *inode;
+
+    if (fh->data.data_len != sizeof(struct ram_handle))
+    {
+        *status = NFS3ERR_BADHANDLE;
+        return NULL;
+    }
+    memcpy(&handle, fh->data.data_val, sizeof(struct ram_handle));
+    if ((handle.export_id ^ export_id) >= MAX_EXPORTS)
+    {
+        *status = NFS3ERR_STALE;
+        return NULL;
+    }
+    *export = handle.export_id ^ export_id;
+    pthread_rwlock_rdlock(&ram_lock);
+    inode = inode_at(handle.ino);
+    if (inode && inode->attr.type && inode->fh.gen == handle.gen && __atomic_load_n(&inode->attr.nlink, __ATOMIC_RELAXED) &&
+        (__atomic_load_n(&inode->exports, __ATOMIC_RELAXED) & 1ull << *export))
+        __atomic_add_fetch(&inode->refs, 1, __ATOMIC_RELAXED);
+    else
+        inode = NULL;
+    pthread_rwlock_unlock(&ram_lock);
+    *status = inode ? NFS3_OK : NFS3ERR_STALE;
+    return inode;
+}
+
+static uint32_t ram_inode_to_fh(struct inode *inode, int export, char *fh)
+{
+    struct ram_handle handle = inode->fh;
+
+    if (!(__atomic_load_n(&inode->exports, __ATOMIC_RELAXED) & 1ull << export))
+        __atomic_fetch_or(&inode->exports, 1ull << export, __ATOMIC_RELAXED);
+    handle.export_id ^= export;
+    memcpy(fh, &handle, sizeof(handle));
+    return sizeof(handle);
+}
+
+static void ram_inode_put(struct inode *inode)
+{
+    uint32_t gen;
+
+    if (inode == NULL)
+        return;
+    gen = inode->fh.gen;
+    if (__atomic_sub_fetch(&inode->refs, 1, __ATOMIC_SEQ_CST) > 0 ||
+        __atomic_load_n(&inode->attr.nlink, __ATOMIC_SEQ_CST) > 0)
+        return;
+    // The last reference to an unlinked inode, unless it's already gone
+    pthread_rwlock_wrlock(&ram_lock);
+    if (inode->attr.type && inode->fh.gen == gen && inode->refs == 0 && inode->attr.nlink == 0)
+        inode_free(inode);
+    pthread_rwlock_unlock(&ram_lock);
+}
+
+/*
+ * Operations
+ */
+
+static nfsstat3 ram_getattr(struct inode *inode, fattr3 *attr)
+{
+    get_attr(inode, attr);
+    return NFS3_OK;
+}
+
+// Apply attributes to an inode whose data lock is held for writing
+static void apply_sattr(struct inode *inode, sattr3 *sattr)
+{
+    nfstime3 now;
+
+    ram_now(&now);
+    if (sattr->size.set_it && sattr->size.set_size3_u.size != inode->attr.size)
+    {
+        file_truncate(inode, sattr->size.set_size3_u.size);
+        inode->attr.mtime = now;
+    }
+    if (sattr->mode.set_it)
+        inode->attr.mode = sattr->mode.set_mode3_u.mode & 07777;
+    if (sattr->uid.set_it)
+        inode->attr.uid = sattr->uid.set_uid3_u.uid;
+    if (sattr->gid.set_it)
+        inode->attr.gid = sattr->gid.set_gid3_u.gid;
+    if (sattr->atime.set_it == SET_TO_SERVER_TIME)
+        inode->attr.atime = now;
+    else if (sattr->atime.set_it == SET_TO_CLIENT_TIME)
+        inode->attr.atime = sattr->atime.set_atime_u.atime;
+    if (sattr->mtime.set_it == SET_TO_SERVER_TIME)
+        inode->attr.mtime = now;
+    else if (sattr->mtime.set_it == SET_TO_CLIENT_TIME)
+        inode->attr.mtime = sattr->mtime.set_mtime_u.mtime;
+    inode->attr.ctime = now;
+}
+
+static nfsstat3 ram_setattr(struct inode *inode, struct nfs_cred *cred, sattr3 *sattr, nfstime3 *guard_ctime)
+{
+    pthread_rwlock_t *lock = data_lock(inode);
+    nfsstat3 status = NFS3_OK;
+    fattr3 *attr = &inode->attr;
+    int is_owner;
+
+    pthread_rwlock_wrlock(lock);
+    is_owner = cred->uid == 0 || cred->uid == attr->uid;
+    if (guard_ctime && (guard_ctime->seconds != attr->ctime.seconds || guard_ctime->nseconds != attr->ctime.nseconds))
+        status = NFS3ERR_NOT_SYNC;
+    else if ((sattr->mode.set_it || sattr->atime.set_it == SET_TO_CLIENT_TIME ||
+        sattr->mtime.set_it == SET_TO_CLIENT_TIME) && !is_owner)
+        status = NFS3ERR_PERM;
+    else if (sattr->uid.set_it && sattr->uid.set_uid3_u.uid != attr->uid && cred->uid != 0)
+        status = NFS3ERR_PERM;
+    else if (sattr->gid.set_it && sattr->gid.set_gid3_u.gid != attr->gid &&
+        cred->uid != 0 && (!is_owner || !in_group(cred, sattr->gid.set_gid3_u.gid)))
+        status = NFS3ERR_PERM;
+    else if ((sattr->size.set_it || sattr->atime.set_it == SET_TO_SERVER_TIME ||
+        sattr->mtime.set_it == SET_TO_SERVER_TIME) && !is_owner && !may_access(attr, cred, MAY_WRITE))
+        status = NFS3ERR_ACCES;
+    else if (sattr->size.set_it && attr->type != NF3REG)
+        status = attr->type == NF3DIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+    else
+        apply_sattr(inode, sattr);
+    pthread_rwlock_unlock(lock);
+    return status;
+}
+
+// Check that dir is a directory the caller may search (and modify)
+static nfsstat3 dir_access(struct inode *dir, struct nfs_cred *cred, int want, fattr3 *attr)
+{
+    if (dir->attr.type != NF3DIR)
+        return NFS3ERR_NOTDIR;
+    get_attr(dir, attr);
+    if (!may_access(attr, cred, want))
+        return NFS3ERR_ACCES;
+    return NFS3_OK;
+}
+
+static nfsstat3 ram_lookup(struct inode *dir, struct nfs_cred *cred, const char *name, struct inode **child, fattr3 *attr)
+{
+    nfsstat3 status;
+    uint32_t slot;
+
+    *child = NULL;
+    if ((status = dir_access(dir, cred, MAY_EXEC, attr)) != NFS3_OK)
+        return status;
+    if (strcmp(name, ".") && strcmp(name, "..") && (status = check_name(name)) != NFS3_OK)
+        return status;
+    pthread_rwlock_rdlock(&ram_lock);
+    if (!strcmp(name, "."))
+        *child = dir;
+    else if (!strcmp(name, ".."))
+        *child = dir->attr.nlink ? inode_at(dir->u.dir->parent) : NULL;
+    else if ((slot = dir_find(dir->u.dir, name, name_hash(name))) != NO_SLOT)
+        *child = inode_at(dir->u.dir->entries[slot].ino);
+    if (*child)
+        __atomic_add_fetch(&(*child)->refs, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&ram_lock);
+    if (*child == NULL)
+        return NFS3ERR_NOENT;
+    get_attr(*child, attr);
+    return NFS3_OK;
+}
+
+static nfsstat3 ram_access(struct inode *inode, struct nfs_cred *cred, uint32_t want, uint32_t *granted)
+{
+    fattr3 attr;
+
+    get_attr(inode, &attr);
+    *granted = 0;
+    if ((want & ACCESS3_READ) && may_access(&attr, cred, MAY_READ))
+        *granted |= ACCESS3_READ;
+    if (attr.type == NF3DIR)
+    {
+        if ((want & ACCESS3_LOOKUP) && may_access(&attr, cred, MAY_EXEC))
+            *granted |= ACCESS3_LOOKUP;
+        if (may_access(&attr, cred, MAY_WRITE|MAY_EXEC))
+            *granted |= want & (ACCESS3_MODIFY|ACCESS3_EXTEND|ACCESS3_DELETE);
+    }
+    else
+    {
+        if (may_access(&attr, cred, MAY_WRITE))
+            *granted |= want & (ACCESS3_MODIFY|ACCESS3_EXTEND);
+        if ((want & ACCESS3_EXECUTE) && may_access(&attr, cred, MAY_EXEC))
+            *granted |= ACCESS3_EXECUTE;
+    }
+    return NFS3_OK;
+}
+
+static nfsstat3 ram_readlink(struct inode *inode, char *buf, size_t size)
+{
+    // Targets never change, the reference keeps this one alive
+    if (inode->attr.type != NF3LNK)
+        return NFS3ERR_INVAL;
+    snprintf(buf, size, "%s", inode->u.target);
+    return NFS3_OK;
+}
+
+static nfsstat3 ram_read(struct inode *inode, struct nfs_cred *cred, uint64_t offset, uint32_t count, char *buf, uint32_t *done, int *eof, fattr3 *attr)
+{
+    pthread_rwlock_t *lock = data_lock(inode);
+    uint64_t pos, end;
+
+    if (inode->attr.type != NF3REG)
+        return inode->attr.type == NF3DIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+    pthread_rwlock_rdlock(lock);
+    *attr = inode->attr;
+    // The owner may always read, the client has already checked the open
+    if (cred->uid != attr->uid && !may_access(attr, cred, MAY_READ))
+    {
+        pthread_rwlock_unlock(lock);
+        return NFS3ERR_ACCES;
+    }
+    end = offset >= attr->size ? offset : (attr->size - offset < count ? attr->size : offset + count);
+    for (pos = offset; pos < end; )
+    {
+        uint32_t in_page = pos & (RAM_PAGE_SIZE - 1);
+        uint32_t len = RAM_PAGE_SIZE - in_page < end - pos ? RAM_PAGE_SIZE - in_page : end - pos;
+        char *page = page_find(inode, pos >> RAM_PAGE_SHIFT);
+        if (page)
+            memcpy(buf + (pos - offset), page + in_page, len);
+        else
+            memset(buf + (pos - offset), 0, len);
+        pos += len;
+    }
+    pthread_rwlock_unlock(lock);
+    *done = end - offset;
+    *eof = end >= attr->size;
+    return NFS3_OK;
+}
+
+static nfsstat3 ram_write(struct inode *inode, struct nfs_cred *cred, uint64_t offset, uint32_t count, char *buf, stable_how stable, uint32_t *done, wcc_data *wcc)
+{
+    pthread_rwlock_t *lock = data_lock(inode);
+    nfsstat3 status = NFS3_OK;
+    uint64_t pos, end = offset + count;
+
+    wcc->before.attributes_follow = FALSE;
+    wcc->after.attributes_follow = FALSE;
+    if (inode->attr.type != NF3REG)
+        return inode->attr.type == NF3DIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+    if (end < offset || end > (uint64_t)LLONG_MAX)
+        return NFS3ERR_FBIG;
+    pthread_rwlock_wrlock(lock);
+    wcc->before.attributes_follow = TRUE;
+    wcc->before.pre_op_attr_u.attributes.size = inode->attr.size;
+    wcc->before.pre_op_attr_u.attributes.mtime = inode->attr.mtime;
+    wcc->before.pre_op_attr_u.attributes.ctime = inode->attr.ctime;
+    if (cred->uid != inode->attr.uid && !may_access(&inode->attr, cred, MAY_WRITE))
+    {
+        pthread_rwlock_unlock(lock);
+        return NFS3ERR_ACCES;
+    }
+    for (pos = offset; pos < end; )
+    {
+        uint32_t in_page = pos & (RAM_PAGE_SIZE - 1);
+        uint32_t len = RAM_PAGE_SIZE - in_page < end - pos ? RAM_PAGE_SIZE - in_page : end - pos;
+        char *page = page_get(inode, pos >> RAM_PAGE_SHIFT, &status);
+        if (page == NULL)
+            break;
+        memcpy(page + in_page, buf + (pos - offset), len);
+        pos += len;
+    }
+    // A short write is fine, as long as something has been written
+    *done = pos - offset;
+    if (pos > offset || count == 0)
+    {
+        status = NFS3_OK;
+        if (pos > inode->attr.size)
+            inode->attr.size = pos;
+        ram_now(&inode->attr.mtime);
+        inode->attr.ctime = inode->attr.mtime;
+    }
+    wcc->after.attributes_follow = TRUE;
+    wcc->after.post_op_attr_u.attributes = inode->attr;
+    pthread_rwlock_unlock(lock);
+    return status;
+}
+
+/*
+ * Owner of a new object: the caller, unless root asked for another one.
+ */
+static void new_owner(struct nfs_cred *cred, sattr3 *sattr, uint32_t *uid, uint32_t *gid)
+{
+    *uid = cred->uid;
+    *gid = cred->gid;
+    if (sattr && sattr->uid.set_it && cred->uid == 0)
+        *uid = sattr->uid.set_uid3_u.uid;
+    if (sattr && sattr->gid.set_it && (cred->uid == 0 || in_group(cred, sattr->gid.set_gid3_u.gid)))
+        *gid = sattr->gid.set_gid3_u.gid;
+}
+
+/*
+ * Add a new object to dir, the caller holds ram_lock for writing and has
+ * checked the name and that it doesn't exist yet. Returns it with a
+ * reference for the client.
+ */
+static nfsstat3 add_child(struct inode *dir, const char *name, uint32_t hash, struct nfs_cred *cred, sattr3 *sattr,
+    ftype3 type, uint32_t mode, struct inode **child)
+{
+    struct inode *inode;
+    nfsstat3 status;
+    uint32_t uid, gid;
+
+    if (sattr && sattr->mode.set_it)
+        mode = sattr->mode.set_mode3_u.mode & 07777;
+    new_owner(cred, sattr, &uid, &gid);
+    if ((inode = inode_alloc(type, mode, uid, gid)) == NULL)
+        return NFS3ERR_NOSPC;
+    inode->attr.nlink = 1;
+    if (type == NF3DIR)
+    {
+        if ((inode->u.dir = calloc(1, sizeof(struct ram_dir))) == NULL)
+        {
+            inode->attr.nlink = 0;
+            inode_free(inode);
+            return NFS3ERR_JUKEBOX;
+        }
+        inode->u.dir->free = NO_SLOT;
+        inode->u.dir->parent = dir->fh.ino;
+        inode->attr.nlink = 2;
+        inode->attr.size = 64;
+    }
+    if ((status = dir_add(dir->u.dir, name, hash, inode->fh.ino)) != NFS3_OK)
+    {
+        inode->attr.nlink = 0;
+        inode_free(inode);
+        return status;
+    }
+    dir_changed(dir, type == NF3DIR);
+    inode->refs = 1;
+    *child = inode;
+    return NFS3_OK;
+}
+
+// Look up an existing child to create name in, ram_lock is held for writing
+static nfsstat3 new_name(struct inode *dir, struct nfs_cred *cred, const char *name, uint32_t *hash, uint32_t *slot)
+{
+    nfsstat3 status;
+    fattr3 attr;
+
+    if ((status = check_name(name)) != NFS3_OK)
+        return status;
+    if ((status = dir_access(dir, cred, MAY_WRITE|MAY_EXEC, &attr)) != NFS3_OK)
+        return status;
+    // Removed directories can't get new entries
+    if (dir->attr.nlink == 0)
+        return NFS3ERR_NOENT;
+    *hash = name_hash(name);
+    *slot = dir_find(dir->u.dir, name, *hash);
+    return NFS3_OK;
+}
+
+static nfsstat3 ram_create(struct inode *dir, struct nfs_cred *cred, const char *name, createhow3 *how, struct inode **child)
+{
+    sattr3 *sattr = how->mode == EXCLUSIVE ? NULL : &how->createhow3_u.obj_attributes;
+    struct inode *existing;
+    nfsstat3 status;
+    uint32_t hash, slot, verf[2];
+
+    *child = NULL;
+    memcpy(verf, how->createhow3_u.verf, sizeof(verf));
+    pthread_rwlock_wrlock(&ram_lock);
+    if ((status = new_name(dir, cred, name, &hash, &slot)) != NFS3_OK)
+        goto out;
+    if (slot == NO_SLOT)
+    {
+        if ((status = add_child(dir, name, hash, cred, sattr, NF3REG, 0644, child)) != NFS3_OK)
+            goto out;
+        pthread_rwlock_wrlock(data_lock(*child));
+        if (how->mode == EXCLUSIVE)
+        {
+            // Keep the verifier in the timestamps, like knfsd does
+            (*child)->attr.atime.seconds = verf[0];
+            (*child)->attr.atime.nseconds = 0;
+            (*child)->attr.mtime.seconds = verf[1];
+            (*child)->attr.mtime.nseconds = 0;
+        }
+        else
+        {
+            sattr3 rest = *sattr;
+            rest.mode.set_it = FALSE;
+            rest.uid.set_it = FALSE;
+            rest.gid.set_it = FALSE;
+            apply_sattr(*child, &rest);
+        }
+        pthread_rwlock_unlock(data_lock(*child));
+        goto out;
+    }
+    existing = inode_at(dir->u.dir->entries[slot].ino);
+    status = NFS3ERR_EXIST;
+    if (how->mode == UNCHECKED)
+    {
+        // Existing files are only truncated if asked to, with the rights SETATTR would need
+        status = NFS3_OK;
+        if (sattr->size.set_it)
+        {
+            fattr3 attr;
+            get_attr(existing, &attr);
+            if (attr.type != NF3REG)
+                status = attr.type == NF3DIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+            else if (cred->uid != 0 && cred->uid != attr.uid && !may_access(&attr, cred, MAY_WRITE))
+                status = NFS3ERR_ACCES;
+            else
+            {
+                pthread_rwlock_wrlock(data_lock(existing));
+                file_truncate(existing, sattr->size.set_size3_u.size);
+                ram_now(&existing->attr.mtime);
+                existing->attr.ctime = existing->attr.mtime;
+                pthread_rwlock_unlock(data_lock(existing));
+            }
+        }
+    }
+    else if (how->mode == EXCLUSIVE)
+    {
+        // A retransmission of our own EXCLUSIVE create succeeds
+        fattr3 attr;
+        get_attr(existing, &attr);
+        if (attr.type == NF3REG && attr.atime.seconds == verf[0] && attr.mtime.seconds == verf[1])
+            status = NFS3_OK;
+    }
+    if (status == NFS3_OK)
+    {
+        __atomic_add_fetch(&existing->refs, 1, __ATOMIC_RELAXED);
+        *child = existing;
+    }
+out:
+    pthread_rwlock_unlock(&ram_lock);
+    return status;
+}
+
+static nfsstat3 ram_mkdir(struct inode *dir, struct nfs_cred *cred, const char *name, sattr3 *sattr, struct inode **child)
+{
+    nfsstat3 status;
+    uint32_t hash, slot;
+
+    *child = NULL;
+    pthread_rwlock_wrlock(&ram_lock);
+    if ((status = new_name(dir, cred, name, &hash, &slot)) == NFS3_OK)
+    {
+        if (slot != NO_SLOT)
+            status = NFS3ERR_EXIST;
+        else
+            status = add_child(dir, name, hash, cred, sattr, NF3DIR, 0755, child);
+    }
+    pthread_rwlock_unlock(&ram_lock);
+    return status;
+}
+
+static nfsstat3 ram_symlink(struct inode *dir, struct nfs_cred *cred, const char *name, const char *target, sattr3 *sattr, struct inode **child)
+{
+    nfsstat3 status;
+    uint32_t hash, slot;
+    char *copy;
+
+    *child = NULL;
+    if (target == NULL || strlen(target) >= PATH_MAX)
+        return NFS3ERR_NAMETOOLONG;
+    if ((copy = strdup(target)) == NULL)
+        return NFS3ERR_JUKEBOX;
+    pthread_rwlock_wrlock(&ram_lock);
+    if ((status = new_name(dir, cred, name, &hash, &slot)) == NFS3_OK)
+    {
+        if (slot != NO_SLOT)
+            status = NFS3ERR_EXIST;
+        else
+            status = add_child(dir, name, hash, cred, sattr, NF3LNK, 0777, child);
+    }
+    if (status == NFS3_OK)
+    {
+        (*child)->u.target = copy;
+        (*child)->attr.size = strlen(copy);
+    }
+    else
+        free(copy);
+    pthread_rwlock_unlock(&ram_lock);
+    return status;
+}
+
+static nfsstat3 ram_mknod(struct inode *dir, struct nfs_cred *cred, const char *name, mknoddata3 *what, struct inode **child)
+{
+    sattr3 *sattr;
+    nfsstat3 status;
+    uint32_t hash, slot;
+
+    *child = NULL;
+    switch (what->type)
+    {
+    case NF3CHR:
+    case NF3BLK:
+        sattr = &what->mknoddata3_u.device.dev_attributes;
+        break;
+    case NF3SOCK:
+    case NF3FIFO:
+        sattr = &what->mknoddata3_u.pipe_attributes;
+        break;
+    default:
+        return NFS3ERR_BADTYPE;
+    }
+    pthread_rwlock_wrlock(&ram_lock);
+    if ((status = new_name(dir, cred, name, &hash, &slot)) == NFS3_OK)
+    {
+        if (slot != NO_SLOT)
+            status = NFS3ERR_EXIST;
+        else
+            status = add_child(dir, name, hash, cred, sattr, what->type, 0644, child);
+    }
+    if (status == NFS3_OK && (what->type == NF3CHR || what->type == NF3BLK))
+        (*child)->attr.rdev = what->mknoddata3_u.device.spec;
+    pthread_rwlock_unlock(&ram_lock);
+    return status;
+}
+
+/*
+ * Find the entry to remove or rename from dir, ram_lock is held for
+ * writing.
+ */
+static nfsstat3 old_name(struct inode *dir, struct nfs_cred *cred, const char *name, uint32_t *slot, struct inode **child)
+{
+    fattr3 attr, child_attr;
+    nfsstat3 status;
+
+    if ((status = check_name(name)) != NFS3_OK)
+        return status;
+    if ((status = dir_access(dir, cred, MAY_WRITE|MAY_EXEC, &attr)) != NFS3_OK)
+        return status;
+    if ((*slot = dir_find(dir->u.dir, name, name_hash(name))) == NO_SLOT)
+        return NFS3ERR_NOENT;
+    *child = inode_at(dir->u.dir->entries[*slot].ino);
+    get_attr(*child, &child_attr);
+    if (!may_delete(&attr, child_attr.uid, cred))
+        return NFS3ERR_ACCES;
+    return NFS3_OK;
+}
+
+static nfsstat3 ram_remove(struct inode *dir, struct nfs_cred *cred, const char *name)
+{
+    struct inode *child;
+    nfsstat3 status;
+    uint32_t slot;
+
+    pthread_rwlock_wrlock(&ram_lock);
+    if ((status = old_name(dir, cred, name, &slot, &child)) == NFS3_OK)
+    {
+        if (child->attr.type == NF3DIR)
+            status = NFS3ERR_ISDIR;
+        else
+        {
+            dir_remove(dir->u.dir, slot);
+            dir_changed(dir, 0);
+            inode_unlink(child, 0);
+        }
+    }
+    pthread_rwlock_unlock(&ram_lock);
+    return status;
+}
+
+static nfsstat3 ram_rmdir(struct inode *dir, struct nfs_cred *cred, const char *name)
+{
+    struct inode *child;
+    nfsstat3 status;
+    uint32_t slot;
+
+    if (!strcmp(name, "."))
+        return NFS3ERR_INVAL;
+    if (!strcmp(name, ".."))
+        return NFS3ERR_NOTEMPTY;
+    pthread_rwlock_wrlock(&ram_lock);
+    if ((status = old_name(dir, cred, name, &slot, &child)) == NFS3_OK)
+    {
+        if (child->attr.type != NF3DIR)
+            status = NFS3ERR_NOTDIR;
+        else if (child->u.dir->count)
+            status = NFS3ERR_NOTEMPTY;
+        else
+        {
+            dir_remove(dir->u.dir, slot);
+            dir_changed(dir, -1);
+            inode_unlink(child, 1);
+        }
+    }
+    pthread_rwlock_unlock(&ram_lock);
+    return status;
+}
+
+static nfsstat3 ram_rename(struct inode *from_dir, const char *from_name, struct inode *to_dir, const char *to_name, struct nfs_cred *cred)
+{
+    struct inode *child, *replaced = NULL, *up;
+    uint32_t from_slot, to_slot, hash;
+    nfsstat3 status;
+
+    if (!strcmp(from_name, ".") || !strcmp(from_name, "..") ||
+        !strcmp(to_name, ".") || !strcmp(to_name, ".."))
+        return NFS3ERR_INVAL;
+    pthread_rwlock_wrlock(&ram_lock);
+    if ((status = old_name(from_dir, cred, from_name, &from_slot, &child)) != NFS3_OK ||
+        (status = new_name(to_dir, cred, to_name, &hash, &to_slot)) != NFS3_OK)
+        goto out;
+    if (to_slot != NO_SLOT)
+    {
+        fattr3 attr, replaced_attr;
+        replaced = inode_at(to_dir->u.dir->entries[to_slot].ino);
+        // Renaming a file onto another link to it does nothing
+        if (replaced == child)
+            goto out;
+        get_attr(to_dir, &attr);
+        get_attr(replaced, &replaced_attr);
+        if (!may_delete(&attr, replaced_attr.uid, cred))
+            status = NFS3ERR_ACCES;
+        else if (child->attr.type == NF3DIR && replaced->attr.type != NF3DIR)
+            status = NFS3ERR_NOTDIR;
+        else if (child->attr.type != NF3DIR && replaced->attr.type == NF3DIR)
+            status = NFS3ERR_ISDIR;
+        else if (replaced->attr.type == NF3DIR && replaced->u.dir->count)
+            status = NFS3ERR_EXIST;
+        if (status != NFS3_OK)
+            goto out;
+    }
+    if (child->attr.type == NF3DIR)
+    {
+        // A directory can't move into itself
+        for (up = to_dir; up->fh.ino != ROOT_INO; up = inode_at(up->u.dir->parent))
+        {
+            if (up == child)
+            {
+                status = NFS3ERR_INVAL;
+                goto out;
+            }
+        }
+    }
+    if ((status = dir_add(to_dir->u.dir, to_name, hash, child->fh.ino)) != NFS3_OK)
+        goto out;
+    if (replaced)
+    {
+        // The new entry takes the place of the old one
+        dir_remove(to_dir->u.dir, to_slot);
+        if (replaced->attr.type == NF3DIR)
+        {
+            dir_changed(to_dir, -1);
+            inode_unlink(replaced, 1);
+        }
+        else
+            inode_unlink(replaced, 0);
+    }
+    dir_remove(from_dir->u.dir, from_slot);
+    if (child->attr.type == NF3DIR && from_dir != to_dir)
+    {
+        child->u.dir->parent = to_dir->fh.ino;
+        dir_changed(from_dir, -1);
+        dir_changed(to_dir, 1);
+    }
+    else
+    {
+        dir_changed(from_dir, 0);
+        dir_changed(to_dir, 0);
+    }
+    pthread_rwlock_wrlock(data_lock(child));
+    ram_now(&child->attr.ctime);
+    pthread_rwlock_unlock(data_lock(child));
+out:
+    pthread_rwlock_unlock(&ram_lock);
+    return status;
+}
+
+static nfsstat3 ram_link(struct inode *inode, struct inode *dir, const char *name, struct nfs_cred *cred)
+{
+    nfsstat3 status;
+    uint32_t hash, slot;
+
+    if (inode->attr.type == NF3DIR)
+        return NFS3ERR_ISDIR;
+    pthread_rwlock_wrlock(&ram_lock);
+    if ((status = new_name(dir, cred, name, &hash, &slot)) != NFS3_OK)
+        goto out;
+    if (slot != NO_SLOT)
+        status = NFS3ERR_EXIST;
+    else if (inode->attr.nlink == 0)
+        status = NFS3ERR_STALE;
+    else if ((status = dir_add(dir->u.dir, name, hash, inode->fh.ino)) == NFS3_OK)
+    {
+        dir_changed(dir, 0);
+        pthread_rwlock_wrlock(data_lock(inode));
+        __atomic_store_n(&inode->attr.nlink, inode->attr.nlink + 1, __ATOMIC_SEQ_CST);
+        ram_now(&inode->attr.ctime);
+        pthread_rwlock_unlock(data_lock(inode));
+    }
+out:
+    pthread_rwlock_unlock(&ram_lock);
+    return status;
+}
+
+/*
+ * Listing. "." and ".." come first with cookies 1 and 2, the entry in slot
+ * i has cookie i + 3. Entries are copied in batches so that the callback,
+ * which may look them up, runs without ram_lock.
+ */
+static nfsstat3 ram_readdir(struct inode *dir, struct nfs_cred *cred, uint64_t cookie, char *verf, readdir_fn fn, void *private_data, int *eof)
+{
+    struct
+    {
+        uint64_t ino;
+        uint64_t cookie;
+        char name[NAME_MAX + 1];
+    } batch[READDIR_BATCH];
+    uint64_t pos = cookie;
+    nfsstat3 status;
+    fattr3 attr;
+    int n, i, end;
+
+    *eof = 0;
+    if ((status = dir_access(dir, cred, MAY_READ, &attr)) != NFS3_OK)
+        return status;
+    memcpy(verf, &attr.mtime.seconds, 4);
+    memcpy(verf + 4, &attr.mtime.nseconds, 4);
+    do
+    {
+        struct ram_dir *d;
+        n = 0;
+        pthread_rwlock_rdlock(&ram_lock);
+        d = dir->u.dir;
+        for (; n < READDIR_BATCH && pos < (uint64_t)d->size + 2; pos++)
+        {
+            if (pos < 2)
+            {
+                batch[n].ino = pos ? d->parent : dir->fh.ino;
+                strcpy(batch[n].name, pos ? ".." : ".");
+            }
+            else if (d->entries[pos - 2].name)
+            {
+                batch[n].ino = d->entries[pos - 2].ino;
+                strcpy(batch[n].name, d->entries[pos - 2].name);
+            }
+            else
+                continue;
+            batch[n++].cookie = pos + 1;
+        }
+        end = pos >= (uint64_t)d->size + 2;
+        pthread_rwlock_unlock(&ram_lock);
+        for (i = 0; i < n; i++)
+        {
+            if (fn(private_data, batch[i].name, batch[i].ino, batch[i].cookie))
+                return NFS3_OK;
+        }
+    } while (!end);
+    *eof = 1;
+    return NFS3_OK;
+}
+
+static nfsstat3 ram_fsstat(struct inode *inode, FSSTAT3resok *res)
+{
+    uint64_t used = __atomic_load_n(&ram_pages, __ATOMIC_RELAXED) << RAM_PAGE_SHIFT;
+    uint64_t files = (uint64_t)INODE_CHUNKS << INODE_CHUNK_SHIFT;
+
+    res->tbytes = ram_max_bytes;
+    res->fbytes = used < ram_max_bytes ? ram_max_bytes - used : 0;
+    res->abytes = res->fbytes;
+    res->tfiles = files;
+    pthread_rwlock_rdlock(&ram_lock);
+    res->ffiles = files - inode_count;
+    pthread_rwlock_unlock(&ram_lock);
+    res->afiles = res->ffiles;
+    res->invarsec = 0;
+    return NFS3_OK;
+}
+
+// Everything is as stable as it gets as soon as it's written
+static nfsstat3 ram_commit(struct inode *inode, uint64_t offset, uint32_t count)
+{
+    if (inode->attr.type != NF3REG)
+        return inode->attr.type == NF3DIR ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+    return NFS3_OK;
+}
+
+const struct backend ram_backend = {
+    .init = ram_init,
+    .write_verf = ram_write_verf,
+    .root = ram_root,
+    .inode_from_fh = ram_inode_from_fh,
+    .inode_to_fh = ram_inode_to_fh,
+    .inode_put = ram_inode_put,
+    .getattr = ram_getattr,
+    .setattr = ram_setattr,
+    .lookup = ram_lookup,
+    .access = ram_access,
+    .readlink = ram_readlink,
+    .read = ram_read,
+    .write = ram_write,
+    .create = ram_create,
+    .mkdir = ram_mkdir,
+    .symlink = ram_symlink,
+    .mknod = ram_mknod,
+    .remove = ram_remove,
+    .rmdir = ram_rmdir,
+    .rename = ram_rename,
+    .link = ram_link,
+    .readdir = ram_readdir,
+    .fsstat = ram_fsstat,
+    .commit = ram_commit,
+};
@@ -3,7 +3,10 @@
 #define _GNU_SOURCE
 #endif
 
+#include <errno.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -11,99 +14,1638 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
+#include <linux/tcp.h>
 
 #include <event2/event.h>
 
 #include "nfs-service.h"
+#include "nfs-backend.h"
+#include "nfs-uring.h"
+#include "nfs-pool.h"
+#include "nfs-export.h"
 
-struct event_base *base;
+/*
+ * Allocation. Every worker keeps free lists of the objects it allocates
+ * per connection and per call (slabs) and of reply buffers by size class,
+ * and an arena for the temporaries of the call being run that is released
+ * in one go when the call is done. Memory only goes back to malloc when a
+ * free list is full, so once warmed up calls don't malloc at all, which
+ * the mallocs counters in the stats show. All of it is only touched by
+ * the owning worker, the counters are also read by the stats reader.
+ */
+#define SLAB_MAX 4096
+#define BUF_MIN_SHIFT 9
+#define BUF_CLASSES 12
+#define BUF_CLASS_BYTES (8*1024*1024)
+#define ARENA_SIZE (64*1024)
+#define ARENA_MAX (8*1024*1024)
+
+struct slab
+{
+    size_t size;
+    void *free;
+    int count;
+    uint64_t allocs;
+    uint64_t mallocs;
+};
+
+// Reply buffers of 512 bytes to 1 MiB, bigger ones always come from malloc
+struct buf_pool
+{
+    void *free[BUF_CLASSES];
+    int count[BUF_CLASSES];
+    uint64_t allocs;
+    uint64_t mallocs;
+};
+
+struct arena
+{
+    char *base;
+    size_t size;
+    size_t used;
+    // Allocations that didn't fit, the arena grows to hold them next time
+    struct arena_chunk *extra;
+    size_t extra_size;
+    uint64_t allocs;
+    uint64_t mallocs;
+};
+
+struct arena_chunk
+{
+    struct arena_chunk *next;
+    char data[];
+};
 
+/*
+ * Every worker thread runs its own event loop with its own set of
+ * SO_REUSEPORT listeners, so the kernel spreads incoming connections
+ * between threads and a connection never leaves the thread that accepted it.
+ */
+struct worker
+{
+    int id;
+    pthread_t thread;
+    struct event_base *base;
+    struct event *listen_events[2];
+
+    // Deferred replies completed by other threads, flushed by wakeup_event
+    pthread_mutex_t completed_lock;
+    struct deferred_reply *completed;
+    int wakeup_fd;
+    struct event *wakeup_event;
+
+    struct udp_socket *udp[2];
+
+    // Call statistics, indexed by service and proc, see call_stats()
+    struct proc_stats *stats;
+    // TCP connections, locked for the stats reader
+    pthread_mutex_t conns_lock;
+    struct server *conns;
+
+    // Connections that used up their turn, resumed by resume_event
+    struct server *yield_head;
+    struct server *yield_tail;
+    struct event *resume_event;
+    // Connections with replies to write, flushed by flush_event
+    struct server *flush_head;
+    struct event *flush_event;
+
+    struct slab server_slab;
+    struct slab raw_slab;
+    struct slab deferred_slab;
+    struct buf_pool buf_pool;
+    struct arena arena;
+};
+
+struct worker *workers;
+int num_workers;
+
+/*
+ * A server is referenced by its connection and by every deferred reply
+ * that is still pending on it. When the client goes away the rpc context
+ * and events are torn down at once, but the structure itself lives until
+ * the last deferred reply has been completed.
+ */
 struct server
 {
+    struct worker *worker;
     struct rpc_context *rpc;
     struct event *read_event;
     struct event *write_event;
+    int refs;
+    // Request data kept by deferred replies, see rpc_defer_hold_data()
+    size_t held_data;
+    // Replies written by us instead of libnfs, see rpc_send_reply_fd()
+    struct raw_reply *raw_head;
+    struct raw_reply *raw_tail;
+    // Client address and port, see sockaddr_to_key()
+    uint8_t addr[16];
+    uint16_t port;
+    // Export rules of the client, for any export and for each, looked up once when accepted
+    const struct export_rule *rule;
+    const struct export_rule *rules[MAX_EXPORTS];
+    /*
+     * Flow control, see update_events(). Calls are in flight from the
+     * time they are deferred or their reply is queued until the reply
+     * has been written. Read by the stats reader.
+     */
+    uint64_t deferred;
+    uint64_t queued;
+    uint64_t queued_bytes;
+    uint64_t max_depth;
+    uint64_t calls;
+    uint64_t writes;
+    uint64_t pauses;
+    uint64_t yields;
+    int paused;
+    int turn_calls;
+    int yielded;
+    struct server *yield_next;
+    // Events that are added, POLLIN and POLLOUT
+    int armed;
+    // Queued on the worker's flush list, see schedule_flush()
+    int flush_pending;
+    struct server *flush_next;
+    // Link in the worker's connection list
+    int fd;
+    struct server *conn_prev;
+    struct server *conn_next;
+};
+
+/*
+ * A reply written to the socket directly: record marker, RPC header and
+ * encoded body in buf, then len bytes of file data and pad bytes of XDR
+ * padding. The data is sent with sendfile(), or from memory if chunks is
+ * set: every chunk is a record fragment of its own, handed back with
+ * release() as soon as it has been written.
+ * Replies never interleave with libnfs output: one is only started when
+ * libnfs has nothing left to write, and libnfs doesn't get POLLOUT while
+ * one is partially written.
+ */
+struct raw_reply
+{
+    struct raw_reply *next;
+    char *buf;
+    size_t buf_len;
+    size_t buf_pos;
+    int fd;
+    off_t offset;
+    struct iovec *chunks;
+    int num_chunks;
+    int chunk;
+    // Bytes of the current chunk sent, including its record marker
+    size_t chunk_pos;
+    void (*release)(char *data);
+    size_t len;
+    size_t pad;
+    // Bytes left when it was queued
+    size_t queued_bytes;
+};
+
+// Record marker and accepted reply header
+#define RAW_HEADER_SIZE 28
+// Most replies written by a single sendmsg()
+#define FLUSH_IOV 64
+// Replies carry at most MAX_TRANSFER bytes of data
+#define RAW_REPLY_MAX (256*1024*1024)
+
+/*
+ * Duplicate request cache. The encoded replies of non-idempotent calls
+ * are kept, keyed by client address and port, xid, program, version and
+ * proc, and sent again when the client retransmits the call. Clients
+ * reconnect from the same port to make this work, and the port tells apart
+ * clients on the same host whose xids collide. A retransmission of a call
+ * that is still in progress is dropped, the client will retransmit it
+ * again later.
+ * The cache is split into partitions by hash, each with its own lock,
+ * hash chains and LRU list of at most DRC_PART_ENTRIES entries.
+ */
+#define DRC_PARTS 32
+#define DRC_PART_ENTRIES 512
+#define DRC_BUCKETS 1024
+
+struct drc_entry
+{
+    struct drc_entry *hash_next;
+    struct drc_entry *lru_prev;
+    struct drc_entry *lru_next;
+    uint64_t hash;
+    uint8_t addr[16];
+    uint16_t port;
+    uint32_t xid;
+    uint32_t prog;
+    uint32_t vers;
+    uint32_t proc;
+    // Reply with record marker, NULL while the call is in progress
+    char *reply;
+    size_t reply_len;
+};
+
+struct drc_part
+{
+    pthread_mutex_t lock;
+    struct drc_entry *hash[DRC_BUCKETS];
+    struct drc_entry lru;
+    int count;
+};
+
+static struct drc_part drc_parts[DRC_PARTS];
+static uint64_t drc_hits;
+static uint64_t drc_in_progress;
+static uint64_t drc_evictions;
+
+// Calls of clients that no export admits
+static uint64_t calls_denied;
+
+struct deferred_reply
+{
+    struct deferred_reply *next;
+    struct server *server;
+    struct rpc_msg call;
+    size_t held_data;
+    deferred_send_fn send;
+    void *private_data;
+    // See rpc_defer_state() and rpc_defer_alloc()
+    uint64_t state[DEFERRED_STATE_SIZE / 8];
+    void *allocs;
+};
+
+/*
+ * UDP. Every worker has its own SO_REUSEPORT sockets too. Datagrams are
+ * drained in batches with recvmmsg(), each call is decoded and dispatched
+ * by us to the same service tables libnfs uses for TCP, and the replies
+ * of a batch go out with a single sendmmsg(). Transfer and directory
+ * sizes are limited to UDP_MAX_TRANSFER for UDP calls, see
+ * rpc_max_transfer(); replies that still don't fit into a datagram are
+ * answered with SYSTEM_ERR, so that the client fails instead of retrying
+ * forever.
+ */
+#define UDP_BATCH 32
+#define UDP_MAX_SIZE 65536
+#define UDP_MAX_REPLY 65507
+
+struct udp_socket
+{
+    struct worker *worker;
+    int fd;
+    int port;
+    struct event *event;
+    // Never connected, tells the service procs that a call came over UDP
+    struct rpc_context *rpc;
+    // Received batch and the call being dispatched
+    struct mmsghdr in[UDP_BATCH];
+    struct iovec in_iov[UDP_BATCH];
+    struct sockaddr_storage addrs[UDP_BATCH];
+    int current;
+    // Export rule of the client of the current call for any export, see rpc_client_rule()
+    const struct export_rule *rule;
+    // Replies of the batch, the buffers start with a record marker
+    struct mmsghdr out[UDP_BATCH];
+    struct iovec out_iov[UDP_BATCH];
+    char *replies[UDP_BATCH];
+    struct proc_stats *reply_stats[UDP_BATCH];
+    int count;
+    // Datagram payload bytes, read by the stats reader
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+};
+
+/*
+ * Call statistics. Every worker counts the calls of each proc and keeps
+ * log-linear latency histograms of four phases: decode (from the end of
+ * the previous call on the connection, or from the wakeup, until the
+ * proc runs), handler (until the proc starts to reply, or returns if it
+ * defers the reply), encode and send. UDP replies go out in batches, each
+ * one is charged an equal share of the sendmmsg().
+ * Only the owning worker writes its counters, readers add up all workers
+ * with relaxed loads, so the dispatch path takes no locks. The buckets
+ * are 12.5% wide and cover up to 2^40 ns.
+ */
+#define MAX_PROCS 24
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((40 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+enum { PHASE_DECODE, PHASE_HANDLER, PHASE_ENCODE, PHASE_SEND, NUM_PHASES };
+
+static const char *phase_names[NUM_PHASES] = { "decode", "handler", "encode", "send" };
+
+struct proc_stats
+{
+    uint64_t calls;
+    // Size of the last reply, encoding the next one starts with it
+    uint32_t reply_size;
+    uint64_t hist[NUM_PHASES][HIST_BUCKETS];
+};
+
+// The call being dispatched on this thread, see run_proc()
+struct call_timing
+{
+    struct rpc_msg *call;
+    struct proc_stats *stats;
+    uint64_t start;
+    int replied;
 };
 
+uint32_t max_write_data = 64*1024*1024;
+
+/*
+ * Fairness between connections. A connection stops reading requests while
+ * it has max_in_flight calls in flight or more than max_queued_bytes of
+ * replies waiting for the client to read them. A connection that ran
+ * calls_per_turn calls in one turn yields to the other ready connections
+ * of its worker before it reads again. The limits are checked between
+ * reads, the calls libnfs has already read are always run.
+ */
+static uint64_t max_in_flight = 64;
+static uint64_t max_queued_bytes = 8*1024*1024;
+static int calls_per_turn = 16;
+
+static __thread struct worker *current_worker;
+static __thread struct server *current_server;
+static __thread struct udp_socket *current_udp;
+static __thread struct call_timing current_call;
+// When decoding the next call started
+static __thread uint64_t decode_start;
+
+static struct proc_stats *call_stats(struct rpc_msg *call);
+
+static void *slab_alloc(struct slab *slab)
+{
+    void *obj = slab->free;
+    __atomic_add_fetch(&slab->allocs, 1, __ATOMIC_RELAXED);
+    if (obj)
+    {
+        slab->free = *(void **)obj;
+        slab->count--;
+        return obj;
+    }
+    __atomic_add_fetch(&slab->mallocs, 1, __ATOMIC_RELAXED);
+    return malloc(slab->size);
+}
+
+static void slab_free(struct slab *slab, void *obj)
+{
+    if (slab->count >= SLAB_MAX)
+    {
+        free(obj);
+        return;
+    }
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    slab->count++;
+}
+
+/*
+ * A reply buffer of at least size bytes, *cap is set to its actual size.
+ * The size class is kept in front of the buffer.
+ */
+static char *buf_get(size_t size, size_t *cap)
+{
+    struct buf_pool *pool = current_worker ? &current_worker->buf_pool : NULL;
+    int class = 0;
+    uint64_t *head;
+
+    while (class < BUF_CLASSES && (size_t)1 << (class + BUF_MIN_SHIFT) < size)
+        class++;
+    if (pool)
+        __atomic_add_fetch(&pool->allocs, 1, __ATOMIC_RELAXED);
+    if (pool && class < BUF_CLASSES && pool->free[class])
+    {
+        head = pool->free[class];
+        pool->free[class] = *(void **)(head + 1);
+        pool->count[class]--;
+    }
+    else
+    {
+        if (class < BUF_CLASSES)
+            size = (size_t)1 << (class + BUF_MIN_SHIFT);
+        if (pool)
+            __atomic_add_fetch(&pool->mallocs, 1, __ATOMIC_RELAXED);
+        head = malloc(sizeof(uint64_t) + size);
+        if (head == NULL)
+            return NULL;
+        *head = size;
+    }
+    *cap = *head;
+    return (char *)(head + 1);
+}
+
+static void buf_put(char *buf)
+{
+    struct buf_pool *pool = current_worker ? &current_worker->buf_pool : NULL;
+    uint64_t *head = (uint64_t *)buf - 1;
+    int class = 0;
+
+    if (buf == NULL)
+        return;
+    while (class < BUF_CLASSES && (uint64_t)1 << (class + BUF_MIN_SHIFT) != *head)
+        class++;
+    if (pool == NULL || class == BUF_CLASSES || pool->count[class] >= BUF_CLASS_BYTES >> (class + BUF_MIN_SHIFT))
+    {
+        free(head);
+        return;
+    }
+    *(void **)buf = pool->free[class];
+    pool->free[class] = head;
+    pool->count[class]++;
+}
+
+void *rpc_alloc(size_t size)
+{
+    struct arena *arena = &current_worker->arena;
+    struct arena_chunk *chunk;
+
+    size = (size + 15) & ~(size_t)15;
+    __atomic_add_fetch(&arena->allocs, 1, __ATOMIC_RELAXED);
+    if (arena->used + size <= arena->size)
+    {
+        arena->used += size;
+        return arena->base + arena->used - size;
+    }
+    __atomic_add_fetch(&arena->mallocs, 1, __ATOMIC_RELAXED);
+    chunk = malloc(sizeof(struct arena_chunk) + size);
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = arena->extra;
+    arena->extra = chunk;
+    arena->extra_size += size;
+    return chunk->data;
+}
+
+// Release everything allocated by the call, the arena grows if it was too small
+static void arena_reset(struct arena *arena)
+{
+    size_t size;
+
+    arena->used = 0;
+    if (arena->extra == NULL)
+        return;
+    while (arena->extra)
+    {
+        struct arena_chunk *chunk = arena->extra;
+        arena->extra = chunk->next;
+        free(chunk);
+    }
+    size = arena->size + arena->extra_size;
+    arena->extra_size = 0;
+    if (arena->size >= ARENA_MAX)
+        return;
+    if (size > ARENA_MAX)
+        size = ARENA_MAX;
+    free(arena->base);
+    arena->base = malloc(size);
+    arena->size = arena->base ? size : 0;
+    __atomic_add_fetch(&arena->mallocs, 1, __ATOMIC_RELAXED);
+}
+
+static void arena_init(struct arena *arena)
+{
+    arena->base = malloc(ARENA_SIZE);
+    arena->size = arena->base ? ARENA_SIZE : 0;
+}
+
+static struct raw_reply *alloc_raw_reply(void)
+{
+    struct raw_reply *raw = slab_alloc(&current_worker->raw_slab);
+    if (raw == NULL)
+        return NULL;
+    memset(raw, 0, sizeof(*raw));
+    raw->fd = -1;
+    return raw;
+}
+
+static uint64_t stats_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Counters have a single writer, a plain load and store is enough
+static void stat_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static void stat_sub(uint64_t *counter, uint64_t n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) - n, __ATOMIC_RELAXED);
+}
+
+static void hist_add(struct proc_stats *stats, int phase, uint64_t ns)
+{
+    int bucket = ns;
+    if (ns >= 2 << HIST_SUB_BITS)
+    {
+        int exp = 63 - __builtin_clzll(ns);
+        bucket = ((exp - HIST_SUB_BITS) << HIST_SUB_BITS) + (ns >> (exp - HIST_SUB_BITS));
+        if (bucket >= HIST_BUCKETS)
+            bucket = HIST_BUCKETS - 1;
+    }
+    stat_add(&stats->hist[phase][bucket], 1);
+}
+
+// The middle of a bucket in ns
+static double hist_value(int bucket)
+{
+    uint64_t mantissa, width;
+    int exp;
+    if (bucket < 2 << HIST_SUB_BITS)
+        return bucket;
+    exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    mantissa = (bucket & ((1 << HIST_SUB_BITS) - 1)) | (1 << HIST_SUB_BITS);
+    width = 1ull << (exp - HIST_SUB_BITS);
+    return mantissa * width + width / 2.0;
+}
+
+/*
+ * The stats of a call that is being replied to. Ends the handler phase
+ * if it is the call being dispatched, deferred replies are looked up.
+ */
+static struct proc_stats *reply_stats(struct rpc_msg *call, uint64_t now)
+{
+    if (current_call.call == call)
+    {
+        if (!current_call.replied && current_call.stats)
+            hist_add(current_call.stats, PHASE_HANDLER, now - current_call.start);
+        current_call.replied = 1;
+        return current_call.stats;
+    }
+    return call_stats(call);
+}
+
+/*
+ * Portmapper registry, hashed by program, version and netid. Netids are
+ * interned so that they compare as pointers. The encoded DUMP replies are
+ * kept until the registry changes, so polling them only copies bytes.
+ */
+#define MAP_BUCKETS 64
+#define MAX_NETIDS 16
+
 struct mapping
 {
     struct mapping *next;
     u_int prog;
     u_int vers;
     int port;
-    char *netid;
+    const char *netid;
     char *addr;
     char *owner;
 };
-struct mapping *map;
 
-void free_map_item(struct mapping *item)
+// A reply body encoded in advance
+struct encoded_reply
+{
+    char *data;
+    uint32_t len;
+};
+
+static struct mapping *map[MAP_BUCKETS];
+static const char *netids[MAX_NETIDS];
+static int num_netids;
+static struct encoded_reply pmap2_dump_reply;
+static struct encoded_reply pmap3_dump_reply;
+/* The registry is shared by all workers, SET/UNSET take it for writing */
+pthread_rwlock_t map_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void free_map_item(struct mapping *item)
+{
+    free(item->addr);
+    free(item->owner);
+    free(item);
+}
+
+static void put_server(struct server *server)
+{
+    if (--server->refs > 0)
+        return;
+    slab_free(&server->worker->server_slab, server);
+}
+
+static void free_raw_reply(struct raw_reply *raw)
+{
+    if (raw->fd >= 0)
+        close(raw->fd);
+    if (raw->chunks)
+    {
+        for (; raw->chunk < raw->num_chunks; raw->chunk++)
+            raw->release(raw->chunks[raw->chunk].iov_base);
+        buf_put((char *)raw->chunks);
+    }
+    buf_put(raw->buf);
+    slab_free(&current_worker->raw_slab, raw);
+}
+
+static void free_server(struct server *server)
+{
+    while (server->raw_head)
+    {
+        struct raw_reply *raw = server->raw_head;
+        server->raw_head = raw->next;
+        free_raw_reply(raw);
+    }
+    server->raw_tail = NULL;
+    if (server->rpc)
+    {
+        struct worker *worker = server->worker;
+        pthread_mutex_lock(&worker->conns_lock);
+        if (server->conn_prev)
+            server->conn_prev->conn_next = server->conn_next;
+        else
+            worker->conns = server->conn_next;
+        if (server->conn_next)
+            server->conn_next->conn_prev = server->conn_prev;
+        pthread_mutex_unlock(&worker->conns_lock);
+        rpc_disconnect(server->rpc, NULL);
+        rpc_destroy_context(server->rpc);
+        server->rpc = NULL;
+    }
+    // The events live in the same slab object, see do_accept()
+    if (server->read_event)
+    {
+        event_del(server->read_event);
+        server->read_event = NULL;
+    }
+    if (server->write_event)
+    {
+        event_del(server->write_event);
+        server->write_event = NULL;
+    }
+    put_server(server);
+}
+
+/*
+ * Based on the state of libnfs and its context, update libevent
+ * accordingly regarding which events we are interested in. Only changes
+ * are passed on to libevent.
+ */
+static void update_events(struct server *server)
+{
+    int events = rpc_which_events(server->rpc);
+    int paused;
+    // A scheduled flush tries the socket before we wait for it
+    if (server->raw_head && !server->flush_pending)
+        events |= POLLOUT;
+    // Don't take more requests while deferred ones hold too much data,
+    // too many are in flight or the client doesn't read its replies
+    paused = server->held_data > max_write_data ||
+        server->deferred + server->queued >= max_in_flight ||
+        server->queued_bytes > max_queued_bytes;
+    if (paused && !server->paused)
+        stat_add(&server->pauses, 1);
+    server->paused = paused;
+    if (paused || server->yielded)
+        events &= ~POLLIN;
+    events &= POLLIN | POLLOUT;
+    if (server->read_event && ((events ^ server->armed) & POLLIN))
+    {
+        if (events & POLLIN)
+            event_add(server->read_event, NULL);
+        else
+            event_del(server->read_event);
+    }
+    if (server->write_event && ((events ^ server->armed) & POLLOUT))
+    {
+        if (events & POLLOUT)
+            event_add(server->write_event, NULL);
+        else
+            event_del(server->write_event);
+    }
+    server->armed = events;
+}
+
+/*
+ * Write as much of a raw reply as the socket takes.
+ * Returns 1 when it has been sent completely, 0 if the socket is full
+ * and -1 on error.
+ */
+static int write_raw_reply(struct server *server, struct raw_reply *raw)
+{
+    static const char zeros[4096];
+    int sock = server->fd;
+    ssize_t n;
+
+    while (raw->buf_pos < raw->buf_len)
+    {
+        stat_add(&server->writes, 1);
+        n = send(sock, raw->buf + raw->buf_pos, raw->buf_len - raw->buf_pos, MSG_NOSIGNAL | (raw->len ? MSG_MORE : 0));
+        if (n < 0)
+            goto error;
+        raw->buf_pos += n;
+    }
+    while (raw->chunks && raw->chunk < raw->num_chunks)
+    {
+        struct iovec *chunk = &raw->chunks[raw->chunk];
+        int last = raw->chunk == raw->num_chunks - 1;
+        // The first chunk is part of the fragment that starts in buf
+        size_t head = raw->chunk ? 4 : 0, marker_sent;
+        uint32_t marker = htonl((last ? 0x80000000 : 0) | (chunk->iov_len + (last ? raw->pad : 0)));
+        struct iovec iov[2];
+        struct msghdr msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        if (raw->chunk_pos < head)
+        {
+            iov[0].iov_base = (char *)&marker + raw->chunk_pos;
+            iov[0].iov_len = head - raw->chunk_pos;
+            iov[1] = *chunk;
+            msg.msg_iovlen = 2;
+        }
+        else
+        {
+            iov[0].iov_base = (char *)chunk->iov_base + (raw->chunk_pos - head);
+            iov[0].iov_len = chunk->iov_len - (raw->chunk_pos - head);
+            msg.msg_iovlen = 1;
+        }
+        marker_sent = raw->chunk_pos < head ? head - raw->chunk_pos : 0;
+        stat_add(&server->writes, 1);
+        n = sendmsg(sock, &msg, MSG_NOSIGNAL | (last && !raw->pad ? 0 : MSG_MORE));
+        if (n < 0)
+            goto error;
+        raw->chunk_pos += n;
+        raw->len -= (size_t)n > marker_sent ? n - marker_sent : 0;
+        if (raw->chunk_pos == head + chunk->iov_len)
+        {
+            raw->release(chunk->iov_base);
+            raw->chunk++;
+            raw->chunk_pos = 0;
+        }
+    }
+    while (raw->len > 0)
+    {
+        stat_add(&server->writes, 1);
+        n = sendfile(sock, raw->fd, &raw->offset, raw->len);
+        if (n < 0)
+            goto error;
+        if (n == 0)
+        {
+            // The file has been truncated meanwhile, keep the record intact
+            raw->pad += raw->len;
+            raw->len = 0;
+        }
+        raw->len -= n;
+    }
+    while (raw->pad > 0)
+    {
+        stat_add(&server->writes, 1);
+        n = send(sock, zeros, raw->pad < sizeof(zeros) ? raw->pad : sizeof(zeros), MSG_NOSIGNAL);
+        if (n < 0)
+            goto error;
+        raw->pad -= n;
+    }
+    return 1;
+error:
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        return 0;
+    return -1;
+}
+
+// Replies without data, whose buf is all there is to write
+static int raw_reply_plain(struct raw_reply *raw)
+{
+    return raw->len == 0 && raw->pad == 0 && raw->chunks == NULL;
+}
+
+static void pop_raw_reply(struct server *server)
+{
+    struct raw_reply *raw = server->raw_head;
+    server->raw_head = raw->next;
+    if (server->raw_head == NULL)
+        server->raw_tail = NULL;
+    stat_sub(&server->queued, 1);
+    stat_sub(&server->queued_bytes, raw->queued_bytes);
+    free_raw_reply(raw);
+}
+
+/*
+ * Write the queued replies, as many as the socket takes. Replies without
+ * data are gathered into a single sendmsg(), together with the header of
+ * a reply with data that follows them, whose data then goes out with
+ * write_raw_reply(). Returns -1 on error.
+ */
+static int flush_raw_replies(struct server *server)
+{
+    struct iovec iov[FLUSH_IOV];
+    struct msghdr msg;
+    struct raw_reply *raw;
+    ssize_t n;
+    int count, r;
+
+    while ((raw = server->raw_head) != NULL)
+    {
+        // libnfs may have a partially written reply of its own
+        if (raw->buf_pos == 0 && (rpc_which_events(server->rpc) & POLLOUT))
+            return 0;
+        if (raw->buf_pos < raw->buf_len)
+        {
+            count = 0;
+            for (; raw && count < FLUSH_IOV; raw = raw->next)
+            {
+                iov[count].iov_base = raw->buf + raw->buf_pos;
+                iov[count++].iov_len = raw->buf_len - raw->buf_pos;
+                if (!raw_reply_plain(raw))
+                    break;
+            }
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            stat_add(&server->writes, 1);
+            n = sendmsg(server->fd, &msg, MSG_NOSIGNAL | (raw ? MSG_MORE : 0));
+            if (n < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+            while ((raw = server->raw_head) != NULL && n > 0)
+            {
+                size_t len = raw->buf_len - raw->buf_pos < (size_t)n ? raw->buf_len - raw->buf_pos : (size_t)n;
+                raw->buf_pos += len;
+                n -= len;
+                if (raw->buf_pos < raw->buf_len)
+                    return 0;
+                if (!raw_reply_plain(raw))
+                    break;
+                pop_raw_reply(server);
+            }
+            if (raw == NULL || raw_reply_plain(raw))
+                continue;
+        }
+        r = write_raw_reply(server, raw);
+        if (r <= 0)
+            return r;
+        pop_raw_reply(server);
+    }
+    return 0;
+}
+
+/*
+ * Write the queued replies of the connection once the events that are
+ * ready now have been handled, so that the replies to a whole batch of
+ * calls go out with a single system call.
+ */
+static void schedule_flush(struct server *server)
+{
+    struct worker *worker = server->worker;
+    if (server->flush_pending)
+        return;
+    server->flush_pending = 1;
+    server->refs++;
+    server->flush_next = worker->flush_head;
+    worker->flush_head = server;
+    if (server->flush_next == NULL)
+        event_active(worker->flush_event, EV_WRITE, 0);
+}
+
+static void flush_servers(evutil_socket_t fd, short events, void *private_data)
+{
+    struct worker *worker = private_data;
+    struct server *server = worker->flush_head;
+
+    worker->flush_head = NULL;
+    while (server)
+    {
+        struct server *next = server->flush_next;
+        server->flush_next = NULL;
+        server->flush_pending = 0;
+        if (server->rpc)
+        {
+            if (flush_raw_replies(server) < 0)
+                free_server(server);
+            else
+                update_events(server);
+        }
+        put_server(server);
+        server = next;
+    }
+}
+
+/*
+ * Encode the record marker, the accepted reply header and the body,
+ * into a buffer of at least hint bytes.
+ */
+static int encode_raw_reply(struct rpc_msg *call, void *reply, zdrproc_t encode_fn, size_t extra, uint32_t hint, struct raw_reply *raw)
+{
+    size_t size = hint + RAW_HEADER_SIZE;
+    for (;;)
+    {
+        char *buf = buf_get(size, &size);
+        ZDR zdr;
+        if (buf == NULL)
+            return -1;
+        zdrmem_create(&zdr, buf + RAW_HEADER_SIZE, size - RAW_HEADER_SIZE, ZDR_ENCODE);
+        if (encode_fn(&zdr, reply))
+        {
+            uint32_t *header = (uint32_t *)buf;
+            uint32_t body = zdr_getpos(&zdr);
+            header[0] = htonl(0x80000000 | (RAW_HEADER_SIZE - 4 + body + extra));
+            header[1] = htonl(call->xid);
+            header[2] = htonl(REPLY);
+            header[3] = htonl(MSG_ACCEPTED);
+            header[4] = htonl(AUTH_NONE);
+            header[5] = 0;
+            header[6] = htonl(SUCCESS);
+            zdr_destroy(&zdr);
+            raw->buf = buf;
+            raw->buf_len = RAW_HEADER_SIZE + body;
+            return 0;
+        }
+        zdr_destroy(&zdr);
+        buf_put(buf);
+        if (size >= RAW_REPLY_MAX)
+            return -1;
+        size *= 2;
+    }
+}
+
+/*
+ * Encode a reply with encode_raw_reply() and account for it in the stats
+ * of its proc. Big replies don't have to grow the buffer over and over
+ * again, it starts out as big as the last reply of the proc.
+ */
+static int encode_call_reply(struct rpc_msg *call, void *reply, zdrproc_t encode_fn, size_t extra, uint32_t hint, struct raw_reply *raw, struct proc_stats **stats)
+{
+    uint64_t start = stats_clock();
+    int r;
+
+    *stats = reply_stats(call, start);
+    if (*stats && (*stats)->reply_size > hint)
+        hint = (*stats)->reply_size;
+    r = encode_raw_reply(call, reply, encode_fn, extra, hint, raw);
+    if (*stats)
+    {
+        if (r == 0)
+            (*stats)->reply_size = raw->buf_len - RAW_HEADER_SIZE;
+        hist_add(*stats, PHASE_ENCODE, stats_clock() - start);
+    }
+    return r;
+}
+
+// Track the deepest the connection's queue has been
+static void note_depth(struct server *server)
+{
+    if (server->deferred + server->queued > server->max_depth)
+        stat_add(&server->max_depth, server->deferred + server->queued - server->max_depth);
+}
+
+static void queue_raw_reply(struct server *server, struct raw_reply *raw)
+{
+    if (server->raw_tail)
+        server->raw_tail->next = raw;
+    else
+        server->raw_head = raw;
+    server->raw_tail = raw;
+    raw->queued_bytes = raw->buf_len - raw->buf_pos + raw->len + raw->pad;
+    stat_add(&server->queued, 1);
+    stat_add(&server->queued_bytes, raw->queued_bytes);
+    note_depth(server);
+}
+
+/*
+ * Queue an encoded raw reply for the next flush. A reply with data from
+ * fd is written right away instead, after the ones queued before it,
+ * since fd is only borrowed. Returns -1 without sending anything if fd
+ * can't be kept until later.
+ */
+static int send_raw_reply(struct server *server, struct raw_reply *raw, int fd)
+{
+    int r = 0;
+
+    if (fd < 0 || raw->len == 0)
+    {
+        queue_raw_reply(server, raw);
+        schedule_flush(server);
+        return 0;
+    }
+
+    // Usually the whole reply goes out right away
+    if (server->raw_head)
+        r = flush_raw_replies(server);
+    raw->fd = fd;
+    if (r == 0 && server->raw_head == NULL && !(rpc_which_events(server->rpc) & POLLOUT))
+        r = write_raw_reply(server, raw);
+    raw->fd = -1;
+    if (r != 0)
+    {
+        // On errors the connection is closed by the next rpc_service()
+        free_raw_reply(raw);
+        return 0;
+    }
+
+    // The rest is sent later, keep our own reference to the file
+    if ((raw->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0)
+    {
+        if (raw->buf_pos == 0)
+        {
+            free_raw_reply(raw);
+            return -1;
+        }
+        // Can't finish the record, let the client reconnect and retry
+        shutdown(server->fd, SHUT_RDWR);
+        free_raw_reply(raw);
+        return 0;
+    }
+    queue_raw_reply(server, raw);
+    return 0;
+}
+
+// Send a reply with data from fd or chunks, see rpc_send_reply_fd() and rpc_send_reply_chunks()
+static int send_data_reply(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, int fd, uint64_t offset,
+    struct iovec *chunks, int num_chunks, void (*release)(char *buf), uint32_t len)
+{
+    struct server *server = current_server;
+    struct proc_stats *stats;
+    struct raw_reply *raw;
+    struct iovec *copy = NULL;
+    uint64_t start;
+    size_t cap;
+    int r;
+
+    if (server == NULL || server->rpc != rpc)
+        return -1;
+    if (num_chunks > 0 && (copy = (struct iovec *)buf_get(num_chunks * sizeof(struct iovec), &cap)) == NULL)
+        return -1;
+    raw = alloc_raw_reply();
+    if (raw == NULL)
+    {
+        buf_put((char *)copy);
+        return -1;
+    }
+    raw->offset = offset;
+    raw->len = len;
+    raw->pad = (4 - len % 4) % 4;
+    if (encode_call_reply(call, reply, encode_fn, raw->len + raw->pad, 0, raw, &stats) < 0)
+    {
+        buf_put((char *)copy);
+        free_raw_reply(raw);
+        return -1;
+    }
+    if (num_chunks > 1)
+    {
+        // The first fragment ends with the first chunk, see write_raw_reply()
+        uint32_t *header = (uint32_t *)raw->buf;
+        header[0] = htonl(raw->buf_len - 4 + chunks[0].iov_len);
+    }
+    // From here on the reply owns the chunks
+    if (copy)
+    {
+        memcpy(copy, chunks, num_chunks * sizeof(struct iovec));
+        raw->chunks = copy;
+        raw->num_chunks = num_chunks;
+        raw->release = release;
+    }
+    start = stats_clock();
+    r = send_raw_reply(server, raw, fd);
+    if (stats)
+        hist_add(stats, PHASE_SEND, stats_clock() - start);
+    return r;
+}
+
+int rpc_send_reply_fd(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, int fd, uint64_t offset, uint32_t len)
+{
+    return send_data_reply(rpc, call, reply, encode_fn, fd, offset, NULL, 0, NULL, len);
+}
+
+int rpc_send_reply_chunks(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, struct iovec *chunks, int count,
+    void (*release)(char *buf))
+{
+    uint32_t len = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+        len += chunks[i].iov_len;
+    return send_data_reply(rpc, call, reply, encode_fn, -1, 0, chunks, count, release, len);
+}
+
+/*
+ * Queue an encoded reply of the current UDP batch, takes over buf.
+ * Its send time is charged to stats.
+ */
+static void udp_queue(struct udp_socket *udp, char *buf, size_t len, struct proc_stats *stats)
+{
+    int i = udp->count;
+    if (i >= UDP_BATCH)
+    {
+        buf_put(buf);
+        return;
+    }
+    if (len - 4 > UDP_MAX_REPLY)
+    {
+        // Only accepted replies get that long, keep their header
+        ((uint32_t *)buf)[6] = htonl(SYSTEM_ERR);
+        len = 7 * sizeof(uint32_t);
+    }
+    udp->replies[i] = buf;
+    udp->reply_stats[i] = stats;
+    udp->out_iov[i].iov_base = buf + 4;
+    udp->out_iov[i].iov_len = len - 4;
+    memset(&udp->out[i], 0, sizeof(udp->out[i]));
+    udp->out[i].msg_hdr.msg_name = &udp->addrs[udp->current];
+    udp->out[i].msg_hdr.msg_namelen = udp->in[udp->current].msg_hdr.msg_namelen;
+    udp->out[i].msg_hdr.msg_iov = &udp->out_iov[i];
+    udp->out[i].msg_hdr.msg_iovlen = 1;
+    udp->count++;
+}
+
+/*
+ * Send a reply encoded by encode_raw_reply() on the transport of the call,
+ * charging the time to stats.
+ */
+static int send_encoded_reply(struct rpc_context *rpc, struct raw_reply *raw, struct proc_stats *stats)
+{
+    struct udp_socket *udp = current_udp;
+    uint64_t start;
+    int r;
+
+    if (udp && udp->rpc == rpc)
+    {
+        udp_queue(udp, raw->buf, raw->buf_len, stats);
+        raw->buf = NULL;
+        free_raw_reply(raw);
+        return 0;
+    }
+    start = stats_clock();
+    r = send_raw_reply(current_server, raw, -1);
+    if (stats)
+        hist_add(stats, PHASE_SEND, stats_clock() - start);
+    return r;
+}
+
+/*
+ * Replies are encoded and written by us rather than libnfs, on TCP too,
+ * so that encoding and sending can be timed separately.
+ */
+int rpc_reply(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, int alloc_hint)
+{
+    struct udp_socket *udp = current_udp;
+    struct proc_stats *stats;
+    struct raw_reply *raw;
+
+    if ((udp == NULL || udp->rpc != rpc) && (current_server == NULL || current_server->rpc != rpc))
+        return rpc_send_reply(rpc, call, reply, encode_fn, alloc_hint);
+    raw = alloc_raw_reply();
+    if (raw == NULL)
+        return -1;
+    if (encode_call_reply(call, reply, encode_fn, 0, alloc_hint, raw, &stats) < 0)
+    {
+        free_raw_reply(raw);
+        return -1;
+    }
+    return send_encoded_reply(rpc, raw, stats);
+}
+
+// Reject a call as if its credentials were too weak
+static void reply_auth_error(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    struct raw_reply *raw = alloc_raw_reply();
+    uint32_t *reply;
+    size_t cap;
+    if (raw == NULL)
+        return;
+    if ((reply = (uint32_t *)buf_get(6 * sizeof(uint32_t), &cap)) == NULL)
+    {
+        free_raw_reply(raw);
+        return;
+    }
+    reply[0] = htonl(0x80000000 | 5 * sizeof(uint32_t));
+    reply[1] = htonl(call->xid);
+    reply[2] = htonl(REPLY);
+    reply[3] = htonl(MSG_DENIED);
+    reply[4] = htonl(1); // AUTH_ERROR
+    reply[5] = htonl(5); // AUTH_TOOWEAK
+    raw->buf = (char *)reply;
+    raw->buf_len = 6 * sizeof(uint32_t);
+    send_encoded_reply(rpc, raw, NULL);
+}
+
+// Client address in the form used as key, IPv4 addresses are mapped to IPv6
+static void sockaddr_to_key(struct sockaddr_storage *ss, uint8_t *addr, uint16_t *port)
+{
+    memset(addr, 0, 16);
+    *port = 0;
+    if (ss->ss_family == AF_INET6)
+    {
+        memcpy(addr, &((struct sockaddr_in6 *)ss)->sin6_addr, 16);
+        *port = ntohs(((struct sockaddr_in6 *)ss)->sin6_port);
+    }
+    else if (ss->ss_family == AF_INET)
+    {
+        addr[10] = addr[11] = 0xff;
+        memcpy(addr + 12, &((struct sockaddr_in *)ss)->sin_addr, 4);
+        *port = ntohs(((struct sockaddr_in *)ss)->sin_port);
+    }
+}
+
+void rpc_client_addr(struct rpc_context *rpc, uint8_t *addr)
+{
+    struct udp_socket *udp = current_udp;
+    uint16_t port;
+    if (udp && udp->rpc == rpc)
+        sockaddr_to_key(&udp->addrs[udp->current], addr, &port);
+    else if (current_server && current_server->rpc == rpc)
+        memcpy(addr, current_server->addr, 16);
+    else
+        memset(addr, 0, 16);
+}
+
+// UDP clients are looked up call by call, only for the exports they use
+const struct export_rule *rpc_client_rule(struct rpc_context *rpc, int export)
+{
+    struct udp_socket *udp = current_udp;
+    uint8_t addr[16];
+    uint16_t port;
+    if (udp && udp->rpc == rpc)
+    {
+        sockaddr_to_key(&udp->addrs[udp->current], addr, &port);
+        return export_client_rule(exports_by_index[export], addr);
+    }
+    if (current_server && current_server->rpc == rpc)
+        return current_server->rules[export];
+    return NULL;
+}
+
+// Whether the client of the call is admitted to some export
+static int client_admitted(struct rpc_context *rpc)
+{
+    struct udp_socket *udp = current_udp;
+    if (udp && udp->rpc == rpc)
+        return udp->rule != NULL;
+    return current_server && current_server->rpc == rpc && current_server->rule != NULL;
+}
+
+uint32_t rpc_max_transfer(struct rpc_context *rpc)
+{
+    struct udp_socket *udp = current_udp;
+    return udp && udp->rpc == rpc ? UDP_MAX_TRANSFER : MAX_TRANSFER;
+}
+
+/*
+ * Duplicate request cache
+ */
+
+// Returns 0 if the call didn't come from one of our connections or sockets
+static int drc_key(struct rpc_context *rpc, struct rpc_msg *call, struct drc_entry *key)
+{
+    struct server *server = current_server;
+    struct udp_socket *udp = current_udp;
+    uint64_t a, b;
+    if (udp && udp->rpc == rpc)
+        sockaddr_to_key(&udp->addrs[udp->current], key->addr, &key->port);
+    else if (server && server->rpc == rpc)
+    {
+        memcpy(key->addr, server->addr, sizeof(key->addr));
+        key->port = server->port;
+    }
+    else
+        return 0;
+    key->xid = call->xid;
+    key->prog = call->body.cbody.prog;
+    key->vers = call->body.cbody.vers;
+    key->proc = call->body.cbody.proc;
+    memcpy(&a, key->addr, 8);
+    memcpy(&b, key->addr + 8, 8);
+    key->hash = ((a * 0x9e3779b97f4a7c15ull) ^ b ^ ((uint64_t)key->prog << 32 | key->vers << 8 | key->proc)) * 0xff51afd7ed558ccdull;
+    key->hash ^= (key->xid ^ (uint64_t)key->port << 32) * 0xc4ceb9fe1a85ec53ull;
+    return 1;
+}
+
+static struct drc_part *drc_part_of(struct drc_entry *key)
+{
+    return &drc_parts[(key->hash >> 32) % DRC_PARTS];
+}
+
+// Must be called with the partition locked, returns the link to the entry
+static struct drc_entry **drc_find(struct drc_part *part, struct drc_entry *key)
+{
+    struct drc_entry **link = &part->hash[key->hash % DRC_BUCKETS];
+    for (; *link; link = &(*link)->hash_next)
+    {
+        struct drc_entry *entry = *link;
+        if (entry->hash == key->hash && entry->xid == key->xid && entry->proc == key->proc &&
+            entry->port == key->port && entry->prog == key->prog && entry->vers == key->vers &&
+            !memcmp(entry->addr, key->addr, sizeof(key->addr)))
+            break;
+    }
+    return link;
+}
+
+static void drc_lru_unlink(struct drc_entry *entry)
+{
+    entry->lru_prev->lru_next = entry->lru_next;
+    entry->lru_next->lru_prev = entry->lru_prev;
+}
+
+static void drc_lru_push(struct drc_part *part, struct drc_entry *entry)
+{
+    entry->lru_next = part->lru.lru_next;
+    entry->lru_prev = &part->lru;
+    part->lru.lru_next->lru_prev = entry;
+    part->lru.lru_next = entry;
+}
+
+// Must be called with the partition locked
+static void drc_remove(struct drc_part *part, struct drc_entry **link)
+{
+    struct drc_entry *entry = *link;
+    *link = entry->hash_next;
+    drc_lru_unlink(entry);
+    part->count--;
+    free(entry->reply);
+    free(entry);
+}
+
+int rpc_drc_begin(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    struct drc_entry key, *entry;
+    struct raw_reply *raw = NULL;
+    struct drc_part *part;
+
+    if (!drc_key(rpc, call, &key))
+        return 0;
+    part = drc_part_of(&key);
+    pthread_mutex_lock(&part->lock);
+    entry = *drc_find(part, &key);
+    if (entry)
+    {
+        if (entry->reply && (raw = alloc_raw_reply()) != NULL)
+        {
+            size_t cap;
+            raw->buf = buf_get(entry->reply_len, &cap);
+            raw->buf_len = entry->reply_len;
+            if (raw->buf)
+                memcpy(raw->buf, entry->reply, entry->reply_len);
+            drc_lru_unlink(entry);
+            drc_lru_push(part, entry);
+        }
+        pthread_mutex_unlock(&part->lock);
+        __atomic_add_fetch(raw ? &drc_hits : &drc_in_progress, 1, __ATOMIC_RELAXED);
+        if (raw && raw->buf)
+            send_encoded_reply(rpc, raw, NULL);
+        else if (raw)
+            free_raw_reply(raw);
+        return 1;
+    }
+
+    // Remember the call as in progress
+    entry = malloc(sizeof(struct drc_entry));
+    if (entry)
+    {
+        *entry = key;
+        entry->reply = NULL;
+        entry->reply_len = 0;
+        entry->hash_next = part->hash[key.hash % DRC_BUCKETS];
+        part->hash[key.hash % DRC_BUCKETS] = entry;
+        drc_lru_push(part, entry);
+        part->count++;
+    }
+    while (part->count > DRC_PART_ENTRIES)
+    {
+        drc_remove(part, drc_find(part, part->lru.lru_prev));
+        __atomic_add_fetch(&drc_evictions, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&part->lock);
+    return 0;
+}
+
+int rpc_send_reply_drc(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, int alloc_hint)
+{
+    struct drc_entry key, **link;
+    struct proc_stats *stats;
+    struct raw_reply *raw;
+    struct drc_part *part;
+    char *copy = NULL;
+
+    if (!drc_key(rpc, call, &key))
+        return rpc ? rpc_reply(rpc, call, reply, encode_fn, alloc_hint) : -1;
+    raw = alloc_raw_reply();
+    if (raw == NULL)
+        return -1;
+    if (encode_call_reply(call, reply, encode_fn, 0, alloc_hint, raw, &stats) == 0 && (copy = malloc(raw->buf_len)) != NULL)
+        memcpy(copy, raw->buf, raw->buf_len);
+
+    // Keep the reply, or forget the call if we can't
+    part = drc_part_of(&key);
+    pthread_mutex_lock(&part->lock);
+    link = drc_find(part, &key);
+    if (*link && copy)
+    {
+        (*link)->reply = copy;
+        (*link)->reply_len = raw->buf_len;
+        copy = NULL;
+    }
+    else if (*link)
+        drc_remove(part, link);
+    pthread_mutex_unlock(&part->lock);
+    free(copy);
+
+    // The client has gone, see send_deferred()
+    if (rpc == NULL)
+    {
+        free_raw_reply(raw);
+        return 0;
+    }
+    if (raw->buf == NULL)
+    {
+        free_raw_reply(raw);
+        return rpc_reply(rpc, call, reply, encode_fn, alloc_hint);
+    }
+    return send_encoded_reply(rpc, raw, stats);
+}
+
+/*
+ * Take over the reply to the call currently being processed.
+ * The call is copied without its arguments, which libnfs frees as soon as
+ * the service proc returns. Only calls received on a TCP connection can
+ * be deferred, returns NULL for the others.
+ */
+struct deferred_reply *rpc_defer_reply(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    struct deferred_reply *deferred;
+
+    if (current_server == NULL || current_server->rpc != rpc)
+        return NULL;
+    deferred = slab_alloc(&current_worker->deferred_slab);
+    if (deferred == NULL)
+        return NULL;
+    memset(deferred, 0, sizeof(*deferred));
+    deferred->server = current_server;
+    deferred->server->refs++;
+    stat_add(&current_server->deferred, 1);
+    note_depth(current_server);
+    deferred->call = *call;
+    deferred->call.body.cbody.args = NULL;
+    deferred->call.body.cbody.cred.oa_base = NULL;
+    deferred->call.body.cbody.cred.oa_length = 0;
+    deferred->call.body.cbody.verf.oa_base = NULL;
+    deferred->call.body.cbody.verf.oa_length = 0;
+    return deferred;
+}
+
+void *rpc_defer_state(struct deferred_reply *deferred)
+{
+    return deferred->state;
+}
+
+// Allocations are chained through a pointer in front of them
+void *rpc_defer_alloc(struct deferred_reply *deferred, size_t size)
+{
+    size_t cap;
+    void **buf = (void **)buf_get(sizeof(void *) + size, &cap);
+    if (buf == NULL)
+        return NULL;
+    buf[0] = deferred->allocs;
+    deferred->allocs = buf;
+    return buf + 1;
+}
+
+void rpc_defer_hold_data(struct deferred_reply *deferred, size_t len)
 {
-    free(item->netid);
-    free(item->addr);
-    free(item->owner);
-    free(item);
+    deferred->held_data += len;
+    deferred->server->held_data += len;
 }
 
-static void free_server(struct server *server)
+/*
+ * Send a deferred reply on the thread that owns its connection.
+ * If the client has disconnected meanwhile the callback still runs,
+ * with rpc == NULL, so that it can release its private data.
+ */
+static void send_deferred(struct deferred_reply *deferred)
 {
+    struct server *server = deferred->server;
+    current_server = server;
+    deferred->send(server->rpc, &deferred->call, deferred->private_data);
+    current_server = NULL;
+    while (deferred->allocs)
+    {
+        void **buf = deferred->allocs;
+        deferred->allocs = buf[0];
+        buf_put((char *)buf);
+    }
+    server->held_data -= deferred->held_data;
+    stat_sub(&server->deferred, 1);
     if (server->rpc)
+        update_events(server);
+    put_server(server);
+    slab_free(&current_worker->deferred_slab, deferred);
+}
+
+/*
+ * Complete a deferred reply. May be called from any thread: completions
+ * from other threads are queued on the owning worker and its event loop is
+ * woken through an eventfd.
+ */
+void rpc_complete_deferred(struct deferred_reply *deferred, deferred_send_fn send, void *private_data)
+{
+    struct worker *worker = deferred->server->worker;
+    int was_empty;
+
+    deferred->send = send;
+    deferred->private_data = private_data;
+    if (current_worker == worker)
     {
-        rpc_disconnect(server->rpc, NULL);
-        rpc_destroy_context(server->rpc);
+        send_deferred(deferred);
+        return;
     }
-    if (server->read_event)
+
+    pthread_mutex_lock(&worker->completed_lock);
+    was_empty = worker->completed == NULL;
+    deferred->next = worker->completed;
+    worker->completed = deferred;
+    pthread_mutex_unlock(&worker->completed_lock);
+    if (was_empty)
+        eventfd_write(worker->wakeup_fd, 1);
+}
+
+// Flush deferred replies queued by other threads
+static void worker_wakeup(evutil_socket_t fd, short events, void *private_data)
+{
+    struct worker *worker = private_data;
+    struct deferred_reply *list, *deferred, *fifo = NULL;
+    eventfd_t value;
+
+    eventfd_read(fd, &value);
+    pthread_mutex_lock(&worker->completed_lock);
+    list = worker->completed;
+    worker->completed = NULL;
+    pthread_mutex_unlock(&worker->completed_lock);
+
+    // The queue is a LIFO stack, reply in completion order
+    while (list)
     {
-        event_free(server->read_event);
+        deferred = list;
+        list = list->next;
+        deferred->next = fifo;
+        fifo = deferred;
     }
-    if (server->write_event)
+    while (fifo)
     {
-        event_free(server->write_event);
+        deferred = fifo;
+        fifo = fifo->next;
+        send_deferred(deferred);
     }
-    free(server);
 }
 
-/*
- * Based on the state of libnfs and its context, update libevent
- * accordingly regarding which events we are interested in.
- */
-static void update_events(struct rpc_context *rpc, struct event *read_event, struct event *write_event)
+// The interned netid, or NULL if nothing has ever been registered with it
+static const char *netid_find(const char *name)
 {
-    int events = rpc_which_events(rpc);
-    if (read_event)
-    {
-        if (events & POLLIN)
-            event_add(read_event, NULL);
-        else
-            event_del(read_event);
-    }
-    if (write_event)
+    int i;
+    for (i = 0; i < num_netids; i++)
     {
-        if (events & POLLOUT)
-            event_add(write_event, NULL);
-        else
-            event_del(write_event);
+        if (!strcmp(netids[i], name))
+            return netids[i];
     }
+    return NULL;
+}
+
+// The caller must hold map_lock for writing
+static const char *netid_intern(const char *name)
+{
+    const char *netid = netid_find(name);
+    if (netid == NULL && num_netids < MAX_NETIDS)
+        netid = netids[num_netids++] = strdup(name);
+    return netid;
+}
+
+static struct mapping **map_bucket(u_int prog, u_int vers, const char *netid)
+{
+    uint64_t hash = (((uint64_t)prog << 32 | vers) ^ (uintptr_t)netid) * 0x9e3779b97f4a7c15ull;
+    return &map[(hash >> 32) % MAP_BUCKETS];
+}
+
+// Drop the encoded DUMP replies, the caller must hold map_lock for writing
+static void map_changed(void)
+{
+    free(pmap2_dump_reply.data);
+    pmap2_dump_reply.data = NULL;
+    free(pmap3_dump_reply.data);
+    pmap3_dump_reply.data = NULL;
 }
 
 /*
- * Add a registration for program,version,netid.
+ * Add a registration for program,version,netid. Takes over addr and owner.
+ * The caller must hold map_lock for writing once the workers are running.
  */
-int pmap_register(int prog, int vers, char *netid, char *addr, char *owner)
+int pmap_register(int prog, int vers, const char *netid, char *addr, char *owner)
 {
-    struct mapping *item;
+    struct mapping *item, **bucket;
     char *str;
     int count = 0;
 
     item = malloc(sizeof(struct mapping));
     item->prog  = prog;
     item->vers  = vers;
-    item->netid = netid;
+    item->port  = 0;
+    item->netid = netid_intern(netid);
     item->addr  = addr;
     item->owner = owner;
+    if (item->netid == NULL)
+    {
+        free_map_item(item);
+        return -1;
+    }
 
     /* The port are the last two dotted decimal fields in the address */
     for (str = item->addr + strlen(item->addr) - 1; str >= item->addr; str--)
@@ -124,54 +1666,102 @@ int pmap_register(int prog, int vers, char *netid, char *addr, char *owner)
         }
     }
 
-    item->next = map;
-    map = item;
+    bucket = map_bucket(prog, vers, item->netid);
+    item->next = *bucket;
+    *bucket = item;
+    map_changed();
+    return 0;
 }
 
 /*
  * Find and return a registration matching program,version,netid.
+ * The caller must hold map_lock.
  */
-struct mapping *map_lookup(int prog, int vers, char *netid)
+struct mapping *map_lookup(int prog, int vers, const char *netid)
 {
     struct mapping *tmp;
-    for (tmp = map; tmp; tmp = tmp->next)
+    if ((netid = netid_find(netid)) == NULL)
+        return NULL;
+    for (tmp = *map_bucket(prog, vers, netid); tmp; tmp = tmp->next)
     {
-        if (tmp->prog != prog)
-            continue;
-        if (tmp->vers != vers)
-            continue;
-        if (strcmp(tmp->netid, netid))
-            continue;
-        return tmp;
+        if (tmp->prog == prog && tmp->vers == vers && tmp->netid == netid)
+            return tmp;
     }
     return NULL;
 }
 
 /*
  * Remove a registration from our map or registrations.
+ * Returns 1 if there was one. The caller must hold map_lock for writing.
  */
-void map_remove(int prog, int vers, char *netid)
+int map_remove(int prog, int vers, const char *netid)
 {
-    struct mapping *prev = NULL;
-    struct mapping *tmp;
-    for (tmp = map; tmp; prev = tmp, tmp = tmp->next)
+    struct mapping **link, *tmp;
+    if ((netid = netid_find(netid)) == NULL)
+        return 0;
+    for (link = map_bucket(prog, vers, netid); (tmp = *link) != NULL; link = &tmp->next)
     {
-        if (tmp->prog != prog)
-            continue;
-        if (tmp->vers != vers)
-            continue;
-        if (strcmp(tmp->netid, netid))
-            continue;
-        break;
+        if (tmp->prog == prog && tmp->vers == vers && tmp->netid == netid)
+        {
+            *link = tmp->next;
+            free_map_item(tmp);
+            map_changed();
+            return 1;
+        }
     }
-    if (tmp == NULL)
-        return;
-    if (prev)
-        prev->next = tmp->next;
-    else
-        map = tmp->next;
-    free_map_item(tmp);
-    return;
+    return 0;
+}
+
+static bool_t zdr_encoded_reply(ZDR *zdrs, struct encoded_reply *reply)
+{
+    return zdr_opaque(zdrs, reply->data, reply->len);
+}
+
+// Encode a reply body once so that it can be sent many times
+static int encode_reply_body(zdrproc_t encode_fn, void *body, struct encoded_reply *reply)
+{
+    uint32_t size = 4096;
+    for (;;)
+    {
+        char *buf = malloc(size);
+        ZDR zdr;
+        if (buf == NULL)
+            return -1;
+        zdrmem_create(&zdr, buf, size, ZDR_ENCODE);
+        if (encode_fn(&zdr, body))
+        {
+            reply->data = buf;
+            reply->len = zdr_getpos(&zdr);
+            zdr_destroy(&zdr);
+            return 0;
+        }
+        zdr_destroy(&zdr);
+        free(buf);
+        if (size >= 16*1024*1024)
+            return -1;
+        size *= 2;
+    }
+}
+
+/*
+ * Send an encoded DUMP reply, encoding it with build() first if the
+ * registry has changed since it was last sent.
+ */
+static void send_dump_reply(struct rpc_context *rpc, struct rpc_msg *call, struct encoded_reply *reply, int (*build)(struct encoded_reply *))
+{
+    pthread_rwlock_rdlock(&map_lock);
+    if (reply->data == NULL)
+    {
+        pthread_rwlock_unlock(&map_lock);
+        pthread_rwlock_wrlock(&map_lock);
+        if (reply->data == NULL && build(reply) < 0)
+        {
+            pthread_rwlock_unlock(&map_lock);
+            return;
+        }
+    }
+    rpc_reply(rpc, call, reply, (zdrproc_t)zdr_encoded_reply, reply->len);
+    pthread_rwlock_unlock(&map_lock);
 }
 
 /*
@@ -182,7 +1772,7 @@ void map_remove(int prog, int vers, char *netid)
  */
 static int pmap2_null_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
-    rpc_send_reply(rpc, call, NULL, (zdrproc_t)zdr_void, 0);
+    rpc_reply(rpc, call, NULL, (zdrproc_t)zdr_void, 0);
     return 0;
 }
 
@@ -203,10 +1793,12 @@ static int pmap2_getport_proc(struct rpc_context *rpc, struct rpc_msg *call)
         netid = "tcp";
     else
         netid = "udp";
+    pthread_rwlock_rdlock(&map_lock);
     tmp = map_lookup(args->prog, args->vers, netid);
     if (tmp)
         port = tmp->port;
-    rpc_send_reply(rpc, call, &port, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
+    pthread_rwlock_unlock(&map_lock);
+    rpc_reply(rpc, call, &port, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
     return 0;
 }
 
@@ -215,36 +1807,40 @@ static int pmap2_getport_proc(struct rpc_context *rpc, struct rpc_msg *call)
  * This RPC returns a list of all endpoints that are registered with
  * portmapper.
  */
-static int pmap2_dump_proc(struct rpc_context *rpc, struct rpc_msg *call)
+static int pmap2_build_dump(struct encoded_reply *encoded)
 {
     PMAP2DUMPres reply;
     struct mapping *tmp;
+    int i, ret;
 
     reply.list = NULL;
-    for (tmp = map; tmp; tmp = tmp->next)
+    for (i = 0; i < MAP_BUCKETS; i++)
     {
-        struct pmap2_mapping_list *tmp_list;
-        int proto;
+        for (tmp = map[i]; tmp; tmp = tmp->next)
+        {
+            struct pmap2_mapping_list *tmp_list;
+            int proto;
 
-        /* pmap2 only support ipv4 */
-        if (!strcmp(tmp->netid, "tcp"))
-            proto = IPPROTO_TCP;
-        else if (!strcmp(tmp->netid, "udp"))
-            proto = IPPROTO_UDP;
-        else
-            continue;
+            /* pmap2 only support ipv4 */
+            if (!strcmp(tmp->netid, "tcp"))
+                proto = IPPROTO_TCP;
+            else if (!strcmp(tmp->netid, "udp"))
+                proto = IPPROTO_UDP;
+            else
+                continue;
 
-        tmp_list = malloc(sizeof(struct pmap2_mapping_list));
-        tmp_list->map.prog  = tmp->prog;
-        tmp_list->map.vers  = tmp->vers;
-        tmp_list->map.prot  = proto;
-        tmp_list->map.port  = tmp->port;
+            tmp_list = malloc(sizeof(struct pmap2_mapping_list));
+            tmp_list->map.prog  = tmp->prog;
+            tmp_list->map.vers  = tmp->vers;
+            tmp_list->map.prot  = proto;
+            tmp_list->map.port  = tmp->port;
 
-        tmp_list->next = reply.list;
-        reply.list = tmp_list;
+            tmp_list->next = reply.list;
+            reply.list = tmp_list;
+        }
     }
 
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_PMAP2DUMPres, sizeof(PMAP2DUMPres));
+    ret = encode_reply_body((zdrproc_t)zdr_PMAP2DUMPres, &reply, encoded);
 
     while (reply.list)
     {
@@ -253,9 +1849,29 @@ static int pmap2_dump_proc(struct rpc_context *rpc, struct rpc_msg *call)
         reply.list = tmp_list;
     }
 
+    return ret;
+}
+
+static int pmap2_dump_proc(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    send_dump_reply(rpc, call, &pmap2_dump_reply, pmap2_build_dump);
     return 0;
 }
 
+/*
+ * Like rpcbind, registrations are only changed by local callers. UDP
+ * source addresses are easily forged, but not as loopback ones from the
+ * outside.
+ */
+static int pmap_local_caller(struct rpc_context *rpc)
+{
+    uint8_t addr[16];
+
+    rpc_client_addr(rpc, addr);
+    return IN6_IS_ADDR_LOOPBACK((struct in6_addr *)addr) ||
+        (IN6_IS_ADDR_V4MAPPED((struct in6_addr *)addr) && addr[12] == 127);
+}
+
 /*
  * v2 SET
  * This procedure is used to register and endpoint with portmapper.
@@ -267,23 +1883,33 @@ static int pmap2_set_proc(struct rpc_context *rpc, struct rpc_msg *call)
     char *addr;
     uint32_t response = 1;
 
+    if (!pmap_local_caller(rpc))
+    {
+        response = 0;
+        rpc_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
+        return 0;
+    }
     if (args->prot == IPPROTO_TCP)
         prot = "tcp";
     else
         prot = "udp";
 
     /* Don't update if we already have a mapping */
+    pthread_rwlock_wrlock(&map_lock);
     if (map_lookup(args->prog, args->vers, prot))
     {
+        pthread_rwlock_unlock(&map_lock);
         response = 0;
-        rpc_send_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
+        rpc_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
         return 0;
     }
 
     asprintf(&addr, "0.0.0.0.%d.%d", args->port >> 8, args->port & 0xff);
-    pmap_register(args->prog, args->vers, strdup(prot), addr, strdup("<unknown>"));
+    if (pmap_register(args->prog, args->vers, prot, addr, strdup("<unknown>")) < 0)
+        response = 0;
+    pthread_rwlock_unlock(&map_lock);
 
-    rpc_send_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
+    rpc_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
     return 0;
 }
 
@@ -298,12 +1924,20 @@ static int pmap2_unset_proc(struct rpc_context *rpc, struct rpc_msg *call)
     char *prot;
     char *addr;
     uint32_t response = 1;
+    if (!pmap_local_caller(rpc))
+    {
+        response = 0;
+        rpc_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
+        return 0;
+    }
     if (args->prot == IPPROTO_TCP)
         prot = "tcp";
     else
         prot = "udp";
+    pthread_rwlock_wrlock(&map_lock);
     map_remove(args->prog, args->vers, prot);
-    rpc_send_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
+    pthread_rwlock_unlock(&map_lock);
+    rpc_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
     return 0;
 }
 
@@ -332,79 +1966,528 @@ struct service_proc pmap2_pt[] = {
     //{PMAP2_CALLIT, pmap2_...},
 };
 
-/*
- * The NULL procedure. All protocols/versions must provide a NULL procedure
- * as index 0.
- * It is used by clients, and rpcinfo, to "ping" a service and verify that
- * the service is available and that it does support the indicated version.
- */
-static int pmap3_null_proc(struct rpc_context *rpc, struct rpc_msg *call)
+/*
+ * The NULL procedure. All protocols/versions must provide a NULL procedure
+ * as index 0.
+ * It is used by clients, and rpcinfo, to "ping" a service and verify that
+ * the service is available and that it does support the indicated version.
+ */
+static int pmap3_null_proc(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    rpc_reply(rpc, call, NULL, (zdrproc_t)zdr_void, 0);
+    return 0;
+}
+
+/*
+ * v3 SET
+ * Registers an endpoint, fails if program,version,netid is already
+ * registered.
+ */
+static int pmap3_set_proc(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    PMAP3SETargs *args = call->body.cbody.args;
+    uint32_t response = 0;
+
+    if (!pmap_local_caller(rpc))
+    {
+        rpc_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
+        return 0;
+    }
+    pthread_rwlock_wrlock(&map_lock);
+    if (!map_lookup(args->prog, args->vers, args->netid))
+        response = pmap_register(args->prog, args->vers, args->netid, strdup(args->addr), strdup(args->owner)) == 0;
+    pthread_rwlock_unlock(&map_lock);
+
+    rpc_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
+    return 0;
+}
+
+/*
+ * v3 UNSET
+ * Removes the registration for program,version,netid, or for all netids
+ * if netid is empty.
+ */
+static int pmap3_unset_proc(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    PMAP3UNSETargs *args = call->body.cbody.args;
+    uint32_t response = 0;
+    int i;
+
+    if (!pmap_local_caller(rpc))
+    {
+        rpc_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
+        return 0;
+    }
+    pthread_rwlock_wrlock(&map_lock);
+    if (args->netid[0])
+        response = map_remove(args->prog, args->vers, args->netid);
+    else
+    {
+        for (i = 0; i < num_netids; i++)
+            response |= map_remove(args->prog, args->vers, netids[i]);
+    }
+    pthread_rwlock_unlock(&map_lock);
+
+    rpc_reply(rpc, call, &response, (zdrproc_t)zdr_uint32_t, sizeof(uint32_t));
+    return 0;
+}
+
+/*
+ * v3 GETADDR
+ * Returns the universal address of program,version,netid, or an empty
+ * string if it isn't registered. An empty netid means the transport the
+ * call came in on.
+ */
+static int pmap3_getaddr_proc(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    PMAP3GETADDRargs *args = call->body.cbody.args;
+    PMAP3GETADDRres reply;
+    const char *netid = args->netid;
+    struct mapping *tmp;
+
+    if (!netid[0])
+        netid = current_udp && current_udp->rpc == rpc ? "udp" : "tcp";
+    reply.addr = "";
+    pthread_rwlock_rdlock(&map_lock);
+    tmp = map_lookup(args->prog, args->vers, netid);
+    if (tmp)
+        reply.addr = tmp->addr;
+    // addr is borrowed from the registry, keep it locked until encoded
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_PMAP3GETADDRres, sizeof(PMAP3GETADDRres));
+    pthread_rwlock_unlock(&map_lock);
+    return 0;
+}
+
+/*
+ * v3 DUMP.
+ * This RPC returns a list of all endpoints that are registered with
+ * portmapper.
+ */
+static int pmap3_build_dump(struct encoded_reply *encoded)
+{
+    PMAP3DUMPres reply;
+    struct mapping *tmp;
+    int i, ret;
+
+    reply.list = NULL;
+    for (i = 0; i < MAP_BUCKETS; i++)
+    {
+        for (tmp = map[i]; tmp; tmp = tmp->next)
+        {
+            struct pmap3_mapping_list *tmp_list;
+
+            tmp_list = malloc(sizeof(struct pmap3_mapping_list));
+            tmp_list->map.prog  = tmp->prog;
+            tmp_list->map.vers  = tmp->vers;
+            tmp_list->map.netid = (char *)tmp->netid;
+            tmp_list->map.addr  = tmp->addr;
+            tmp_list->map.owner = tmp->owner;
+
+            tmp_list->next = reply.list;
+            reply.list = tmp_list;
+        }
+    }
+
+    ret = encode_reply_body((zdrproc_t)zdr_PMAP3DUMPres, &reply, encoded);
+
+    while (reply.list)
+    {
+        struct pmap3_mapping_list *tmp_list = reply.list->next;
+        free(reply.list);
+        reply.list = tmp_list;
+    }
+
+    return ret;
+}
+
+static int pmap3_dump_proc(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    send_dump_reply(rpc, call, &pmap3_dump_reply, pmap3_build_dump);
+    return 0;
+}
+
+/*
+ * Service table for portmapper v3.
+ *
+ * Service management is table driven in libnfs and this is the table
+ * that defines which procedures we implement for portmapper v3.
+ * If clients try to connect to the not-yet-implemented procedures here
+ * libnfs will automatically respond with an RPC layer error that flags
+ * PROCEDURE UNAVAILABLE.
+ *
+ * This table contains the procedure number, the callback function to implement
+ * this procedure, the unmarshalling function that libnfs should use to unppack
+ * the client payload as well as its size.
+ */
+struct service_proc pmap3_pt[] = {
+    {PMAP3_NULL, pmap3_null_proc, (zdrproc_t)zdr_void, 0},
+    {PMAP3_SET, pmap3_set_proc, (zdrproc_t)zdr_PMAP3SETargs, sizeof(PMAP3SETargs)},
+    {PMAP3_UNSET, pmap3_unset_proc, (zdrproc_t)zdr_PMAP3UNSETargs, sizeof(PMAP3UNSETargs)},
+    {PMAP3_GETADDR, pmap3_getaddr_proc, (zdrproc_t)zdr_PMAP3GETADDRargs, sizeof(PMAP3GETADDRargs)},
+    {PMAP3_DUMP, pmap3_dump_proc, (zdrproc_t)zdr_void, 0},
+    //{PMAP3_CALLIT, pmap3_...},
+    //{PMAP3_GETTIME, pmap3_...},
+    //{PMAP3_UADDR2TADDR, pmap3_...},
+    //{PMAP3_TADDR2UADDR, pmap3_...},
+};
+
+/*
+ * Services we provide, registered with libnfs on every connection and
+ * dispatched by us for UDP.
+ */
+struct service
+{
+    int prog;
+    int vers;
+    struct service_proc *procs;
+    int num_procs;
+    // For the statistics, proc names are indexed by proc number
+    const char *name;
+    const char **proc_names;
+    // Only for clients admitted by the export table
+    int exported;
+    // The procs as registered with libnfs, see timed_proc()
+    struct service_proc *timed_procs;
+};
+
+static const char *pmap2_names[] = {
+    "NULL", "SET", "UNSET", "GETPORT", "DUMP", "CALLIT", NULL
+};
+
+static const char *pmap3_names[] = {
+    "NULL", "SET", "UNSET", "GETADDR", "DUMP", "CALLIT", "GETTIME",
+    "UADDR2TADDR", "TADDR2UADDR", NULL
+};
+
+static const char *nfs3_names[] = {
+    "NULL", "GETATTR", "SETATTR", "LOOKUP", "ACCESS", "READLINK", "READ",
+    "WRITE", "CREATE", "MKDIR", "SYMLINK", "MKNOD", "REMOVE", "RMDIR",
+    "RENAME", "LINK", "READDIR", "READDIRPLUS", "FSSTAT", "FSINFO",
+    "PATHCONF", "COMMIT", NULL
+};
+
+static const char *mount3_names[] = {
+    "NULL", "MNT", "DUMP", "UMNT", "UMNTALL", "EXPORT", NULL
+};
+
+static const char *nfs4_names[] = {
+    "NULL", "COMPOUND", NULL
+};
+
+static struct service services[] = {
+    {PMAP_PROGRAM, PMAP_V2, pmap2_pt, sizeof(pmap2_pt) / sizeof(pmap2_pt[0]), "portmap2", pmap2_names, 0},
+    {PMAP_PROGRAM, PMAP_V3, pmap3_pt, sizeof(pmap3_pt) / sizeof(pmap3_pt[0]), "portmap3", pmap3_names, 0},
+    {NFS_PROGRAM, NFS_V3, nfs3_pt, sizeof(nfs3_pt) / sizeof(nfs3_pt[0]), "nfs3", nfs3_names, 1},
+    {MOUNT_PROGRAM, MOUNT_V3, nfs3_mount_pt, sizeof(nfs3_mount_pt) / sizeof(nfs3_mount_pt[0]), "mount3", mount3_names, 0},
+    {NFS4_PROGRAM, NFS_V4, nfs4_pt, sizeof(nfs4_pt) / sizeof(nfs4_pt[0]), "nfs4", nfs4_names, 1},
+};
+
+#define NUM_SERVICES (sizeof(services) / sizeof(services[0]))
+
+static int find_service(uint32_t prog, uint32_t vers)
+{
+    unsigned i;
+    for (i = 0; i < NUM_SERVICES; i++)
+    {
+        if ((uint32_t)services[i].prog == prog && (uint32_t)services[i].vers == vers)
+            return i;
+    }
+    return -1;
+}
+
+static struct service_proc *find_proc(struct service *service, uint32_t proc)
+{
+    int i;
+    // The tables are usually indexed by proc number
+    if (proc < (uint32_t)service->num_procs && service->procs[proc].proc == proc)
+        return &service->procs[proc];
+    for (i = 0; i < service->num_procs; i++)
+    {
+        if (service->procs[i].proc == proc)
+            return &service->procs[i];
+    }
+    return NULL;
+}
+
+static struct proc_stats *proc_stats_of(int service, uint32_t proc)
+{
+    if (current_worker == NULL || proc >= MAX_PROCS)
+        return NULL;
+    return &current_worker->stats[service * MAX_PROCS + proc];
+}
+
+static struct proc_stats *call_stats(struct rpc_msg *call)
+{
+    int service = find_service(call->body.cbody.prog, call->body.cbody.vers);
+    return service < 0 ? NULL : proc_stats_of(service, call->body.cbody.proc);
+}
+
+// Run a service proc, timing it from decode_start on
+static int run_proc(struct rpc_context *rpc, struct rpc_msg *call, int service, struct service_proc *proc)
+{
+    struct proc_stats *stats = proc_stats_of(service, call->body.cbody.proc);
+    uint64_t now = stats_clock();
+    int ret;
+
+    // MOUNT checks the export itself
+    if (services[service].exported && !client_admitted(rpc))
+    {
+        __atomic_add_fetch(&calls_denied, 1, __ATOMIC_RELAXED);
+        reply_auth_error(rpc, call);
+        decode_start = now;
+        return 0;
+    }
+    if (stats)
+    {
+        stat_add(&stats->calls, 1);
+        hist_add(stats, PHASE_DECODE, now - decode_start);
+    }
+    current_call.call = call;
+    current_call.stats = stats;
+    current_call.start = now;
+    current_call.replied = 0;
+    ret = proc->func(rpc, call);
+    now = stats_clock();
+    if (stats && !current_call.replied)
+        hist_add(stats, PHASE_HANDLER, now - current_call.start);
+    current_call.call = NULL;
+    // Decoding the next call of the batch starts now
+    decode_start = now;
+    return ret;
+}
+
+// Registered with libnfs for every proc, runs the real one
+static int timed_proc(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    int service = find_service(call->body.cbody.prog, call->body.cbody.vers);
+    struct service_proc *proc = service < 0 ? NULL : find_proc(&services[service], call->body.cbody.proc);
+    int ret = proc ? run_proc(rpc, call, service, proc) : 0;
+    arena_reset(&current_worker->arena);
+    if (current_server && current_server->rpc == rpc)
+    {
+        current_server->turn_calls++;
+        stat_add(&current_server->calls, 1);
+    }
+    return ret;
+}
+
+// Reply to a call we can't dispatch, rejected is set for an RPC version mismatch
+static void udp_reply_error(struct udp_socket *udp, uint32_t xid, int rejected, uint32_t stat, uint32_t low, uint32_t high)
+{
+    size_t cap;
+    uint32_t *reply = (uint32_t *)buf_get(10 * sizeof(uint32_t), &cap);
+    int n = 0;
+    if (reply == NULL)
+        return;
+    reply[n++] = 0;
+    reply[n++] = htonl(xid);
+    reply[n++] = htonl(REPLY);
+    if (rejected)
+    {
+        reply[n++] = htonl(MSG_DENIED);
+        reply[n++] = htonl(0); // RPC_MISMATCH
+    }
+    else
+    {
+        reply[n++] = htonl(MSG_ACCEPTED);
+        reply[n++] = htonl(AUTH_NONE);
+        reply[n++] = 0;
+        reply[n++] = htonl(stat);
+    }
+    if (rejected || stat == PROG_MISMATCH)
+    {
+        reply[n++] = htonl(low);
+        reply[n++] = htonl(high);
+    }
+    udp_queue(udp, (char *)reply, n * sizeof(uint32_t), NULL);
+}
+
+static int get_word(char *buf, size_t len, size_t *pos, uint32_t *value)
 {
-    rpc_send_reply(rpc, call, NULL, (zdrproc_t)zdr_void, 0);
+    if (*pos + 4 > len)
+        return -1;
+    memcpy(value, buf + *pos, 4);
+    *value = ntohl(*value);
+    *pos += 4;
     return 0;
 }
 
-/*
- * v3 DUMP.
- * This RPC returns a list of all endpoints that are registered with
- * portmapper.
- */
-static int pmap3_dump_proc(struct rpc_context *rpc, struct rpc_msg *call)
+static int get_auth(char *buf, size_t len, size_t *pos, struct opaque_auth *auth)
 {
-    PMAP3DUMPres reply;
-    struct mapping *tmp;
-    reply.list = NULL;
-    for (tmp = map; tmp; tmp = tmp->next)
-    {
-        struct pmap3_mapping_list *tmp_list;
+    uint32_t size;
+    if (get_word(buf, len, pos, &auth->oa_flavor) < 0 ||
+        get_word(buf, len, pos, &size) < 0 ||
+        size > 400 || *pos + ((size + 3) & ~3u) > len)
+        return -1;
+    auth->oa_base = size ? buf + *pos : NULL;
+    auth->oa_length = size;
+    *pos += (size + 3) & ~3u;
+    return 0;
+}
+
+// Decode and dispatch one call, malformed datagrams are ignored
+static void udp_dispatch(struct udp_socket *udp, char *buf, size_t len)
+{
+    struct service_proc *proc = NULL;
+    struct rpc_msg call;
+    uint32_t direction, low = ~0u, high = 0;
+    uint8_t addr[16];
+    uint16_t port;
+    size_t pos = 0;
+    unsigned i;
+    int found = 0, index = 0;
+    ZDR zdr;
 
-        tmp_list = malloc(sizeof(struct pmap3_mapping_list));
-        tmp_list->map.prog  = tmp->prog;
-        tmp_list->map.vers  = tmp->vers;
-        tmp_list->map.netid = tmp->netid;
-        tmp_list->map.addr  = tmp->addr;
-        tmp_list->map.owner = tmp->owner;
+    decode_start = stats_clock();
+    memset(&call, 0, sizeof(call));
+    call.direction = CALL;
+    if (get_word(buf, len, &pos, &call.xid) < 0 ||
+        get_word(buf, len, &pos, &direction) < 0 || direction != CALL ||
+        get_word(buf, len, &pos, &call.body.cbody.rpcvers) < 0)
+        return;
+    if (call.body.cbody.rpcvers != 2)
+    {
+        udp_reply_error(udp, call.xid, 1, 0, 2, 2);
+        return;
+    }
+    if (get_word(buf, len, &pos, &call.body.cbody.prog) < 0 ||
+        get_word(buf, len, &pos, &call.body.cbody.vers) < 0 ||
+        get_word(buf, len, &pos, &call.body.cbody.proc) < 0 ||
+        get_auth(buf, len, &pos, &call.body.cbody.cred) < 0 ||
+        get_auth(buf, len, &pos, &call.body.cbody.verf) < 0)
+        return;
 
-        tmp_list->next = reply.list;
-        reply.list = tmp_list;
+    for (i = 0; i < NUM_SERVICES && !proc; i++)
+    {
+        struct service *service = &services[i];
+        if (service->prog != (int)call.body.cbody.prog)
+            continue;
+        found = 1;
+        if ((uint32_t)service->vers < low)
+            low = service->vers;
+        if ((uint32_t)service->vers > high)
+            high = service->vers;
+        if (service->vers != (int)call.body.cbody.vers)
+            continue;
+        index = i;
+        proc = find_proc(service, call.body.cbody.proc);
+        if (!proc)
+        {
+            udp_reply_error(udp, call.xid, 0, PROC_UNAVAIL, 0, 0);
+            return;
+        }
     }
+    if (!proc)
+    {
+        udp_reply_error(udp, call.xid, 0, found ? PROG_MISMATCH : PROG_UNAVAIL, low, high);
+        return;
+    }
+
+    call.body.cbody.args = rpc_alloc(proc->decode_buf_size);
+    if (call.body.cbody.args == NULL)
+        return;
+    memset(call.body.cbody.args, 0, proc->decode_buf_size);
+    zdrmem_create(&zdr, buf + pos, len - pos, ZDR_DECODE);
+    sockaddr_to_key(&udp->addrs[udp->current], addr, &port);
+    udp->rule = export_match(addr);
+    if (proc->decode_fn(&zdr, call.body.cbody.args))
+        run_proc(udp->rpc, &call, index, proc);
+    else
+        udp_reply_error(udp, call.xid, 0, GARBAGE_ARGS, 0, 0);
+    zdr_free(proc->decode_fn, call.body.cbody.args);
+    zdr_destroy(&zdr);
+    arena_reset(&udp->worker->arena);
+}
 
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_PMAP3DUMPres, sizeof(PMAP3DUMPres));
+static void udp_flush(struct udp_socket *udp)
+{
+    uint64_t start, share = 0, bytes = 0;
+    int i, sent = 0;
 
-    while (reply.list)
+    // Replies the socket doesn't take are lost like any datagram
+    if (udp->count)
     {
-        struct pmap3_mapping_list *tmp_list = reply.list->next;
-        free(reply.list);
-        reply.list = tmp_list;
+        start = stats_clock();
+        sent = sendmmsg(udp->fd, udp->out, udp->count, MSG_DONTWAIT);
+        share = (stats_clock() - start) / udp->count;
     }
+    for (i = 0; i < udp->count; i++)
+    {
+        if (i < sent)
+            bytes += udp->out[i].msg_len;
+        if (udp->reply_stats[i])
+            hist_add(udp->reply_stats[i], PHASE_SEND, share);
+        buf_put(udp->replies[i]);
+    }
+    stat_add(&udp->bytes_out, bytes);
+    udp->count = 0;
+}
 
-    return 0;
+// Drain the socket, a few batches at a time
+static void udp_io(evutil_socket_t fd, short events, void *private_data)
+{
+    struct udp_socket *udp = private_data;
+    int batches, n, i;
+
+    for (batches = 0; batches < 8; batches++)
+    {
+        for (i = 0; i < UDP_BATCH; i++)
+        {
+            udp->in[i].msg_hdr.msg_namelen = sizeof(udp->addrs[i]);
+            udp->in[i].msg_hdr.msg_flags = 0;
+        }
+        n = recvmmsg(udp->fd, udp->in, UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0)
+            return;
+        current_udp = udp;
+        for (i = 0; i < n; i++)
+        {
+            stat_add(&udp->bytes_in, udp->in[i].msg_len);
+            udp->current = i;
+            udp_dispatch(udp, udp->in_iov[i].iov_base, udp->in[i].msg_len);
+        }
+        current_udp = NULL;
+        udp_flush(udp);
+        if (n < UDP_BATCH)
+            return;
+    }
 }
 
 /*
- * Service table for portmapper v3.
- *
- * Service management is table driven in libnfs and this is the table
- * that defines which procedures we implement for portmapper v3.
- * If clients try to connect to the not-yet-implemented procedures here
- * libnfs will automatically respond with an RPC layer error that flags
- * PROCEDURE UNAVAILABLE.
- *
- * This table contains the procedure number, the callback function to implement
- * this procedure, the unmarshalling function that libnfs should use to unppack
- * the client payload as well as its size.
+ * Stop reading from the connection until the other connections that are
+ * ready now had their turn: resume_event is run after their events.
  */
-struct service_proc pmap3_pt[] = {
-    {PMAP3_NULL, pmap3_null_proc, (zdrproc_t)zdr_void, 0},
-    //{PMAP3_SET, pmap3_...},
-    //{PMAP3_UNSET, pmap3_...},
-    //{PMAP3_GETADDR, pmap3_...},
-    {PMAP3_DUMP, pmap3_dump_proc, (zdrproc_t)zdr_void, 0},
-    //{PMAP3_CALLIT, pmap3_...},
-    //{PMAP3_GETTIME, pmap3_...},
-    //{PMAP3_UADDR2TADDR, pmap3_...},
-    //{PMAP3_TADDR2UADDR, pmap3_...},
-};
+static void yield_server(struct server *server)
+{
+    struct worker *worker = server->worker;
+    server->yielded = 1;
+    server->refs++;
+    stat_add(&server->yields, 1);
+    if (worker->yield_tail)
+        worker->yield_tail->yield_next = server;
+    else
+        worker->yield_head = server;
+    worker->yield_tail = server;
+    event_active(worker->resume_event, EV_READ, 0);
+}
+
+static void resume_servers(evutil_socket_t fd, short events, void *private_data)
+{
+    struct worker *worker = private_data;
+    struct server *server = worker->yield_head;
+
+    worker->yield_head = worker->yield_tail = NULL;
+    while (server)
+    {
+        struct server *next = server->yield_next;
+        server->yield_next = NULL;
+        server->yielded = 0;
+        if (server->rpc)
+            update_events(server);
+        put_server(server);
+        server = next;
+    }
+}
 
 // Handle incoming event
 static void server_io(evutil_socket_t fd, short events, void *private_data)
@@ -415,28 +2498,47 @@ static void server_io(evutil_socket_t fd, short events, void *private_data)
         revents |= POLLIN;
     if (events & EV_WRITE)
         revents |= POLLOUT;
+    current_server = server;
+    if ((revents & POLLOUT) && flush_raw_replies(server) < 0)
+        goto error;
+    // libnfs must not write while one of our replies is partially written
+    if (server->raw_head && server->raw_head->buf_pos > 0)
+        revents &= ~POLLOUT;
+    decode_start = stats_clock();
+    server->turn_calls = 0;
     // Let libnfs process the event
     if (rpc_service(server->rpc, revents) < 0)
-    {
-        free_server(server);
-        return;
-    }
+        goto error;
+    // Replies to the calls, and those that waited for libnfs output to drain
+    if (server->raw_head)
+        schedule_flush(server);
+    current_server = NULL;
+    if (server->turn_calls >= calls_per_turn && !server->yielded)
+        yield_server(server);
     // Update which events we are interested in
-    update_events(server->rpc, server->read_event, server->write_event);
+    update_events(server);
+    return;
+error:
+    current_server = NULL;
+    free_server(server);
 }
 
 // Accept a connection
 static void do_accept(evutil_socket_t s, short events, void *private_data)
 {
+    struct worker *worker = private_data;
     struct sockaddr_storage ss;
     socklen_t len = sizeof(ss);
     struct server *server;
+    unsigned i;
     int fd;
 
-    server = malloc(sizeof(struct server));
+    server = slab_alloc(&worker->server_slab);
     if (server == NULL)
         return;
     memset(server, 0, sizeof(*server));
+    server->worker = worker;
+    server->refs = 1;
 
     if ((fd = accept(s, (struct sockaddr *)&ss, &len)) < 0)
     {
@@ -444,6 +2546,9 @@ static void do_accept(evutil_socket_t s, short events, void *private_data)
         return;
     }
     evutil_make_socket_nonblocking(fd);
+    sockaddr_to_key(&ss, server->addr, &server->port);
+    server->rule = export_match(server->addr);
+    export_client_rules(server->addr, server->rules);
 
     server->rpc = rpc_init_server_context(fd);
     if (server->rpc == NULL)
@@ -452,43 +2557,36 @@ static void do_accept(evutil_socket_t s, short events, void *private_data)
         free_server(server);
         return;
     }
+    server->fd = fd;
+    pthread_mutex_lock(&worker->conns_lock);
+    server->conn_next = worker->conns;
+    if (worker->conns)
+        worker->conns->conn_prev = server;
+    worker->conns = server;
+    pthread_mutex_unlock(&worker->conns_lock);
 
-    // portmap
-    rpc_register_service(server->rpc, PMAP_PROGRAM, PMAP_V2, pmap2_pt, sizeof(pmap2_pt) / sizeof(pmap2_pt[0]));
-    rpc_register_service(server->rpc, PMAP_PROGRAM, PMAP_V3, pmap3_pt, sizeof(pmap3_pt) / sizeof(pmap3_pt[0]));
-
-    // NFS
-    rpc_register_service(server->rpc, NFS_PROGRAM, NFS_V3, nfs3_pt, sizeof(nfs3_pt) / sizeof(nfs3_pt[0]));
-    rpc_register_service(server->rpc, MOUNT_PROGRAM, MOUNT_V3, nfs3_mount_pt, sizeof(nfs3_mount_pt) / sizeof(nfs3_mount_pt[0]));
+    // portmap and NFS
+    for (i = 0; i < NUM_SERVICES; i++)
+        rpc_register_service(server->rpc, services[i].prog, services[i].vers, services[i].timed_procs, services[i].num_procs);
 
-    // read and write events
-    server->read_event = event_new(base, fd, EV_READ|EV_PERSIST, server_io, server);
-    server->write_event = event_new(base, fd, EV_WRITE|EV_PERSIST, server_io, server);
-    update_events(server->rpc, server->read_event, server->write_event);
+    // read and write events, stored behind the server
+    server->read_event = (struct event *)(server + 1);
+    server->write_event = (struct event *)((char *)(server + 1) + event_get_struct_event_size());
+    event_assign(server->read_event, worker->base, fd, EV_READ|EV_PERSIST, server_io, server);
+    event_assign(server->write_event, worker->base, fd, EV_WRITE|EV_PERSIST, server_io, server);
+    update_events(server);
 }
 
-int main(int argc, char *argv[])
+/*
+ * Create a listening TCP socket on the given port.
+ * SO_REUSEPORT lets every worker bind its own socket to the same port
+ * and have the kernel balance incoming connections between them.
+ */
+static int create_listener(int port)
 {
     struct sockaddr_in in;
     int one = 1;
 
-    base = event_base_new();
-    if (base == NULL)
-    {
-        printf("Failed create event context\n");
-        exit(10);
-    }
-
-    in.sin_family = AF_INET;
-    in.sin_port = htons(111);
-    in.sin_addr.s_addr = htonl(INADDR_ANY);
-
-    pmap_register(PMAP_PROGRAM, PMAP_V2, strdup("tcp"), strdup("0.0.0.0.0.111"), strdup("portmapper-service"));
-    pmap_register(PMAP_PROGRAM, PMAP_V3, strdup("tcp"), strdup("0.0.0.0.0.111"), strdup("portmapper-service"));
-    pmap_register(NFS_PROGRAM, NFS_V3, strdup("tcp"), strdup("0.0.0.0.0.2049"), strdup("nfs-server"));
-    pmap_register(MOUNT_PROGRAM, MOUNT_V3, strdup("tcp"), strdup("0.0.0.0.0.2049"), strdup("rpc.mountd"));
-
-    // Portmap socket
     int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_socket == -1)
     {
@@ -497,46 +2595,524 @@ int main(int argc, char *argv[])
     }
     evutil_make_socket_nonblocking(listen_socket);
     setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        printf("Failed to set SO_REUSEPORT on listening socket\n");
+        exit(10);
+    }
+    in.sin_family = AF_INET;
+    in.sin_port = htons(port);
+    in.sin_addr.s_addr = htonl(INADDR_ANY);
     if (bind(listen_socket, (struct sockaddr *)&in, sizeof(in)) < 0)
     {
         printf("Failed to bind listening socket\n");
         exit(10);
     }
-    if (listen(listen_socket, 16) < 0)
+    if (listen(listen_socket, SOMAXCONN) < 0)
     {
         printf("failed to listen to socket\n");
         exit(10);
     }
-    struct event *listen_event = event_new(base, listen_socket, EV_READ|EV_PERSIST, do_accept, NULL);
-    event_add(listen_event, NULL);
+    return listen_socket;
+}
+
+/*
+ * Create a UDP socket on the given port for a worker, also with
+ * SO_REUSEPORT so that every worker has its own.
+ */
+static struct udp_socket *create_udp_socket(struct worker *worker, int port)
+{
+    struct udp_socket *udp;
+    struct sockaddr_in in;
+    int i, one = 1;
 
-    // NFS socket
-    int nfs_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (nfs_socket == -1)
+    udp = calloc(1, sizeof(struct udp_socket));
+    udp->worker = worker;
+    udp->port = port;
+    udp->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (udp->fd == -1)
     {
-        printf("Failed to create listening socket\n");
+        printf("Failed to create UDP socket\n");
+        exit(10);
+    }
+    evutil_make_socket_nonblocking(udp->fd);
+    setsockopt(udp->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(udp->fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+    {
+        printf("Failed to set SO_REUSEPORT on UDP socket\n");
         exit(10);
     }
-    evutil_make_socket_nonblocking(nfs_socket);
-    setsockopt(nfs_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
     in.sin_family = AF_INET;
-    in.sin_port = htons(2049);
+    in.sin_port = htons(port);
     in.sin_addr.s_addr = htonl(INADDR_ANY);
-    if (bind(nfs_socket, (struct sockaddr *)&in, sizeof(in)) < 0)
+    if (bind(udp->fd, (struct sockaddr *)&in, sizeof(in)) < 0)
     {
-        printf("Failed to bind listening socket\n");
+        printf("Failed to bind UDP socket\n");
         exit(10);
     }
-    if (listen(nfs_socket, 16) < 0)
+    udp->rpc = rpc_init_context();
+    for (i = 0; i < UDP_BATCH; i++)
     {
-        printf("failed to listen to socket\n");
+        udp->in_iov[i].iov_base = malloc(UDP_MAX_SIZE);
+        udp->in_iov[i].iov_len = UDP_MAX_SIZE;
+        udp->in[i].msg_hdr.msg_name = &udp->addrs[i];
+        udp->in[i].msg_hdr.msg_iov = &udp->in_iov[i];
+        udp->in[i].msg_hdr.msg_iovlen = 1;
+        if (udp->in_iov[i].iov_base == NULL)
+        {
+            printf("Failed to allocate UDP buffers\n");
+            exit(10);
+        }
+    }
+    if (udp->rpc == NULL)
+    {
+        printf("Failed to create UDP context\n");
+        exit(10);
+    }
+    udp->event = event_new(worker->base, udp->fd, EV_READ|EV_PERSIST, udp_io, udp);
+    event_add(udp->event, NULL);
+    return udp;
+}
+
+// Latency at quantile q of a histogram with count entries, in microseconds
+static double hist_quantile(uint64_t *hist, uint64_t count, double q)
+{
+    uint64_t rank = q * count, seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist[i];
+        if (seen > rank)
+            return hist_value(i) / 1000;
+    }
+    return hist_value(HIST_BUCKETS - 1) / 1000;
+}
+
+// Calls of every proc that has been called, added up over all workers
+static void write_proc_stats(FILE *f)
+{
+    static uint64_t hist[NUM_PHASES][HIST_BUCKETS];
+    char name[64];
+    unsigned i;
+    int proc, w, phase, b;
+
+    fprintf(f, "latency in us, p50/p99/p999\n");
+    for (i = 0; i < NUM_SERVICES; i++)
+    {
+        for (proc = 0; services[i].proc_names[proc] && proc < MAX_PROCS; proc++)
+        {
+            uint64_t calls = 0, count;
+            memset(hist, 0, sizeof(hist));
+            for (w = 0; w < num_workers; w++)
+            {
+                struct proc_stats *stats = &workers[w].stats[i * MAX_PROCS + proc];
+                calls += __atomic_load_n(&stats->calls, __ATOMIC_RELAXED);
+                for (phase = 0; phase < NUM_PHASES; phase++)
+                {
+                    for (b = 0; b < HIST_BUCKETS; b++)
+                        hist[phase][b] += __atomic_load_n(&stats->hist[phase][b], __ATOMIC_RELAXED);
+                }
+            }
+            if (calls == 0)
+                continue;
+            snprintf(name, sizeof(name), "%s.%s", services[i].name, services[i].proc_names[proc]);
+            fprintf(f, "%-22s %10lu calls", name, calls);
+            for (phase = 0; phase < NUM_PHASES; phase++)
+            {
+                for (count = 0, b = 0; b < HIST_BUCKETS; b++)
+                    count += hist[phase][b];
+                if (count == 0)
+                    continue;
+                fprintf(f, "  %s %.1f/%.1f/%.1f", phase_names[phase],
+                    hist_quantile(hist[phase], count, 0.5),
+                    hist_quantile(hist[phase], count, 0.99),
+                    hist_quantile(hist[phase], count, 0.999));
+            }
+            fprintf(f, "\n");
+        }
+    }
+}
+
+// Bytes received and sent on every connection and UDP socket
+static void write_conn_stats(FILE *f)
+{
+    struct server *server;
+    char name[INET6_ADDRSTRLEN];
+    int w, i;
+
+    for (w = 0; w < num_workers; w++)
+    {
+        struct worker *worker = &workers[w];
+        for (i = 0; i < 2; i++)
+        {
+            fprintf(f, "worker %d udp port %d: %lu bytes in, %lu bytes out\n", w, worker->udp[i]->port,
+                __atomic_load_n(&worker->udp[i]->bytes_in, __ATOMIC_RELAXED),
+                __atomic_load_n(&worker->udp[i]->bytes_out, __ATOMIC_RELAXED));
+        }
+        pthread_mutex_lock(&worker->conns_lock);
+        for (server = worker->conns; server; server = server->conn_next)
+        {
+            struct tcp_info info;
+            socklen_t len = sizeof(info);
+            memset(&info, 0, sizeof(info));
+            getsockopt(server->fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+            // IPv4 addresses are mapped in the key
+            if (IN6_IS_ADDR_V4MAPPED((struct in6_addr *)server->addr))
+                inet_ntop(AF_INET, server->addr + 12, name, sizeof(name));
+            else
+                inet_ntop(AF_INET6, server->addr, name, sizeof(name));
+            fprintf(f, "worker %d tcp %s port %d: %llu bytes in, %llu bytes out, %lu calls, %lu writes, "
+                "%lu in flight (max %lu), %lu bytes queued, paused %lu times, yielded %lu times\n",
+                w, name, server->port,
+                (unsigned long long)info.tcpi_bytes_received, (unsigned long long)info.tcpi_bytes_acked,
+                __atomic_load_n(&server->calls, __ATOMIC_RELAXED),
+                __atomic_load_n(&server->writes, __ATOMIC_RELAXED),
+                __atomic_load_n(&server->deferred, __ATOMIC_RELAXED) + __atomic_load_n(&server->queued, __ATOMIC_RELAXED),
+                __atomic_load_n(&server->max_depth, __ATOMIC_RELAXED),
+                __atomic_load_n(&server->queued_bytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&server->pauses, __ATOMIC_RELAXED),
+                __atomic_load_n(&server->yields, __ATOMIC_RELAXED));
+        }
+        pthread_mutex_unlock(&worker->conns_lock);
+    }
+}
+
+// Allocations of all workers, and how many of them had to malloc
+static void write_alloc_stats(FILE *f)
+{
+    uint64_t counts[5][2] = {{0}};
+    static const char *names[5] = { "connections", "replies", "deferred replies", "reply buffers", "call arena" };
+    int w, i;
+
+    for (w = 0; w < num_workers; w++)
+    {
+        struct worker *worker = &workers[w];
+        uint64_t *pairs[5][2] = {
+            { &worker->server_slab.allocs, &worker->server_slab.mallocs },
+            { &worker->raw_slab.allocs, &worker->raw_slab.mallocs },
+            { &worker->deferred_slab.allocs, &worker->deferred_slab.mallocs },
+            { &worker->buf_pool.allocs, &worker->buf_pool.mallocs },
+            { &worker->arena.allocs, &worker->arena.mallocs },
+        };
+        for (i = 0; i < 5; i++)
+        {
+            counts[i][0] += __atomic_load_n(pairs[i][0], __ATOMIC_RELAXED);
+            counts[i][1] += __atomic_load_n(pairs[i][1], __ATOMIC_RELAXED);
+        }
+    }
+    for (i = 0; i < 5; i++)
+        fprintf(f, "allocator %s: %lu allocations, %lu mallocs\n", names[i], counts[i][0], counts[i][1]);
+}
+
+static void write_stats(FILE *f)
+{
+    fprintf(f, "attribute cache: %lu hits, %lu misses\n",
+        __atomic_load_n(&attr_cache_hits, __ATOMIC_RELAXED),
+        __atomic_load_n(&attr_cache_misses, __ATOMIC_RELAXED));
+    fprintf(f, "name cache: %lu hits, %lu negative hits, %lu misses\n",
+        __atomic_load_n(&dnlc_hits, __ATOMIC_RELAXED),
+        __atomic_load_n(&dnlc_negative_hits, __ATOMIC_RELAXED),
+        __atomic_load_n(&dnlc_misses, __ATOMIC_RELAXED));
+    fprintf(f, "duplicate request cache: %lu replayed, %lu dropped in progress, %lu evictions\n",
+        __atomic_load_n(&drc_hits, __ATOMIC_RELAXED),
+        __atomic_load_n(&drc_in_progress, __ATOMIC_RELAXED),
+        __atomic_load_n(&drc_evictions, __ATOMIC_RELAXED));
+    fprintf(f, "exports: %lu calls denied\n", __atomic_load_n(&calls_denied, __ATOMIC_RELAXED));
+    fprintf(f, "io_uring: %lu operations (%lu on registered files, %lu on registered buffers), %lu submits, %lu reaps, %lu ring full\n",
+        __atomic_load_n(&io_ops, __ATOMIC_RELAXED),
+        __atomic_load_n(&io_fixed_files, __ATOMIC_RELAXED),
+        __atomic_load_n(&io_fixed_buffers, __ATOMIC_RELAXED),
+        __atomic_load_n(&io_submits, __ATOMIC_RELAXED),
+        __atomic_load_n(&io_reaps, __ATOMIC_RELAXED),
+        __atomic_load_n(&io_ring_full, __ATOMIC_RELAXED));
+    fprintf(f, "buffer pool: %lu KiB in use, peak %lu KiB of %lu KiB, %lu requests denied\n",
+        __atomic_load_n(&pool_used_bytes, __ATOMIC_RELAXED) >> 10,
+        __atomic_load_n(&pool_peak_bytes, __ATOMIC_RELAXED) >> 10,
+        pool_max_bytes >> 10,
+        __atomic_load_n(&pool_denied, __ATOMIC_RELAXED));
+    write_alloc_stats(f);
+    write_proc_stats(f);
+    write_conn_stats(f);
+}
+
+static void print_stats(evutil_socket_t sig, short events, void *private_data)
+{
+    write_stats(stdout);
+    fflush(stdout);
+}
+
+/*
+ * A client of the stats socket gets the statistics as text, then the
+ * connection is closed, e.g. "socat - UNIX-CONNECT:/run/nfs-server.stats".
+ */
+static void stats_accept(evutil_socket_t s, short events, void *private_data)
+{
+    struct timeval timeout = {1, 0};
+    char *buf = NULL;
+    size_t len = 0, pos = 0;
+    ssize_t n;
+    FILE *f;
+    int fd;
+
+    if ((fd = accept4(s, NULL, NULL, SOCK_CLOEXEC)) < 0)
+        return;
+    f = open_memstream(&buf, &len);
+    if (f)
+    {
+        write_stats(f);
+        fclose(f);
+    }
+    // Don't hold up the worker for a reader that doesn't read
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    while (pos < len && (n = send(fd, buf + pos, len - pos, MSG_NOSIGNAL)) > 0)
+        pos += n;
+    free(buf);
+    close(fd);
+}
+
+static int create_stats_socket(const char *path)
+{
+    struct sockaddr_un un;
+    int s;
+
+    if (strlen(path) >= sizeof(un.sun_path))
+    {
+        printf("Stats socket path %s is too long\n", path);
+        exit(10);
+    }
+    s = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (s == -1)
+    {
+        printf("Failed to create stats socket\n");
         exit(10);
     }
-    listen_event = event_new(base, nfs_socket, EV_READ|EV_PERSIST, do_accept, NULL);
-    event_add(listen_event, NULL);
+    evutil_make_socket_nonblocking(s);
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, path);
+    unlink(path);
+    if (bind(s, (struct sockaddr *)&un, sizeof(un)) < 0 || listen(s, 16) < 0)
+    {
+        printf("Failed to bind stats socket %s\n", path);
+        exit(10);
+    }
+    return s;
+}
 
+static void *worker_main(void *private_data)
+{
+    struct worker *worker = private_data;
+    current_worker = worker;
+    // The ring belongs to the thread, file I/O is synchronous without one
+    if (io_ring_entries && io_ring_start(worker->base) < 0 && worker->id == 0)
+        printf("io_uring is not available (%s), using synchronous file I/O\n", strerror(errno));
     // Start the event loop
-    event_base_dispatch(base);
+    event_base_dispatch(worker->base);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *export_dir = ".";
+    const char *stats_path = "/run/nfs-server.stats";
+    const char *exports_file = NULL;
+    struct event *stats_event;
+    unsigned long value;
+    unsigned j;
+    char *end;
+    int i, opt;
+
+    num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "t:d:e:f:a:w:s:q:b:n:m:u:R:W:M:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            num_workers = atoi(optarg);
+            break;
+        case 'd':
+            export_dir = optarg;
+            break;
+        case 'e':
+            exports_file = optarg;
+            break;
+        case 'f':
+            fd_cache_max = atoi(optarg);
+            break;
+        case 'a':
+            attr_timeout_ms = atoi(optarg);
+            break;
+        case 'w':
+            // In MiB, the byte count has to fit in 32 bits
+            value = strtoul(optarg, &end, 10);
+            if (*optarg < '0' || *optarg > '9' || *end != 0 || value > UINT32_MAX >> 20)
+            {
+                printf("Invalid max_write_data_mb %s, at most %u\n", optarg, UINT32_MAX >> 20);
+                exit(10);
+            }
+            max_write_data = value << 20;
+            break;
+        case 's':
+            stats_path = optarg;
+            break;
+        case 'q':
+            max_in_flight = atoi(optarg);
+            break;
+        case 'b':
+            max_queued_bytes = atoi(optarg) * 1024ull*1024;
+            break;
+        case 'n':
+            calls_per_turn = atoi(optarg);
+            break;
+        case 'm':
+            // Export a RAM filesystem of this many MiB instead of export_dir
+            backend = &ram_backend;
+            ram_max_bytes = strtoull(optarg, NULL, 10) * 1024*1024;
+            break;
+        case 'u':
+            io_ring_entries = atoi(optarg);
+            break;
+        case 'R':
+            max_read_size = atoi(optarg) * 1024;
+            break;
+        case 'W':
+            max_write_size = atoi(optarg) * 1024;
+            break;
+        case 'M':
+            pool_max_bytes = strtoull(optarg, NULL, 10) * 1024*1024;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-d export_dir] [-e exports_file] [-f fd_cache_size] [-a attr_timeout_ms] [-w max_write_data_mb]\n"
+                "       [-s stats_socket] [-q max_calls_in_flight] [-b max_queued_reply_mb] [-n calls_per_turn] [-m ram_fs_mb]\n"
+                "       [-u io_ring_entries] [-R max_read_kb] [-W max_write_kb] [-M buffer_pool_mb]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (num_workers < 1)
+        num_workers = 1;
+    if (max_in_flight < 1)
+        max_in_flight = 1;
+    if (calls_per_turn < 1)
+        calls_per_turn = 1;
+    if (fd_cache_max < 1)
+        fd_cache_max = 1;
+    if (max_write_data < 1024*1024)
+        max_write_data = 1024*1024;
+    // Whole pages, and a single write can't exceed what a connection may hold
+    if (max_write_size > max_write_data)
+        max_write_size = max_write_data;
+    max_read_size = max_read_size < 4096 ? 4096 : (max_read_size > MAX_TRANSFER ? MAX_TRANSFER : max_read_size & ~4095u);
+    max_write_size = max_write_size < 4096 ? 4096 : (max_write_size > MAX_TRANSFER ? MAX_TRANSFER : max_write_size & ~4095u);
+    if (pool_max_bytes < POOL_CHUNK_SIZE)
+        pool_max_bytes = POOL_CHUNK_SIZE;
+
+    if (pool_init() != 0)
+    {
+        printf("Failed to reserve %lu MiB for the buffer pool\n", pool_max_bytes >> 20);
+        exit(10);
+    }
+
+    if (backend->init(export_dir) != 0)
+    {
+        if (backend == &ram_backend)
+            printf("Failed to create the RAM filesystem\n");
+        else
+            printf("Failed to open export directory %s\n", export_dir);
+        exit(10);
+    }
+    if (exports_file == NULL)
+        exports_default();
+    else if (exports_load(exports_file) != 0)
+        exit(10);
+    for (i = 0; i < DRC_PARTS; i++)
+    {
+        pthread_mutex_init(&drc_parts[i].lock, NULL);
+        drc_parts[i].lru.lru_prev = drc_parts[i].lru.lru_next = &drc_parts[i].lru;
+    }
+
+    // libnfs calls the procs through timed_proc()
+    for (j = 0; j < NUM_SERVICES; j++)
+    {
+        services[j].timed_procs = malloc(services[j].num_procs * sizeof(struct service_proc));
+        memcpy(services[j].timed_procs, services[j].procs, services[j].num_procs * sizeof(struct service_proc));
+        for (i = 0; i < services[j].num_procs; i++)
+            services[j].timed_procs[i].func = timed_proc;
+    }
+
+    pmap_register(PMAP_PROGRAM, PMAP_V2, "tcp", strdup("0.0.0.0.0.111"), strdup("portmapper-service"));
+    pmap_register(PMAP_PROGRAM, PMAP_V3, "tcp", strdup("0.0.0.0.0.111"), strdup("portmapper-service"));
+    pmap_register(NFS_PROGRAM, NFS_V3, "tcp", strdup("0.0.0.0.0.2049"), strdup("nfs-server"));
+    pmap_register(MOUNT_PROGRAM, MOUNT_V3, "tcp", strdup("0.0.0.0.0.2049"), strdup("rpc.mountd"));
+    pmap_register(NFS4_PROGRAM, NFS_V4, "tcp", strdup("0.0.0.0.0.2049"), strdup("nfs-server"));
+    pmap_register(PMAP_PROGRAM, PMAP_V2, "udp", strdup("0.0.0.0.0.111"), strdup("portmapper-service"));
+    pmap_register(PMAP_PROGRAM, PMAP_V3, "udp", strdup("0.0.0.0.0.111"), strdup("portmapper-service"));
+    pmap_register(NFS_PROGRAM, NFS_V3, "udp", strdup("0.0.0.0.0.2049"), strdup("nfs-server"));
+    pmap_register(MOUNT_PROGRAM, MOUNT_V3, "udp", strdup("0.0.0.0.0.2049"), strdup("rpc.mountd"));
+
+    workers = calloc(num_workers, sizeof(struct worker));
+    for (i = 0; i < num_workers; i++)
+    {
+        struct worker *worker = &workers[i];
+        worker->id = i;
+        worker->base = event_base_new();
+        if (worker->base == NULL)
+        {
+            printf("Failed create event context\n");
+            exit(10);
+        }
+        // Portmap and NFS sockets
+        worker->listen_events[0] = event_new(worker->base, create_listener(111), EV_READ|EV_PERSIST, do_accept, worker);
+        event_add(worker->listen_events[0], NULL);
+        worker->listen_events[1] = event_new(worker->base, create_listener(2049), EV_READ|EV_PERSIST, do_accept, worker);
+        event_add(worker->listen_events[1], NULL);
+        worker->udp[0] = create_udp_socket(worker, 111);
+        worker->udp[1] = create_udp_socket(worker, 2049);
+        worker->stats = calloc(NUM_SERVICES * MAX_PROCS, sizeof(struct proc_stats));
+        if (worker->stats == NULL)
+        {
+            printf("Failed to allocate statistics\n");
+            exit(10);
+        }
+        pthread_mutex_init(&worker->conns_lock, NULL);
+        worker->server_slab.size = sizeof(struct server) + 2 * event_get_struct_event_size();
+        worker->raw_slab.size = sizeof(struct raw_reply);
+        worker->deferred_slab.size = sizeof(struct deferred_reply);
+        arena_init(&worker->arena);
+
+        pthread_mutex_init(&worker->completed_lock, NULL);
+        worker->wakeup_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+        if (worker->wakeup_fd < 0)
+        {
+            printf("Failed to create eventfd\n");
+            exit(10);
+        }
+        worker->wakeup_event = event_new(worker->base, worker->wakeup_fd, EV_READ|EV_PERSIST, worker_wakeup, worker);
+        event_add(worker->wakeup_event, NULL);
+        // Only ever activated, see yield_server() and schedule_flush()
+        worker->resume_event = event_new(worker->base, -1, 0, resume_servers, worker);
+        worker->flush_event = event_new(worker->base, -1, 0, flush_servers, worker);
+    }
+
+    // Print statistics on SIGUSR1
+    stats_event = evsignal_new(workers[0].base, SIGUSR1, print_stats, NULL);
+    event_add(stats_event, NULL);
+    // and to whoever connects to the stats socket, an empty path turns it off
+    if (stats_path[0])
+    {
+        stats_event = event_new(workers[0].base, create_stats_socket(stats_path), EV_READ|EV_PERSIST, stats_accept, NULL);
+        event_add(stats_event, NULL);
+    }
+
+    // Worker 0 runs on the main thread
+    for (i = 1; i < num_workers; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+        {
+            printf("Failed to start worker thread\n");
+            exit(10);
+        }
+    }
+    worker_main(&workers[0]);
 
     return 0;
 }
@@ -1,322 +1,1194 @@
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <arpa/inet.h>
 #include "nfs-service.h"
+#include "nfs-backend.h"
+#include "nfs-pool.h"
+#include "nfs-export.h"
 
-static void fill_example_fsattr(struct fattr3 *attr)
-{
-    struct timespec now;
-    clock_gettime(CLOCK_REALTIME, &now);
-    attr->type = NF3DIR;
-    attr->mode = 0755;
-    attr->nlink = 1;
-    attr->uid = 0;
-    attr->gid = 0;
-    attr->size = 4096;
-    attr->used = 4096;
-    attr->rdev = (specdata3){ 0, 0 };
-    attr->fsid = 1;
-    attr->fileid = 1;
-    attr->atime.seconds = now.tv_sec;
-    attr->atime.nseconds = now.tv_nsec;
-    attr->mtime = attr->atime;
-    attr->ctime = attr->atime;
+// Preferred READDIR size, large enough for a few thousand entries
+#define DIR_PREF (1024*1024)
+
+uint32_t max_read_size = 1024*1024;
+uint32_t max_write_size = 1024*1024;
+
+// Returns 0 if the call has no valid AUTH_UNIX credentials
+static int get_auth_unix(struct rpc_msg *call, struct nfs_cred *cred)
+{
+    struct opaque_auth *auth = &call->body.cbody.cred;
+    uint32_t *p = (uint32_t *)auth->oa_base;
+    uint32_t *end = p + auth->oa_length/4;
+    uint32_t len, i;
+
+    if (auth->oa_flavor != AUTH_UNIX || p+2 > end)
+        return 0;
+    // Skip the stamp and the machine name
+    len = ntohl(p[1]);
+    p += 2 + (len+3)/4;
+    if (p+3 > end)
+        return 0;
+    cred->uid = ntohl(p[0]);
+    cred->gid = ntohl(p[1]);
+    len = ntohl(p[2]);
+    p += 3;
+    for (i = 0; i < len && i < 16 && p < end; i++)
+        cred->gids[i] = ntohl(*p++);
+    cred->ngids = i;
+    return 1;
+}
+
+/*
+ * Take the caller's identity from AUTH_UNIX credentials. Everything else,
+ * and the users the client's export rule squashes, is mapped to the
+ * anonymous user of the rule.
+ */
+void get_cred(struct rpc_msg *call, const struct export_rule *rule, struct nfs_cred *cred)
+{
+    if (!get_auth_unix(call, cred) ||
+        (rule && (rule->squash == SQUASH_ALL || (rule->squash == SQUASH_ROOT && cred->uid == 0))))
+    {
+        cred->uid = rule ? rule->anon_uid : 65534;
+        cred->gid = rule ? rule->anon_gid : 65534;
+        cred->ngids = 0;
+    }
+}
+
+/*
+ * The export a call works in: the one its handle was handed out under,
+ * and the client's rule for it. Handles in the reply go out under the
+ * same export.
+ */
+struct call_export
+{
+    int index;
+    const struct export_rule *rule;
+};
+
+// The inode of a handle, if the client is admitted to its export
+static struct inode *get_inode(struct rpc_context *rpc, nfs_fh3 *fh, struct call_export *ex, nfsstat3 *status)
+{
+    struct inode *inode = backend->inode_from_fh(fh, &ex->index, status);
+
+    ex->rule = NULL;
+    if (inode == NULL)
+        return NULL;
+    if (ex->index >= num_exports)
+        *status = NFS3ERR_STALE;
+    else if ((ex->rule = rpc_client_rule(rpc, ex->index)) == NULL)
+        *status = NFS3ERR_ACCES;
+    else
+        return inode;
+    backend->inode_put(inode);
+    return NULL;
+}
+
+// The inode a proc changes, fails with NFS3ERR_ROFS for read-only clients
+static struct inode *inode_to_change(struct rpc_context *rpc, nfs_fh3 *fh, struct call_export *ex, nfsstat3 *status)
+{
+    struct inode *inode = get_inode(rpc, fh, ex, status);
+
+    if (inode && ex->rule->read_only)
+    {
+        backend->inode_put(inode);
+        *status = NFS3ERR_ROFS;
+        return NULL;
+    }
+    return inode;
+}
+
+// The second inode of RENAME and LINK, which must be in the same export
+static struct inode *get_inode_in(struct rpc_context *rpc, nfs_fh3 *fh, const struct call_export *ex, nfsstat3 *status)
+{
+    struct call_export other;
+    struct inode *inode = get_inode(rpc, fh, &other, status);
+
+    if (inode && other.index != ex->index)
+    {
+        backend->inode_put(inode);
+        *status = NFS3ERR_XDEV;
+        return NULL;
+    }
+    return inode;
+}
+
+// The handle of inode under export, in call memory
+static void get_fh(struct inode *inode, int export, nfs_fh3 *fh)
+{
+    char buf[NFS3_FHSIZE];
+
+    fh->data.data_len = backend->inode_to_fh(inode, export, buf);
+    fh->data.data_val = rpc_alloc(fh->data.data_len);
+    memcpy(fh->data.data_val, buf, fh->data.data_len);
+}
+
+static void get_post_op_attr(struct inode *inode, post_op_attr *attr)
+{
+    attr->attributes_follow = inode && backend->getattr(inode, &attr->post_op_attr_u.attributes) == NFS3_OK;
+}
+
+// Only the attributes after the change are reported
+static void get_wcc(struct inode *dir, wcc_data *wcc)
+{
+    wcc->before.attributes_follow = FALSE;
+    get_post_op_attr(dir, &wcc->after);
+}
+
+static void get_post_op_fh(struct inode *inode, int export, post_op_fh3 *fh)
+{
+    fh->handle_follows = inode != NULL;
+    if (inode)
+        get_fh(inode, export, &fh->post_op_fh3_u.handle);
 }
 
 static int nfs3_null_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
-    rpc_send_reply(rpc, call, NULL, (zdrproc_t)zdr_void, 0);
+    rpc_reply(rpc, call, NULL, (zdrproc_t)zdr_void, 0);
     return 0;
 }
 
 static int nfs3_getattr_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     GETATTR3args *args = call->body.cbody.args;
+    struct call_export ex;
     GETATTR3res reply;
-    if (args->object.data.data_len != 10)
-    {
-        // Example error
-        reply.status = NFS3ERR_PERM;
-    }
-    else
-    {
-        // Fill info
-        reply.status = NFS3_OK;
-        fill_example_fsattr(&reply.GETATTR3res_u.resok.obj_attributes);
-    }
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_GETATTR3res, sizeof(GETATTR3res));
+    struct inode *inode = get_inode(rpc, &args->object, &ex, &reply.status);
+    if (inode)
+        reply.status = backend->getattr(inode, &reply.GETATTR3res_u.resok.obj_attributes);
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_GETATTR3res, sizeof(GETATTR3res));
+    backend->inode_put(inode);
     return 0;
 }
 
 static int nfs3_setattr_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     SETATTR3args *args = call->body.cbody.args;
+    struct call_export ex;
     SETATTR3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_SETATTR3res, sizeof(SETATTR3res));
+    struct nfs_cred cred;
+    struct inode *inode;
+    wcc_data *wcc = &reply.SETATTR3res_u.resok.obj_wcc;
+    if (rpc_drc_begin(rpc, call))
+        return 0;
+    inode = inode_to_change(rpc, &args->object, &ex, &reply.status);
+    get_cred(call, ex.rule, &cred);
+    if (inode)
+    {
+        reply.status = backend->setattr(inode, &cred, &args->new_attributes,
+            args->guard.check ? &args->guard.sattrguard3_u.obj_ctime : NULL);
+    }
+    if (reply.status != NFS3_OK)
+        wcc = &reply.SETATTR3res_u.resfail.obj_wcc;
+    get_wcc(inode, wcc);
+    rpc_send_reply_drc(rpc, call, &reply, (zdrproc_t)zdr_SETATTR3res, sizeof(SETATTR3res));
+    backend->inode_put(inode);
     return 0;
 }
 
 static int nfs3_lookup_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     LOOKUP3args *args = call->body.cbody.args;
+    struct call_export ex;
     LOOKUP3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_LOOKUP3res, sizeof(LOOKUP3res));
+    struct nfs_cred cred;
+    struct inode *dir = get_inode(rpc, &args->what.dir, &ex, &reply.status);
+    struct inode *child = NULL;
+    get_cred(call, ex.rule, &cred);
+    if (dir)
+    {
+        LOOKUP3resok *resok = &reply.LOOKUP3res_u.resok;
+        const char *name = args->what.name;
+        // Clients don't get above the root of their export
+        if (!strcmp(name, "..") && export_is_root(ex.index, dir))
+            name = ".";
+        reply.status = backend->lookup(dir, &cred, name, &child, &resok->obj_attributes.post_op_attr_u.attributes);
+        if (reply.status == NFS3_OK)
+        {
+            get_fh(child, ex.index, &resok->object);
+            resok->obj_attributes.attributes_follow = TRUE;
+            get_post_op_attr(dir, &resok->dir_attributes);
+        }
+    }
+    if (reply.status != NFS3_OK)
+        get_post_op_attr(dir, &reply.LOOKUP3res_u.resfail.dir_attributes);
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_LOOKUP3res, sizeof(LOOKUP3res));
+    backend->inode_put(child);
+    backend->inode_put(dir);
     return 0;
 }
 
 static int nfs3_access_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     ACCESS3args *args = call->body.cbody.args;
+    struct call_export ex;
     ACCESS3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_ACCESS3res, sizeof(ACCESS3res));
+    struct nfs_cred cred;
+    struct inode *inode = get_inode(rpc, &args->object, &ex, &reply.status);
+    get_cred(call, ex.rule, &cred);
+    if (inode)
+        reply.status = backend->access(inode, &cred, args->access, &reply.ACCESS3res_u.resok.access);
+    if (reply.status == NFS3_OK && ex.rule->read_only)
+        reply.ACCESS3res_u.resok.access &= ~(ACCESS3_MODIFY | ACCESS3_EXTEND | ACCESS3_DELETE);
+    get_post_op_attr(inode, reply.status == NFS3_OK
+        ? &reply.ACCESS3res_u.resok.obj_attributes : &reply.ACCESS3res_u.resfail.obj_attributes);
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_ACCESS3res, sizeof(ACCESS3res));
+    backend->inode_put(inode);
     return 0;
 }
 
 static int nfs3_readlink_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     READLINK3args *args = call->body.cbody.args;
+    struct call_export ex;
     READLINK3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_READLINK3res, sizeof(READLINK3res));
+    char target[PATH_MAX+1];
+    struct inode *inode = get_inode(rpc, &args->symlink, &ex, &reply.status);
+    if (inode)
+        reply.status = backend->readlink(inode, target, sizeof(target));
+    if (reply.status == NFS3_OK)
+    {
+        reply.READLINK3res_u.resok.data = target;
+        get_post_op_attr(inode, &reply.READLINK3res_u.resok.symlink_attributes);
+    }
+    else
+        get_post_op_attr(inode, &reply.READLINK3res_u.resfail.symlink_attributes);
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_READLINK3res, sizeof(READLINK3res));
+    backend->inode_put(inode);
     return 0;
 }
 
+// READ3res up to the length of the data, which is sent separately
+static bool_t zdr_READ3res_head(ZDR *zdrs, READ3res *res)
+{
+    READ3resok *resok = &res->READ3res_u.resok;
+    return zdr_nfsstat3(zdrs, &res->status) &&
+        zdr_post_op_attr(zdrs, &resok->file_attributes) &&
+        zdr_count3(zdrs, &resok->count) &&
+        zdr_bool(zdrs, &resok->eof) &&
+        zdr_u_int(zdrs, &resok->data.data_len);
+}
+
+/*
+ * READ, WRITE and COMMIT go to the ring of the worker when it has one and
+ * the call can be deferred. The reply is sent when the backend completes
+ * the I/O; the state of the call lives in the deferred reply.
+ */
+struct io_call
+{
+    struct backend_io io;
+    struct deferred_reply *deferred;
+    deferred_send_fn send;
+};
+
+_Static_assert(sizeof(struct io_call) <= DEFERRED_STATE_SIZE, "struct io_call doesn't fit into a deferred reply");
+
+static void io_call_complete(struct backend_io *io)
+{
+    struct io_call *c = (struct io_call *)io;
+    rpc_complete_deferred(c->deferred, c->send, c);
+}
+
+/*
+ * Defer the call for asynchronous I/O on inode, whose reference goes with
+ * it. Returns NULL if it has to be answered right away instead.
+ */
+static struct io_call *io_call_begin(struct rpc_context *rpc, struct rpc_msg *call, struct inode *inode, deferred_send_fn send)
+{
+    struct deferred_reply *deferred;
+    struct io_call *c;
+
+    if (!io_ring_ready() || (deferred = rpc_defer_reply(rpc, call)) == NULL)
+        return NULL;
+    c = rpc_defer_state(deferred);
+    memset(c, 0, sizeof(*c));
+    c->deferred = deferred;
+    c->send = send;
+    c->io.complete = io_call_complete;
+    c->io.inode = inode;
+    return c;
+}
+
+void put_chunks(struct iovec *chunks, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+        io_buffer_put(chunks[i].iov_base);
+}
+
+int get_chunks(struct iovec *chunks, uint32_t count)
+{
+    int n = 0;
+    while (count > 0)
+    {
+        size_t len = count < POOL_CHUNK_SIZE ? count : POOL_CHUNK_SIZE;
+        if ((chunks[n].iov_base = io_buffer_get(len)) == NULL)
+        {
+            put_chunks(chunks, n);
+            return -1;
+        }
+        chunks[n++].iov_len = len;
+        count -= len;
+    }
+    return n;
+}
+
+/*
+ * How much a READ may return: at most max_read_size and what the
+ * transport carries and, for reads of several chunks, no buffers for what
+ * the cached attributes say is past the end of the file.
+ */
+static uint32_t read_count(struct rpc_context *rpc, struct inode *inode, uint64_t offset, uint32_t count)
+{
+    fattr3 attr;
+
+    if (count > max_read_size)
+        count = max_read_size;
+    if (count > rpc_max_transfer(rpc))
+        count = rpc_max_transfer(rpc);
+    if (count <= POOL_CHUNK_SIZE || backend->getattr(inode, &attr) != NFS3_OK)
+        return count;
+    if (offset >= attr.size)
+        return 0;
+    return attr.size - offset < count ? attr.size - offset : count;
+}
+
+// Reply to a successful read, without the data
+static void fill_read_reply(struct backend_io *io, READ3res *reply)
+{
+    READ3resok *resok = &reply->READ3res_u.resok;
+    reply->status = NFS3_OK;
+    resok->file_attributes.attributes_follow = TRUE;
+    resok->file_attributes.post_op_attr_u.attributes = io->attr;
+    resok->count = io->done;
+    resok->eof = io->eof;
+    resok->data.data_len = io->done;
+}
+
+/*
+ * Reply to a read into io->iov. Bigger reads are sent from the chunks
+ * rather than copied; the chunks the reply took are removed from io->iov.
+ */
+static void reply_read(struct rpc_context *rpc, struct rpc_msg *call, struct backend_io *io)
+{
+    READ3res reply;
+    uint32_t left = io->done;
+    int n;
+
+    if (io->status == NFS3_OK && io->done >= SENDFILE_MIN_READ)
+    {
+        // Chunks past the data stay with the caller
+        for (n = 0; left > 0; n++)
+        {
+            if (io->iov[n].iov_len > left)
+                io->iov[n].iov_len = left;
+            left -= io->iov[n].iov_len;
+        }
+        fill_read_reply(io, &reply);
+        if (rpc_send_reply_chunks(rpc, call, &reply, (zdrproc_t)zdr_READ3res_head, io->iov, n, io_buffer_put) == 0)
+        {
+            io->iov += n;
+            io->iovcnt -= n;
+            if (backend->readahead)
+                backend->readahead(io->inode, rpc, io->offset, io->done);
+            return;
+        }
+        // Not a TCP connection, a short read of the first chunk fits better
+        if (n > 1)
+        {
+            io->done = io->iov[0].iov_len;
+            io->eof = 0;
+        }
+    }
+    if (io->status == NFS3_OK)
+    {
+        fill_read_reply(io, &reply);
+        reply.READ3res_u.resok.data.data_val = io->iovcnt ? io->iov[0].iov_base : NULL;
+    }
+    else
+    {
+        reply.status = io->status;
+        get_post_op_attr(io->inode, &reply.READ3res_u.resfail.file_attributes);
+    }
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_READ3res, sizeof(READ3res));
+    if (io->status == NFS3_OK && backend->readahead)
+        backend->readahead(io->inode, rpc, io->offset, io->done);
+}
+
+static void send_read_reply(struct rpc_context *rpc, struct rpc_msg *call, void *private_data)
+{
+    struct io_call *c = private_data;
+    struct backend_io *io = &c->io;
+
+    if (rpc)
+        reply_read(rpc, call, io);
+    put_chunks(io->iov, io->iovcnt);
+    backend->inode_put(io->inode);
+}
+
+// Synchronous read into io->iov, chunk by chunk
+static nfsstat3 read_chunks(struct backend_io *io, struct nfs_cred *cred)
+{
+    nfsstat3 status;
+    uint32_t done;
+    int i;
+
+    for (i = 0; i < io->iovcnt && !io->eof; i++)
+    {
+        status = backend->read(io->inode, cred, io->offset + io->done, io->iov[i].iov_len, io->iov[i].iov_base, &done, &io->eof, &io->attr);
+        if (status != NFS3_OK)
+            return status;
+        io->done += done;
+        if (done < io->iov[i].iov_len)
+            break;
+    }
+    return NFS3_OK;
+}
+
 static int nfs3_read_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     READ3args *args = call->body.cbody.args;
-    READ3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_READ3res, sizeof(READ3res));
+    struct call_export ex;
+    struct iovec chunks[MAX_CHUNKS];
+    struct backend_io io;
+    struct nfs_cred cred;
+    struct inode *inode = get_inode(rpc, &args->file, &ex, &io.status);
+    uint32_t count = inode ? read_count(rpc, inode, args->offset, args->count) : 0;
+    struct io_call *c;
+    int fd, n = -1;
+
+    get_cred(call, ex.rule, &cred);
+    if (inode && backend->read_async && io_ring_ready() && (n = get_chunks(chunks, count)) >= 0)
+    {
+        if ((c = io_call_begin(rpc, call, inode, send_read_reply)) != NULL)
+        {
+            c->io.offset = args->offset;
+            c->io.count = count;
+            c->io.iov = rpc_defer_alloc(c->deferred, (n ? n : 1) * sizeof(struct iovec));
+            if (c->io.iov == NULL)
+            {
+                put_chunks(chunks, n);
+                c->io.status = NFS3ERR_SERVERFAULT;
+                io_call_complete(&c->io);
+                return 0;
+            }
+            memcpy(c->io.iov, chunks, n * sizeof(struct iovec));
+            c->io.iovcnt = n;
+            backend->read_async(&c->io, &cred);
+            return 0;
+        }
+        put_chunks(chunks, n);
+        n = -1;
+    }
+    io.inode = inode;
+    io.offset = args->offset;
+    io.count = count;
+    io.iov = chunks;
+    io.iovcnt = 0;
+    io.done = 0;
+    io.eof = 0;
+    if (inode && backend->read_fd)
+    {
+        // Also where reads go when the pool is used up, they don't need buffers
+        io.status = backend->read_fd(inode, &cred, args->offset, count, &fd, &io.done, &io.eof, &io.attr);
+        if (io.status == NFS3_OK && io.done >= SENDFILE_MIN_READ)
+        {
+            // Only the headers are encoded, the data goes from the page cache to the socket
+            READ3res reply;
+            fill_read_reply(&io, &reply);
+            if (rpc_send_reply_fd(rpc, call, &reply, (zdrproc_t)zdr_READ3res_head, fd, args->offset, io.done) == 0)
+            {
+                if (backend->readahead)
+                    backend->readahead(inode, rpc, args->offset, io.done);
+                backend->inode_put(inode);
+                return 0;
+            }
+        }
+        io.done = 0;
+        io.eof = 0;
+    }
+    if (io.status == NFS3_OK && count < SENDFILE_MIN_READ)
+    {
+        // Small reads are copied into the reply anyway
+        chunks[0].iov_base = rpc_alloc(count ? count : 1);
+        chunks[0].iov_len = count;
+        io.iovcnt = 1;
+        io.status = read_chunks(&io, &cred);
+        n = 0;
+    }
+    else if (io.status == NFS3_OK)
+    {
+        // Over budget the client is asked to retry later
+        if ((n = get_chunks(chunks, count)) < 0)
+            io.status = NFS3ERR_JUKEBOX;
+        else
+        {
+            io.iovcnt = n;
+            io.status = read_chunks(&io, &cred);
+        }
+    }
+    reply_read(rpc, call, &io);
+    // Whatever the reply didn't take, unless it was call memory
+    if (n > 0)
+        put_chunks(io.iov, io.iovcnt);
+    backend->inode_put(inode);
     return 0;
 }
 
+/*
+ * WRITE3args decoder that leaves the data in the receive buffer instead of
+ * copying it, so it goes from there straight to the backend. The data is
+ * only valid until the proc returns.
+ */
+static bool_t zdr_WRITE3args_inplace(ZDR *zdrs, WRITE3args *args)
+{
+    uint32_t len;
+    if (!zdr_nfs_fh3(zdrs, &args->file) ||
+        !zdr_offset3(zdrs, &args->offset) ||
+        !zdr_count3(zdrs, &args->count) ||
+        !zdr_stable_how(zdrs, &args->stable))
+        return FALSE;
+    // There's nothing to free, the data belongs to the receive buffer
+    if (zdrs->x_op != ZDR_DECODE)
+        return zdrs->x_op == ZDR_FREE;
+    if (!zdr_u_int(zdrs, &args->data.data_len))
+        return FALSE;
+    len = (args->data.data_len + 3) & ~3u;
+    if (len < args->data.data_len || len > (uint32_t)(zdrs->size - zdrs->pos))
+        return FALSE;
+    args->data.data_val = zdrs->buf + zdrs->pos;
+    zdrs->pos += len;
+    return TRUE;
+}
+
+static void reply_write(struct rpc_context *rpc, struct rpc_msg *call, struct backend_io *io)
+{
+    WRITE3res reply;
+
+    reply.status = io->status;
+    if (reply.status == NFS3_OK)
+    {
+        WRITE3resok *resok = &reply.WRITE3res_u.resok;
+        resok->file_wcc = io->wcc;
+        resok->count = io->done;
+        // Writes are performed with exactly the requested stability
+        resok->committed = io->stable;
+        backend->write_verf(resok->verf);
+    }
+    else
+        reply.WRITE3res_u.resfail.file_wcc = io->wcc;
+    rpc_send_reply_drc(rpc, call, &reply, (zdrproc_t)zdr_WRITE3res, sizeof(WRITE3res));
+}
+
 static int nfs3_write_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     WRITE3args *args = call->body.cbody.args;
-    WRITE3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_WRITE3res, sizeof(WRITE3res));
+    struct call_export ex;
+    struct backend_io io = { 0 };
+    struct nfs_cred cred;
+    struct inode *inode;
+    uint32_t count = args->count < args->data.data_len ? args->count : args->data.data_len;
+    if (rpc_drc_begin(rpc, call))
+        return 0;
+    if (count > max_write_size)
+        count = max_write_size;
+    inode = inode_to_change(rpc, &args->file, &ex, &io.status);
+    get_cred(call, ex.rule, &cred);
+    /*
+     * The data is written straight from the receive buffer. It belongs to
+     * libnfs and is reused when the proc returns, so an asynchronous write
+     * would have to copy it first; buffered writes rarely wait anyway.
+     */
+    io.stable = args->stable;
+    if (inode)
+        io.status = backend->write(inode, &cred, args->offset, count, args->data.data_val, args->stable, &io.done, &io.wcc);
+    reply_write(rpc, call, &io);
+    backend->inode_put(inode);
     return 0;
 }
 
+/*
+ * Common reply for CREATE, MKDIR, SYMLINK and MKNOD, their results
+ * only differ in type names.
+ */
+static void fill_create_reply(nfsstat3 status, struct inode *dir, struct inode *child, int export, CREATE3res *reply)
+{
+    reply->status = status;
+    if (status == NFS3_OK)
+    {
+        get_post_op_fh(child, export, &reply->CREATE3res_u.resok.obj);
+        get_post_op_attr(child, &reply->CREATE3res_u.resok.obj_attributes);
+        get_wcc(dir, &reply->CREATE3res_u.resok.dir_wcc);
+    }
+    else
+        get_wcc(dir, &reply->CREATE3res_u.resfail.dir_wcc);
+}
+
 static int nfs3_create_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     CREATE3args *args = call->body.cbody.args;
+    struct call_export ex;
     CREATE3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_CREATE3res, sizeof(CREATE3res));
+    struct nfs_cred cred;
+    nfsstat3 status;
+    struct inode *dir;
+    struct inode *child = NULL;
+    if (rpc_drc_begin(rpc, call))
+        return 0;
+    dir = inode_to_change(rpc, &args->where.dir, &ex, &status);
+    get_cred(call, ex.rule, &cred);
+    if (dir)
+        status = backend->create(dir, &cred, args->where.name, &args->how, &child);
+    fill_create_reply(status, dir, child, ex.index, &reply);
+    rpc_send_reply_drc(rpc, call, &reply, (zdrproc_t)zdr_CREATE3res, sizeof(CREATE3res));
+    backend->inode_put(child);
+    backend->inode_put(dir);
     return 0;
 }
 
 static int nfs3_mkdir_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     MKDIR3args *args = call->body.cbody.args;
-    MKDIR3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_MKDIR3res, sizeof(MKDIR3res));
+    struct call_export ex;
+    CREATE3res reply;
+    struct nfs_cred cred;
+    nfsstat3 status;
+    struct inode *dir;
+    struct inode *child = NULL;
+    if (rpc_drc_begin(rpc, call))
+        return 0;
+    dir = inode_to_change(rpc, &args->where.dir, &ex, &status);
+    get_cred(call, ex.rule, &cred);
+    if (dir)
+        status = backend->mkdir(dir, &cred, args->where.name, &args->attributes, &child);
+    fill_create_reply(status, dir, child, ex.index, &reply);
+    rpc_send_reply_drc(rpc, call, &reply, (zdrproc_t)zdr_MKDIR3res, sizeof(MKDIR3res));
+    backend->inode_put(child);
+    backend->inode_put(dir);
     return 0;
 }
 
 static int nfs3_symlink_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     SYMLINK3args *args = call->body.cbody.args;
-    SYMLINK3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_SYMLINK3res, sizeof(SYMLINK3res));
+    struct call_export ex;
+    CREATE3res reply;
+    struct nfs_cred cred;
+    nfsstat3 status;
+    struct inode *dir;
+    struct inode *child = NULL;
+    if (rpc_drc_begin(rpc, call))
+        return 0;
+    dir = inode_to_change(rpc, &args->where.dir, &ex, &status);
+    get_cred(call, ex.rule, &cred);
+    if (dir)
+    {
+        status = backend->symlink(dir, &cred, args->where.name, args->symlink.symlink_data,
+            &args->symlink.symlink_attributes, &child);
+    }
+    fill_create_reply(status, dir, child, ex.index, &reply);
+    rpc_send_reply_drc(rpc, call, &reply, (zdrproc_t)zdr_SYMLINK3res, sizeof(SYMLINK3res));
+    backend->inode_put(child);
+    backend->inode_put(dir);
     return 0;
 }
 
 static int nfs3_mknod_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     MKNOD3args *args = call->body.cbody.args;
-    MKNOD3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_MKNOD3res, sizeof(MKNOD3res));
+    struct call_export ex;
+    CREATE3res reply;
+    struct nfs_cred cred;
+    nfsstat3 status;
+    struct inode *dir;
+    struct inode *child = NULL;
+    if (rpc_drc_begin(rpc, call))
+        return 0;
+    dir = inode_to_change(rpc, &args->where.dir, &ex, &status);
+    get_cred(call, ex.rule, &cred);
+    if (dir)
+        status = backend->mknod(dir, &cred, args->where.name, &args->what, &child);
+    fill_create_reply(status, dir, child, ex.index, &reply);
+    rpc_send_reply_drc(rpc, call, &reply, (zdrproc_t)zdr_MKNOD3res, sizeof(MKNOD3res));
+    backend->inode_put(child);
+    backend->inode_put(dir);
     return 0;
 }
 
 static int nfs3_remove_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     REMOVE3args *args = call->body.cbody.args;
+    struct call_export ex;
     REMOVE3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_REMOVE3res, sizeof(REMOVE3res));
+    struct nfs_cred cred;
+    struct inode *dir;
+    if (rpc_drc_begin(rpc, call))
+        return 0;
+    dir = inode_to_change(rpc, &args->object.dir, &ex, &reply.status);
+    get_cred(call, ex.rule, &cred);
+    if (dir)
+        reply.status = backend->remove(dir, &cred, args->object.name);
+    // resok and resfail are the same
+    get_wcc(dir, &reply.REMOVE3res_u.resok.dir_wcc);
+    rpc_send_reply_drc(rpc, call, &reply, (zdrproc_t)zdr_REMOVE3res, sizeof(REMOVE3res));
+    backend->inode_put(dir);
     return 0;
 }
 
 static int nfs3_rmdir_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     RMDIR3args *args = call->body.cbody.args;
+    struct call_export ex;
     RMDIR3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_RMDIR3res, sizeof(RMDIR3res));
+    struct nfs_cred cred;
+    struct inode *dir;
+    if (rpc_drc_begin(rpc, call))
+        return 0;
+    dir = inode_to_change(rpc, &args->object.dir, &ex, &reply.status);
+    get_cred(call, ex.rule, &cred);
+    if (dir)
+        reply.status = backend->rmdir(dir, &cred, args->object.name);
+    get_wcc(dir, &reply.RMDIR3res_u.resok.dir_wcc);
+    rpc_send_reply_drc(rpc, call, &reply, (zdrproc_t)zdr_RMDIR3res, sizeof(RMDIR3res));
+    backend->inode_put(dir);
     return 0;
 }
 
 static int nfs3_rename_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     RENAME3args *args = call->body.cbody.args;
+    struct call_export ex;
     RENAME3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_RENAME3res, sizeof(RENAME3res));
+    struct nfs_cred cred;
+    struct inode *from_dir, *to_dir;
+    if (rpc_drc_begin(rpc, call))
+        return 0;
+    from_dir = inode_to_change(rpc, &args->from.dir, &ex, &reply.status);
+    to_dir = from_dir ? get_inode_in(rpc, &args->to.dir, &ex, &reply.status) : NULL;
+    get_cred(call, ex.rule, &cred);
+    if (from_dir && to_dir)
+        reply.status = backend->rename(from_dir, args->from.name, to_dir, args->to.name, &cred);
+    get_wcc(from_dir, &reply.RENAME3res_u.resok.fromdir_wcc);
+    get_wcc(to_dir, &reply.RENAME3res_u.resok.todir_wcc);
+    rpc_send_reply_drc(rpc, call, &reply, (zdrproc_t)zdr_RENAME3res, sizeof(RENAME3res));
+    backend->inode_put(to_dir);
+    backend->inode_put(from_dir);
     return 0;
 }
 
 static int nfs3_link_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     LINK3args *args = call->body.cbody.args;
+    struct call_export ex;
     LINK3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_LINK3res, sizeof(LINK3res));
+    struct nfs_cred cred;
+    struct inode *inode, *dir;
+    if (rpc_drc_begin(rpc, call))
+        return 0;
+    inode = inode_to_change(rpc, &args->file, &ex, &reply.status);
+    dir = inode ? get_inode_in(rpc, &args->link.dir, &ex, &reply.status) : NULL;
+    get_cred(call, ex.rule, &cred);
+    if (inode && dir)
+        reply.status = backend->link(inode, dir, args->link.name, &cred);
+    get_post_op_attr(inode, &reply.LINK3res_u.resok.file_attributes);
+    get_wcc(dir, &reply.LINK3res_u.resok.linkdir_wcc);
+    rpc_send_reply_drc(rpc, call, &reply, (zdrproc_t)zdr_LINK3res, sizeof(LINK3res));
+    backend->inode_put(dir);
+    backend->inode_put(inode);
+    return 0;
+}
+
+/*
+ * Directory listing state. Sizes are estimates of the encoded reply so
+ * that it fits into the client's dircount and maxcount.
+ */
+struct readdir_state
+{
+    struct inode *dir;
+    int export;
+    struct nfs_cred *cred;
+    uint32_t dircount, maxcount;
+    uint32_t dirsize, size;
+    int count, alloc;
+    entry3 *entries;
+    entryplus3 *plus_entries;
+    struct inode **children;
+};
+
+// status, directory attributes, verifier, end of list and eof
+#define READDIR_REPLY_SIZE (4 + 4+84 + 8 + 4 + 4)
+
+// Grows an array allocated with rpc_alloc()
+static void *grow_array(void *array, uint32_t count, uint32_t alloc, size_t size)
+{
+    void *grown = rpc_alloc(alloc*size);
+    if (count)
+        memcpy(grown, array, count*size);
+    return grown;
+}
+
+static char *copy_name(const char *name, uint32_t len)
+{
+    char *copy = rpc_alloc(len + 1);
+    memcpy(copy, name, len + 1);
+    return copy;
+}
+
+static int readdir_add(void *private_data, const char *name, uint64_t ino, uint64_t cookie)
+{
+    struct readdir_state *st = private_data;
+    uint32_t len = strlen(name);
+    // value follows, fileid, name and cookie
+    uint32_t size = 4 + 8 + 4 + ((len+3) & ~3) + 8;
+    entry3 *entry;
+    if (st->size + size > st->maxcount)
+        return 1;
+    if (st->count >= st->alloc)
+    {
+        st->alloc = st->alloc ? st->alloc*2 : 32;
+        st->entries = grow_array(st->entries, st->count, st->alloc, sizeof(entry3));
+    }
+    entry = &st->entries[st->count++];
+    entry->fileid = ino;
+    entry->name = copy_name(name, len);
+    entry->cookie = cookie;
+    st->size += size;
+    return 0;
+}
+
+static int readdirplus_add(void *private_data, const char *name, uint64_t ino, uint64_t cookie)
+{
+    struct readdir_state *st = private_data;
+    uint32_t len = strlen(name);
+    uint32_t dirsize = 8 + 4 + ((len+3) & ~3) + 8;
+    uint32_t size = 4 + dirsize + 4 + 4;
+    struct inode *child = NULL;
+    entryplus3 *entry;
+    post_op_fh3 fh;
+    fattr3 attr;
+    if (st->dirsize + dirsize > st->dircount)
+        return 1;
+    // The export root stands in for its parent, as in LOOKUP
+    if (!strcmp(name, "..") && export_is_root(st->export, st->dir))
+        backend->lookup(st->dir, st->cred, ".", &child, &attr);
+    else
+        backend->lookup(st->dir, st->cred, name, &child, &attr);
+    get_post_op_fh(child, st->export, &fh);
+    if (child)
+        size += 84 + 4 + ((fh.post_op_fh3_u.handle.data.data_len+3) & ~3);
+    if (st->size + size > st->maxcount)
+    {
+        backend->inode_put(child);
+        return 1;
+    }
+    if (st->count >= st->alloc)
+    {
+        st->alloc = st->alloc ? st->alloc*2 : 32;
+        st->plus_entries = grow_array(st->plus_entries, st->count, st->alloc, sizeof(entryplus3));
+        st->children = grow_array(st->children, st->count, st->alloc, sizeof(struct inode *));
+    }
+    entry = &st->plus_entries[st->count];
+    st->children[st->count++] = child;
+    entry->fileid = ino;
+    entry->name = copy_name(name, len);
+    entry->cookie = cookie;
+    entry->name_attributes.attributes_follow = child != NULL;
+    if (child)
+        entry->name_attributes.post_op_attr_u.attributes = attr;
+    entry->name_handle = fh;
+    st->dirsize += dirsize;
+    st->size += size;
     return 0;
 }
 
 static int nfs3_readdir_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     READDIR3args *args = call->body.cbody.args;
+    struct call_export ex;
     READDIR3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_READDIR3res, sizeof(READDIR3res));
+    struct nfs_cred cred;
+    struct readdir_state st = { 0 };
+    struct inode *dir = get_inode(rpc, &args->dir, &ex, &reply.status);
+    int eof = 0, i;
+    get_cred(call, ex.rule, &cred);
+    if (dir)
+    {
+        st.maxcount = args->count < rpc_max_transfer(rpc) ? args->count : rpc_max_transfer(rpc);
+        st.size = READDIR_REPLY_SIZE;
+        reply.status = backend->readdir(dir, &cred, args->cookie, reply.READDIR3res_u.resok.cookieverf, readdir_add, &st, &eof);
+        if (reply.status == NFS3_OK && !st.count && !eof)
+            reply.status = NFS3ERR_TOOSMALL;
+    }
+    if (reply.status == NFS3_OK)
+    {
+        READDIR3resok *resok = &reply.READDIR3res_u.resok;
+        get_post_op_attr(dir, &resok->dir_attributes);
+        for (i = 0; i < st.count; i++)
+            st.entries[i].nextentry = i < st.count-1 ? &st.entries[i+1] : NULL;
+        resok->reply.entries = st.count ? st.entries : NULL;
+        resok->reply.eof = eof;
+    }
+    else
+        get_post_op_attr(dir, &reply.READDIR3res_u.resfail.dir_attributes);
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_READDIR3res, sizeof(READDIR3res));
+    backend->inode_put(dir);
     return 0;
 }
 
 static int nfs3_readdirplus_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     READDIRPLUS3args *args = call->body.cbody.args;
+    struct call_export ex;
     READDIRPLUS3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_READDIRPLUS3res, sizeof(READDIRPLUS3res));
+    struct nfs_cred cred;
+    struct readdir_state st = { 0 };
+    struct inode *dir = get_inode(rpc, &args->dir, &ex, &reply.status);
+    int eof = 0, i;
+    get_cred(call, ex.rule, &cred);
+    if (dir)
+    {
+        st.dir = dir;
+        st.export = ex.index;
+        st.cred = &cred;
+        st.dircount = args->dircount;
+        st.maxcount = args->maxcount < rpc_max_transfer(rpc) ? args->maxcount : rpc_max_transfer(rpc);
+        st.size = READDIR_REPLY_SIZE;
+        reply.status = backend->readdir(dir, &cred, args->cookie, reply.READDIRPLUS3res_u.resok.cookieverf, readdirplus_add, &st, &eof);
+        if (reply.status == NFS3_OK && !st.count && !eof)
+            reply.status = NFS3ERR_TOOSMALL;
+    }
+    if (reply.status == NFS3_OK)
+    {
+        READDIRPLUS3resok *resok = &reply.READDIRPLUS3res_u.resok;
+        get_post_op_attr(dir, &resok->dir_attributes);
+        for (i = 0; i < st.count; i++)
+            st.plus_entries[i].nextentry = i < st.count-1 ? &st.plus_entries[i+1] : NULL;
+        resok->reply.entries = st.count ? st.plus_entries : NULL;
+        resok->reply.eof = eof;
+    }
+    else
+        get_post_op_attr(dir, &reply.READDIRPLUS3res_u.resfail.dir_attributes);
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_READDIRPLUS3res, sizeof(READDIRPLUS3res));
+    for (i = 0; i < st.count; i++)
+        backend->inode_put(st.children[i]);
+    backend->inode_put(dir);
     return 0;
 }
 
 static int nfs3_fsstat_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     FSSTAT3args *args = call->body.cbody.args;
+    struct call_export ex;
     FSSTAT3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_FSSTAT3res, sizeof(FSSTAT3res));
+    struct inode *inode = get_inode(rpc, &args->fsroot, &ex, &reply.status);
+    if (inode)
+        reply.status = backend->fsstat(inode, &reply.FSSTAT3res_u.resok);
+    get_post_op_attr(inode, reply.status == NFS3_OK
+        ? &reply.FSSTAT3res_u.resok.obj_attributes : &reply.FSSTAT3res_u.resfail.obj_attributes);
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_FSSTAT3res, sizeof(FSSTAT3res));
+    backend->inode_put(inode);
     return 0;
 }
 
 static int nfs3_fsinfo_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     FSINFO3args *args = call->body.cbody.args;
+    struct call_export ex;
     FSINFO3res reply;
-    if (args->fsroot.data.data_len != 10)
+    struct inode *inode = get_inode(rpc, &args->fsroot, &ex, &reply.status);
+    uint32_t max = rpc_max_transfer(rpc);
+    if (!inode)
     {
-        // Example error
-        reply.status = NFS3ERR_INVAL;
+        reply.FSINFO3res_u.resfail.obj_attributes.attributes_follow = FALSE;
     }
     else
     {
         // Fill info
         reply.status = NFS3_OK;
-        reply.FSINFO3res_u.resok.obj_attributes.attributes_follow = TRUE;
-        fill_example_fsattr(&reply.FSINFO3res_u.resok.obj_attributes.post_op_attr_u.attributes);
-        reply.FSINFO3res_u.resok.rtmax = 128*1024*1024;
-        reply.FSINFO3res_u.resok.rtpref = 128*1024*1024;
+        get_post_op_attr(inode, &reply.FSINFO3res_u.resok.obj_attributes);
+        reply.FSINFO3res_u.resok.rtmax = max_read_size < max ? max_read_size : max;
+        reply.FSINFO3res_u.resok.rtpref = reply.FSINFO3res_u.resok.rtmax;
         reply.FSINFO3res_u.resok.rtmult = 4096;
-        reply.FSINFO3res_u.resok.wtmax = 128*1024*1024;
-        reply.FSINFO3res_u.resok.wtpref = 128*1024*1024;
+        reply.FSINFO3res_u.resok.wtmax = max_write_size < max ? max_write_size : max;
+        reply.FSINFO3res_u.resok.wtpref = reply.FSINFO3res_u.resok.wtmax;
         reply.FSINFO3res_u.resok.wtmult = 4096;
-        reply.FSINFO3res_u.resok.dtpref = 128;
+        reply.FSINFO3res_u.resok.dtpref = DIR_PREF < max ? DIR_PREF : max;
         reply.FSINFO3res_u.resok.maxfilesize = 0x7fffffffffffffff;
-        reply.FSINFO3res_u.resok.time_delta.seconds = 1;
-        reply.FSINFO3res_u.resok.time_delta.nseconds = 0;
-        reply.FSINFO3res_u.resok.properties = FSF3_SYMLINK | FSF3_HOMOGENEOUS;
+        reply.FSINFO3res_u.resok.time_delta.seconds = 0;
+        reply.FSINFO3res_u.resok.time_delta.nseconds = 1;
+        reply.FSINFO3res_u.resok.properties = FSF3_LINK | FSF3_SYMLINK | FSF3_HOMOGENEOUS | FSF3_CANSETTIME;
     }
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_FSINFO3res, sizeof(FSINFO3res));
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_FSINFO3res, sizeof(FSINFO3res));
+    backend->inode_put(inode);
     return 0;
 }
 
 static int nfs3_pathconf_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     PATHCONF3args *args = call->body.cbody.args;
+    struct call_export ex;
     PATHCONF3res reply;
-    if (args->object.data.data_len != 10)
+    struct inode *inode = get_inode(rpc, &args->object, &ex, &reply.status);
+    if (!inode)
     {
-        // Example error
-        reply.status = NFS3ERR_INVAL;
+        reply.PATHCONF3res_u.resfail.obj_attributes.attributes_follow = FALSE;
     }
     else
     {
         // Fill info
         reply.status = NFS3_OK;
-        reply.PATHCONF3res_u.resok.obj_attributes.attributes_follow = FALSE;
+        get_post_op_attr(inode, &reply.PATHCONF3res_u.resok.obj_attributes);
         reply.PATHCONF3res_u.resok.linkmax = 0;
         reply.PATHCONF3res_u.resok.name_max = 255;
         reply.PATHCONF3res_u.resok.no_trunc = TRUE;
-        reply.PATHCONF3res_u.resok.chown_restricted = FALSE;
+        reply.PATHCONF3res_u.resok.chown_restricted = TRUE;
         reply.PATHCONF3res_u.resok.case_insensitive = FALSE;
         reply.PATHCONF3res_u.resok.case_preserving = TRUE;
     }
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_PATHCONF3res, sizeof(PATHCONF3res));
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_PATHCONF3res, sizeof(PATHCONF3res));
+    backend->inode_put(inode);
     return 0;
 }
 
+static void reply_commit(struct rpc_context *rpc, struct rpc_msg *call, struct backend_io *io)
+{
+    COMMIT3res reply;
+
+    reply.status = io->status;
+    if (reply.status == NFS3_OK)
+    {
+        get_wcc(io->inode, &reply.COMMIT3res_u.resok.file_wcc);
+        backend->write_verf(reply.COMMIT3res_u.resok.verf);
+    }
+    else
+        get_wcc(io->inode, &reply.COMMIT3res_u.resfail.file_wcc);
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_COMMIT3res, sizeof(COMMIT3res));
+}
+
+static void send_commit_reply(struct rpc_context *rpc, struct rpc_msg *call, void *private_data)
+{
+    struct io_call *c = private_data;
+    if (rpc)
+        reply_commit(rpc, call, &c->io);
+    backend->inode_put(c->io.inode);
+}
+
 static int nfs3_commit_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     COMMIT3args *args = call->body.cbody.args;
-    COMMIT3res reply;
-    
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_COMMIT3res, sizeof(COMMIT3res));
+    struct call_export ex;
+    struct backend_io io;
+    struct inode *inode = get_inode(rpc, &args->file, &ex, &io.status);
+    struct io_call *c;
+    if (inode && backend->commit_async && (c = io_call_begin(rpc, call, inode, send_commit_reply)) != NULL)
+    {
+        c->io.offset = args->offset;
+        c->io.count = args->count;
+        backend->commit_async(&c->io);
+        return 0;
+    }
+    io.inode = inode;
+    if (inode)
+        io.status = backend->commit(inode, args->offset, args->count);
+    reply_commit(rpc, call, &io);
+    backend->inode_put(inode);
     return 0;
 }
 
+// The MNT status of resolving an export path
+static mountstat3 mount_status(nfsstat3 status)
+{
+    switch (status)
+    {
+    case NFS3_OK:
+    case NFS3ERR_NOENT:
+    case NFS3ERR_ACCES:
+    case NFS3ERR_NOTDIR:
+    case NFS3ERR_NAMETOOLONG:
+        // The same numbers
+        return (mountstat3)status;
+    default:
+        return MNT3ERR_IO;
+    }
+}
+
 static int mount3_mnt_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     dirpath *arg = call->body.cbody.args;
-    int flavor = AUTH_NONE;
+    int flavors[] = { AUTH_UNIX, AUTH_NONE };
+    const struct export_rule *rule;
+    struct inode *inode = NULL;
+    struct export *export;
+    char fh[NFS3_FHSIZE];
+    uint8_t addr[16];
     mountres3 reply;
-    reply.fhs_status = MNT3_OK;
-    reply.mountres3_u.mountinfo.fhandle.fhandle3_len = 10;
-    reply.mountres3_u.mountinfo.fhandle.fhandle3_val = "roothandle";
-    reply.mountres3_u.mountinfo.auth_flavors.auth_flavors_len = 1;
-    reply.mountres3_u.mountinfo.auth_flavors.auth_flavors_val = &flavor;
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_mountres3, sizeof(mountres3));
+    rpc_client_addr(rpc, addr);
+    if ((export = export_find(*arg, addr, &rule)) == NULL)
+        reply.fhs_status = MNT3ERR_NOENT;
+    else if (rule == NULL)
+        reply.fhs_status = MNT3ERR_ACCES;
+    else
+        reply.fhs_status = mount_status(export_lookup(export, *arg, &inode));
+    if (reply.fhs_status == MNT3_OK)
+    {
+        reply.mountres3_u.mountinfo.fhandle.fhandle3_len = backend->inode_to_fh(inode, export->index, fh);
+        reply.mountres3_u.mountinfo.fhandle.fhandle3_val = fh;
+        reply.mountres3_u.mountinfo.auth_flavors.auth_flavors_len = 2;
+        reply.mountres3_u.mountinfo.auth_flavors.auth_flavors_val = flavors;
+        mount_add(addr, *arg);
+    }
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_mountres3, sizeof(mountres3));
+    backend->inode_put(inode);
     return 0;
 }
 
 static int mount3_dump_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
-    mountlist reply;
-    reply = (struct mountbody*)malloc(sizeof(struct mountbody));
-    reply->ml_hostname = "10.0.2.15";
-    reply->ml_directory = "/test";
-    reply->ml_next = NULL;
-    rpc_send_reply(rpc, call, NULL, (zdrproc_t)zdr_mountlist, sizeof(mountlist));
-    free(reply);
+    mountlist reply = mount_list();
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_mountlist, sizeof(mountlist));
     return 0;
 }
 
 static int mount3_umnt_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
     dirpath *arg = call->body.cbody.args;
-    // do nothing
-    rpc_send_reply(rpc, call, NULL, (zdrproc_t)zdr_void, 0);
+    uint8_t addr[16];
+    rpc_client_addr(rpc, addr);
+    mount_remove(addr, *arg);
+    rpc_reply(rpc, call, NULL, (zdrproc_t)zdr_void, 0);
     return 0;
 }
 
 static int mount3_umntall_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
-    // do nothing
-    rpc_send_reply(rpc, call, NULL, (zdrproc_t)zdr_void, 0);
+    uint8_t addr[16];
+    rpc_client_addr(rpc, addr);
+    mount_remove(addr, NULL);
+    rpc_reply(rpc, call, NULL, (zdrproc_t)zdr_void, 0);
     return 0;
 }
 
 static int mount3_export_proc(struct rpc_context *rpc, struct rpc_msg *call)
 {
-    exports reply;
-    reply = (struct exportnode*)malloc(sizeof(struct exportnode) + sizeof(struct groupnode));
-    reply->ex_dir = "/test";
-    reply->ex_groups = (struct groupnode*)(reply+1);
-    reply->ex_groups->gr_name = "10.0.2.15";
-    reply->ex_groups->gr_next = NULL;
-    reply->ex_next = NULL;
-    rpc_send_reply(rpc, call, &reply, (zdrproc_t)zdr_exports, sizeof(exports));
-    free(reply);
+    exports reply = NULL, *tail = &reply;
+    struct groupnode **group_tail;
+    struct export_rule *rule;
+    struct export *export;
+    for (export = export_table; export; export = export->next)
+    {
+        if ((*tail = rpc_alloc(sizeof(struct exportnode))) == NULL)
+            break;
+        (*tail)->ex_dir = export->path;
+        (*tail)->ex_next = NULL;
+        group_tail = &(*tail)->ex_groups;
+        for (rule = export->rules; rule && (*group_tail = rpc_alloc(sizeof(struct groupnode))) != NULL; rule = rule->next)
+        {
+            (*group_tail)->gr_name = rule->client;
+            group_tail = &(*group_tail)->gr_next;
+        }
+        *group_tail = NULL;
+        tail = &(*tail)->ex_next;
+    }
+    rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_exports, sizeof(exports));
     return 0;
 }
 
@@ -328,7 +1200,7 @@ struct service_proc nfs3_pt[22] = {
     {NFS3_ACCESS,      nfs3_access_proc,      (zdrproc_t)zdr_ACCESS3args,      sizeof(ACCESS3args)},
     {NFS3_READLINK,    nfs3_readlink_proc,    (zdrproc_t)zdr_READLINK3args,    sizeof(READLINK3args)},
     {NFS3_READ,        nfs3_read_proc,        (zdrproc_t)zdr_READ3args,        sizeof(READ3args)},
-    {NFS3_WRITE,       nfs3_write_proc,       (zdrproc_t)zdr_WRITE3args,       sizeof(WRITE3args)},
+    {NFS3_WRITE,       nfs3_write_proc,       (zdrproc_t)zdr_WRITE3args_inplace, sizeof(WRITE3args)},
     {NFS3_CREATE,      nfs3_create_proc,      (zdrproc_t)zdr_CREATE3args,      sizeof(CREATE3args)},
     {NFS3_MKDIR,       nfs3_mkdir_proc,       (zdrproc_t)zdr_MKDIR3args,       sizeof(MKDIR3args)},
     {NFS3_SYMLINK,     nfs3_symlink_proc,     (zdrproc_t)zdr_SYMLINK3args,     sizeof(SYMLINK3args)},
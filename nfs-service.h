@@ -1,11 +1,137 @@
 #pragma once
 
 #include <sys/time.h>
+#include <sys/uio.h>
 #include "libnfs.h"
 #include "libnfs-raw.h"
 #include "libnfs-raw-mount.h"
 #include "libnfs-raw-nfs.h"
+#include "libnfs-raw-nfs4.h"
 #include "libnfs-raw-portmap.h"
 
 extern struct service_proc nfs3_pt[22];
 extern struct service_proc nfs3_mount_pt[6];
+extern struct service_proc nfs4_pt[2];
+
+/*
+ * Largest READ and WRITE transfers, advertised by FSINFO and enforced:
+ * longer READs return less data and longer WRITEs write less, as the
+ * protocol allows.
+ */
+#define MAX_TRANSFER (128*1024*1024)
+
+extern uint32_t max_read_size;
+extern uint32_t max_write_size;
+
+/*
+ * Largest transfer or directory listing the transport of the call can
+ * carry in one reply: UDP_MAX_TRANSFER for calls that came over UDP, where
+ * a reply must fit into a datagram, MAX_TRANSFER otherwise. FSINFO
+ * advertises no more and longer requests are shortened to it.
+ */
+#define UDP_MAX_TRANSFER (32*1024)
+
+uint32_t rpc_max_transfer(struct rpc_context *rpc);
+
+/*
+ * Service procs reply with rpc_reply() instead of rpc_send_reply(). It
+ * takes the same arguments and also handles calls that came in over UDP,
+ * which libnfs doesn't see.
+ */
+int rpc_reply(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, int alloc_hint);
+
+/*
+ * Call-scoped memory for temporaries of the proc, e.g. the data of the
+ * reply. It is released all at once when the proc returns and must not be
+ * freed, nor used by deferred replies, which outlive the call.
+ */
+void *rpc_alloc(size_t size);
+
+/*
+ * The client of the call: its address, IPv4 addresses mapped to IPv6, and
+ * the rule that admits it to the export with index export, see
+ * nfs-export.h, or NULL if it isn't admitted. NFS calls of clients that
+ * aren't admitted to any export are rejected before they reach the procs.
+ */
+struct export_rule;
+
+void rpc_client_addr(struct rpc_context *rpc, uint8_t *addr);
+const struct export_rule *rpc_client_rule(struct rpc_context *rpc, int export);
+
+/*
+ * Deferred replies.
+ *
+ * A service proc that can't answer right away (e.g. because it waits for
+ * backend I/O) calls rpc_defer_reply() and returns without replying.
+ * Later, from a completion callback or any other thread, it calls
+ * rpc_complete_deferred(). The send callback then runs on the event loop
+ * that owns the connection and should call rpc_reply() as usual.
+ * If the client has disconnected in the meantime, the callback is called
+ * with rpc == NULL and must only release private_data.
+ */
+struct deferred_reply;
+typedef void (*deferred_send_fn)(struct rpc_context *rpc, struct rpc_msg *call, void *private_data);
+
+struct deferred_reply *rpc_defer_reply(struct rpc_context *rpc, struct rpc_msg *call);
+void rpc_complete_deferred(struct deferred_reply *deferred, deferred_send_fn send, void *private_data);
+
+/*
+ * Room for the state of a deferred call: DEFERRED_STATE_SIZE bytes, 8 byte
+ * aligned, that live until the send callback has returned.
+ */
+#define DEFERRED_STATE_SIZE 512
+
+void *rpc_defer_state(struct deferred_reply *deferred);
+
+// More memory for a deferred call, released with its state
+void *rpc_defer_alloc(struct deferred_reply *deferred, size_t size);
+
+/*
+ * WRITE payloads are decoded in place and are only valid while the proc
+ * runs. A proc that defers its reply and keeps the data until then must
+ * copy it and account for the copy with rpc_defer_hold_data(), on the
+ * thread that received the call. A connection that holds more than
+ * max_write_data bytes stops reading requests until replies release it.
+ */
+extern uint32_t max_write_data;
+
+void rpc_defer_hold_data(struct deferred_reply *deferred, size_t len);
+
+/*
+ * Zero-copy replies.
+ *
+ * Sends an accepted reply whose body is encoded by encode_fn, followed by
+ * len bytes of fd starting at offset and XDR padding. The file data goes
+ * to the socket with sendfile() and is never copied to user space; the
+ * encoded part must end with the opaque length. fd only has to stay valid
+ * until the call returns. Returns -1 if the reply can't be sent this way
+ * (e.g. the call didn't come in on a TCP connection); the caller should
+ * then send a regular reply.
+ */
+int rpc_send_reply_fd(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, int fd, uint64_t offset, uint32_t len);
+
+// Smaller reads are cheaper to copy than to send in three pieces
+#define SENDFILE_MIN_READ (16*1024)
+
+/*
+ * The same with the data in memory, count chunks that are sent without
+ * being copied into the reply, each as a record fragment of its own. On
+ * success the reply takes over the buffers, not the array, and gives each
+ * back with release(), on this thread, as soon as it has been written.
+ */
+int rpc_send_reply_chunks(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, struct iovec *chunks, int count,
+    void (*release)(char *buf));
+
+/*
+ * Duplicate request cache.
+ *
+ * Non-idempotent procs call rpc_drc_begin() before doing anything. If it
+ * returns non-zero the call is a retransmission that has been answered
+ * from the cache or is still in progress, and the proc must return
+ * without replying. Otherwise the proc replies with rpc_send_reply_drc(),
+ * which works like rpc_reply() and keeps a copy of the encoded reply.
+ * A deferred send callback may also call it with rpc == NULL, then the
+ * reply is only kept for when the client retransmits the call.
+ */
+int rpc_drc_begin(struct rpc_context *rpc, struct rpc_msg *call);
+int rpc_send_reply_drc(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, int alloc_hint);
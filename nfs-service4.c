@@ -0,0 +1,1139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "nfs-service.h"
+#include "nfs-backend.h"
+#include "nfs-export.h"
+
+/*
+ * NFSv4.0 service.
+ *
+ * Everything goes through COMPOUND, whose operations run in order against
+ * a current filehandle until one of them fails. Filehandles are the nfs3
+ * ones and objects are reached through the same backend, so v3 and v4
+ * clients share the export and its caches. Clients find the root with
+ * PUTROOTFH and walk down with LOOKUP, there's no MOUNT protocol and no
+ * need for the portmapper.
+ *
+ * The server keeps no open state. OPEN checks access and hands out a
+ * stateid that READ and WRITE accept like any other, CLOSE has nothing to
+ * release. Client IDs only carry the time the server started, so that
+ * clients notice a restart and set up their client ID again.
+ */
+
+#define LEASE_TIME 90
+
+#define ATTR(n) ((uint64_t)1 << (n))
+
+// Attributes that only come from fsstat()
+#define FSSTAT_ATTRS (ATTR(FATTR4_FILES_AVAIL) | ATTR(FATTR4_FILES_FREE) | ATTR(FATTR4_FILES_TOTAL) | \
+    ATTR(FATTR4_SPACE_AVAIL) | ATTR(FATTR4_SPACE_FREE) | ATTR(FATTR4_SPACE_TOTAL))
+
+// Attributes SETATTR and OPEN can set
+#define SETTABLE_ATTRS (ATTR(FATTR4_SIZE) | ATTR(FATTR4_MODE) | ATTR(FATTR4_OWNER) | ATTR(FATTR4_OWNER_GROUP) | \
+    ATTR(FATTR4_TIME_ACCESS_SET) | ATTR(FATTR4_TIME_MODIFY_SET))
+
+static const uint64_t supported_attrs =
+    ATTR(FATTR4_SUPPORTED_ATTRS) | ATTR(FATTR4_TYPE) | ATTR(FATTR4_FH_EXPIRE_TYPE) | ATTR(FATTR4_CHANGE) |
+    ATTR(FATTR4_SIZE) | ATTR(FATTR4_LINK_SUPPORT) | ATTR(FATTR4_SYMLINK_SUPPORT) | ATTR(FATTR4_NAMED_ATTR) |
+    ATTR(FATTR4_FSID) | ATTR(FATTR4_UNIQUE_HANDLES) | ATTR(FATTR4_LEASE_TIME) | ATTR(FATTR4_RDATTR_ERROR) |
+    ATTR(FATTR4_CANSETTIME) | ATTR(FATTR4_CASE_INSENSITIVE) | ATTR(FATTR4_CASE_PRESERVING) |
+    ATTR(FATTR4_CHOWN_RESTRICTED) | ATTR(FATTR4_FILEHANDLE) | ATTR(FATTR4_FILEID) | ATTR(FATTR4_HOMOGENEOUS) |
+    ATTR(FATTR4_MAXFILESIZE) | ATTR(FATTR4_MAXNAME) | ATTR(FATTR4_MAXREAD) | ATTR(FATTR4_MAXWRITE) |
+    ATTR(FATTR4_MODE) | ATTR(FATTR4_NO_TRUNC) | ATTR(FATTR4_NUMLINKS) | ATTR(FATTR4_OWNER) |
+    ATTR(FATTR4_OWNER_GROUP) | ATTR(FATTR4_RAWDEV) | ATTR(FATTR4_SPACE_USED) | ATTR(FATTR4_TIME_ACCESS) |
+    ATTR(FATTR4_TIME_ACCESS_SET) | ATTR(FATTR4_TIME_DELTA) | ATTR(FATTR4_TIME_METADATA) |
+    ATTR(FATTR4_TIME_MODIFY) | ATTR(FATTR4_TIME_MODIFY_SET) | ATTR(FATTR4_MOUNTED_ON_FILEID) | FSSTAT_ATTRS;
+
+// Room for all supported attributes, in XDR words
+#define ATTR_WORDS 160
+
+struct compound
+{
+    struct rpc_context *rpc;
+    struct rpc_msg *call;
+    // The caller's identity and access under the export of the current handle
+    struct nfs_cred cred;
+    int read_only;
+    struct inode *current;
+    struct inode *saved;
+    // The exports the current and saved handles were handed out under
+    int export;
+    int saved_export;
+    // The operation is the last one of the compound
+    int last;
+    // The reply goes to the duplicate request cache
+    int drc;
+    // READ data the reply can still take
+    uint32_t read_left;
+    // Data of a final READ that is sent from the file, fd is -1 if none
+    int fd;
+    uint64_t fd_offset;
+    uint32_t fd_len;
+    /*
+     * Pool chunks of copied READ data, given back once the reply has been
+     * sent. The data of a final READ of several chunks is sent from them
+     * separately, it's in the num_data chunks from data.
+     */
+    struct iovec chunks[MAX_CHUNKS];
+    int num_chunks;
+    struct iovec *data;
+    int num_data;
+};
+
+static nfsstat4 status4(nfsstat3 status)
+{
+    // The v4 codes kept the values of the v3 ones, except for these
+    switch (status)
+    {
+    case NFS3ERR_NODEV:
+    case NFS3ERR_REMOTE:
+        return NFS4ERR_IO;
+    case NFS3ERR_NOT_SYNC:
+        return NFS4ERR_INVAL;
+    default:
+        return (nfsstat4)status;
+    }
+}
+
+// Operations that stay in the export of the current handle pass c->export
+static void set_current(struct compound *c, struct inode *inode, int export)
+{
+    const struct export_rule *rule = rpc_client_rule(c->rpc, export);
+
+    backend->inode_put(c->current);
+    c->current = inode;
+    c->export = export;
+    get_cred(c->call, rule, &c->cred);
+    c->read_only = rule && rule->read_only;
+}
+
+// Another reference to inode, the backend hands them out by handle
+static struct inode *dup_inode(struct inode *inode, int export, nfsstat4 *status)
+{
+    char buf[NFS3_FHSIZE];
+    nfsstat3 status3;
+    nfs_fh3 fh;
+    struct inode *dup;
+
+    fh.data.data_len = backend->inode_to_fh(inode, export, buf);
+    fh.data.data_val = buf;
+    dup = backend->inode_from_fh(&fh, &export, &status3);
+    *status = status4(status3);
+    return dup;
+}
+
+/*
+ * Client IDs are the start time of the server and a counter, the time is
+ * taken when the first client shows up.
+ */
+static uint32_t boot_time;
+static uint32_t next_clientid;
+static uint32_t next_stateid;
+
+static uint32_t server_boot(void)
+{
+    uint32_t expected = 0;
+
+    if (__atomic_load_n(&boot_time, __ATOMIC_RELAXED) == 0)
+        __atomic_compare_exchange_n(&boot_time, &expected, (uint32_t)time(NULL), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return __atomic_load_n(&boot_time, __ATOMIC_RELAXED);
+}
+
+static uint64_t new_clientid(void)
+{
+    return (uint64_t)server_boot() << 32 | __atomic_add_fetch(&next_clientid, 1, __ATOMIC_RELAXED);
+}
+
+static nfsstat4 check_clientid(clientid4 clientid)
+{
+    return clientid >> 32 == server_boot() ? NFS4_OK : NFS4ERR_STALE_CLIENTID;
+}
+
+// A component as a C string in call memory
+static nfsstat4 get_name(component4 *component, char **name)
+{
+    uint32_t len = component->utf8string_len;
+    char *val = component->utf8string_val;
+
+    if (len == 0)
+        return NFS4ERR_INVAL;
+    if (len > NAME_MAX)
+        return NFS4ERR_NAMETOOLONG;
+    if (memchr(val, 0, len) || memchr(val, '/', len))
+        return NFS4ERR_BADCHAR;
+    if ((len == 1 && val[0] == '.') || (len == 2 && val[0] == '.' && val[1] == '.'))
+        return NFS4ERR_BADNAME;
+    if ((*name = rpc_alloc(len + 1)) == NULL)
+        return NFS4ERR_RESOURCE;
+    memcpy(*name, val, len);
+    (*name)[len] = 0;
+    return NFS4_OK;
+}
+
+static uint64_t bitmap_get(bitmap4 *bitmap)
+{
+    uint64_t mask = 0;
+    if (bitmap->bitmap4_len > 0)
+        mask = bitmap->bitmap4_val[0];
+    if (bitmap->bitmap4_len > 1)
+        mask |= (uint64_t)bitmap->bitmap4_val[1] << 32;
+    return mask;
+}
+
+static nfsstat4 bitmap_set(bitmap4 *bitmap, uint64_t mask)
+{
+    uint32_t *words = rpc_alloc(2 * sizeof(uint32_t));
+    if (words == NULL)
+    {
+        bitmap->bitmap4_len = 0;
+        return NFS4ERR_RESOURCE;
+    }
+    words[0] = mask;
+    words[1] = mask >> 32;
+    bitmap->bitmap4_len = mask >> 32 ? 2 : mask ? 1 : 0;
+    bitmap->bitmap4_val = words;
+    return NFS4_OK;
+}
+
+static uint64_t change_attr(fattr3 *attr)
+{
+    return (uint64_t)attr->ctime.seconds * 1000000000 + attr->ctime.nseconds;
+}
+
+static uint64_t dir_change(struct inode *dir)
+{
+    fattr3 attr;
+    return backend->getattr(dir, &attr) == NFS3_OK ? change_attr(&attr) : 0;
+}
+
+/*
+ * Attribute values are encoded by hand, fattr4 only has them as opaque
+ * data.
+ */
+struct attr_buf
+{
+    uint32_t *p;
+    uint32_t words[ATTR_WORDS];
+};
+
+static void put32(struct attr_buf *b, uint32_t value)
+{
+    *b->p++ = htonl(value);
+}
+
+static void put64(struct attr_buf *b, uint64_t value)
+{
+    put32(b, value >> 32);
+    put32(b, value);
+}
+
+static void put_opaque(struct attr_buf *b, const void *data, uint32_t len)
+{
+    put32(b, len);
+    b->p[len / 4] = 0;
+    memcpy(b->p, data, len);
+    b->p += (len + 3) / 4;
+}
+
+static void put_id(struct attr_buf *b, uint32_t id)
+{
+    // Owners are numeric, as Linux clients send them with AUTH_UNIX
+    char str[12];
+    put_opaque(b, str, snprintf(str, sizeof(str), "%u", id));
+}
+
+static void put_time(struct attr_buf *b, nfstime3 *time)
+{
+    put64(b, time->seconds);
+    put32(b, time->nseconds);
+}
+
+/*
+ * The attributes in want that we have, in call memory. If status isn't
+ * NFS4_OK the object couldn't be reached and only rdattr_error is returned.
+ * Returns NFS4ERR_RESOURCE if there is no memory for them.
+ */
+static nfsstat4 encode_attrs(struct inode *inode, int export, fattr3 *attr, nfsstat4 status, uint64_t want, fattr4 *attrs)
+{
+    char fh[NFS3_FHSIZE];
+    struct attr_buf b;
+    FSSTAT3resok fs;
+
+    want &= supported_attrs & ~(ATTR(FATTR4_TIME_ACCESS_SET) | ATTR(FATTR4_TIME_MODIFY_SET));
+    if (status != NFS4_OK)
+        want &= ATTR(FATTR4_RDATTR_ERROR);
+    if ((want & FSSTAT_ATTRS) && backend->fsstat(inode, &fs) != NFS3_OK)
+        want &= ~FSSTAT_ATTRS;
+    b.p = b.words;
+    if (want & ATTR(FATTR4_SUPPORTED_ATTRS))
+    {
+        put32(&b, 2);
+        put32(&b, (uint32_t)supported_attrs);
+        put32(&b, supported_attrs >> 32);
+    }
+    if (want & ATTR(FATTR4_TYPE))
+        put32(&b, attr->type);
+    if (want & ATTR(FATTR4_FH_EXPIRE_TYPE))
+        put32(&b, FH4_PERSISTENT);
+    if (want & ATTR(FATTR4_CHANGE))
+        put64(&b, change_attr(attr));
+    if (want & ATTR(FATTR4_SIZE))
+        put64(&b, attr->size);
+    if (want & ATTR(FATTR4_LINK_SUPPORT))
+        put32(&b, TRUE);
+    if (want & ATTR(FATTR4_SYMLINK_SUPPORT))
+        put32(&b, TRUE);
+    if (want & ATTR(FATTR4_NAMED_ATTR))
+        put32(&b, FALSE);
+    if (want & ATTR(FATTR4_FSID))
+    {
+        put64(&b, attr->fsid);
+        put64(&b, 0);
+    }
+    if (want & ATTR(FATTR4_UNIQUE_HANDLES))
+        put32(&b, TRUE);
+    if (want & ATTR(FATTR4_LEASE_TIME))
+        put32(&b, LEASE_TIME);
+    if (want & ATTR(FATTR4_RDATTR_ERROR))
+        put32(&b, status);
+    if (want & ATTR(FATTR4_CANSETTIME))
+        put32(&b, TRUE);
+    if (want & ATTR(FATTR4_CASE_INSENSITIVE))
+        put32(&b, FALSE);
+    if (want & ATTR(FATTR4_CASE_PRESERVING))
+        put32(&b, TRUE);
+    if (want & ATTR(FATTR4_CHOWN_RESTRICTED))
+        put32(&b, TRUE);
+    if (want & ATTR(FATTR4_FILEHANDLE))
+    {
+        put_opaque(&b, fh, backend->inode_to_fh(inode, export, fh));
+    }
+    if (want & ATTR(FATTR4_FILEID))
+        put64(&b, attr->fileid);
+    if (want & ATTR(FATTR4_FILES_AVAIL))
+        put64(&b, fs.afiles);
+    if (want & ATTR(FATTR4_FILES_FREE))
+        put64(&b, fs.ffiles);
+    if (want & ATTR(FATTR4_FILES_TOTAL))
+        put64(&b, fs.tfiles);
+    if (want & ATTR(FATTR4_HOMOGENEOUS))
+        put32(&b, TRUE);
+    if (want & ATTR(FATTR4_MAXFILESIZE))
+        put64(&b, 0x7fffffffffffffff);
+    if (want & ATTR(FATTR4_MAXNAME))
+        put32(&b, NAME_MAX);
+    if (want & ATTR(FATTR4_MAXREAD))
+        put64(&b, max_read_size);
+    if (want & ATTR(FATTR4_MAXWRITE))
+        put64(&b, max_write_size);
+    if (want & ATTR(FATTR4_MODE))
+        put32(&b, attr->mode & 07777);
+    if (want & ATTR(FATTR4_NO_TRUNC))
+        put32(&b, TRUE);
+    if (want & ATTR(FATTR4_NUMLINKS))
+        put32(&b, attr->nlink);
+    if (want & ATTR(FATTR4_OWNER))
+        put_id(&b, attr->uid);
+    if (want & ATTR(FATTR4_OWNER_GROUP))
+        put_id(&b, attr->gid);
+    if (want & ATTR(FATTR4_RAWDEV))
+    {
+        put32(&b, attr->rdev.specdata1);
+        put32(&b, attr->rdev.specdata2);
+    }
+    if (want & ATTR(FATTR4_SPACE_AVAIL))
+        put64(&b, fs.abytes);
+    if (want & ATTR(FATTR4_SPACE_FREE))
+        put64(&b, fs.fbytes);
+    if (want & ATTR(FATTR4_SPACE_TOTAL))
+        put64(&b, fs.tbytes);
+    if (want & ATTR(FATTR4_SPACE_USED))
+        put64(&b, attr->used);
+    if (want & ATTR(FATTR4_TIME_ACCESS))
+        put_time(&b, &attr->atime);
+    if (want & ATTR(FATTR4_TIME_DELTA))
+    {
+        put64(&b, 0);
+        put32(&b, 1);
+    }
+    if (want & ATTR(FATTR4_TIME_METADATA))
+        put_time(&b, &attr->ctime);
+    if (want & ATTR(FATTR4_TIME_MODIFY))
+        put_time(&b, &attr->mtime);
+    if (want & ATTR(FATTR4_MOUNTED_ON_FILEID))
+        put64(&b, attr->fileid);
+
+    attrs->attr_vals.attrlist4_len = (b.p - b.words) * 4;
+    if ((attrs->attr_vals.attrlist4_val = rpc_alloc(attrs->attr_vals.attrlist4_len)) == NULL)
+        return NFS4ERR_RESOURCE;
+    memcpy(attrs->attr_vals.attrlist4_val, b.words, attrs->attr_vals.attrlist4_len);
+    return bitmap_set(&attrs->attrmask, want);
+}
+
+static int get32(char **p, char *end, uint32_t *value)
+{
+    if (end - *p < 4)
+        return -1;
+    memcpy(value, *p, 4);
+    *value = ntohl(*value);
+    *p += 4;
+    return 0;
+}
+
+static int get_id(char **p, char *end, uint32_t *id)
+{
+    char str[12], *str_end;
+    uint32_t len;
+
+    if (get32(p, end, &len) < 0 || len == 0 || len >= sizeof(str) || end - *p < (len + 3) / 4 * 4)
+        return -1;
+    memcpy(str, *p, len);
+    str[len] = 0;
+    *p += (len + 3) / 4 * 4;
+    *id = strtoul(str, &str_end, 10);
+    return *str_end ? -1 : 0;
+}
+
+static int get_settime(char **p, char *end, time_how *how, nfstime3 *time)
+{
+    uint32_t set_it, seconds_hi;
+
+    if (get32(p, end, &set_it) < 0)
+        return -1;
+    *how = SET_TO_SERVER_TIME;
+    if (set_it != SET_TO_CLIENT_TIME4)
+        return 0;
+    *how = SET_TO_CLIENT_TIME;
+    return get32(p, end, &seconds_hi) < 0 || get32(p, end, &time->seconds) < 0 || get32(p, end, &time->nseconds) < 0 ? -1 : 0;
+}
+
+// Attributes to set as a sattr3, set tells which ones are set
+static nfsstat4 decode_sattr(fattr4 *attrs, sattr3 *sattr, uint64_t *set)
+{
+    char *p = attrs->attr_vals.attrlist4_val;
+    char *end = p + attrs->attr_vals.attrlist4_len;
+    uint32_t i, hi, lo;
+
+    memset(sattr, 0, sizeof(*sattr));
+    *set = bitmap_get(&attrs->attrmask);
+    for (i = 2; i < attrs->attrmask.bitmap4_len; i++)
+    {
+        if (attrs->attrmask.bitmap4_val[i])
+            return NFS4ERR_ATTRNOTSUPP;
+    }
+    if (*set & ~SETTABLE_ATTRS)
+        return NFS4ERR_ATTRNOTSUPP;
+    if (*set & ATTR(FATTR4_SIZE))
+    {
+        sattr->size.set_it = TRUE;
+        if (get32(&p, end, &hi) < 0 || get32(&p, end, &lo) < 0)
+            return NFS4ERR_INVAL;
+        sattr->size.set_size3_u.size = (uint64_t)hi << 32 | lo;
+    }
+    if (*set & ATTR(FATTR4_MODE))
+    {
+        sattr->mode.set_it = TRUE;
+        if (get32(&p, end, &sattr->mode.set_mode3_u.mode) < 0)
+            return NFS4ERR_INVAL;
+    }
+    if (*set & ATTR(FATTR4_OWNER))
+    {
+        sattr->uid.set_it = TRUE;
+        if (get_id(&p, end, &sattr->uid.set_uid3_u.uid) < 0)
+            return NFS4ERR_BADOWNER;
+    }
+    if (*set & ATTR(FATTR4_OWNER_GROUP))
+    {
+        sattr->gid.set_it = TRUE;
+        if (get_id(&p, end, &sattr->gid.set_gid3_u.gid) < 0)
+            return NFS4ERR_BADOWNER;
+    }
+    if ((*set & ATTR(FATTR4_TIME_ACCESS_SET)) && get_settime(&p, end, &sattr->atime.set_it, &sattr->atime.set_atime_u.atime) < 0)
+        return NFS4ERR_INVAL;
+    if ((*set & ATTR(FATTR4_TIME_MODIFY_SET)) && get_settime(&p, end, &sattr->mtime.set_it, &sattr->mtime.set_mtime_u.mtime) < 0)
+        return NFS4ERR_INVAL;
+    return p == end ? NFS4_OK : NFS4ERR_INVAL;
+}
+
+/*
+ * Operations. They return the status of their result, the other fields
+ * are only looked at if it's NFS4_OK. Those that need a current
+ * filehandle have one.
+ */
+static nfsstat4 op_access(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    ACCESS4args *args = &arg->nfs_argop4_u.opaccess;
+    ACCESS4resok *resok = &res->nfs_resop4_u.opaccess.ACCESS4res_u.resok4;
+    nfsstat3 status;
+
+    resok->supported = args->access & (ACCESS4_READ | ACCESS4_LOOKUP | ACCESS4_MODIFY | ACCESS4_EXTEND | ACCESS4_DELETE | ACCESS4_EXECUTE);
+    // The v4 bits are the v3 ones
+    status = backend->access(c->current, &c->cred, resok->supported, &resok->access);
+    resok->access &= resok->supported;
+    if (c->read_only)
+        resok->access &= ~(ACCESS4_MODIFY | ACCESS4_EXTEND | ACCESS4_DELETE);
+    return status4(status);
+}
+
+static nfsstat4 op_close(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    CLOSE4args *args = &arg->nfs_argop4_u.opclose;
+    stateid4 *stateid = &res->nfs_resop4_u.opclose.CLOSE4res_u.open_stateid;
+
+    *stateid = args->open_stateid;
+    stateid->seqid++;
+    return NFS4_OK;
+}
+
+static nfsstat4 op_commit(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    COMMIT4args *args = &arg->nfs_argop4_u.opcommit;
+    nfsstat3 status = backend->commit(c->current, args->offset, args->count);
+
+    backend->write_verf(res->nfs_resop4_u.opcommit.COMMIT4res_u.resok4.writeverf);
+    return status4(status);
+}
+
+static nfsstat4 op_getattr(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    GETATTR4args *args = &arg->nfs_argop4_u.opgetattr;
+    nfsstat3 status;
+    fattr3 attr;
+
+    if ((status = backend->getattr(c->current, &attr)) != NFS3_OK)
+        return status4(status);
+    return encode_attrs(c->current, c->export, &attr, NFS4_OK, bitmap_get(&args->attr_request),
+        &res->nfs_resop4_u.opgetattr.GETATTR4res_u.resok4.obj_attributes);
+}
+
+static nfsstat4 op_getfh(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    nfs_fh4 *object = &res->nfs_resop4_u.opgetfh.GETFH4res_u.resok4.object;
+    char fh[NFS3_FHSIZE];
+
+    object->nfs_fh4_len = backend->inode_to_fh(c->current, c->export, fh);
+    if ((object->nfs_fh4_val = rpc_alloc(object->nfs_fh4_len)) == NULL)
+        return NFS4ERR_RESOURCE;
+    memcpy(object->nfs_fh4_val, fh, object->nfs_fh4_len);
+    return NFS4_OK;
+}
+
+static nfsstat4 op_lookup(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    LOOKUP4args *args = &arg->nfs_argop4_u.oplookup;
+    struct inode *child;
+    nfsstat4 status;
+    nfsstat3 status3;
+    fattr3 attr;
+    char *name;
+
+    if ((status = get_name(&args->objname, &name)) != NFS4_OK)
+        return status;
+    status3 = backend->lookup(c->current, &c->cred, name, &child, &attr);
+    if (status3 == NFS3_OK)
+        set_current(c, child, c->export);
+    return status4(status3);
+}
+
+static nfsstat4 op_lookupp(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    struct inode *parent;
+    nfsstat3 status;
+    fattr3 attr;
+
+    // The root of the export has no parent here, unlike with ".."
+    status = export_is_root(c->export, c->current)
+        ? NFS3ERR_NOENT : backend->lookup(c->current, &c->cred, "..", &parent, &attr);
+    if (status == NFS3_OK)
+        set_current(c, parent, c->export);
+    return status4(status);
+}
+
+static nfsstat4 op_open(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    OPEN4args *args = &arg->nfs_argop4_u.opopen;
+    OPEN4resok *resok = &res->nfs_resop4_u.opopen.OPEN4res_u.resok4;
+    struct inode *child = NULL;
+    uint32_t want = 0, granted, id;
+    uint64_t set = 0;
+    int existing;
+    nfsstat4 status;
+    nfsstat3 status3;
+    fattr3 attr;
+    char *name;
+
+    // Nothing to reclaim after a restart, there was no state before it either
+    if (args->claim.claim == CLAIM_PREVIOUS)
+        return NFS4ERR_NO_GRACE;
+    if (args->claim.claim != CLAIM_NULL)
+        return NFS4ERR_NOTSUPP;
+    if ((status = check_clientid(args->owner.clientid)) != NFS4_OK)
+        return status;
+    if ((status = get_name(&args->claim.open_claim4_u.file, &name)) != NFS4_OK)
+        return status;
+    if (c->read_only && (args->openhow.opentype == OPEN4_CREATE || (args->share_access & OPEN4_SHARE_ACCESS_WRITE)))
+        return NFS4ERR_ROFS;
+    resok->cinfo.atomic = FALSE;
+    resok->cinfo.before = dir_change(c->current);
+    // Access is checked for files that exist, whoever creates a file may open it whatever its mode
+    if (args->openhow.opentype == OPEN4_CREATE)
+    {
+        createhow4 *how4 = &args->openhow.openflag4_u.how;
+        createhow3 how;
+        how.mode = (createmode3)how4->mode;
+        if (how4->mode == EXCLUSIVE4)
+            memcpy(how.createhow3_u.verf, how4->createhow4_u.createverf, NFS3_CREATEVERFSIZE);
+        else if ((status = decode_sattr(&how4->createhow4_u.createattrs, &how.createhow3_u.obj_attributes, &set)) != NFS4_OK)
+            return status;
+        status3 = backend->create(c->current, &c->cred, name, &how, &child);
+        if (status3 == NFS3_OK)
+            status3 = backend->getattr(child, &attr);
+        // UNCHECKED4 returns a file that is already there, the directory didn't change then
+        existing = status3 == NFS3_OK && how4->mode == UNCHECKED4 && dir_change(c->current) == resok->cinfo.before;
+    }
+    else
+    {
+        status3 = backend->lookup(c->current, &c->cred, name, &child, &attr);
+        existing = 1;
+    }
+    if (existing)
+    {
+        if (args->share_access & OPEN4_SHARE_ACCESS_READ)
+            want |= ACCESS3_READ;
+        if (args->share_access & OPEN4_SHARE_ACCESS_WRITE)
+            want |= ACCESS3_MODIFY;
+        if (status3 == NFS3_OK && attr.type == NF3REG && (status3 = backend->access(child, &c->cred, want, &granted)) == NFS3_OK &&
+            granted != want)
+            status3 = NFS3ERR_ACCES;
+    }
+    if (status3 == NFS3_OK && attr.type != NF3REG)
+        status = attr.type == NF3DIR ? NFS4ERR_ISDIR : attr.type == NF3LNK ? NFS4ERR_SYMLINK : NFS4ERR_INVAL;
+    else
+        status = status4(status3);
+    if (status != NFS4_OK)
+    {
+        backend->inode_put(child);
+        return status;
+    }
+    resok->cinfo.after = dir_change(c->current);
+    set_current(c, child, c->export);
+
+    resok->stateid.seqid = 1;
+    id = __atomic_add_fetch(&next_stateid, 1, __ATOMIC_RELAXED);
+    memcpy(resok->stateid.other, &args->owner.clientid, 8);
+    memcpy(resok->stateid.other + 8, &id, 4);
+    // No OPEN_CONFIRM needed, there are no open owners to keep track of
+    resok->rflags = OPEN4_RESULT_LOCKTYPE_POSIX;
+    if ((status = bitmap_set(&resok->attrset, set)) != NFS4_OK)
+        return status;
+    resok->delegation.delegation_type = OPEN_DELEGATE_NONE;
+    return NFS4_OK;
+}
+
+static nfsstat4 op_open_confirm(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    OPEN_CONFIRM4args *args = &arg->nfs_argop4_u.opopen_confirm;
+    stateid4 *stateid = &res->nfs_resop4_u.opopen_confirm.OPEN_CONFIRM4res_u.resok4.open_stateid;
+
+    *stateid = args->open_stateid;
+    stateid->seqid++;
+    return NFS4_OK;
+}
+
+static nfsstat4 op_putfh(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    PUTFH4args *args = &arg->nfs_argop4_u.opputfh;
+    struct inode *inode;
+    nfsstat3 status;
+    nfs_fh3 fh;
+    int export;
+
+    fh.data.data_len = args->object.nfs_fh4_len;
+    fh.data.data_val = args->object.nfs_fh4_val;
+    if ((inode = backend->inode_from_fh(&fh, &export, &status)) == NULL)
+        return status4(status);
+    if (export >= num_exports)
+        status = NFS3ERR_STALE;
+    else if (rpc_client_rule(c->rpc, export) == NULL)
+        status = NFS3ERR_ACCES;
+    if (status != NFS3_OK)
+    {
+        backend->inode_put(inode);
+        return status4(status);
+    }
+    set_current(c, inode, export);
+    return NFS4_OK;
+}
+
+/*
+ * There is no pseudo filesystem, the root is that of the first export
+ * the client is admitted to. With "/" exported first it's the real one.
+ */
+static nfsstat4 op_putrootfh(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    struct inode *inode;
+    nfsstat3 status;
+    int i;
+
+    for (i = 0; i < num_exports; i++)
+    {
+        if (rpc_client_rule(c->rpc, i) == NULL)
+            continue;
+        if ((status = export_lookup(exports_by_index[i], exports_by_index[i]->path, &inode)) != NFS3_OK)
+            return status4(status);
+        set_current(c, inode, i);
+        return NFS4_OK;
+    }
+    return NFS4ERR_ACCESS;
+}
+
+/*
+ * Read count bytes into pool chunks held by the compound. Only the data of
+ * a final READ that doesn't go to the duplicate request cache can be sent
+ * from several chunks, the others are inline and get one.
+ */
+static nfsstat4 read_chunks(struct compound *c, uint64_t offset, uint32_t count, READ4resok *resok, uint32_t *done, int *eof)
+{
+    struct iovec *chunks = c->chunks + c->num_chunks;
+    uint32_t len;
+    nfsstat3 status;
+    fattr3 attr;
+    int i, n;
+
+    if (!c->last || c->drc)
+        count = count < POOL_CHUNK_SIZE ? count : POOL_CHUNK_SIZE;
+    if ((MAX_CHUNKS - c->num_chunks) * (uint64_t)POOL_CHUNK_SIZE < count)
+        count = (MAX_CHUNKS - c->num_chunks) * POOL_CHUNK_SIZE;
+    if (count == 0)
+        return NFS4ERR_RESOURCE;
+    // Over budget the client is asked to retry later
+    if ((n = get_chunks(chunks, count)) < 0)
+        return NFS4ERR_DELAY;
+    c->num_chunks += n;
+    *done = 0;
+    for (i = 0; i < n && !*eof; i++)
+    {
+        status = backend->read(c->current, &c->cred, offset + *done, chunks[i].iov_len, chunks[i].iov_base, &len, eof, &attr);
+        if (status != NFS3_OK)
+            return status4(status);
+        *done += len;
+        if (len < chunks[i].iov_len)
+            break;
+    }
+    // Chunks past the data are only given back with the others
+    for (n = 0, len = *done; len > 0; n++)
+    {
+        if (chunks[n].iov_len > len)
+            chunks[n].iov_len = len;
+        len -= chunks[n].iov_len;
+    }
+    resok->data.data_val = n == 1 ? chunks[0].iov_base : NULL;
+    if (n > 1)
+    {
+        c->data = chunks;
+        c->num_data = n;
+    }
+    return NFS4_OK;
+}
+
+static nfsstat4 op_read(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    READ4args *args = &arg->nfs_argop4_u.opread;
+    READ4resok *resok = &res->nfs_resop4_u.opread.READ4res_u.resok4;
+    uint32_t count = args->count < c->read_left ? args->count : c->read_left;
+    uint32_t done = 0;
+    nfsstat4 error;
+    nfsstat3 status;
+    fattr3 attr;
+    int eof = 0, fd;
+
+    // The data of a final READ can go from the page cache to the socket
+    if (c->last && !c->drc && backend->read_fd && count >= SENDFILE_MIN_READ)
+    {
+        status = backend->read_fd(c->current, &c->cred, args->offset, count, &fd, &done, &eof, &attr);
+        if (status != NFS3_OK)
+            return status4(status);
+        if (done >= SENDFILE_MIN_READ)
+        {
+            c->fd = fd;
+            c->fd_offset = args->offset;
+            c->fd_len = done;
+            resok->eof = eof;
+            resok->data.data_len = done;
+            resok->data.data_val = NULL;
+            return NFS4_OK;
+        }
+    }
+    // Otherwise it's copied, without buffers for what's past the end of the file
+    if (count > SENDFILE_MIN_READ && backend->getattr(c->current, &attr) == NFS3_OK)
+        count = args->offset >= attr.size ? 0 : attr.size - args->offset < count ? attr.size - args->offset : count;
+    if (count < SENDFILE_MIN_READ)
+    {
+        // Small reads are copied into the reply anyway
+        if ((resok->data.data_val = rpc_alloc(count ? count : 1)) == NULL)
+            return NFS4ERR_RESOURCE;
+        status = backend->read(c->current, &c->cred, args->offset, count, resok->data.data_val, &done, &eof, &attr);
+        if (status != NFS3_OK)
+            return status4(status);
+    }
+    else if ((error = read_chunks(c, args->offset, count, resok, &done, &eof)) != NFS4_OK)
+        return error;
+    c->read_left -= done;
+    resok->eof = eof;
+    resok->data.data_len = done;
+    if (backend->readahead)
+        backend->readahead(c->current, c->rpc, args->offset, done);
+    return NFS4_OK;
+}
+
+struct readdir4_state
+{
+    struct inode *dir;
+    int export;
+    struct nfs_cred *cred;
+    uint64_t want;
+    uint32_t maxcount, size;
+    entry4 *first, *last;
+    // NFS4ERR_RESOURCE if the listing was cut short for lack of memory
+    nfsstat4 status;
+};
+
+// Status, verifier, end of list and eof
+#define READDIR4_REPLY_SIZE (4 + 8 + 4 + 4)
+
+static int readdir4_add(void *private_data, const char *name, uint64_t ino, uint64_t cookie)
+{
+    struct readdir4_state *st = private_data;
+    uint32_t len = strlen(name), size;
+    struct inode *child = NULL;
+    nfsstat3 status;
+    entry4 *entry;
+    fattr3 attr;
+
+    // v4 listings have no . and ..
+    if (!strcmp(name, ".") || !strcmp(name, ".."))
+        return 0;
+    if ((entry = rpc_alloc(sizeof(entry4))) == NULL)
+    {
+        st->status = NFS4ERR_RESOURCE;
+        return 1;
+    }
+    status = backend->lookup(st->dir, st->cred, name, &child, &attr);
+    st->status = encode_attrs(child, st->export, &attr, status4(status), st->want, &entry->attrs);
+    backend->inode_put(child);
+    if (st->status != NFS4_OK)
+        return 1;
+    // value follows, cookie, name and attributes
+    size = 4 + 8 + 4 + ((len+3) & ~3) + 4 + 4*entry->attrs.attrmask.bitmap4_len + 4 + entry->attrs.attr_vals.attrlist4_len;
+    if (st->size + size > st->maxcount)
+        return 1;
+    entry->cookie = cookie;
+    entry->name.utf8string_len = len;
+    if ((entry->name.utf8string_val = rpc_alloc(len)) == NULL)
+    {
+        st->status = NFS4ERR_RESOURCE;
+        return 1;
+    }
+    memcpy(entry->name.utf8string_val, name, len);
+    entry->nextentry = NULL;
+    if (st->last)
+        st->last->nextentry = entry;
+    else
+        st->first = entry;
+    st->last = entry;
+    st->size += size;
+    return 0;
+}
+
+static nfsstat4 op_readdir(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    READDIR4args *args = &arg->nfs_argop4_u.opreaddir;
+    READDIR4resok *resok = &res->nfs_resop4_u.opreaddir.READDIR4res_u.resok4;
+    struct readdir4_state st = { 0 };
+    nfsstat3 status;
+    int eof = 0;
+
+    st.dir = c->current;
+    st.export = c->export;
+    st.cred = &c->cred;
+    st.want = bitmap_get(&args->attr_request);
+    st.maxcount = args->maxcount < rpc_max_transfer(c->rpc) ? args->maxcount : rpc_max_transfer(c->rpc);
+    st.size = READDIR4_REPLY_SIZE;
+    status = backend->readdir(c->current, &c->cred, args->cookie, resok->cookieverf, readdir4_add, &st, &eof);
+    if (status != NFS3_OK)
+        return status4(status);
+    if (st.status != NFS4_OK)
+        return st.status;
+    if (!st.first && !eof)
+        return NFS4ERR_TOOSMALL;
+    resok->reply.entries = st.first;
+    resok->reply.eof = eof;
+    return NFS4_OK;
+}
+
+static nfsstat4 op_readlink(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    linktext4 *link = &res->nfs_resop4_u.opreadlink.READLINK4res_u.resok4.link;
+    char *target = rpc_alloc(PATH_MAX+1);
+    nfsstat3 status;
+
+    if (target == NULL)
+        return NFS4ERR_RESOURCE;
+    status = backend->readlink(c->current, target, PATH_MAX+1);
+    link->utf8string_val = target;
+    link->utf8string_len = status == NFS3_OK ? strlen(target) : 0;
+    return status4(status);
+}
+
+static nfsstat4 op_renew(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    return check_clientid(arg->nfs_argop4_u.oprenew.clientid);
+}
+
+static nfsstat4 op_restorefh(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    struct inode *inode;
+    nfsstat4 status;
+
+    if (c->saved == NULL)
+        return NFS4ERR_RESTOREFH;
+    if ((inode = dup_inode(c->saved, c->saved_export, &status)) != NULL)
+        set_current(c, inode, c->saved_export);
+    return status;
+}
+
+static nfsstat4 op_savefh(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    struct inode *inode;
+    nfsstat4 status;
+
+    if ((inode = dup_inode(c->current, c->export, &status)) != NULL)
+    {
+        backend->inode_put(c->saved);
+        c->saved = inode;
+        c->saved_export = c->export;
+    }
+    return status;
+}
+
+static nfsstat4 op_setattr(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    SETATTR4args *args = &arg->nfs_argop4_u.opsetattr;
+    bitmap4 *attrsset = &res->nfs_resop4_u.opsetattr.attrsset;
+    nfsstat4 status;
+    sattr3 sattr;
+    uint64_t set;
+
+    // Reported whatever the status
+    attrsset->bitmap4_len = 0;
+    if (c->read_only)
+        return NFS4ERR_ROFS;
+    if ((status = decode_sattr(&args->obj_attributes, &sattr, &set)) != NFS4_OK)
+        return status;
+    if ((status = status4(backend->setattr(c->current, &c->cred, &sattr, NULL))) == NFS4_OK)
+        status = bitmap_set(attrsset, set);
+    return status;
+}
+
+static nfsstat4 op_setclientid(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    SETCLIENTID4resok *resok = &res->nfs_resop4_u.opsetclientid.SETCLIENTID4res_u.resok4;
+
+    resok->clientid = new_clientid();
+    memcpy(resok->setclientid_confirm, &resok->clientid, NFS4_VERIFIER_SIZE);
+    return NFS4_OK;
+}
+
+static nfsstat4 op_setclientid_confirm(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    return check_clientid(arg->nfs_argop4_u.opsetclientid_confirm.clientid);
+}
+
+static nfsstat4 op_write(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    WRITE4args *args = &arg->nfs_argop4_u.opwrite;
+    WRITE4resok *resok = &res->nfs_resop4_u.opwrite.WRITE4res_u.resok4;
+    uint32_t count = args->data.data_len < max_write_size ? args->data.data_len : max_write_size;
+    nfsstat3 status;
+    wcc_data wcc;
+
+    if (c->read_only)
+        return NFS4ERR_ROFS;
+    // The v4 stabilities are the v3 ones
+    status = backend->write(c->current, &c->cred, args->offset, count, args->data.data_val, (stable_how)args->stable,
+        &resok->count, &wcc);
+    resok->committed = args->stable;
+    backend->write_verf(resok->writeverf);
+    return status4(status);
+}
+
+static nfsstat4 op_ok(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res)
+{
+    return NFS4_OK;
+}
+
+struct op
+{
+    nfsstat4 (*fn)(struct compound *c, nfs_argop4 *arg, nfs_resop4 *res);
+    int needs_fh;
+};
+
+// Operations that aren't here are answered with NFS4ERR_NOTSUPP
+static const struct op ops[OP_RELEASE_LOCKOWNER + 1] = {
+    [OP_ACCESS]              = {op_access,              1},
+    [OP_CLOSE]               = {op_close,               1},
+    [OP_COMMIT]              = {op_commit,              1},
+    [OP_GETATTR]             = {op_getattr,             1},
+    [OP_GETFH]               = {op_getfh,               1},
+    [OP_LOOKUP]              = {op_lookup,              1},
+    [OP_LOOKUPP]             = {op_lookupp,             1},
+    [OP_OPEN]                = {op_open,                1},
+    [OP_OPEN_CONFIRM]        = {op_open_confirm,        1},
+    [OP_PUTFH]               = {op_putfh,               0},
+    [OP_PUTPUBFH]            = {op_putrootfh,           0},
+    [OP_PUTROOTFH]           = {op_putrootfh,           0},
+    [OP_READ]                = {op_read,                1},
+    [OP_READDIR]             = {op_readdir,             1},
+    [OP_READLINK]            = {op_readlink,            1},
+    [OP_RENEW]               = {op_renew,               0},
+    [OP_RESTOREFH]           = {op_restorefh,           0},
+    [OP_SAVEFH]              = {op_savefh,              1},
+    [OP_SETATTR]             = {op_setattr,             1},
+    [OP_SETCLIENTID]         = {op_setclientid,         0},
+    [OP_SETCLIENTID_CONFIRM] = {op_setclientid_confirm, 0},
+    [OP_WRITE]               = {op_write,               1},
+    [OP_RELEASE_LOCKOWNER]   = {op_ok,                  0},
+};
+
+// COMPOUND4res up to the length of the data of the final READ, which is sent separately from a file or chunks
+static bool_t zdr_COMPOUND4res_head(ZDR *zdrs, COMPOUND4res *res)
+{
+    u_int i, n = res->resarray.resarray_len - 1;
+    nfs_resop4 *last = &res->resarray.resarray_val[n];
+    READ4res *read = &last->nfs_resop4_u.opread;
+
+    if (!zdr_nfsstat4(zdrs, &res->status) ||
+        !zdr_utf8str_cs(zdrs, &res->tag) ||
+        !zdr_u_int(zdrs, &res->resarray.resarray_len))
+        return FALSE;
+    for (i = 0; i < n; i++)
+    {
+        if (!zdr_nfs_resop4(zdrs, &res->resarray.resarray_val[i]))
+            return FALSE;
+    }
+    return zdr_nfs_opnum4(zdrs, &last->resop) &&
+        zdr_nfsstat4(zdrs, &read->status) &&
+        zdr_bool(zdrs, &read->READ4res_u.resok4.eof) &&
+        zdr_u_int(zdrs, &read->READ4res_u.resok4.data.data_len);
+}
+
+// Compounds that change something are answered from the duplicate request cache when retransmitted
+static int needs_drc(COMPOUND4args *args)
+{
+    u_int i;
+    for (i = 0; i < args->argarray.argarray_len; i++)
+    {
+        nfs_argop4 *arg = &args->argarray.argarray_val[i];
+        if (arg->argop == OP_WRITE || arg->argop == OP_SETATTR ||
+            (arg->argop == OP_OPEN && arg->nfs_argop4_u.opopen.openhow.opentype == OPEN4_CREATE))
+            return 1;
+    }
+    return 0;
+}
+
+static int nfs4_null_proc(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    rpc_reply(rpc, call, NULL, (zdrproc_t)zdr_void, 0);
+    return 0;
+}
+
+static int nfs4_compound_proc(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    COMPOUND4args *args = call->body.cbody.args;
+    u_int i, n = args->argarray.argarray_len;
+    struct compound c = { 0 };
+    COMPOUND4res reply;
+    nfs_resop4 *res = NULL;
+    nfsstat4 status;
+
+    c.drc = needs_drc(args);
+    if (c.drc && rpc_drc_begin(rpc, call))
+        return 0;
+    c.rpc = rpc;
+    c.call = call;
+    c.read_left = max_read_size < rpc_max_transfer(rpc) ? max_read_size : rpc_max_transfer(rpc);
+    c.fd = -1;
+    reply.status = args->minorversion == 0 ? NFS4_OK : NFS4ERR_MINOR_VERS_MISMATCH;
+    reply.tag = args->tag;
+    reply.resarray.resarray_len = 0;
+    if ((reply.resarray.resarray_val = rpc_alloc((n ? n : 1) * sizeof(nfs_resop4))) == NULL)
+        reply.status = NFS4ERR_RESOURCE;
+    for (i = 0; i < n && reply.status == NFS4_OK; i++)
+    {
+        nfs_argop4 *arg = &args->argarray.argarray_val[i];
+        res = &reply.resarray.resarray_val[i];
+        res->resop = arg->argop;
+        c.last = i == n - 1;
+        if (arg->argop < OP_ACCESS || arg->argop > OP_RELEASE_LOCKOWNER)
+        {
+            res->resop = OP_ILLEGAL;
+            status = NFS4ERR_OP_ILLEGAL;
+        }
+        else if (ops[arg->argop].fn == NULL)
+            status = NFS4ERR_NOTSUPP;
+        else if (ops[arg->argop].needs_fh && c.current == NULL)
+            status = NFS4ERR_NOFILEHANDLE;
+        else
+            status = ops[arg->argop].fn(&c, arg, res);
+        // Every result starts with its status
+        *(nfsstat4 *)&res->nfs_resop4_u = status;
+        reply.resarray.resarray_len++;
+        reply.status = status;
+    }
+
+    if (c.fd >= 0)
+    {
+        if (rpc_send_reply_fd(rpc, call, &reply, (zdrproc_t)zdr_COMPOUND4res_head, c.fd, c.fd_offset, c.fd_len) == 0)
+        {
+            if (backend->readahead)
+                backend->readahead(c.current, rpc, c.fd_offset, c.fd_len);
+            goto done;
+        }
+        // Not a TCP connection, the READ is done again with the data copied
+        c.last = 0;
+        reply.status = *(nfsstat4 *)&res->nfs_resop4_u = op_read(&c, &args->argarray.argarray_val[n - 1], res);
+    }
+    if (c.num_data)
+    {
+        READ4resok *resok = &res->nfs_resop4_u.opread.READ4res_u.resok4;
+        if (rpc_send_reply_chunks(rpc, call, &reply, (zdrproc_t)zdr_COMPOUND4res_head, c.data, c.num_data, io_buffer_put) == 0)
+        {
+            // The reply took the data chunks
+            put_chunks(c.data + c.num_data, c.chunks + c.num_chunks - c.data - c.num_data);
+            c.num_chunks = c.data - c.chunks;
+            goto done;
+        }
+        // Not a TCP connection, a short read of the first chunk fits better
+        resok->data.data_val = c.data[0].iov_base;
+        resok->data.data_len = c.data[0].iov_len;
+        resok->eof = FALSE;
+    }
+    if (c.drc)
+        rpc_send_reply_drc(rpc, call, &reply, (zdrproc_t)zdr_COMPOUND4res, sizeof(COMPOUND4res));
+    else
+        rpc_reply(rpc, call, &reply, (zdrproc_t)zdr_COMPOUND4res, sizeof(COMPOUND4res));
+done:
+    put_chunks(c.chunks, c.num_chunks);
+    backend->inode_put(c.saved);
+    backend->inode_put(c.current);
+    return 0;
+}
+
+struct service_proc nfs4_pt[2] = {
+    {NFSPROC4_NULL,     nfs4_null_proc,     (zdrproc_t)zdr_void,          0},
+    {NFSPROC4_COMPOUND, nfs4_compound_proc, (zdrproc_t)zdr_COMPOUND4args, sizeof(COMPOUND4args)},
+};
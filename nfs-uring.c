@@ -0,0 +1,468 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include <event2/event.h>
+
+#include "nfs-uring.h"
+#include "nfs-pool.h"
+
+/*
+ * The ring is driven with the raw system calls, the kernel interface is
+ * small enough not to need a library for it.
+ *
+ * The submission queue index array maps every slot to itself, so an entry
+ * is queued by filling in the next sqe; the tail is only published to the
+ * kernel when the batch is submitted. Completions are reaped in order from
+ * the shared completion queue. We never have more operations in flight
+ * than the completion queue holds, so it can't overflow.
+ *
+ * Every ring registers IO_BUFFERS buffers of IO_BUFFER_SIZE bytes, one
+ * chunk of the buffer pool each; when they are all taken buffers come from
+ * the pool. If the kernel won't pin them (RLIMIT_MEMLOCK) they are still
+ * handed out, with plain reads. Transfers of several chunks are
+ * vectored and can't use registered buffers. The registered file table is
+ * sparse and indexed by fd, so fd n goes to slot n.
+ */
+#define IO_BUFFER_SIZE POOL_CHUNK_SIZE
+#define IO_BUFFERS 16
+#define IO_MAX_FILES 65536
+
+struct io_ring
+{
+    int fd;
+    int event_fd;
+    // Reaps completions when event_fd becomes readable
+    struct event *complete_event;
+    // Activated by the first queued operation, submits the batch
+    struct event *submit_event;
+
+    // sq_tail includes the entries the kernel hasn't been told about yet
+    unsigned *sq_khead;
+    unsigned *sq_ktail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_tail;
+    struct io_uring_sqe *sqes;
+    unsigned *cq_khead;
+    unsigned *cq_ktail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    // Queued but not submitted, and not completed yet
+    unsigned pending;
+    unsigned in_flight;
+    unsigned max_in_flight;
+
+    // Registered buffers, a set bit in free_buffers means it's free
+    char *buffers;
+    uint32_t free_buffers;
+    int buffers_registered;
+    // Registered files by fd, max_files is 0 if there are none
+    uint8_t *files;
+    int max_files;
+    // Files to close once the queued operations have been submitted
+    int *closing;
+    int num_closing;
+    int max_closing;
+};
+
+unsigned io_ring_entries = 256;
+
+uint64_t io_ops;
+uint64_t io_fixed_files;
+uint64_t io_fixed_buffers;
+uint64_t io_submits;
+uint64_t io_reaps;
+uint64_t io_ring_full;
+
+static __thread struct io_ring *ring;
+
+static int ring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int fd, unsigned to_submit)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void stat_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+// Index of the registered buffer that holds buf, or -1
+static int buffer_index(struct io_ring *r, char *buf)
+{
+    if (buf < r->buffers || buf >= r->buffers + (size_t)IO_BUFFERS * IO_BUFFER_SIZE)
+        return -1;
+    return (buf - r->buffers) / IO_BUFFER_SIZE;
+}
+
+static void close_file(struct io_ring *r, int fd)
+{
+    struct io_uring_files_update update;
+    int none = -1;
+
+    if (fd < r->max_files && r->files[fd])
+    {
+        memset(&update, 0, sizeof(update));
+        update.offset = fd;
+        update.fds = (uintptr_t)&none;
+        ring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+        r->files[fd] = 0;
+    }
+    close(fd);
+}
+
+static void ring_submit(struct io_ring *r)
+{
+    int n;
+
+    if (r->pending == 0)
+        return;
+    __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+    do
+        n = ring_enter(r->fd, r->pending);
+    while (n < 0 && errno == EINTR);
+    if (n > 0)
+    {
+        r->pending -= n;
+        stat_add(&io_submits, 1);
+    }
+    // The kernel is short of memory, try again after the other events
+    if (r->pending)
+        event_active(r->submit_event, EV_READ, 0);
+    else
+    {
+        while (r->num_closing > 0)
+            close_file(r, r->closing[--r->num_closing]);
+    }
+}
+
+static void ring_flush(evutil_socket_t fd, short events, void *private_data)
+{
+    ring_submit(private_data);
+}
+
+static void ring_complete(evutil_socket_t fd, short events, void *private_data)
+{
+    struct io_ring *r = private_data;
+    unsigned head, tail;
+    eventfd_t value;
+
+    // Completions posted after this read signal the eventfd again
+    eventfd_read(fd, &value);
+    stat_add(&io_reaps, 1);
+    head = *r->cq_khead;
+    while (head != (tail = __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE)))
+    {
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+            struct io_op *op = (struct io_op *)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+            // Give the entry back before the callback queues new operations
+            __atomic_store_n(r->cq_khead, ++head, __ATOMIC_RELEASE);
+            r->in_flight--;
+            op->complete(op, res);
+        }
+    }
+}
+
+/*
+ * Next free sqe, submits what is queued if the submission queue is full.
+ * Returns NULL if there's no room for another operation.
+ */
+static struct io_uring_sqe *ring_get_sqe(struct io_ring *r)
+{
+    struct io_uring_sqe *sqe;
+
+    if (r->in_flight >= r->max_in_flight)
+        return NULL;
+    if (r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE) >= r->sq_entries)
+    {
+        ring_submit(r);
+        if (r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE) >= r->sq_entries)
+            return NULL;
+    }
+    sqe = &r->sqes[r->sq_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void ring_queue(struct io_ring *r, struct io_uring_sqe *sqe, struct io_op *op, int fd)
+{
+    sqe->user_data = (uintptr_t)op;
+    sqe->fd = fd;
+    if (fd < r->max_files && r->files[fd])
+    {
+        // The slot of a registered file is its fd
+        sqe->flags |= IOSQE_FIXED_FILE;
+        stat_add(&io_fixed_files, 1);
+    }
+    r->sq_tail++;
+    r->in_flight++;
+    if (r->pending++ == 0)
+        event_active(r->submit_event, EV_READ, 0);
+    stat_add(&io_ops, 1);
+}
+
+int io_ring_ready(void)
+{
+    return ring != NULL;
+}
+
+static struct io_uring_sqe *get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ring == NULL)
+        return NULL;
+    sqe = ring_get_sqe(ring);
+    if (sqe == NULL)
+        stat_add(&io_ring_full, 1);
+    return sqe;
+}
+
+int io_readv(struct io_op *op, int fd, struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+    int index;
+
+    if (sqe == NULL)
+        return -1;
+    sqe->off = offset;
+    if (iovcnt != 1)
+    {
+        sqe->opcode = IORING_OP_READV;
+        sqe->addr = (uintptr_t)iov;
+        sqe->len = iovcnt;
+        ring_queue(ring, sqe, op, fd);
+        return 0;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->addr = (uintptr_t)iov->iov_base;
+    sqe->len = iov->iov_len;
+    index = buffer_index(ring, iov->iov_base);
+    if (index >= 0 && ring->buffers_registered)
+    {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = index;
+        stat_add(&io_fixed_buffers, 1);
+    }
+    ring_queue(ring, sqe, op, fd);
+    return 0;
+}
+
+int io_fdatasync(struct io_op *op, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    ring_queue(ring, sqe, op, fd);
+    return 0;
+}
+
+char *io_buffer_get(size_t size)
+{
+    struct io_ring *r = ring;
+
+    if (r && size <= IO_BUFFER_SIZE && r->free_buffers)
+    {
+        int i = __builtin_ctz(r->free_buffers);
+        r->free_buffers &= ~(1u << i);
+        return r->buffers + (size_t)i * IO_BUFFER_SIZE;
+    }
+    return pool_get(size);
+}
+
+void io_buffer_put(char *buf)
+{
+    int i = ring ? buffer_index(ring, buf) : -1;
+
+    if (i >= 0)
+        ring->free_buffers |= 1u << i;
+    else
+        pool_put(buf);
+}
+
+void io_register_file(int fd)
+{
+    struct io_ring *r = ring;
+    struct io_uring_files_update update;
+
+    if (r == NULL || fd < 0 || fd >= r->max_files)
+        return;
+    memset(&update, 0, sizeof(update));
+    update.offset = fd;
+    update.fds = (uintptr_t)&fd;
+    if (ring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1)
+        r->files[fd] = 1;
+}
+
+void io_close_file(int fd)
+{
+    struct io_ring *r = ring;
+    int *closing;
+
+    if (r == NULL || fd < 0)
+    {
+        close(fd);
+        return;
+    }
+    // Queued operations still refer to the file by its fd or its slot
+    ring_submit(r);
+    if (r->pending == 0)
+    {
+        close_file(r, fd);
+        return;
+    }
+    if (r->num_closing == r->max_closing)
+    {
+        closing = realloc(r->closing, (r->max_closing + 16) * sizeof(int));
+        // Better to keep the fd open for good than to let it be reused
+        if (closing == NULL)
+            return;
+        r->closing = closing;
+        r->max_closing += 16;
+    }
+    r->closing[r->num_closing++] = fd;
+}
+
+static void register_buffers(struct io_ring *r)
+{
+    struct iovec iov[IO_BUFFERS];
+    int i;
+
+    r->buffers = mmap(NULL, (size_t)IO_BUFFERS * IO_BUFFER_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (r->buffers == MAP_FAILED)
+    {
+        r->buffers = NULL;
+        return;
+    }
+    for (i = 0; i < IO_BUFFERS; i++)
+    {
+        iov[i].iov_base = r->buffers + (size_t)i * IO_BUFFER_SIZE;
+        iov[i].iov_len = IO_BUFFER_SIZE;
+    }
+    r->free_buffers = (1u << IO_BUFFERS) - 1;
+    r->buffers_registered = ring_register(r->fd, IORING_REGISTER_BUFFERS, iov, IO_BUFFERS) == 0;
+}
+
+static void register_files(struct io_ring *r)
+{
+    struct rlimit limit;
+    int *fds;
+    int i, n = IO_MAX_FILES;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)n)
+        n = limit.rlim_cur;
+    fds = malloc(n * sizeof(int));
+    r->files = calloc(n, 1);
+    if (fds == NULL || r->files == NULL)
+        goto out;
+    for (i = 0; i < n; i++)
+        fds[i] = -1;
+    if (ring_register(r->fd, IORING_REGISTER_FILES, fds, n) == 0)
+        r->max_files = n;
+out:
+    free(fds);
+}
+
+int io_ring_start(struct event_base *base)
+{
+    struct io_uring_params params;
+    struct io_ring *r = calloc(1, sizeof(struct io_ring));
+    size_t sq_size, cq_size, sqes_size;
+    char *sq = MAP_FAILED, *cq = MAP_FAILED;
+    unsigned i;
+    int err;
+
+    if (r == NULL)
+        return -1;
+    r->event_fd = -1;
+    r->sqes = MAP_FAILED;
+    memset(&params, 0, sizeof(params));
+    r->fd = ring_setup(io_ring_entries, &params);
+    if (r->fd < 0)
+    {
+        free(r);
+        return -1;
+    }
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+        goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        cq = sq;
+    else if ((cq = mmap(NULL, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+        goto fail;
+    r->sqes = mmap(NULL, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+    r->sq_khead = (unsigned *)(sq + params.sq_off.head);
+    r->sq_ktail = (unsigned *)(sq + params.sq_off.tail);
+    r->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    r->sq_entries = params.sq_entries;
+    r->sq_tail = *r->sq_ktail;
+    for (i = 0; i < params.sq_entries; i++)
+        ((unsigned *)(sq + params.sq_off.array))[i] = i;
+    r->cq_khead = (unsigned *)(cq + params.cq_off.head);
+    r->cq_ktail = (unsigned *)(cq + params.cq_off.tail);
+    r->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    r->max_in_flight = params.cq_entries;
+
+    r->event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (r->event_fd < 0 || ring_register(r->fd, IORING_REGISTER_EVENTFD, &r->event_fd, 1) < 0)
+        goto fail;
+    register_buffers(r);
+    register_files(r);
+
+    r->complete_event = event_new(base, r->event_fd, EV_READ|EV_PERSIST, ring_complete, r);
+    event_add(r->complete_event, NULL);
+    // Only ever activated, see ring_queue()
+    r->submit_event = event_new(base, -1, 0, ring_flush, r);
+    ring = r;
+    return 0;
+
+fail:
+    err = errno;
+    if (r->event_fd >= 0)
+        close(r->event_fd);
+    if (r->sqes != MAP_FAILED)
+        munmap(r->sqes, sqes_size);
+    if (cq != MAP_FAILED && cq != sq)
+        munmap(cq, cq_size);
+    if (sq != MAP_FAILED)
+        munmap(sq, sq_size);
+    close(r->fd);
+    free(r);
+    errno = err;
+    return -1;
+}
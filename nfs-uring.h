@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * io_uring engine.
+ *
+ * Every worker thread has its own ring for file I/O. Operations queued
+ * while the event loop runs its callbacks are submitted together with a
+ * single io_uring_enter() once they are done, and completions are reaped
+ * when the eventfd of the ring, which is part of the worker's event loop,
+ * becomes readable. Completion callbacks run on the thread that queued the
+ * operation.
+ *
+ * All of it is per thread and does nothing on threads without a ring:
+ * queueing fails, so callers fall back to synchronous I/O.
+ */
+struct event_base;
+
+struct io_op
+{
+    // Called with the result of the operation, a byte count or -errno
+    void (*complete)(struct io_op *op, int res);
+};
+
+// Ring size, 0 turns the engine off
+extern unsigned io_ring_entries;
+
+/*
+ * Start the ring of the calling thread on its event loop.
+ * Returns -1 with errno set if the kernel doesn't let us have one.
+ */
+int io_ring_start(struct event_base *base);
+
+// Whether the calling thread has a ring
+int io_ring_ready(void);
+
+/*
+ * Queue a read or fdatasync(). Returns -1 if there is no ring or no room
+ * in it, and then op is never completed. The buffers, iov and the file
+ * must stay valid until it has been completed. Registered files and
+ * buffers are used automatically.
+ */
+int io_readv(struct io_op *op, int fd, struct iovec *iov, int iovcnt, uint64_t offset);
+int io_fdatasync(struct io_op *op, int fd);
+
+/*
+ * Buffers for file data of at most POOL_CHUNK_SIZE bytes, taken from the
+ * buffers registered with the ring while there are free ones and from the
+ * buffer pool otherwise. NULL when the pool is used up. Must be released
+ * on the thread that allocated them.
+ */
+char *io_buffer_get(size_t size);
+void io_buffer_put(char *buf);
+
+/*
+ * Register an open file with the ring, so operations on it skip the fd
+ * table lookup. Registered files are closed with io_close_file(), which
+ * unregisters them. Operations in flight keep their own reference to the
+ * file, but those that are queued and not submitted yet only have its fd:
+ * if the kernel doesn't take them all, the file is closed once it does,
+ * so that the fd can't be reused meanwhile.
+ */
+void io_register_file(int fd);
+void io_close_file(int fd);
+
+/* Statistics of all rings */
+extern uint64_t io_ops;
+extern uint64_t io_fixed_files;
+extern uint64_t io_fixed_buffers;
+extern uint64_t io_submits;
+extern uint64_t io_reaps;
+extern uint64_t io_ring_full;
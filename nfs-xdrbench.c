@@ -0,0 +1,622 @@
+#define _FILE_OFFSET_BITS 64
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nfs-service.h"
+#include "nfs-uring.h"
+
+/*
+ * XDR microbenchmarks.
+ *
+ * For every entry of nfs3_pt and nfs3_mount_pt, builds realistic
+ * arguments and results, in a small and, where the size varies, a large
+ * variant. It then times three things without any networking:
+ * - decoding the arguments with the decoder from the service table, as
+ *   the server does
+ * - encoding the result with the encoder the procs reply with
+ * - encoding the arguments, which is the client side
+ * Every measurement prints one JSON line with the encoded size, ns per
+ * operation and MB/s.
+ */
+
+/*
+ * The benchmark links the service tables, the procs never run. These
+ * stand in for the parts of nfs-server.c and nfs-uring.c they would call.
+ */
+uint32_t max_write_data = 64*1024*1024;
+
+int rpc_reply(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, int alloc_hint)
+{
+    return -1;
+}
+
+void *rpc_alloc(size_t size)
+{
+    return NULL;
+}
+
+void rpc_client_addr(struct rpc_context *rpc, uint8_t *addr)
+{
+    memset(addr, 0, 16);
+}
+
+const struct export_rule *rpc_client_rule(struct rpc_context *rpc, int export)
+{
+    return NULL;
+}
+
+uint32_t rpc_max_transfer(struct rpc_context *rpc)
+{
+    return MAX_TRANSFER;
+}
+
+struct deferred_reply *rpc_defer_reply(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    return NULL;
+}
+
+void rpc_complete_deferred(struct deferred_reply *deferred, deferred_send_fn send, void *private_data)
+{
+}
+
+void *rpc_defer_state(struct deferred_reply *deferred)
+{
+    return NULL;
+}
+
+void *rpc_defer_alloc(struct deferred_reply *deferred, size_t size)
+{
+    return NULL;
+}
+
+void rpc_defer_hold_data(struct deferred_reply *deferred, size_t len)
+{
+}
+
+int rpc_send_reply_fd(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, int fd, uint64_t offset, uint32_t len)
+{
+    return -1;
+}
+
+int rpc_send_reply_chunks(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, struct iovec *chunks, int count,
+    void (*release)(char *buf))
+{
+    return -1;
+}
+
+int rpc_drc_begin(struct rpc_context *rpc, struct rpc_msg *call)
+{
+    return 0;
+}
+
+int rpc_send_reply_drc(struct rpc_context *rpc, struct rpc_msg *call, void *reply, zdrproc_t encode_fn, int alloc_hint)
+{
+    return -1;
+}
+
+int io_ring_ready(void)
+{
+    return 0;
+}
+
+int io_readv(struct io_op *op, int fd, struct iovec *iov, int iovcnt, uint64_t offset)
+{
+    return -1;
+}
+
+int io_fdatasync(struct io_op *op, int fd)
+{
+    return -1;
+}
+
+char *io_buffer_get(size_t size)
+{
+    return malloc(size ? size : 1);
+}
+
+void io_buffer_put(char *buf)
+{
+    free(buf);
+}
+
+void io_register_file(int fd)
+{
+}
+
+void io_close_file(int fd)
+{
+    close(fd);
+}
+
+#define BUF_SIZE (8*1024*1024)
+#define LARGE_DATA (1024*1024)
+#define SMALL_DATA 4096
+#define LARGE_ENTRIES 4096
+#define SMALL_ENTRIES 16
+
+static char handle[16] = "0123456789abcdef";
+static char *data;
+static char long_name[256];
+static char long_path[1024];
+static int min_time_ms = 200;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void fill_fh(nfs_fh3 *fh)
+{
+    fh->data.data_len = sizeof(handle);
+    fh->data.data_val = handle;
+}
+
+static void fill_fattr(fattr3 *attr)
+{
+    attr->type = NF3REG;
+    attr->mode = 0644;
+    attr->nlink = 1;
+    attr->uid = 1000;
+    attr->gid = 1000;
+    attr->size = 123456789;
+    attr->used = 123469824;
+    attr->fsid = 0x1234;
+    attr->fileid = 987654321;
+    attr->atime.seconds = attr->mtime.seconds = attr->ctime.seconds = 1700000000;
+    attr->atime.nseconds = attr->mtime.nseconds = attr->ctime.nseconds = 123456789;
+}
+
+static void fill_post_op_attr(post_op_attr *attr)
+{
+    attr->attributes_follow = TRUE;
+    fill_fattr(&attr->post_op_attr_u.attributes);
+}
+
+static void fill_wcc(wcc_data *wcc)
+{
+    wcc->before.attributes_follow = TRUE;
+    wcc->before.pre_op_attr_u.attributes.size = 123456789;
+    wcc->before.pre_op_attr_u.attributes.mtime.seconds = 1700000000;
+    wcc->before.pre_op_attr_u.attributes.ctime.seconds = 1700000000;
+    fill_post_op_attr(&wcc->after);
+}
+
+static void fill_diropargs(diropargs3 *args, int large)
+{
+    fill_fh(&args->dir);
+    args->name = large ? long_name : "file.txt";
+}
+
+static void fill_sattr(sattr3 *sattr)
+{
+    sattr->mode.set_it = TRUE;
+    sattr->mode.set_mode3_u.mode = 0644;
+    sattr->uid.set_it = TRUE;
+    sattr->uid.set_uid3_u.uid = 1000;
+    sattr->gid.set_it = TRUE;
+    sattr->gid.set_gid3_u.gid = 1000;
+}
+
+// Results of CREATE, MKDIR, SYMLINK and MKNOD all look like this
+static void fill_create_res(CREATE3res *res)
+{
+    res->status = NFS3_OK;
+    res->CREATE3res_u.resok.obj.handle_follows = TRUE;
+    fill_fh(&res->CREATE3res_u.resok.obj.post_op_fh3_u.handle);
+    fill_post_op_attr(&res->CREATE3res_u.resok.obj_attributes);
+    fill_wcc(&res->CREATE3res_u.resok.dir_wcc);
+}
+
+/*
+ * Fill the arguments and the result of a proc. The lists of directory
+ * entries are allocated, everything else points to static data.
+ */
+static void fill_mount(int proc, void *a, void *r, int large)
+{
+    switch (proc)
+    {
+    case MOUNT3_MNT:
+    case MOUNT3_UMNT:
+        *(dirpath *)a = large ? long_path : "/export";
+        if (proc == MOUNT3_MNT)
+        {
+            static int flavors[] = { AUTH_UNIX };
+            mountres3 *res = r;
+            res->fhs_status = MNT3_OK;
+            res->mountres3_u.mountinfo.fhandle.fhandle3_len = sizeof(handle);
+            res->mountres3_u.mountinfo.fhandle.fhandle3_val = handle;
+            res->mountres3_u.mountinfo.auth_flavors.auth_flavors_len = 1;
+            res->mountres3_u.mountinfo.auth_flavors.auth_flavors_val = flavors;
+        }
+        break;
+    case MOUNT3_EXPORT:
+    {
+        static struct groupnode group = { "10.0.2.15", NULL };
+        static struct exportnode export = { "/", &group, NULL };
+        *(exports *)r = &export;
+        break;
+    }
+    }
+}
+
+static void fill_nfs3(int proc, void *a, void *r, int large)
+{
+    int entries = large ? LARGE_ENTRIES : SMALL_ENTRIES, i;
+
+    switch (proc)
+    {
+    case NFS3_GETATTR:
+        fill_fh(&((GETATTR3args *)a)->object);
+        fill_fattr(&((GETATTR3res *)r)->GETATTR3res_u.resok.obj_attributes);
+        break;
+    case NFS3_SETATTR:
+        fill_fh(&((SETATTR3args *)a)->object);
+        fill_sattr(&((SETATTR3args *)a)->new_attributes);
+        fill_wcc(&((SETATTR3res *)r)->SETATTR3res_u.resok.obj_wcc);
+        break;
+    case NFS3_LOOKUP:
+        fill_diropargs(&((LOOKUP3args *)a)->what, large);
+        fill_fh(&((LOOKUP3res *)r)->LOOKUP3res_u.resok.object);
+        fill_post_op_attr(&((LOOKUP3res *)r)->LOOKUP3res_u.resok.obj_attributes);
+        fill_post_op_attr(&((LOOKUP3res *)r)->LOOKUP3res_u.resok.dir_attributes);
+        break;
+    case NFS3_ACCESS:
+        fill_fh(&((ACCESS3args *)a)->object);
+        ((ACCESS3args *)a)->access = 0x3f;
+        fill_post_op_attr(&((ACCESS3res *)r)->ACCESS3res_u.resok.obj_attributes);
+        ((ACCESS3res *)r)->ACCESS3res_u.resok.access = 0x3f;
+        break;
+    case NFS3_READLINK:
+        fill_fh(&((READLINK3args *)a)->symlink);
+        fill_post_op_attr(&((READLINK3res *)r)->READLINK3res_u.resok.symlink_attributes);
+        ((READLINK3res *)r)->READLINK3res_u.resok.data = large ? long_path : "../target";
+        break;
+    case NFS3_READ:
+    {
+        READ3resok *resok = &((READ3res *)r)->READ3res_u.resok;
+        fill_fh(&((READ3args *)a)->file);
+        ((READ3args *)a)->offset = 1 << 20;
+        ((READ3args *)a)->count = large ? LARGE_DATA : SMALL_DATA;
+        fill_post_op_attr(&resok->file_attributes);
+        resok->count = resok->data.data_len = large ? LARGE_DATA : SMALL_DATA;
+        resok->data.data_val = data;
+        break;
+    }
+    case NFS3_WRITE:
+    {
+        WRITE3args *args = a;
+        fill_fh(&args->file);
+        args->offset = 1 << 20;
+        args->count = args->data.data_len = large ? LARGE_DATA : SMALL_DATA;
+        args->stable = UNSTABLE;
+        args->data.data_val = data;
+        fill_wcc(&((WRITE3res *)r)->WRITE3res_u.resok.file_wcc);
+        ((WRITE3res *)r)->WRITE3res_u.resok.count = args->count;
+        break;
+    }
+    case NFS3_CREATE:
+        fill_diropargs(&((CREATE3args *)a)->where, large);
+        ((CREATE3args *)a)->how.mode = UNCHECKED;
+        fill_sattr(&((CREATE3args *)a)->how.createhow3_u.obj_attributes);
+        fill_create_res(r);
+        break;
+    case NFS3_MKDIR:
+        fill_diropargs(&((MKDIR3args *)a)->where, large);
+        fill_sattr(&((MKDIR3args *)a)->attributes);
+        fill_create_res(r);
+        break;
+    case NFS3_SYMLINK:
+        fill_diropargs(&((SYMLINK3args *)a)->where, 0);
+        fill_sattr(&((SYMLINK3args *)a)->symlink.symlink_attributes);
+        ((SYMLINK3args *)a)->symlink.symlink_data = large ? long_path : "../target";
+        fill_create_res(r);
+        break;
+    case NFS3_MKNOD:
+        fill_diropargs(&((MKNOD3args *)a)->where, large);
+        ((MKNOD3args *)a)->what.type = NF3FIFO;
+        fill_sattr(&((MKNOD3args *)a)->what.mknoddata3_u.pipe_attributes);
+        fill_create_res(r);
+        break;
+    case NFS3_REMOVE:
+        fill_diropargs(&((REMOVE3args *)a)->object, large);
+        fill_wcc(&((REMOVE3res *)r)->REMOVE3res_u.resok.dir_wcc);
+        break;
+    case NFS3_RMDIR:
+        fill_diropargs(&((RMDIR3args *)a)->object, large);
+        fill_wcc(&((RMDIR3res *)r)->RMDIR3res_u.resok.dir_wcc);
+        break;
+    case NFS3_RENAME:
+        fill_diropargs(&((RENAME3args *)a)->from, large);
+        fill_diropargs(&((RENAME3args *)a)->to, large);
+        fill_wcc(&((RENAME3res *)r)->RENAME3res_u.resok.fromdir_wcc);
+        fill_wcc(&((RENAME3res *)r)->RENAME3res_u.resok.todir_wcc);
+        break;
+    case NFS3_LINK:
+        fill_fh(&((LINK3args *)a)->file);
+        fill_diropargs(&((LINK3args *)a)->link, large);
+        fill_post_op_attr(&((LINK3res *)r)->LINK3res_u.resok.file_attributes);
+        fill_wcc(&((LINK3res *)r)->LINK3res_u.resok.linkdir_wcc);
+        break;
+    case NFS3_READDIR:
+    {
+        READDIR3resok *resok = &((READDIR3res *)r)->READDIR3res_u.resok;
+        entry3 *list = calloc(entries, sizeof(entry3));
+        fill_fh(&((READDIR3args *)a)->dir);
+        ((READDIR3args *)a)->count = 1024*1024;
+        fill_post_op_attr(&resok->dir_attributes);
+        for (i = 0; i < entries; i++)
+        {
+            list[i].fileid = 1000 + i;
+            list[i].name = "some-file-name.dat";
+            list[i].cookie = i + 1;
+            list[i].nextentry = i + 1 < entries ? &list[i + 1] : NULL;
+        }
+        resok->reply.entries = list;
+        resok->reply.eof = TRUE;
+        break;
+    }
+    case NFS3_READDIRPLUS:
+    {
+        READDIRPLUS3resok *resok = &((READDIRPLUS3res *)r)->READDIRPLUS3res_u.resok;
+        entryplus3 *list = calloc(entries, sizeof(entryplus3));
+        fill_fh(&((READDIRPLUS3args *)a)->dir);
+        ((READDIRPLUS3args *)a)->dircount = 1024*1024;
+        ((READDIRPLUS3args *)a)->maxcount = 1024*1024;
+        fill_post_op_attr(&resok->dir_attributes);
+        for (i = 0; i < entries; i++)
+        {
+            list[i].fileid = 1000 + i;
+            list[i].name = "some-file-name.dat";
+            list[i].cookie = i + 1;
+            fill_post_op_attr(&list[i].name_attributes);
+            list[i].name_handle.handle_follows = TRUE;
+            fill_fh(&list[i].name_handle.post_op_fh3_u.handle);
+            list[i].nextentry = i + 1 < entries ? &list[i + 1] : NULL;
+        }
+        resok->reply.entries = list;
+        resok->reply.eof = TRUE;
+        break;
+    }
+    case NFS3_FSSTAT:
+        fill_fh(&((FSSTAT3args *)a)->fsroot);
+        fill_post_op_attr(&((FSSTAT3res *)r)->FSSTAT3res_u.resok.obj_attributes);
+        ((FSSTAT3res *)r)->FSSTAT3res_u.resok.tbytes = 1ull << 40;
+        ((FSSTAT3res *)r)->FSSTAT3res_u.resok.fbytes = 1ull << 39;
+        break;
+    case NFS3_FSINFO:
+        fill_fh(&((FSINFO3args *)a)->fsroot);
+        fill_post_op_attr(&((FSINFO3res *)r)->FSINFO3res_u.resok.obj_attributes);
+        ((FSINFO3res *)r)->FSINFO3res_u.resok.rtmax = 1024*1024;
+        break;
+    case NFS3_PATHCONF:
+        fill_fh(&((PATHCONF3args *)a)->object);
+        fill_post_op_attr(&((PATHCONF3res *)r)->PATHCONF3res_u.resok.obj_attributes);
+        ((PATHCONF3res *)r)->PATHCONF3res_u.resok.name_max = 255;
+        break;
+    case NFS3_COMMIT:
+        fill_fh(&((COMMIT3args *)a)->file);
+        ((COMMIT3args *)a)->count = 1024*1024;
+        fill_wcc(&((COMMIT3res *)r)->COMMIT3res_u.resok.file_wcc);
+        break;
+    }
+}
+
+static void free_nfs3(int proc, void *r)
+{
+    if (proc == NFS3_READDIR)
+        free(((READDIR3res *)r)->READDIR3res_u.resok.reply.entries);
+    else if (proc == NFS3_READDIRPLUS)
+        free(((READDIRPLUS3res *)r)->READDIRPLUS3res_u.resok.reply.entries);
+}
+
+// What the table entries don't say: how clients encode the arguments and how the procs encode the result
+struct proc_codec
+{
+    const char *name;
+    zdrproc_t args_fn;
+    zdrproc_t res_fn;
+    size_t res_size;
+    // Whether the size of the arguments or the result varies
+    int has_large;
+};
+
+static struct proc_codec nfs3_codecs[] = {
+    {"NULL",        (zdrproc_t)zdr_void,             (zdrproc_t)zdr_void,            0,                       0},
+    {"GETATTR",     (zdrproc_t)zdr_GETATTR3args,     (zdrproc_t)zdr_GETATTR3res,     sizeof(GETATTR3res),     0},
+    {"SETATTR",     (zdrproc_t)zdr_SETATTR3args,     (zdrproc_t)zdr_SETATTR3res,     sizeof(SETATTR3res),     0},
+    {"LOOKUP",      (zdrproc_t)zdr_LOOKUP3args,      (zdrproc_t)zdr_LOOKUP3res,      sizeof(LOOKUP3res),      1},
+    {"ACCESS",      (zdrproc_t)zdr_ACCESS3args,      (zdrproc_t)zdr_ACCESS3res,      sizeof(ACCESS3res),      0},
+    {"READLINK",    (zdrproc_t)zdr_READLINK3args,    (zdrproc_t)zdr_READLINK3res,    sizeof(READLINK3res),    1},
+    {"READ",        (zdrproc_t)zdr_READ3args,        (zdrproc_t)zdr_READ3res,        sizeof(READ3res),        1},
+    {"WRITE",       (zdrproc_t)zdr_WRITE3args,       (zdrproc_t)zdr_WRITE3res,       sizeof(WRITE3res),       1},
+    {"CREATE",      (zdrproc_t)zdr_CREATE3args,      (zdrproc_t)zdr_CREATE3res,      sizeof(CREATE3res),      1},
+    {"MKDIR",       (zdrproc_t)zdr_MKDIR3args,       (zdrproc_t)zdr_MKDIR3res,       sizeof(MKDIR3res),       1},
+    {"SYMLINK",     (zdrproc_t)zdr_SYMLINK3args,     (zdrproc_t)zdr_SYMLINK3res,     sizeof(SYMLINK3res),     1},
+    {"MKNOD",       (zdrproc_t)zdr_MKNOD3args,       (zdrproc_t)zdr_MKNOD3res,       sizeof(MKNOD3res),       1},
+    {"REMOVE",      (zdrproc_t)zdr_REMOVE3args,      (zdrproc_t)zdr_REMOVE3res,      sizeof(REMOVE3res),      1},
+    {"RMDIR",       (zdrproc_t)zdr_RMDIR3args,       (zdrproc_t)zdr_RMDIR3res,       sizeof(RMDIR3res),       1},
+    {"RENAME",      (zdrproc_t)zdr_RENAME3args,      (zdrproc_t)zdr_RENAME3res,      sizeof(RENAME3res),      1},
+    {"LINK",        (zdrproc_t)zdr_LINK3args,        (zdrproc_t)zdr_LINK3res,        sizeof(LINK3res),        1},
+    {"READDIR",     (zdrproc_t)zdr_READDIR3args,     (zdrproc_t)zdr_READDIR3res,     sizeof(READDIR3res),     1},
+    {"READDIRPLUS", (zdrproc_t)zdr_READDIRPLUS3args, (zdrproc_t)zdr_READDIRPLUS3res, sizeof(READDIRPLUS3res), 1},
+    {"FSSTAT",      (zdrproc_t)zdr_FSSTAT3args,      (zdrproc_t)zdr_FSSTAT3res,      sizeof(FSSTAT3res),      0},
+    {"FSINFO",      (zdrproc_t)zdr_FSINFO3args,      (zdrproc_t)zdr_FSINFO3res,      sizeof(FSINFO3res),      0},
+    {"PATHCONF",    (zdrproc_t)zdr_PATHCONF3args,    (zdrproc_t)zdr_PATHCONF3res,    sizeof(PATHCONF3res),    0},
+    {"COMMIT",      (zdrproc_t)zdr_COMMIT3args,      (zdrproc_t)zdr_COMMIT3res,      sizeof(COMMIT3res),      0},
+};
+
+static struct proc_codec mount3_codecs[] = {
+    {"NULL",    (zdrproc_t)zdr_void,    (zdrproc_t)zdr_void,      0,                 0},
+    {"MNT",     (zdrproc_t)zdr_dirpath, (zdrproc_t)zdr_mountres3, sizeof(mountres3), 1},
+    {"DUMP",    (zdrproc_t)zdr_void,    (zdrproc_t)zdr_mountlist, sizeof(mountlist), 0},
+    {"UMNT",    (zdrproc_t)zdr_dirpath, (zdrproc_t)zdr_void,      0,                 1},
+    {"UMNTALL", (zdrproc_t)zdr_void,    (zdrproc_t)zdr_void,      0,                 0},
+    {"EXPORT",  (zdrproc_t)zdr_void,    (zdrproc_t)zdr_exports,   sizeof(exports),   0},
+};
+
+static void report(const char *service, const char *proc, int large, const char *what, uint32_t bytes, uint64_t ops, uint64_t ns)
+{
+    printf("{\"proc\": \"%s.%s\", \"variant\": \"%s\", \"op\": \"%s\", \"bytes\": %u, \"ns_per_op\": %.1f, \"mb_per_sec\": %.1f}\n",
+        service, proc, large ? "large" : "small", what, bytes, (double)ns / ops, ops * (double)bytes / ns * 1000);
+}
+
+// Encode body with fn over and over, returns the encoded size or -1
+static int time_encode(zdrproc_t fn, void *body, char *buf, uint64_t *ops, uint64_t *ns)
+{
+    uint64_t start = now_ns(), end = start + min_time_ms * 1000000ull, now;
+    uint32_t len = 0;
+    ZDR zdr;
+
+    *ops = 0;
+    do
+    {
+        int i;
+        for (i = 0; i < 16; i++)
+        {
+            zdrmem_create(&zdr, buf, BUF_SIZE, ZDR_ENCODE);
+            if (!fn(&zdr, body))
+                return -1;
+            len = zdr_getpos(&zdr);
+            zdr_destroy(&zdr);
+        }
+        *ops += 16;
+    } while ((now = now_ns()) < end);
+    *ns = now - start;
+    return len;
+}
+
+/*
+ * Decode len bytes of buf over and over like the server does: into a
+ * cleared buffer of decode_buf_size that is freed with zdr_free().
+ */
+static int time_decode(struct service_proc *entry, char *buf, uint32_t len, uint64_t *ops, uint64_t *ns)
+{
+    uint64_t start = now_ns(), end = start + min_time_ms * 1000000ull, now;
+    char *args = malloc(entry->decode_buf_size ? entry->decode_buf_size : 1);
+    ZDR zdr;
+
+    *ops = 0;
+    do
+    {
+        int i;
+        for (i = 0; i < 16; i++)
+        {
+            memset(args, 0, entry->decode_buf_size);
+            zdrmem_create(&zdr, buf, len, ZDR_DECODE);
+            if (!entry->decode_fn(&zdr, args))
+            {
+                free(args);
+                return -1;
+            }
+            zdr_free(entry->decode_fn, args);
+            zdr_destroy(&zdr);
+        }
+        *ops += 16;
+    } while ((now = now_ns()) < end);
+    *ns = now - start;
+    free(args);
+    return 0;
+}
+
+static void bench_service(const char *service, struct service_proc *table, int num_procs, struct proc_codec *codecs,
+    void (*fill)(int proc, void *args, void *res, int large), void (*release)(int proc, void *res),
+    char *buf, const char *only)
+{
+    int i, large, len;
+    uint64_t ops, ns;
+
+    for (i = 0; i < num_procs; i++)
+    {
+        struct service_proc *entry = &table[i];
+        struct proc_codec *codec = &codecs[entry->proc];
+
+        if (only && strcasecmp(only, codec->name))
+            continue;
+        for (large = 0; large <= codec->has_large; large++)
+        {
+            char *args = calloc(1, entry->decode_buf_size + 1);
+            char *res = calloc(1, codec->res_size + 1);
+
+            fill(entry->proc, args, res, large);
+
+            // Client side encoding, which also gives us the bytes to decode
+            len = time_encode(codec->args_fn, args, buf, &ops, &ns);
+            if (len < 0)
+            {
+                printf("Failed to encode %s.%s arguments\n", service, codec->name);
+                exit(10);
+            }
+            report(service, codec->name, large, "encode_args", len, ops, ns);
+            if (time_decode(entry, buf, len, &ops, &ns) < 0)
+            {
+                printf("Failed to decode %s.%s arguments\n", service, codec->name);
+                exit(10);
+            }
+            report(service, codec->name, large, "decode_args", len, ops, ns);
+
+            len = time_encode(codec->res_fn, res, buf, &ops, &ns);
+            if (len < 0)
+            {
+                printf("Failed to encode %s.%s result\n", service, codec->name);
+                exit(10);
+            }
+            report(service, codec->name, large, "encode_res", len, ops, ns);
+
+            if (release)
+                release(entry->proc, res);
+            free(args);
+            free(res);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    const char *only = NULL;
+    char *buf;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:p:")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            min_time_ms = atoi(optarg);
+            break;
+        case 'p':
+            only = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t ms_per_measurement] [-p proc]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (min_time_ms < 1)
+        min_time_ms = 1;
+
+    buf = malloc(BUF_SIZE);
+    data = malloc(LARGE_DATA);
+    if (buf == NULL || data == NULL)
+    {
+        printf("Failed to allocate buffers\n");
+        exit(10);
+    }
+    memset(data, 'x', LARGE_DATA);
+    memset(long_name, 'n', sizeof(long_name) - 1);
+    memset(long_path, 'p', sizeof(long_path) - 1);
+
+    bench_service("nfs3", nfs3_pt, sizeof(nfs3_pt) / sizeof(nfs3_pt[0]), nfs3_codecs, fill_nfs3, free_nfs3, buf, only);
+    bench_service("mount3", nfs3_mount_pt, sizeof(nfs3_mount_pt) / sizeof(nfs3_mount_pt[0]), mount3_codecs, fill_mount, NULL, buf, only);
+    return 0;
+}